@@ -2,21 +2,96 @@
 
 #define SMARTNS_TX_RX_CORE 8
 #define SMARTNS_CONTROL_CORE 1
+// dma qps per datapath thread by default, -dma_group_size overrides it
 #define SMARTNS_DMA_GROUP_SIZE 1
+#define SMARTNS_DMA_MAX_GROUP_SIZE 8
 #define SMARTNS_DMA_BATCH (4)
+// payloads of at least twice this are split over the dma qps of the group
+#define SMARTNS_DMA_SPLIT_BYTES (4096)
+// fragments of a payload posted behind one doorbell
+#define SMARTNS_DMA_VEC_MAX 16
+// LLC the rx buffers of all datapath threads may take before the auto
+// invalidate policy drops payloads from it, half of the BlueField-3 LLC
+#define SMARTNS_RX_LLC_KB (8 * 1024)
+// CQs a datapath thread collects CQEs of before it DMAs them to the host
+#define SMARTNS_CQE_PENDING_CQS 64
+// flushes of CQEs waiting for the payload dmas before them, and their runs
+#define SMARTNS_CQE_FENCE_DEPTH 16
+#define SMARTNS_CQE_RUN_DEPTH (SMARTNS_CQE_FENCE_DEPTH * SMARTNS_CQE_PENDING_CQS)
+// 8 byte staging slots for host atomics and their results
+#define SMARTNS_ATOMIC_DEPTH 64
+// responder atomics a datapath thread has in flight, and the locks that keep
+// two threads off the same host word
+#define SMARTNS_ATOMIC_INFLIGHT 64
+#define SMARTNS_ATOMIC_LOCKS 256
+// send wqs in pull mode, WQEs read from the host in one dma at most, and how
+// long an idle send wq waits before its producer index is read again
+#define SMARTNS_SEND_WQ_PULL_BATCH 64
+#define SMARTNS_SEND_WQ_PULL_IDLE_NS 500
 
 #define SMARTNS_TX_DEPTH 1024
 #define SMARTNS_RX_DEPTH 1024
-#define SMARTNS_TX_PACKET_BUFFER (128)
+// headers, and the payload of inline sends
+#define SMARTNS_TX_PACKET_BUFFER (256)
 #define SMARTNS_RX_PACKET_BUFFER (8192+128)
 #define SMARTNS_MTU (8192)
 #define SMARTNS_TCP_PORT (6666)
+// qp numbers are dense in [0, SMARTNS_MAX_QP) and index the datapath qp table
+#define SMARTNS_MAX_QP (1 << 16)
 #define SMARTNS_UDP_MAGIC_PORT (23456)
 
 #define SMARTNS_RX_BATCH 16
-#define SMARTNS_RX_SEG   1
+#define SMARTNS_RX_SEG   (SMARTNS_RX_HDR_SPLIT ? 2 : 1)
+// max rx buffers a datapath thread holds for out of order packets
+#define SMARTNS_RX_REORDER_BUFFER (SMARTNS_RX_DEPTH / 2)
+
+// multi-packet (striding) receive queue, a WQE is one buffer the NIC fills
+// stride by stride and a frame takes as many strides as it needs.
+// 0 posts one SMARTNS_RX_PACKET_BUFFER per WQE instead
+#ifndef SMARTNS_RX_MPRQ
+#define SMARTNS_RX_MPRQ 0
+#endif
+#define SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE 8
+#define SMARTNS_RX_MPRQ_LOG_STRIDES 9
+#define SMARTNS_RX_MPRQ_LOG_BUF_SIZE (SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE + SMARTNS_RX_MPRQ_LOG_STRIDES)
+#define SMARTNS_RX_MPRQ_WQES 16
+// buffers beyond the posted ones are left for frames held out of order
+#define SMARTNS_RX_MPRQ_BUFS (2 * SMARTNS_RX_MPRQ_WQES)
+#define SMARTNS_RX_MPRQ_CQ_DEPTH (SMARTNS_RX_MPRQ_WQES << SMARTNS_RX_MPRQ_LOG_STRIDES)
+
+// header/payload split, a receive WR scatters eth, ip, udp and bth of a frame
+// into a slot of a small header ring that stays in cache, and the extension
+// headers and payload into the packet buffer the payload dma reads and
+// invalidates. Only with one SMARTNS_RX_PACKET_BUFFER per WQE
+#ifndef SMARTNS_RX_HDR_SPLIT
+#define SMARTNS_RX_HDR_SPLIT 0
+#endif
+#define SMARTNS_RX_HDR_SLOT 64
+
+#if SMARTNS_RX_MPRQ && SMARTNS_RX_HDR_SPLIT
+#error "SMARTNS_RX_HDR_SPLIT needs SMARTNS_RX_MPRQ disabled"
+#endif
+
+#if SMARTNS_RX_MPRQ
+#define SMARTNS_RX_BUF_SIZE ((size_t)SMARTNS_RX_MPRQ_BUFS << SMARTNS_RX_MPRQ_LOG_BUF_SIZE)
+#elif SMARTNS_RX_HDR_SPLIT
+// the header ring follows the packet buffers
+#define SMARTNS_RX_BUF_SIZE ((size_t)SMARTNS_RX_DEPTH * (SMARTNS_RX_PACKET_BUFFER + SMARTNS_RX_HDR_SLOT))
+#else
+#define SMARTNS_RX_BUF_SIZE ((size_t)SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER)
+#endif
+// zero-copy receive, single packet sends to the first SMARTNS_RX_ZC_QPS QPs
+// carry udp dst port SMARTNS_UDP_ZC_PORT + qpn and are steered to a raw receive
+// queue of that QP, whose WQEs scatter the payload straight into the next host
+// recv buffers. Frames for a queue that isn't armed fall back to the thread's
+// receive queue
+#define SMARTNS_UDP_ZC_PORT (0x6000)
+#define SMARTNS_RX_ZC_QPS 64
+#define SMARTNS_RX_ZC_DEPTH 64
+
 #define SMARTNS_TX_BATCH 16
-#define SMARTNS_TX_SEG   2
+// headers and up to SMARTNS_MAX_SEND_SGE pieces of payload
+#define SMARTNS_TX_SEG   (1 + SMARTNS_MAX_SEND_SGE)
 
 #if defined(__x86_64__)
 #define SMARTNS_DMA_GID_INDEX 3
@@ -25,6 +25,11 @@ struct ipv4_hdr {
     uint32_t dst_addr;
 } __attribute__((__packed__));
 
+// ECN field in the low bits of type_of_service
+#define IP_ECN_MASK 0x03
+#define IP_ECN_ECT0 0x02
+#define IP_ECN_CE   0x03
+
 struct udp_hdr {
     uint16_t src_port;
     uint16_t dst_port;
@@ -2,6 +2,28 @@
 
 #include "smartns.h"
 
-int rxe_handle_req(datapath_handler *handler, dpu_qp *qp);
+// reads and atomics hold a responder resource and complete on their response
+static inline bool rxe_wqe_is_rd_atomic(dpu_send_wqe *wqe) {
+    return wqe->opcode == IBV_WR_RDMA_READ || wqe->opcode == IBV_WR_ATOMIC_CMP_AND_SWP || wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD;
+}
 
-int rxe_handle_recv(datapath_handler *handler);
\ No newline at end of file
+// send until budget bytes went out, the last packet may overshoot it
+int rxe_handle_req(datapath_handler *handler, dpu_qp *qp, size_t budget);
+
+int rxe_handle_recv(datapath_handler *handler);
+
+int rxe_handle_resp(datapath_handler *handler, dpu_qp *qp, size_t budget);
+
+void rxe_rewind_send_wq(datapath_handler *handler, dpu_qp *qp, uint32_t psn);
+
+void rxe_flush_send_wq(datapath_handler *handler, dpu_qp *qp);
+
+void rxe_fail_send_wq(datapath_handler *handler, dpu_qp *qp, ibv_wc_status status, uint32_t psn);
+
+void rxe_arm_retrans_timer(datapath_handler *handler, dpu_qp *qp, size_t now);
+
+void rxe_handle_timer(datapath_handler *handler, dpu_qp *qp, size_t now);
+
+void rxe_handle_ack_timer(datapath_handler *handler, dpu_qp *qp, size_t now);
+
+void rxe_handle_zc_scan(datapath_handler *handler, dpu_qp *qp, size_t now);
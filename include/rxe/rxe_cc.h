@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// per QP congestion control on the requester, all times are in tsc
+enum rxe_cc_algo {
+    RXE_CC_NONE,
+    // Swift style, delay based congestion window in packets
+    RXE_CC_WINDOW,
+    // DCQCN style, rate cut on congestion notification and timer based recovery
+    RXE_CC_RATE,
+};
+
+struct rxe_cc_param {
+    rxe_cc_algo algo;
+    uint32_t mtu;
+
+    // window, below one packet the window is paced over srtt
+    double min_cwnd;
+    double max_cwnd;
+    double ai;
+    double beta;
+    double max_mdf;
+    size_t target_delay_tsc;
+
+    // rate in bytes per tsc
+    double line_rate;
+    double min_rate;
+    double g;
+    double rai;
+    double rhai;
+    uint32_t fast_recovery_stages;
+    size_t rate_timer_tsc;
+    size_t alpha_timer_tsc;
+    size_t min_decrease_tsc;
+};
+
+struct rxe_cc {
+    const rxe_cc_param *param;
+    size_t next_send_tsc;
+    size_t srtt_tsc;
+    size_t last_decrease_tsc;
+
+    double cwnd;
+
+    double rate;
+    double target_rate;
+    double alpha;
+    uint32_t stage;
+    bool cnp_in_period;
+    size_t rate_timer_tsc;
+    size_t alpha_timer_tsc;
+};
+
+static inline bool rxe_cc_enabled(const rxe_cc *cc) {
+    return cc->param->algo != RXE_CC_NONE;
+}
+
+rxe_cc_algo rxe_cc_parse_algo(const char *name);
+
+void rxe_cc_default_param(rxe_cc_param *param, rxe_cc_algo algo, double tsc_per_ns, uint32_t mtu, double line_gbps, size_t target_delay_us);
+
+void rxe_cc_init(rxe_cc *cc, const rxe_cc_param *param, size_t now);
+
+// inflight is in packets
+bool rxe_cc_can_send(rxe_cc *cc, size_t now, uint32_t inflight);
+
+void rxe_cc_on_send(rxe_cc *cc, size_t now, uint32_t bytes);
+
+// rtt_tsc is 0 when the ack carries no sample
+void rxe_cc_on_ack(rxe_cc *cc, size_t now, uint32_t acked_pkts, size_t rtt_tsc);
+
+// CE mark on a response or BECN echoed by the responder
+void rxe_cc_on_congestion(rxe_cc *cc, size_t now);
+
+void rxe_cc_on_timeout(rxe_cc *cc, size_t now);
@@ -3,6 +3,24 @@
 enum rxe_device_param {
     RXE_MAX_PKT_PER_ACK = 64,
     RXE_MAX_UNACKED_PSNS = 128,
+    RXE_RETRANS_TIMEOUT_US = 1000,
+    RXE_MAX_RETRANS_BACKOFF = 6,
+    RXE_TIMER_WHEEL_SLOTS = 1024,
+    RXE_TIMER_TICK_US = 16,
+    RXE_REORDER_WINDOW = 64,
+    RXE_REORDER_NAK_THRESHOLD = 16,
+    RXE_MAX_RESP_RES = 16,
+    RXE_MAX_RESP_BURST = 64,
+    RXE_CC_LINE_GBPS = 200,
+    RXE_CC_TARGET_DELAY_US = 25,
+    RXE_SCHED_QUANTUM = 65536,
+    RXE_SCHED_BURST = 65536,
+    RXE_ACK_COALESCE_PKTS = 1,
+    RXE_ACK_DELAY_US = 4,
+    RXE_ACK_TIMER_SLOTS = 64,
+    RXE_ZC_REARM_US = 64,
+    RXE_ZC_POLL_BATCH = 16,
+    RXE_ZC_MAX_BACKOFF = 6,
 };
 
 static inline int psn_compare(uint32_t psn_a, uint32_t psn_b) {
@@ -9,10 +9,19 @@
 #include "phmap.h"
 #include "devx/devx_mr.h"
 #include "spinlock_mutex.h"
+#include "timer_wheel.h"
 #include "raw_packet/raw_packet.h"
+#include "rxe/rxe_cc.h"
+#include "rxe/rxe_hdr.h"
 
 extern std::atomic<bool> stop_flag;
 
+enum dpu_send_wq_pull_state {
+    dpu_send_wq_pull_idle,
+    dpu_send_wq_pull_doorbell,
+    dpu_send_wq_pull_wqes,
+};
+
 struct alignas(64) dpu_datapath_send_wq {
     struct dpu_context *dpu_ctx;
     size_t datapath_send_wq_id;
@@ -25,6 +34,26 @@ struct alignas(64) dpu_datapath_send_wq {
 
     uint8_t own_flag;
 
+    // pull mode, the host only writes the producer index and the datapath
+    // reads it and then the new WQEs into bf_datapath_send_wq_buf, see
+    // datapath_handler::pull_send_wq. Counters are free running, all of it is
+    // set under active_datapath_send_wq_list_mutex of the owning thread
+    bool pull;
+    dpu_send_wq_pull_state pull_state;
+    uint32_t pulled;
+    uint32_t pull_producer;
+    uint32_t pull_end;
+    // read WQEs get_next_wqe hasn't taken yet
+    uint32_t pull_ready;
+    uint32_t pull_ticket;
+    size_t pull_next_tsc;
+    size_t pull_idle_tsc;
+    uint32_t bf_mkey;
+    uint32_t host_mkey;
+    void *host_send_wq_buf;
+    smartns_wq_doorbell *host_doorbell;
+    smartns_wq_doorbell *bf_doorbell;
+
     smartns_send_wqe *get_next_wqe() {
         smartns_send_wqe *wqe = reinterpret_cast<smartns_send_wqe *>(reinterpret_cast<uint8_t *>(bf_datapath_send_wq_buf) + (head << wqe_shift));
         if (wqe->op_own != own_flag) {
@@ -33,10 +62,38 @@ struct alignas(64) dpu_datapath_send_wq {
         return wqe;
     }
 
-    void step_wq() {
-        ++head;
-        if (head == wqe_cnt) {
-            head = 0;
+    // i-th inline or gather segment after the WQE at head, nullptr until it arrived
+    template <typename SEG>
+    SEG *get_seg(uint32_t i) {
+        uint32_t index = head + 1 + i;
+        uint8_t own = own_flag;
+        if (index >= wqe_cnt) {
+            index -= wqe_cnt;
+            own ^= SMARTNS_SEND_WQE_OWNER_MASK;
+        }
+        SEG *seg = reinterpret_cast<SEG *>(reinterpret_cast<uint8_t *>(bf_datapath_send_wq_buf) + (index << wqe_shift));
+        if (seg->op_own != own) {
+            return nullptr;
+        }
+        return seg;
+    }
+
+    // true once all segs segments of the WQE at head arrived
+    template <typename SEG>
+    bool segs_ready(uint32_t segs) {
+        for (uint32_t i = 0;i < segs;i++) {
+            if (get_seg<SEG>(i) == nullptr) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // past a WQE and its segments
+    void step_wq(uint32_t slots) {
+        head += slots;
+        if (head >= wqe_cnt) {
+            head -= wqe_cnt;
             own_flag = own_flag ^ SMARTNS_SEND_WQE_OWNER_MASK;
         }
     }
@@ -67,9 +124,26 @@ struct alignas(64) dpu_send_wqe {
     uint32_t cur_pkt_offset;
 
     uint8_t is_signal;
+    // holds a CQE of the send cq from its first packet on
+    uint8_t cqe_reserved;
+    // the payload is inline_data, sent from the tx buffer behind the headers
+    uint8_t is_inline;
+    // above 1 the payload is gathered from sge_list instead of local_addr
+    uint8_t num_sge;
+
+    uint64_t compare_add;
+    uint64_t swap;
+
+    // kept for retransmits, the host reuses the ring slots they came in
+    union {
+        uint8_t inline_data[SMARTNS_MAX_INLINE_DATA];
+        smartns_send_sge sge_list[SMARTNS_MAX_SEND_SGE];
+    };
 };
 
-static_assert(sizeof(dpu_send_wqe) == 64, "dpu_send_wqe size must be 64 bytes");
+static_assert(sizeof(dpu_send_wqe) == 256, "dpu_send_wqe size must be 256 bytes");
+static_assert(sizeof(udp_packet) + RXE_BTH_BYTES + RXE_RETH_BYTES + SMARTNS_MAX_INLINE_DATA <= SMARTNS_TX_PACKET_BUFFER,
+    "an inline write must fit one tx buffer");
 
 struct alignas(64) dpu_send_wq {
     struct dpu_context *dpu_ctx;
@@ -86,6 +160,15 @@ struct alignas(64) dpu_send_wq {
     uint32_t psn;
     int opcode;
     int	noack_pkts;
+    // read and atomic requests sent and not completed, bounded by RXE_MAX_RESP_RES
+    int pending_rd_atomic;
+    // ibv_wc_status a fatal nak left the QP in, its WQEs are flushed from then on
+    uint8_t error_status;
+
+    rxe_cc cc;
+    // one psn in flight is timed for rtt, 0 tsc means none
+    uint32_t rtt_probe_psn;
+    size_t rtt_probe_tsc;
 
 
     dpu_send_wqe *get_next_wqe() {
@@ -131,6 +214,98 @@ struct alignas(64) dpu_send_wq {
 struct dpu_mr {
     unsigned int host_mkey;
     struct devx_mr *devx_mr;
+    // remote requests must come on a QP of this pd and ask for access it grants
+    struct dpu_pd *dpu_pd;
+    unsigned int access;
+};
+
+struct rxe_reorder_slot {
+    uint64_t pkt_buf;
+    uint32_t byte_len;
+    uint32_t psn;
+};
+
+// a polled frame, parsed and its QP prefetched before any is processed
+struct rxe_rx_pkt {
+    uint64_t pkt_buf;
+    uint32_t byte_len;
+    struct dpu_qp *qp;
+};
+
+// an atomic locks its host word, reads it, writes the result back and
+// unlocks, each step once the dma before it finished
+enum rxe_atomic_state {
+    rxe_atomic_state_done,
+    rxe_atomic_state_lock,
+    rxe_atomic_state_read,
+    rxe_atomic_state_write,
+};
+
+// dmas and atomics posted up to some point, passed once all of them finished
+struct dma_fence {
+    uint32_t atomic_head;
+    uint32_t dma_head[SMARTNS_DMA_MAX_GROUP_SIZE];
+};
+
+// read response or atomic ack still to be sent, read payload is gathered
+// from host memory by the NIC
+struct rxe_resp_res {
+    int opcode;
+    uint64_t atomic_orig;
+    int atomic_state;
+    uint32_t atomic_stage;
+    uint32_t atomic_ticket;
+    uint64_t compare_add;
+    uint64_t swap;
+    uint64_t va;
+    // checked again before host memory is read, the MR may be gone by then
+    uint32_t rkey;
+    uint32_t host_lkey;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t first_psn;
+    uint32_t cur_psn;
+    // payload dmas and atomics of earlier requests, host memory is read once they landed
+    dma_fence fence;
+};
+
+// executed read or atomic request kept to answer duplicates
+struct rxe_resp_cache {
+    uint32_t first_psn;
+    uint32_t last_psn;
+    int opcode;
+    uint32_t length;
+    uint64_t va;
+    uint32_t rkey;
+    // atomics are not executed twice, duplicates get the first result
+    uint64_t atomic_orig;
+    // the atomic is still executing, duplicates are dropped until it is done
+    bool atomic_pending;
+};
+
+// zero-copy receive queue of a QP. WQE i scatters eth to bth into a slot of buf,
+// the payload into host recv WQE target[i] and anything beyond host_len[i] into
+// the spill buffer after the slots. posted, done and next_target are free running
+struct rxe_zc_rq {
+    ibv_qp *qp;
+    // installed while armed
+    ibv_flow *flow;
+    // ibv_flow_attr followed by its eth and udp spec
+    alignas(8) uint8_t flow_attr[sizeof(ibv_flow_attr) + sizeof(ibv_flow_spec_eth) + sizeof(ibv_flow_spec_tcp_udp)];
+    ibv_mr *mr;
+    uint8_t *buf;
+    uint32_t *target;
+    uint32_t *host_len;
+    uint32_t posted;
+    uint32_t done;
+    uint32_t next_target;
+    // a disarm resets the queue, completions of an older epoch are flushed WQEs
+    uint16_t epoch;
+    uint8_t armed;
+    uint8_t hit;
+    // a disarm waits rearm time before arming again, doubled while arms end without a hit
+    uint8_t backoff;
+    size_t rearm_tsc;
 };
 
 struct alignas(64) dpu_recv_wq {
@@ -141,6 +316,8 @@ struct alignas(64) dpu_recv_wq {
     uint32_t wqe_shift;
     uint32_t max_sge;
     uint32_t	head;
+    // recv WQEs consumed, free running
+    uint32_t wqe_seq;
 
     uint32_t now_sge_num;
     uint32_t now_sge_offset;
@@ -152,6 +329,30 @@ struct alignas(64) dpu_recv_wq {
     uint32_t msn;
     int opcode;
     int sent_psn_nak;
+    // syndrome of the fatal nak a refused request got, 0 while requests are executed
+    int access_nak;
+    // CE seen on a request, echoed as BECN on the next ack or response
+    int ecn_echo;
+
+    // early packets indexed by psn, 0 pkt_buf means empty
+    rxe_reorder_slot *reorder_buf;
+    uint32_t reorder_cnt;
+
+    // read responses ring, res_head and res_tail are free running
+    rxe_resp_res *resp_res;
+    uint32_t res_head;
+    uint32_t res_tail;
+    // ack must not overtake pending read responses
+    int ack_deferred;
+    // an ack was requested in the current receive batch
+    int ack_pending;
+    // ack requests not answered yet, and when the ack is due at the latest
+    uint32_t ack_owed;
+    size_t ack_deadline_tsc;
+    int ack_timer_queued;
+    // responder resources, the last RXE_MAX_RESP_RES executed reads and atomics
+    rxe_resp_cache *res_cache;
+    uint32_t cache_head;
 
     // used for Read/Write
     uint64_t host_va;
@@ -159,10 +360,25 @@ struct alignas(64) dpu_recv_wq {
     uint32_t byte_count;
     uint32_t host_rkey;
     uint32_t resid;
-    dpu_mr *mr;
+    uint32_t host_lkey;
+
+    // nullptr without zero-copy receive
+    rxe_zc_rq *zc;
 
     uint8_t own_flag;
 
+    // the WQE ahead entries after head, nullptr if the host hasn't posted it yet
+    inline smartns_recv_wqe *peek_wqe(uint32_t ahead) {
+        uint32_t index = head + ahead;
+        uint8_t own = own_flag;
+        if (index >= wqe_cnt) {
+            index -= wqe_cnt;
+            own ^= SMARTNS_RECV_WQE_OWNER_MASK;
+        }
+        smartns_recv_wqe *wqe = reinterpret_cast<smartns_recv_wqe *>(reinterpret_cast<uint8_t *>(bf_recv_wq_buf) + (index << wqe_shift));
+        return wqe->op_own == own ? wqe : nullptr;
+    }
+
     inline smartns_recv_wqe *get_next_wqe() {
         smartns_recv_wqe *wqe = reinterpret_cast<smartns_recv_wqe *>(reinterpret_cast<uint8_t *>(bf_recv_wq_buf) + (head << wqe_shift));
         if (wqe->op_own != own_flag) {
@@ -179,6 +395,7 @@ struct alignas(64) dpu_recv_wq {
             head = 0;
             own_flag = own_flag ^ SMARTNS_RECV_WQE_OWNER_MASK;
         }
+        wqe_seq++;
         now_sge_num = 0;
         now_sge_offset = 0;
         now_total_dma_byte = 0;
@@ -188,7 +405,28 @@ struct alignas(64) dpu_recv_wq {
 struct alignas(64) dpu_comp_info {
     uint32_t psn;
     int opcode;
+    // consecutive retransmit timeouts without ack progress
     int timeout;
+    // already rewound for the current hole in read responses
+    int resp_gap_rewind;
+
+    // retransmit timer, deadline is tsc and 0 means disarmed
+    uint8_t timer_queued;
+    size_t deadline;
+};
+
+// send scheduling, linked on the handler's ready list while the QP has work
+struct dpu_qp_sched {
+    struct dpu_qp *prev;
+    struct dpu_qp *next;
+    uint8_t ready;
+    uint32_t weight;
+    // bytes left this round, may go one packet negative
+    int64_t deficit;
+    // token bucket in bytes, 0 rate is unlimited
+    double rate;
+    double tokens;
+    size_t last_tsc;
 };
 
 struct alignas(64) dpu_qp {
@@ -196,6 +434,8 @@ struct alignas(64) dpu_qp {
     struct dpu_pd *dpu_pd;
     size_t qp_number;
     size_t remote_qp_number;
+    // udp dst port of single packet sends, the peer's zero-copy queue, 0 if it has none
+    uint16_t zc_dst_port;
     ibv_qp_type qp_type;
     int mtu;
     unsigned int max_send_wr;
@@ -211,6 +451,8 @@ struct alignas(64) dpu_qp {
     struct dpu_send_wq *send_wq;
     struct dpu_comp_info *comp_info;
     struct dpu_recv_wq *recv_wq;
+
+    struct dpu_qp_sched sched;
 };
 
 struct dpu_pd {
@@ -228,6 +470,16 @@ struct alignas(64) dpu_cq {
     uint32_t tail;
     uint32_t bf_mkey;
     uint32_t host_mkey;
+    // CQEs before head not DMAed to the host yet
+    uint32_t dma_pending;
+    // CQEs written and the host consumer index as last read, both free running
+    uint32_t produced;
+    uint32_t host_consumed;
+    // CQEs held for signaled send WQEs in flight
+    uint32_t reserved;
+    // read of the host consumer index in flight and its atomic qp ticket
+    uint8_t refreshing;
+    uint32_t refresh_ticket;
 
     void *host_cq_buf;
     smartns_cq_doorbell *host_cq_doorbell;
@@ -243,6 +495,7 @@ struct alignas(64) dpu_cq {
     }
 
     inline void step_cq() {
+        ++produced;
         ++head;
         if (head == wqe_cnt) {
             head = 0;
@@ -268,14 +521,46 @@ struct dpu_context {
     phmap::parallel_flat_hash_map<size_t, dpu_cq *>cq_list;
     // qpn to struct qp
     phmap::parallel_flat_hash_map<size_t, dpu_qp *>qp_list;
-    // host mkey to mr
+    // host mkey to mr, changed under every datapath thread's mr_list_mutex
     phmap::parallel_flat_hash_map<unsigned int, dpu_mr *>mr_list;
 };
 
+// one fragment of a vectored dma, the source is in the rx buffer of the batch
+struct dma_vec {
+    uint32_t dest_lkey;
+    uint32_t length;
+    uint64_t dest_addr;
+    uint64_t src_addr;
+};
+
+// CQEs of cq from index first on, copied to the host in one dma
+struct cqe_run {
+    dpu_cq *cq;
+    uint32_t first;
+    uint32_t cnt;
+};
+
+// runs of one CQE flush up to run_end, posted once every dma and atomic
+// posted before the flush finished
+struct cqe_fence {
+    uint32_t run_end;
+    dma_fence dma;
+};
+
+// invalidate of an rx buffer range waiting for the dmas that read it
+struct deferred_invalidate {
+    uint64_t addr;
+    uint64_t end;
+    uint64_t buf_addr;
+    uint32_t lkey;
+    uint32_t qp_index;
+    uint32_t parts_left;
+};
+
 class alignas(64) dma_handler {
 
 public:
-    dma_handler(ibv_context *context, ibv_pd *pd);
+    dma_handler(ibv_context *context, ibv_pd *pd, uint32_t group_size);
 
     ~dma_handler();
     // context and pd will shared with TXPATH QP
@@ -295,83 +580,498 @@ public:
     ibv_qp_ex *cqe_qpx;
     mlx5dv_qp_ex *cqe_mqpx;
     uint32_t cqe_count;
+    // the cqe qp has no ordering against the dma qps, a CQE may only reach
+    // the host after the payload it completes
+    cqe_run *cqe_run_list;
+    uint32_t cqe_run_head;
+    uint32_t cqe_run_tail;
+    cqe_fence *cqe_fence_list;
+    uint32_t cqe_fence_head;
+    uint32_t cqe_fence_tail;
 
     ibv_qp **invalid_qp_list;
     ibv_qp_ex **invalid_qpx_list;
     mlx5dv_qp_ex **invalid_mqpx_list;
+    // invalidates posted and known finished per invalidate qp, wr_id like a dma
     uint32_t *invalid_start_index_list;
     uint32_t *invalid_finish_index_list;
+    //plus one when invalidate anything, and reset to 0 when set signal
+    uint32_t *invalid_count_list;
 
+    // dma qps payload dmas are spread over, at most SMARTNS_DMA_MAX_GROUP_SIZE
+    uint32_t group_size;
     uint32_t now_use_qp_index;
+    // bytes posted and not known finished per dma qp, a dma goes to the least loaded one
+    uint64_t *outstanding_bytes_list;
 
     // this cq will be shared within all DMA QP
     ibv_cq *dma_send_recv_cq;
     // this cq will be shared within all cache invalid QP and cqe
     ibv_cq *invalid_send_recv_cq;
 
-    void *send_tmp_buffer;
-    size_t send_tmp_buffer_offset = 0;
-    ibv_mr *send_tmp_mr;
-    constexpr static size_t send_tmp_buffer_size = 32 * SMARTNS_RX_PACKET_BUFFER;
+    // host atomics and atomic results, every dma is signaled
+    ibv_qp *atomic_qp;
+    ibv_qp_ex *atomic_qpx;
+    mlx5dv_qp_ex *atomic_mqpx;
+    ibv_cq *atomic_cq;
+    ibv_mr *atomic_mr;
+    uint64_t *atomic_buf;
+    uint32_t atomic_head;
+    uint32_t atomic_tail;
+    // host memory is shared by all datapath threads, a word stays locked
+    // from the read of an atomic to its write back. Never waited on
+    static inline spinlock_mutex atomic_lock_list[SMARTNS_ATOMIC_LOCKS];
+    // staging words of atomics in flight, behind the slots in atomic_buf
+    uint32_t *atomic_stage_free_list;
+    uint32_t atomic_stage_free_cnt;
+
+    constexpr static uint32_t dma_depth = 256;
+    // source rx buffer and length of every dma per dma qp, indexed by a free
+    // running sequence that is also the wr_id, 0 for a dma without one
+    uint64_t *pending_buf_list;
+    uint32_t *pending_len_list;
+    uint32_t *pending_head_list;
+    uint32_t *pending_tail_list;
+    constexpr static uint32_t invalid_depth = 256;
+    // rx buffer each invalidate hands back once finished, 0 for none
+    uint64_t *invalid_buf_list;
+    // an invalidate is posted once the dmas reading its range finished, before
+    // that the cache lines may be dropped under the dma. Each dma points at
+    // the one it holds back, plus one, 0 for none
+    uint32_t *pending_deferred_list;
+    deferred_invalidate *deferred_list;
+    uint32_t *deferred_free_list;
+    uint32_t deferred_free_cnt;
+    // deferred invalidates that go to each invalidate qp
+    uint32_t *invalid_deferred_list;
+    // 8 bytes copied by a fence dma, the cache line at fence_line is what a
+    // fence invalidate drops
+    uint64_t *fence_buf;
+    uint64_t fence_line;
+    ibv_mr *fence_mr;
+
+    inline uint64_t push_pending_buf(uint32_t qp_index, uint64_t buf_addr, uint32_t length, uint32_t deferred = 0) {
+        uint32_t seq = pending_head_list[qp_index];
+        assert(seq - pending_tail_list[qp_index] < dma_depth);
+        pending_buf_list[qp_index * dma_depth + seq % dma_depth] = buf_addr;
+        pending_len_list[qp_index * dma_depth + seq % dma_depth] = length;
+        pending_deferred_list[qp_index * dma_depth + seq % dma_depth] = deferred;
+        pending_head_list[qp_index]++;
+        outstanding_bytes_list[qp_index] += length;
+        return qp_index | (static_cast<uint64_t>(seq) << 32);
+    }
 
-    inline void post_dma_req_without_cq(uint32_t dest_lkey, uint64_t dest_addr,
-        uint32_t src_lkey, uint64_t src_addr, uint64_t pkt_buffer_addr, size_t length) {
+    inline uint64_t push_invalid_buf(uint32_t qp_index, uint64_t buf_addr) {
+        uint32_t seq = invalid_start_index_list[qp_index];
+        assert(seq - invalid_finish_index_list[qp_index] < invalid_depth);
+        invalid_buf_list[qp_index * invalid_depth + seq % invalid_depth] = buf_addr;
+        invalid_start_index_list[qp_index]++;
+        return qp_index | (static_cast<uint64_t>(seq) << 32);
+    }
 
-        bool is_signal = dma_count_list[now_use_qp_index] % SMARTNS_DMA_BATCH >= (SMARTNS_DMA_BATCH - 1);
+    // cnt more dmas and invalidates and a flush fence fit on any qp
+    inline bool has_dma_room(uint32_t cnt) {
+        for (uint32_t i = 0;i < group_size;i++) {
+            if (pending_head_list[i] - pending_tail_list[i] + cnt + 1 > dma_depth) {
+                return false;
+            }
+            if (invalid_start_index_list[i] - invalid_finish_index_list[i] + invalid_deferred_list[i] + cnt + 1 > invalid_depth) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // ties stay on the qp in use, it fills its signal batch first
+    inline uint32_t select_dma_qp() {
+        uint32_t best = now_use_qp_index;
+        for (uint32_t i = 0;i < group_size;i++) {
+            if (outstanding_bytes_list[i] < outstanding_bytes_list[best]) {
+                best = i;
+            }
+        }
+        return best;
+    }
 
-        dma_count_list[now_use_qp_index]++;
-        payload_count_list[now_use_qp_index]++;
+    // dmas a payload of length is split into, one per dma qp
+    inline uint32_t dma_parts(size_t length) {
+        if (group_size == 1 || length < 2 * SMARTNS_DMA_SPLIT_BYTES) {
+            return 1;
+        }
+        return min_t(uint32_t, group_size, length / SMARTNS_DMA_SPLIT_BYTES);
+    }
 
-        // dma_qpx_list[now_use_qp_index]->wr_id = now_use_qp_index | (payload_count_list[now_use_qp_index] << 32);
-        // dma_qpx_list[now_use_qp_index]->wr_flags = is_signal ? IBV_SEND_SIGNALED : 0;
-        // size_t tmp_src_addr = reinterpret_cast<size_t>(send_tmp_buffer) + send_tmp_buffer_offset;
-        // dma_mqpx_list[now_use_qp_index]->wr_memcpy_direct(dma_mqpx_list[now_use_qp_index], dest_lkey, dest_addr, send_tmp_mr->lkey, tmp_src_addr, length);
-        // send_tmp_buffer_offset = (send_tmp_buffer_offset + SMARTNS_RX_PACKET_BUFFER) % send_tmp_buffer_size;
+    // wr_id and flags of the next dma on qp_index
+    inline void prepare_dma(uint32_t qp_index, uint64_t src_addr, size_t length, uint32_t deferred = 0) {
+        bool is_signal = dma_count_list[qp_index] % SMARTNS_DMA_BATCH >= (SMARTNS_DMA_BATCH - 1);
 
-        bool is_invalid_signal = invalid_start_index_list[now_use_qp_index] % 16 == 15;
-        invalid_qpx_list[now_use_qp_index]->wr_id = 0;
-        invalid_qpx_list[now_use_qp_index]->wr_flags = is_invalid_signal ? IBV_SEND_SIGNALED : 0;
+        dma_count_list[qp_index]++;
+        payload_count_list[qp_index]++;
 
-        invalid_mqpx_list[now_use_qp_index]->wr_invcache_direct(invalid_mqpx_list[now_use_qp_index], src_lkey, pkt_buffer_addr, round_up((pkt_buffer_addr - src_addr + length), 64), false);
-        invalid_start_index_list[now_use_qp_index]++;
+        dma_qpx_list[qp_index]->wr_id = push_pending_buf(qp_index, src_addr, length, deferred);
+        dma_qpx_list[qp_index]->wr_flags = is_signal ? IBV_SEND_SIGNALED : 0;
 
         if (is_signal) {
-            dma_count_list[now_use_qp_index] = 0;
-            payload_count_list[now_use_qp_index] = 0;
-            now_use_qp_index = (now_use_qp_index + 1) % SMARTNS_DMA_GROUP_SIZE;
+            dma_count_list[qp_index] = 0;
+            payload_count_list[qp_index] = 0;
         }
+        now_use_qp_index = qp_index;
+    }
+
+    inline void post_dma(uint32_t qp_index, uint32_t dest_lkey, uint64_t dest_addr,
+        uint32_t src_lkey, uint64_t src_addr, size_t length, uint32_t deferred = 0) {
+        prepare_dma(qp_index, src_addr, length, deferred);
+        dma_mqpx_list[qp_index]->wr_memcpy_direct(dma_mqpx_list[qp_index], dest_lkey, dest_addr, src_lkey, src_addr, length);
     }
 
-    inline void post_send_recv_cqe(dpu_cq *cq) {
+    // invalidate [addr, end) of an rx buffer once the dmas reading it finished,
+    // poll_dma_cq hands buf_addr back when it finished, none for 0
+    inline void post_invalidate(uint32_t qp_index, uint32_t lkey, uint64_t addr, uint64_t end, uint64_t buf_addr) {
+        bool is_invalid_signal = invalid_count_list[qp_index] % 16 == 15;
+        invalid_qpx_list[qp_index]->wr_id = push_invalid_buf(qp_index, buf_addr);
+        invalid_qpx_list[qp_index]->wr_flags = is_invalid_signal ? IBV_SEND_SIGNALED : 0;
+
+        invalid_mqpx_list[qp_index]->wr_invcache_direct(invalid_mqpx_list[qp_index], lkey, addr, round_up(end - addr, 64), false);
+        invalid_count_list[qp_index] = is_invalid_signal ? 0 : invalid_count_list[qp_index] + 1;
+    }
+
+    // invalidate held back until parts dmas finished, the handle the dmas carry.
+    // Its invalidate qp is set once the last part is posted
+    inline uint32_t defer_invalidate(uint32_t lkey, uint64_t addr, uint64_t end, uint64_t buf_addr, uint32_t parts) {
+        assert(deferred_free_cnt > 0);
+        uint32_t index = deferred_free_list[--deferred_free_cnt];
+        deferred_invalidate *inv = &deferred_list[index];
+        inv->addr = addr;
+        inv->end = end;
+        inv->buf_addr = buf_addr;
+        inv->lkey = lkey;
+        inv->parts_left = parts;
+        return index + 1;
+    }
+
+    inline void set_deferred_qp(uint32_t deferred, uint32_t qp_index) {
+        deferred_list[deferred - 1].qp_index = qp_index;
+        invalid_deferred_list[qp_index]++;
+    }
+
+    // a dma holding the invalidate back finished
+    inline void finish_deferred(uint32_t deferred) {
+        deferred_invalidate *inv = &deferred_list[deferred - 1];
+        if (--inv->parts_left) {
+            return;
+        }
+        invalid_deferred_list[inv->qp_index]--;
+        post_invalidate(inv->qp_index, inv->lkey, inv->addr, inv->end, inv->buf_addr);
+        deferred_free_list[deferred_free_cnt++] = deferred - 1;
+    }
+
+    // src_addr must be inside an rx buffer the caller holds dma_parts(length)
+    // references on, poll_dma_cq hands one back per part once its dma has read it.
+    // With invalidate the caller holds one more, handed back once the
+    // invalidate finished, so the NIC never gets a buffer it may still drop.
+    // The invalidate is posted by poll_dma_cq after all parts finished
+    inline void post_dma_req_without_cq(uint32_t dest_lkey, uint64_t dest_addr,
+        uint32_t src_lkey, uint64_t src_addr, uint64_t pkt_buffer_addr, size_t length, bool invalidate) {
+
+        uint32_t parts = dma_parts(length);
+        size_t part_len = round_up(length / parts, 64);
+        uint32_t deferred = invalidate ? defer_invalidate(src_lkey, pkt_buffer_addr, src_addr + length, src_addr, parts) : 0;
+        for (uint32_t i = 0;i < parts;i++) {
+            size_t offset = i * part_len;
+            post_dma(select_dma_qp(), dest_lkey, dest_addr + offset, src_lkey, src_addr + offset, i + 1 == parts ? length - offset : part_len, deferred);
+        }
+        if (deferred) {
+            set_deferred_qp(deferred, now_use_qp_index);
+        }
+    }
+
+    // cnt dmas out of one rx buffer on one dma qp behind a single doorbell, the
+    // caller holds a reference per entry, and with invalidate one for the
+    // invalidates. Source ranges in adjacent cache lines are invalidated
+    // together, the first one from pkt_buffer_addr on, each once its dmas finished
+    inline void post_dma_vec(const dma_vec *vec, uint32_t cnt, uint32_t src_lkey, uint64_t pkt_buffer_addr, bool invalidate) {
+        uint32_t qp_index = select_dma_qp();
+        ibv_qp_ex *qpx = dma_qpx_list[qp_index];
+        uint32_t deferred = 0;
+        ibv_wr_start(qpx);
+        for (uint32_t i = 0;i < cnt;i++) {
+            if (invalidate) {
+                deferred_invalidate *inv = deferred ? &deferred_list[deferred - 1] : nullptr;
+                if (inv == nullptr || vec[i].src_addr >= round_up(inv->end, 64) + 64 || vec[i].src_addr < inv->addr) {
+                    deferred = defer_invalidate(src_lkey, i == 0 ? pkt_buffer_addr : vec[i].src_addr, 0, 0, 0);
+                    set_deferred_qp(deferred, qp_index);
+                    inv = &deferred_list[deferred - 1];
+                }
+                // nothing is polled before the batch is posted, parts can still grow
+                inv->end = max_t(uint64_t, inv->end, vec[i].src_addr + vec[i].length);
+                inv->parts_left++;
+            }
+            prepare_dma(qp_index, vec[i].src_addr, vec[i].length, deferred);
+            mlx5dv_wr_memcpy(dma_mqpx_list[qp_index], vec[i].dest_lkey, vec[i].dest_addr, src_lkey, vec[i].src_addr, vec[i].length);
+        }
+        assert(ibv_wr_complete(qpx) == 0);
+        if (invalidate) {
+            // invalidates on a qp finish in order, the last one covers the batch
+            deferred_list[deferred - 1].buf_addr = vec[0].src_addr;
+        }
+    }
+
+    inline void poll_atomic_cq() {
+        ibv_wc wc[16];
+        uint32_t num_wc = ibv_poll_cq(atomic_cq, 16, wc);
+        for (uint32_t i = 0; i < num_wc; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                SMARTNS_ERROR("atomic dma cq error %d %ld", wc[i].status, wc[i].wr_id);
+                exit(-1);
+            }
+        }
+        atomic_tail += num_wc;
+    }
+
+    // slot at atomic_head, free once the dma that used it last is done
+    inline uint64_t *get_atomic_slot() {
+        while (atomic_head - atomic_tail >= SMARTNS_ATOMIC_DEPTH) {
+            poll_atomic_cq();
+        }
+        return &atomic_buf[atomic_head % SMARTNS_ATOMIC_DEPTH];
+    }
+
+    inline void post_atomic_memcpy(uint32_t dest_lkey, uint64_t dest_addr, uint32_t src_lkey, uint64_t src_addr) {
+        atomic_qpx->wr_id = atomic_head;
+        atomic_qpx->wr_flags = IBV_SEND_SIGNALED;
+        atomic_mqpx->wr_memcpy_direct(atomic_mqpx, dest_lkey, dest_addr, src_lkey, src_addr, sizeof(uint64_t));
+        atomic_head++;
+    }
+
+    // copy length bytes without waiting, done once atomic_done of the
+    // returned ticket is true
+    inline uint32_t post_atomic_copy(uint32_t dest_lkey, uint64_t dest_addr, uint32_t src_lkey, uint64_t src_addr, uint32_t length) {
+        while (atomic_head - atomic_tail >= SMARTNS_ATOMIC_DEPTH) {
+            poll_atomic_cq();
+        }
+        atomic_qpx->wr_id = atomic_head;
+        atomic_qpx->wr_flags = IBV_SEND_SIGNALED;
+        atomic_mqpx->wr_memcpy_direct(atomic_mqpx, dest_lkey, dest_addr, src_lkey, src_addr, length);
+        return atomic_head++;
+    }
+
+    inline bool atomic_done(uint32_t ticket) {
+        if (static_cast<int32_t>(atomic_tail - ticket) <= 0) {
+            poll_atomic_cq();
+        }
+        return static_cast<int32_t>(atomic_tail - ticket) > 0;
+    }
+
+    inline spinlock_mutex *host_atomic_lock(uint64_t host_addr) {
+        return &atomic_lock_list[(host_addr / sizeof(uint64_t)) % SMARTNS_ATOMIC_LOCKS];
+    }
+
+    inline uint64_t *atomic_stage(uint32_t stage) {
+        return &atomic_buf[SMARTNS_ATOMIC_DEPTH + stage];
+    }
+
+    // lock the host word and read it into a staging word, false if another
+    // atomic holds it or no staging word is free
+    inline bool start_host_atomic(uint32_t host_lkey, uint64_t host_addr, uint32_t *stage, uint32_t *ticket) {
+        if (atomic_stage_free_cnt == 0 || !host_atomic_lock(host_addr)->try_lock()) {
+            return false;
+        }
+        *stage = atomic_stage_free_list[--atomic_stage_free_cnt];
+        *ticket = post_atomic_copy(atomic_mr->lkey, reinterpret_cast<uint64_t>(atomic_stage(*stage)), host_lkey, host_addr, sizeof(uint64_t));
+        return true;
+    }
+
+    // write the staging word back to the host word
+    inline uint32_t write_host_atomic(uint32_t host_lkey, uint64_t host_addr, uint32_t stage) {
+        return post_atomic_copy(host_lkey, host_addr, atomic_mr->lkey, reinterpret_cast<uint64_t>(atomic_stage(stage)), sizeof(uint64_t));
+    }
+
+    inline void finish_host_atomic(uint64_t host_addr, uint32_t stage) {
+        atomic_stage_free_list[atomic_stage_free_cnt++] = stage;
+        host_atomic_lock(host_addr)->unlock();
+    }
+
+    // write an atomic result to host memory
+    inline void post_atomic_result(uint32_t host_lkey, uint64_t host_addr, uint64_t value) {
+        uint64_t *slot = get_atomic_slot();
+        *slot = value;
+        post_atomic_memcpy(host_lkey, host_addr, atomic_mr->lkey, reinterpret_cast<uint64_t>(slot));
+    }
+
+    // cnt CQEs of cq from index first on, inside a batch of post_cqes
+    inline void post_cqe_run(dpu_cq *cq, uint32_t first, uint32_t cnt) {
         bool is_signal = cqe_count % 16 == 15;
 
         cqe_qpx->wr_id = cqe_count;
         cqe_qpx->wr_flags = is_signal ? IBV_SEND_SIGNALED : 0;
-        size_t cqe_offset = (cq->head & (cq->wqe_cnt - 1)) << cq->wqe_shift;
-        cqe_mqpx->wr_memcpy_direct(cqe_mqpx, cq->host_mkey, reinterpret_cast<uint64_t>(cq->host_cq_buf) + cqe_offset, cq->bf_mkey, reinterpret_cast<uint64_t>(cq->bf_cq_buf) + cqe_offset, cq->wqe_size);
+        size_t cqe_offset = static_cast<size_t>(first) << cq->wqe_shift;
+        mlx5dv_wr_memcpy(cqe_mqpx, cq->host_mkey, reinterpret_cast<uint64_t>(cq->host_cq_buf) + cqe_offset, cq->bf_mkey, reinterpret_cast<uint64_t>(cq->bf_cq_buf) + cqe_offset, static_cast<size_t>(cnt) << cq->wqe_shift);
         cqe_count++;
     }
 
-    inline uint32_t poll_dma_cq() {
+    // a flush of cnt CQs fits behind the flushes still waiting
+    inline bool has_cqe_room(uint32_t cnt) {
+        return cqe_fence_head - cqe_fence_tail < SMARTNS_CQE_FENCE_DEPTH &&
+            cqe_run_head - cqe_run_tail + 2 * cnt <= SMARTNS_CQE_RUN_DEPTH;
+    }
+
+    inline void push_cqe_run(dpu_cq *cq, uint32_t first, uint32_t cnt) {
+        cqe_run_list[cqe_run_head % SMARTNS_CQE_RUN_DEPTH] = { cq, first, cnt };
+        cqe_run_head++;
+    }
+
+    // the pending CQEs of each CQ are contiguous up to its head, one dma per
+    // CQ or two where the ring wraps. They wait behind the dmas and atomics
+    // posted so far, post_ready_cqes sends them once those finished
+    inline void post_cqes(dpu_cq **cqs, uint32_t cnt) {
+        assert(has_cqe_room(cnt));
+        for (uint32_t i = 0;i < cnt;i++) {
+            dpu_cq *cq = cqs[i];
+            if (cq->dma_pending == 0) {
+                continue;
+            }
+            uint32_t first = (cq->head - cq->dma_pending) & (cq->wqe_cnt - 1);
+            uint32_t run = min_t(uint32_t, cq->dma_pending, cq->wqe_cnt - first);
+            push_cqe_run(cq, first, run);
+            if (run < cq->dma_pending) {
+                push_cqe_run(cq, 0, cq->dma_pending - run);
+            }
+            cq->dma_pending = 0;
+        }
+        cqe_fence *fence = &cqe_fence_list[cqe_fence_head % SMARTNS_CQE_FENCE_DEPTH];
+        fence->run_end = cqe_run_head;
+        take_fence(&fence->dma);
+        cqe_fence_head++;
+        post_ready_cqes();
+    }
+
+    inline void take_fence(dma_fence *fence) {
+        fence->atomic_head = atomic_head;
+        for (uint32_t i = 0;i < group_size;i++) {
+            fence->dma_head[i] = pending_head_list[i];
+        }
+    }
+
+    inline bool fence_passed(const dma_fence *fence) {
+        if (static_cast<int32_t>(atomic_tail - fence->atomic_head) < 0) {
+            return false;
+        }
+        for (uint32_t i = 0;i < group_size;i++) {
+            if (static_cast<int32_t>(pending_tail_list[i] - fence->dma_head[i]) < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // CQE runs whose dmas finished, in flush order behind a single doorbell
+    inline void post_ready_cqes() {
+        bool started = false;
+        while (cqe_fence_tail != cqe_fence_head) {
+            cqe_fence *fence = &cqe_fence_list[cqe_fence_tail % SMARTNS_CQE_FENCE_DEPTH];
+            if (!fence_passed(&fence->dma)) {
+                break;
+            }
+            for (;cqe_run_tail != fence->run_end;cqe_run_tail++) {
+                if (!started) {
+                    ibv_wr_start(cqe_qpx);
+                    started = true;
+                }
+                cqe_run *run = &cqe_run_list[cqe_run_tail % SMARTNS_CQE_RUN_DEPTH];
+                post_cqe_run(run->cq, run->first, run->cnt);
+            }
+            cqe_fence_tail++;
+        }
+        if (started) {
+            assert(ibv_wr_complete(cqe_qpx) == 0);
+        }
+    }
+
+    // signal the dmas and invalidates posted since the last signaled ones on
+    // every qp, otherwise their buffers wait for more traffic to be released
+    inline void flush_dma() {
+        for (uint32_t i = 0;i < group_size;i++) {
+            if (invalid_count_list[i]) {
+                invalid_qpx_list[i]->wr_id = push_invalid_buf(i, 0);
+                invalid_qpx_list[i]->wr_flags = IBV_SEND_SIGNALED;
+                invalid_mqpx_list[i]->wr_invcache_direct(invalid_mqpx_list[i], fence_mr->lkey, fence_line, 64, false);
+                invalid_count_list[i] = 0;
+            }
+            if (dma_count_list[i] == 0) {
+                continue;
+            }
+            dma_qpx_list[i]->wr_id = push_pending_buf(i, 0, 0);
+            dma_qpx_list[i]->wr_flags = IBV_SEND_SIGNALED;
+            dma_mqpx_list[i]->wr_memcpy_direct(dma_mqpx_list[i], fence_mr->lkey, reinterpret_cast<uint64_t>(fence_buf + 1),
+                fence_mr->lkey, reinterpret_cast<uint64_t>(fence_buf), sizeof(uint64_t));
+            dma_count_list[i] = 0;
+            payload_count_list[i] = 0;
+        }
+    }
+
+    // on_buffer_done(src_addr) for every dma and invalidate known to be finished,
+    // invalidates and CQEs waiting for finished dmas are posted
+    template <typename F>
+    inline uint32_t poll_dma_cq(F &&on_buffer_done) {
         uint32_t total_finish_dma = 0;
         ibv_wc wc[16];
 
-        uint32_t num_wc = ibv_poll_cq(dma_send_recv_cq, 16, wc);
-        for (uint32_t i = 0; i < num_wc; i++) {
-            if (wc[i].status != IBV_WC_SUCCESS) {
-                SMARTNS_ERROR("dma cq error %d %ld\n", wc[i].status, wc[i].wr_id);
-                exit(-1);
+        // drained, a receiver scattering into many SGEs posts more dmas per batch than one poll reaps
+        uint32_t num_wc;
+        do {
+            num_wc = ibv_poll_cq(dma_send_recv_cq, 16, wc);
+            for (uint32_t i = 0; i < num_wc; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    SMARTNS_ERROR("dma cq error %d %ld\n", wc[i].status, wc[i].wr_id);
+                    exit(-1);
+                }
+                // dmas on a qp finish in order, so a signaled one covers the unsignaled before it
+                uint32_t qp_index = wc[i].wr_id & 0xFFFFFFFF;
+                uint32_t seq = wc[i].wr_id >> 32;
+                while (pending_tail_list[qp_index] != seq + 1) {
+                    uint32_t slot = qp_index * dma_depth + pending_tail_list[qp_index] % dma_depth;
+                    uint64_t buf_addr = pending_buf_list[slot];
+                    outstanding_bytes_list[qp_index] -= pending_len_list[slot];
+                    pending_tail_list[qp_index]++;
+                    if (pending_deferred_list[slot]) {
+                        finish_deferred(pending_deferred_list[slot]);
+                    }
+                    if (buf_addr) {
+                        on_buffer_done(buf_addr);
+                        total_finish_dma++;
+                    }
+                }
             }
-            // uint64_t wr_id = wc[i].wr_id;
-            // uint32_t qp_index = wr_id & 0xFFFFFFFF;
-            // uint32_t payload_count = wr_id >> 32;
-            // hack: already free the buffer when do dma ops
-            // total_finish_dma += payload_count;
-        }
+        } while (num_wc == 16);
+
+        do {
+            num_wc = ibv_poll_cq(invalid_send_recv_cq, 16, wc);
+            for (uint32_t i = 0; i < num_wc; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    SMARTNS_ERROR("invalidate cq error %d %ld", wc[i].status, wc[i].wr_id);
+                    exit(-1);
+                }
+                // shared with the cqe qp, whose buffers are its own
+                if (wc[i].qp_num == cqe_qp->qp_num) {
+                    continue;
+                }
+                uint32_t qp_index = wc[i].wr_id & 0xFFFFFFFF;
+                uint32_t seq = wc[i].wr_id >> 32;
+                while (invalid_finish_index_list[qp_index] != seq + 1) {
+                    uint64_t buf_addr = invalid_buf_list[qp_index * invalid_depth + invalid_finish_index_list[qp_index] % invalid_depth];
+                    invalid_finish_index_list[qp_index]++;
+                    if (buf_addr) {
+                        on_buffer_done(buf_addr);
+                    }
+                }
+            }
+        } while (num_wc == 16);
 
-        num_wc = ibv_poll_cq(invalid_send_recv_cq, 16, wc);
-        for (uint32_t i = 0; i < num_wc; i++) {
-            assert(wc[i].status == IBV_WC_SUCCESS);
+        if (unlikely(atomic_head != atomic_tail)) {
+            poll_atomic_cq();
+        }
+        if (cqe_fence_tail != cqe_fence_head) {
+            post_ready_cqes();
         }
 
         return total_finish_dma;
@@ -409,52 +1109,65 @@ public:
     // calculate rss and select special port for remote server 
     uint16_t src_port;
     uint16_t dst_port;
+    // dst_port of the next committed packet, network order
+    uint16_t pkt_dst_port;
 
     uint32_t batch_index;
     uint32_t wr_index;
+    // bytes committed, the send scheduler charges QPs by the difference
+    size_t tx_bytes;
 
     inline void *get_next_pktheader_addr() {
         return reinterpret_cast<void *>(send_buf_addr + send_offset_handler.offset());
     }
 
     inline void commit_pkt_with_payload(uint64_t remote_addr, uint32_t rkey, uint32_t header_size, uint32_t payload_size) {
-        udp_packet *packet = reinterpret_cast<udp_packet *>(send_offset_handler.offset() + send_buf_addr);
-        packet->ip_hdr.total_length = htons(header_size + payload_size - sizeof(ether_hdr));
-        packet->udp_hdr.dgram_len = htons(header_size + payload_size - sizeof(ether_hdr) - sizeof(ipv4_hdr));
-
-        send_sge_list[wr_index * num_sges_per_wr].addr = send_offset_handler.offset() + send_buf_addr;
-        send_sge_list[wr_index * num_sges_per_wr].length = header_size;
-
-        send_sge_list[wr_index * num_sges_per_wr + 1].addr = remote_addr;
-        send_sge_list[wr_index * num_sges_per_wr + 1].length = payload_size;
-        send_sge_list[wr_index * num_sges_per_wr + 1].lkey = rkey;
-
-        send_wr[wr_index].num_sge = 2;
-        if (wr_index > 0) {
-            send_wr[wr_index - 1].next = send_wr + wr_index;
-        }
-        send_wr[wr_index].next = nullptr;
-        send_wr[wr_index].wr_id = send_offset_handler.offset() + send_buf_addr;
-        send_wr[wr_index].send_flags = batch_index == SMARTNS_TX_BATCH - 1 ? (IBV_SEND_IP_CSUM | IBV_SEND_SIGNALED) : IBV_SEND_IP_CSUM;
-
-        batch_index = (batch_index + 1) % SMARTNS_TX_BATCH;
-        wr_index++;
-        send_offset_handler.step();
+        ibv_sge *sge = send_sge_list + wr_index * num_sges_per_wr;
+        sge[1].addr = remote_addr;
+        sge[1].length = payload_size;
+        sge[1].lkey = rkey;
+        commit_wr(header_size, payload_size, 2);
+    }
 
-        if (wr_index == SMARTNS_TX_BATCH) {
-            commit_flush();
+    // payload_size bytes from offset of the message in sge_list, one
+    // sge per piece of the packet that falls in each of them
+    inline void commit_pkt_with_gather(const smartns_send_sge *sge_list, uint32_t num_sge, uint32_t offset, uint32_t header_size, uint32_t payload_size) {
+        ibv_sge *sge = send_sge_list + wr_index * num_sges_per_wr;
+        uint32_t n = 1, left = payload_size;
+        for (uint32_t i = 0;i < num_sge && left;i++) {
+            if (offset >= sge_list[i].byte_count) {
+                offset -= sge_list[i].byte_count;
+                continue;
+            }
+            uint32_t length = min_t(uint32_t, sge_list[i].byte_count - offset, left);
+            sge[n].addr = sge_list[i].addr + offset;
+            sge[n].length = length;
+            sge[n].lkey = sge_list[i].lkey;
+            n++;
+            left -= length;
+            offset = 0;
         }
+        assert(left == 0);
+        commit_wr(header_size, payload_size, n);
     }
 
     inline void commit_pkt_without_payload(uint32_t header_size) {
+        commit_wr(header_size, 0, 1);
+    }
+
+    // headers at the next tx buffer are the first of num_sge sges
+    inline void commit_wr(uint32_t header_size, uint32_t payload_size, uint32_t num_sge) {
         udp_packet *packet = reinterpret_cast<udp_packet *>(send_offset_handler.offset() + send_buf_addr);
-        packet->ip_hdr.total_length = htons(header_size - sizeof(ether_hdr));
-        packet->udp_hdr.dgram_len = htons(header_size - sizeof(ether_hdr) - sizeof(ipv4_hdr));
+        packet->udp_hdr.dst_port = pkt_dst_port;
+        pkt_dst_port = dst_port;
+        packet->ip_hdr.total_length = htons(header_size + payload_size - sizeof(ether_hdr));
+        packet->udp_hdr.dgram_len = htons(header_size + payload_size - sizeof(ether_hdr) - sizeof(ipv4_hdr));
 
         send_sge_list[wr_index * num_sges_per_wr].addr = send_offset_handler.offset() + send_buf_addr;
         send_sge_list[wr_index * num_sges_per_wr].length = header_size;
+        tx_bytes += header_size + payload_size;
 
-        send_wr[wr_index].num_sge = 1;
+        send_wr[wr_index].num_sge = num_sge;
         if (wr_index > 0) {
             send_wr[wr_index - 1].next = send_wr + wr_index;
         }
@@ -491,6 +1204,29 @@ public:
     }
 };
 
+// byte_cnt of a multi-packet receive queue CQE
+#define MLX5_MPRQ_LEN_MASK 0x0000FFFF
+#define MLX5_MPRQ_STRIDE_NUM_MASK 0x3FFF0000
+#define MLX5_MPRQ_STRIDE_NUM_SHIFT 16
+#define MLX5_MPRQ_FILLER_MASK 0x80000000
+
+// order CQE reads after the owner bit, and WQE writes before the doorbell record
+static inline void rx_from_device_barrier() {
+#if defined(__aarch64__)
+    asm volatile("dmb oshld" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+static inline void rx_to_device_barrier() {
+#if defined(__aarch64__)
+    asm volatile("dmb oshst" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
 class alignas(64) rxpath_handler {
 
 public:
@@ -515,9 +1251,254 @@ public:
     size_t rx_depth;
     // convert to size_t 
     size_t recv_buf_addr;
+    // header slot of each packet buffer under SMARTNS_RX_HDR_SPLIT
+    size_t hdr_ring_addr;
+    // bytes of a frame scattered to its header slot
+    constexpr static uint32_t hdr_split_bytes = sizeof(udp_packet) + sizeof(rxe_bth);
+    static_assert(hdr_split_bytes <= SMARTNS_RX_HDR_SLOT);
 
     offset_handler recv_offset_handler;
     offset_handler recv_comp_offset_handler;
+
+    uint32_t wr_index;
+    // buffers held by reorder buffer, not in the recv queue
+    uint32_t held_buffers;
+    // buffers in the recv queue, the NIC fills them in order before one posted now
+    uint32_t posted_buffers;
+    // references to each buffer, the protocol holds one from poll to release
+    // and every payload dma reading from it another
+    uint16_t *recv_buf_ref;
+
+    // the main flow steers frames to recv_qp, send_recv_qp unless SMARTNS_RX_MPRQ
+    ibv_qp *recv_qp;
+
+    // multi-packet receive queue, WQEs and CQEs are accessed directly
+    ibv_wq *mprq_wq;
+    ibv_rwq_ind_table *mprq_ind_table;
+    uint8_t *mprq_wqes;
+    __be32 *mprq_wq_dbrec;
+    uint32_t mprq_wqe_cnt;
+    uint32_t mprq_wqe_stride;
+    uint32_t mprq_wq_pi;
+    uint32_t mprq_wq_ci;
+    // strides of the WQE at mprq_wq_ci the NIC has used
+    uint32_t mprq_consumed_strides;
+    uint8_t *mprq_cqes;
+    __be32 *mprq_cq_dbrec;
+    uint32_t mprq_cqe_cnt;
+    uint32_t mprq_cqe_size;
+    uint32_t mprq_cq_ci;
+    // buffer posted in each WQE, references to each buffer and buffers free to post
+    uint32_t *mprq_slot_buf;
+    uint32_t *mprq_buf_ref;
+    uint32_t *mprq_free_bufs;
+    uint32_t mprq_free_cnt;
+
+    void init_mprq();
+
+    // the ring holds one reference to a posted buffer, every frame in it another
+    inline void put_mprq_buf(uint32_t buf) {
+        if (--mprq_buf_ref[buf] == 0) {
+            mprq_free_bufs[mprq_free_cnt++] = buf;
+        }
+    }
+
+    // out of order frames may be held as long as the ring can still be refilled
+    inline bool can_hold_recv_buffer() {
+        if (SMARTNS_RX_MPRQ) {
+            uint32_t pinned = SMARTNS_RX_MPRQ_BUFS - mprq_free_cnt - (mprq_wq_pi - mprq_wq_ci);
+            return pinned < SMARTNS_RX_MPRQ_BUFS - mprq_wqe_cnt;
+        }
+        return held_buffers < SMARTNS_RX_REORDER_BUFFER;
+    }
+
+    // like ibv_poll_cq, wr_id is the frame address
+    inline int poll_recv_cq(ibv_wc *wc, int num) {
+        if (!SMARTNS_RX_MPRQ) {
+            int recv = ibv_poll_cq(recv_cq, num, wc);
+            for (int i = 0;i < recv;i++) {
+                recv_buf_ref[(wc[i].wr_id - recv_buf_addr) / SMARTNS_RX_PACKET_BUFFER] = 1;
+            }
+            posted_buffers -= recv;
+            return recv;
+        }
+
+        int recv = 0;
+        while (recv < num) {
+            mlx5_cqe64 *cqe = reinterpret_cast<mlx5_cqe64 *>(mprq_cqes + (mprq_cq_ci & (mprq_cqe_cnt - 1)) * mprq_cqe_size + mprq_cqe_size - sizeof(mlx5_cqe64));
+            uint8_t op_own = cqe->op_own;
+            if ((op_own & MLX5_CQE_OWNER_MASK) != !!(mprq_cq_ci & mprq_cqe_cnt) || (op_own >> 4) == MLX5_CQE_INVALID) {
+                break;
+            }
+            rx_from_device_barrier();
+            mprq_cq_ci++;
+            if ((op_own >> 4) != MLX5_CQE_RESP_SEND) {
+                SMARTNS_ERROR("rx cqe error opcode %u syndrome %u\n", op_own >> 4, reinterpret_cast<mlx5_err_cqe *>(cqe)->syndrome);
+                exit(1);
+            }
+
+            uint32_t byte_cnt = be32toh(cqe->byte_cnt);
+            uint32_t buf = mprq_slot_buf[mprq_wq_ci & (mprq_wqe_cnt - 1)];
+            // a filler only consumes the strides left at the end of the WQE
+            if (!(byte_cnt & MLX5_MPRQ_FILLER_MASK)) {
+                uint32_t stride = be16toh(cqe->wqe_counter);
+                wc[recv].wr_id = recv_buf_addr + (static_cast<size_t>(buf) << SMARTNS_RX_MPRQ_LOG_BUF_SIZE) + (static_cast<size_t>(stride) << SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE);
+                wc[recv].byte_len = byte_cnt & MLX5_MPRQ_LEN_MASK;
+                wc[recv].status = IBV_WC_SUCCESS;
+                wc[recv].opcode = IBV_WC_RECV;
+                mprq_buf_ref[buf]++;
+                recv++;
+            }
+            mprq_consumed_strides += (byte_cnt & MLX5_MPRQ_STRIDE_NUM_MASK) >> MLX5_MPRQ_STRIDE_NUM_SHIFT;
+            if (mprq_consumed_strides >= (1u << SMARTNS_RX_MPRQ_LOG_STRIDES)) {
+                mprq_consumed_strides = 0;
+                mprq_wq_ci++;
+                put_mprq_buf(buf);
+            }
+        }
+        if (recv) {
+            *mprq_cq_dbrec = htobe32(mprq_cq_ci & 0xFFFFFF);
+        }
+        return recv;
+    }
+
+    // eth, ip, udp and bth of the frame received into pkt_buf
+    inline uint64_t frame_hdr(uint64_t pkt_buf) {
+        if (SMARTNS_RX_HDR_SPLIT) {
+            return hdr_ring_addr + (pkt_buf - recv_buf_addr) / SMARTNS_RX_PACKET_BUFFER * SMARTNS_RX_HDR_SLOT;
+        }
+        return pkt_buf;
+    }
+
+    // what follows the bth, extension headers and then the payload
+    inline uint64_t frame_data(uint64_t pkt_buf) {
+        if (SMARTNS_RX_HDR_SPLIT) {
+            return pkt_buf;
+        }
+        return pkt_buf + hdr_split_bytes;
+    }
+
+    // bytes the NIC writes before it reaches a buffer released now, with
+    // frames of frame_bytes
+    inline size_t reuse_distance(size_t frame_bytes) {
+        if (SMARTNS_RX_MPRQ) {
+            return static_cast<size_t>(mprq_wq_pi - mprq_wq_ci) << SMARTNS_RX_MPRQ_LOG_BUF_SIZE;
+        }
+        return posted_buffers * round_up(frame_bytes, 64);
+    }
+
+    // addr may point anywhere inside the buffer
+    inline void hold_recv_buffer(uint64_t addr) {
+        if (SMARTNS_RX_MPRQ) {
+            mprq_buf_ref[(addr - recv_buf_addr) >> SMARTNS_RX_MPRQ_LOG_BUF_SIZE]++;
+            return;
+        }
+        recv_buf_ref[(addr - recv_buf_addr) / SMARTNS_RX_PACKET_BUFFER]++;
+    }
+
+    // buffers may be released out of ring order, so repost them by address
+    inline void release_recv_buffer(uint64_t addr) {
+        if (SMARTNS_RX_MPRQ) {
+            put_mprq_buf((addr - recv_buf_addr) >> SMARTNS_RX_MPRQ_LOG_BUF_SIZE);
+            return;
+        }
+        size_t index = (addr - recv_buf_addr) / SMARTNS_RX_PACKET_BUFFER;
+        if (--recv_buf_ref[index]) {
+            return;
+        }
+        uint64_t buf_addr = recv_buf_addr + index * SMARTNS_RX_PACKET_BUFFER;
+        ibv_sge *sge = recv_sge_list + wr_index * num_sges_per_wr;
+        if (SMARTNS_RX_HDR_SPLIT) {
+            sge->addr = hdr_ring_addr + index * SMARTNS_RX_HDR_SLOT;
+            sge->length = hdr_split_bytes;
+            sge++;
+        }
+        sge->addr = buf_addr;
+        sge->length = SMARTNS_RX_PACKET_BUFFER;
+        recv_wr[wr_index].wr_id = buf_addr;
+        recv_wr[wr_index].next = nullptr;
+        posted_buffers++;
+        if (wr_index > 0) {
+            recv_wr[wr_index - 1].next = recv_wr + wr_index;
+        }
+        wr_index++;
+
+        if (wr_index == num_wrs) {
+            flush_recv_buffer();
+        }
+    }
+
+    inline void flush_recv_buffer() {
+        if (SMARTNS_RX_MPRQ) {
+            // refill the ring with free buffers, one doorbell for all of them
+            uint32_t posted = mprq_wq_pi;
+            while (mprq_free_cnt && mprq_wq_pi - mprq_wq_ci < mprq_wqe_cnt) {
+                uint32_t buf = mprq_free_bufs[--mprq_free_cnt];
+                uint32_t slot = mprq_wq_pi & (mprq_wqe_cnt - 1);
+                mlx5_mprq_wqe *wqe = reinterpret_cast<mlx5_mprq_wqe *>(mprq_wqes + slot * mprq_wqe_stride);
+                wqe->dseg.addr = htobe64(recv_buf_addr + (static_cast<size_t>(buf) << SMARTNS_RX_MPRQ_LOG_BUF_SIZE));
+                mprq_slot_buf[slot] = buf;
+                mprq_buf_ref[buf] = 1;
+                mprq_wq_pi++;
+            }
+            if (mprq_wq_pi != posted) {
+                rx_to_device_barrier();
+                *mprq_wq_dbrec = htobe32(mprq_wq_pi & 0xFFFF);
+            }
+            return;
+        }
+        if (wr_index == 0) {
+            return;
+        }
+        assert(ibv_post_recv(send_recv_qp, recv_wr, &recv_bad_wr) == 0);
+        wr_index = 0;
+    }
+};
+
+// whether the payload dma source in an rx buffer is dropped from the LLC, so
+// its dirty lines aren't written back to memory
+enum rx_invalidate_policy {
+    RX_INVALIDATE_ALWAYS,
+    RX_INVALIDATE_NEVER,
+    // skip buffers the NIC rewrites before the LLC would evict them
+    RX_INVALIDATE_AUTO,
+};
+
+rx_invalidate_policy parse_rx_invalidate_policy(const char *name);
+
+struct datapath_counters {
+    size_t retrans_events;
+    size_t retrans_pkts;
+    size_t retrans_timeouts;
+    size_t nak_sent;
+    size_t nak_recv;
+    size_t access_nak_sent;
+    size_t access_nak_recv;
+    size_t rx_fault_drop;
+    size_t rx_fault_reorder;
+    size_t reorder_buffered;
+    size_t reorder_drained;
+    size_t reorder_overflow;
+    size_t dup_replay;
+    size_t dup_drop;
+    size_t unknown_qpn;
+    size_t ecn_marked;
+    size_t cnp_recv;
+    size_t ack_coalesced;
+    size_t ack_delay_fired;
+    size_t zc_hit;
+    size_t zc_miss;
+    size_t zc_stale;
+    size_t zc_arm;
+    size_t zc_disarm;
+    size_t rx_invalidate;
+    size_t rx_invalidate_skip;
+    size_t cq_refresh;
+    size_t cq_full;
+    size_t cq_overflow;
+    size_t pull_doorbell_reads;
+    size_t pull_wqe_reads;
+    size_t pull_wqes;
 };
 
 class alignas(64) datapath_handler {
@@ -529,24 +1510,221 @@ public:
     ::txpath_handler *txpath_handler;
     ::rxpath_handler *rxpath_handler;
     struct ibv_wc *wc_send_recv;
-
-    // don't need use parallel hash map
-    phmap::flat_hash_map<uint64_t, dpu_qp *>local_qpn_to_qp_list;
-
-    phmap::flat_hash_set<dpu_qp *>active_qp_list;
+    // receive batch, and QPs owing an ack once it is processed
+    rxe_rx_pkt *rx_batch;
+    dpu_qp **ack_pending_qps;
+    size_t ack_pending_cnt;
+
+    // QPs of this thread indexed by qp number, written by the control path
+    dpu_qp **qp_table;
+    // held while this thread looks up an MR, the control path takes every
+    // thread's to register or deregister one
+    spinlock_mutex mr_list_mutex;
+
+    // QPs with requests or responses to send, served by weighted deficit round robin
+    dpu_qp *ready_head;
+    dpu_qp *ready_tail;
+    // bytes a weight 1 QP may send per round
+    size_t sched_quantum;
+    // token bucket depth of rate limited QPs
+    size_t sched_burst;
     phmap::parallel_flat_hash_set<dpu_datapath_send_wq *>active_datapath_send_wq_list;
     spinlock_mutex active_datapath_send_wq_list_mutex;
 
+    // CQs with CQEs not DMAed to the host yet, flushed at the end of a send or
+    // receive pass so the CQEs a burst completes go out together
+    dpu_cq **cqe_pending_cqs;
+    uint32_t cqe_pending_cnt;
+
+    // qpn of QPs with an armed retransmit timer
+    timer_wheel<size_t> retrans_timer;
+    size_t retrans_timeout_tsc;
+
+    // a QP acks once this many requests asked for it, or when the ack delay passes
+    uint32_t ack_coalesce_pkts;
+    size_t ack_delay_tsc;
+    // qpn of QPs holding back an ack
+    timer_wheel<size_t> ack_timer;
+
+    // zero-copy receive queues of this thread's QPs complete on zc_cq, and are
+    // armed or refilled by a scan every zc_rearm_tsc
+    bool rx_zero_copy;
+    ibv_cq *zc_cq;
+    size_t zc_rearm_tsc;
+    size_t zc_scan_tsc;
+
+    // fault injection on received frames, threshold out of 2^32, 0 means disabled
+    uint64_t rx_drop_threshold;
+    uint64_t rx_reorder_threshold;
+    uint64_t fault_rand_state;
+
+    // shared by the QPs of this thread
+    rxe_cc_param cc_param;
+
+    rx_invalidate_policy invalidate_policy;
+    // LLC share of this thread's rx buffers under RX_INVALIDATE_AUTO
+    size_t invalidate_llc_bytes;
+
+    datapath_counters counters;
+
+    // nullptr for a qp number this thread doesn't own
+    inline dpu_qp *lookup_qp(size_t qpn) {
+        if (unlikely(qpn >= SMARTNS_MAX_QP)) {
+            return nullptr;
+        }
+        return qp_table[qpn];
+    }
+
+    void sched_activate(dpu_qp *qp);
+
+    void sched_deactivate(dpu_qp *qp);
+
+    void pull_send_wq(dpu_datapath_send_wq *datapath_send_wq);
+
     void loop_datapath_send_wq();
 
     size_t handle_send();
 
     size_t handle_recv();
 
+    size_t handle_timer();
+
+    int inject_rx_fault(ibv_wc *wc, int recv);
+
+    void print_counters();
+
+    // false if the next host recv WQE can't be targeted yet
+    bool zc_arm(dpu_qp *qp);
+
+    void zc_disarm(dpu_qp *qp);
+
+    // target the host recv WQEs after the ones already targeted
+    void zc_refill(dpu_qp *qp);
+
+    // payload dma out of a received frame, its buffer stays posted-out until the dma finished
+    // a batch may scatter more payload than the dma qps hold, reap what finished
+    inline void reserve_dma(uint32_t cnt) {
+        while (unlikely(!dma_handler->has_dma_room(cnt))) {
+            dma_handler->flush_dma();
+            dma_handler->poll_dma_cq([this](uint64_t buf_addr) {
+                rxpath_handler->release_recv_buffer(buf_addr);
+            });
+        }
+    }
+
+    // whether the frame read up to end is invalidated, the buffer holds
+    // a reference for it if so
+    inline bool rx_invalidate(uint64_t pkt_buf, uint64_t end) {
+        bool invalidate = invalidate_policy == RX_INVALIDATE_ALWAYS ||
+            (invalidate_policy == RX_INVALIDATE_AUTO && rxpath_handler->reuse_distance(end - pkt_buf) > invalidate_llc_bytes);
+        if (invalidate) {
+            counters.rx_invalidate++;
+            rxpath_handler->hold_recv_buffer(pkt_buf);
+        } else {
+            counters.rx_invalidate_skip++;
+        }
+        return invalidate;
+    }
+
+    inline void post_payload_dma(uint32_t dest_lkey, uint64_t dest_addr, uint64_t payload_addr, uint64_t pkt_buf, size_t length) {
+        reserve_dma(dma_handler->dma_parts(length));
+        for (uint32_t i = dma_handler->dma_parts(length);i > 0;i--) {
+            rxpath_handler->hold_recv_buffer(payload_addr);
+        }
+        dma_handler->post_dma_req_without_cq(dest_lkey, dest_addr, rxpath_handler->mr->lkey, payload_addr, pkt_buf, length,
+            rx_invalidate(pkt_buf, payload_addr + length));
+    }
+
+    // a frame's payload scattered over several host buffers
+    inline void post_payload_dma_vec(const dma_vec *vec, uint32_t cnt, uint64_t pkt_buf) {
+        reserve_dma(cnt);
+        for (uint32_t i = 0;i < cnt;i++) {
+            rxpath_handler->hold_recv_buffer(vec[i].src_addr);
+        }
+        dma_handler->post_dma_vec(vec, cnt, rxpath_handler->mr->lkey, pkt_buf,
+            rx_invalidate(pkt_buf, vec[cnt - 1].src_addr + vec[cnt - 1].length));
+    }
+
     void dma_send_payload_to_host(dpu_qp *qp, uint64_t paylod_buf, uint64_t pkt_buf, size_t payload_size);
 
     void dma_write_payload_to_host(dpu_qp *qp, uint64_t paylod_buf, uint64_t pkt_buf, size_t payload_size);
 
+    // DMA the consumer index the host last wrote in poll_cq without waiting, one
+    // read per cq in flight. True once a read posted earlier updated host_consumed
+    inline bool refresh_cq(dpu_cq *cq) {
+        if (!cq->refreshing) {
+            cq->refresh_ticket = dma_handler->post_atomic_copy(cq->bf_mkey, reinterpret_cast<uint64_t>(cq->bf_cq_doorbell),
+                cq->host_mkey, reinterpret_cast<uint64_t>(cq->host_cq_doorbell), sizeof(cq->bf_cq_doorbell->consumer_index));
+            cq->refreshing = 1;
+            counters.cq_refresh++;
+        }
+        if (!dma_handler->atomic_done(cq->refresh_ticket)) {
+            return false;
+        }
+        cq->refreshing = 0;
+        cq->host_consumed = cq->bf_cq_doorbell->consumer_index;
+        return true;
+    }
+
+    // the host consumer index is read again only when the cached one leaves
+    // fewer than need CQEs free, callers retry while the read is in flight
+    inline bool cq_has_room(dpu_cq *cq, uint32_t need) {
+        if (cq->produced - cq->host_consumed + cq->reserved + need <= cq->wqe_cnt) {
+            return true;
+        }
+        refresh_cq(cq);
+        return cq->produced - cq->host_consumed + cq->reserved + need <= cq->wqe_cnt;
+    }
+
+    // a signaled send WQE about to start holds the CQE its ack writes
+    inline bool reserve_send_cqe(dpu_qp *qp, dpu_send_wqe *wqe) {
+        if (!wqe->is_signal || wqe->cqe_reserved) {
+            return true;
+        }
+        if (!cq_has_room(qp->send_cq, 1)) {
+            counters.cq_full++;
+            return false;
+        }
+        qp->send_cq->reserved++;
+        wqe->cqe_reserved = 1;
+        return true;
+    }
+
+    // the CQE at the head of cq is written, it goes to the host with the next flush
+    inline void queue_cqe(dpu_cq *cq) {
+        // backpressure keeps this from happening, unless another thread writes the cq too
+        if (unlikely(cq->produced - cq->host_consumed >= cq->wqe_cnt)) {
+            if (refresh_cq(cq) && cq->produced - cq->host_consumed >= cq->wqe_cnt) {
+                counters.cq_overflow++;
+            }
+        }
+        if (cq->dma_pending == 0) {
+            if (cqe_pending_cnt == SMARTNS_CQE_PENDING_CQS) {
+                flush_cqes();
+            }
+            cqe_pending_cqs[cqe_pending_cnt++] = cq;
+        }
+        cq->step_cq();
+        // a run never laps the ring
+        if (++cq->dma_pending == cq->wqe_cnt) {
+            flush_cqes();
+        }
+    }
+
+    inline void flush_cqes() {
+        if (cqe_pending_cnt) {
+            // flushes still waiting for their dmas hold the run ring
+            while (unlikely(!dma_handler->has_cqe_room(cqe_pending_cnt))) {
+                dma_handler->flush_dma();
+                dma_handler->poll_dma_cq([this](uint64_t buf_addr) {
+                    rxpath_handler->release_recv_buffer(buf_addr);
+                });
+            }
+            dma_handler->post_cqes(cqe_pending_cqs, cqe_pending_cnt);
+            cqe_pending_cnt = 0;
+        }
+    }
+
     void dma_send_cq_to_host(dpu_qp *qp);
 
     void dma_recv_cq_to_host(dpu_qp *qp);
@@ -556,9 +1734,18 @@ class datapath_manager {
 private:
     void create_main_flow();
 public:
-    datapath_manager(ibv_context *all_context, ibv_pd *all_pd, size_t numa_node, bool is_server);
+    datapath_manager(ibv_context *all_context, ibv_pd *all_pd, size_t numa_node, bool is_server, uint32_t dma_group_size);
     ~datapath_manager();
 
+    // mark all sent packets ECT(0) so the switches can signal congestion
+    void set_ecn_capable();
+
+    // called by the control path before the QP is published, the datapath arms it
+    // once the host posted a recv WQE
+    void create_zc_rq(dpu_qp *qp, size_t thread_id);
+
+    void destroy_zc_rq(dpu_qp *qp);
+
     bool is_server;
     size_t numa_node;
 
@@ -579,6 +1766,10 @@ private:
     size_t generate_pd_number();
     size_t generate_cq_number();
     size_t generate_qp_number();
+    void release_qp_number(size_t qp_number);
+
+    // destroyed qp numbers, reused oldest first once fresh ones run out
+    std::deque<size_t> free_qp_numbers;
 public:
 
     const size_t control_packet_size = 512;
@@ -598,7 +1789,8 @@ public:
     void handle_create_qp(SMARTNS_CREATE_QP_PARAMS *param);
     void handle_destory_qp(SMARTNS_DESTROY_QP_PARAMS *param);
     void handle_modify_qp(SMARTNS_MODIFY_QP_PARAMS *param);
-
+    void handle_set_qp_sched(SMARTNS_SET_QP_SCHED_PARAMS *param);
+    void handle_set_send_wq_pull(SMARTNS_SET_SEND_WQ_PULL_PARAMS *param);
     phmap::parallel_flat_hash_map<size_t, dpu_context *>context_list;
 
     ibv_context *global_context;
@@ -20,10 +20,19 @@ static __attribute__((unused)) uint8_t vhca_access_key[32] = {
 
 #define SMARTNS_CQE_OWNER_MASK 1
 
+// inline payload of a send WQE fills the next ring slots, SEGS of them at most
+#define SMARTNS_SEND_INLINE_SEG_SIZE 63
+#define SMARTNS_SEND_INLINE_SEGS 2
+#define SMARTNS_MAX_INLINE_DATA (SMARTNS_SEND_INLINE_SEG_SIZE * SMARTNS_SEND_INLINE_SEGS)
+
+// a send WQE with more than one SGE lists all of them in the next ring slots
+#define SMARTNS_SEND_SGE_PER_SEG 3
+#define SMARTNS_SEND_SGE_SEGS 2
+#define SMARTNS_MAX_SEND_SGE (SMARTNS_SEND_SGE_PER_SEG * SMARTNS_SEND_SGE_SEGS)
+
 struct __attribute__((packed)) smartns_send_wqe {
-    uint64_t qpn;
+    uint32_t qpn;
     uint32_t opcode;
-    uint32_t imm;
 
     uint64_t local_addr;
     uint32_t local_lkey;
@@ -31,12 +40,41 @@ struct __attribute__((packed)) smartns_send_wqe {
 
     uint64_t remote_addr;
     uint32_t remote_rkey;
-    uint32_t reserved1;
-
     uint32_t cur_pos;
+
+    // atomic operands share the space of imm
+    union {
+        uint32_t imm;
+        struct __attribute__((packed)) {
+            uint64_t compare_add;
+            uint64_t swap;
+        } atomic;
+    };
+
     uint8_t is_signal;
+    // slots of inline payload after this one, 0 reads the payload at local_addr
+    uint8_t inline_segs;
+    // above 1 the SGEs are in the slots after this one and local_addr is unused
+    uint8_t num_sge;
+    uint8_t reserved[4];
+    uint8_t op_own;
+};
+
+struct __attribute__((packed)) smartns_send_sge {
+    uint64_t addr;
+    uint32_t lkey;
+    uint32_t byte_count;
+};
+
+// owned like the WQE in its slot, the payload may reach the DPU after the WQE
+struct __attribute__((packed)) smartns_send_inline_seg {
+    uint8_t data[SMARTNS_SEND_INLINE_SEG_SIZE];
+    uint8_t op_own;
+};
 
-    uint8_t reserved2[10];
+struct __attribute__((packed)) smartns_send_sge_seg {
+    struct smartns_send_sge sge[SMARTNS_SEND_SGE_PER_SEG];
+    uint8_t reserved[15];
     uint8_t op_own;
 };
 
@@ -53,7 +91,9 @@ struct __attribute__((packed)) smartns_cqe {
     uint32_t wqe_counter;
     uint16_t mlx5_opcode;
     uint8_t cq_opcode;
-    uint8_t reserved[44];
+    // ibv_wc_status of a MLX5_CQE_REQ_ERR completion
+    uint8_t status;
+    uint8_t reserved[43];
     uint8_t op_own;
 };
 
@@ -62,6 +102,12 @@ struct __attribute__((packed)) smartns_cq_doorbell {
     char padding[56];
 };
 
+// producer index of a send wq in pull mode, free running
+struct __attribute__((packed)) smartns_wq_doorbell {
+    size_t producer_index;
+    char padding[56];
+};
+
 struct SMARTNS_KERNEL_COMMON_PARAMS {
     int pid;
     int tgid;
@@ -118,6 +164,8 @@ struct SMARTNS_REG_MR_PARAMS {
     unsigned int host_mkey;
     unsigned long int host_size;
     void *host_addr;
+    // ibv_access_flags, checked against remote requests
+    unsigned int access;
 
     // response
     unsigned int bf_mkey;
@@ -182,6 +230,27 @@ struct SMARTNS_MODIFY_QP_PARAMS {
     unsigned int remote_qp_number;
 };
 
+struct SMARTNS_SET_QP_SCHED_PARAMS {
+    struct SMARTNS_KERNEL_COMMON_PARAMS common_params;
+    unsigned long int context_number;
+    unsigned long int qp_number;
+    // share of the datapath thread relative to other QPs, 0 keeps 1
+    unsigned int weight;
+    // 0 means unlimited
+    unsigned long int rate_limit_mbps;
+};
+
+// the DPU reads WQEs of a send wq from host_send_wq_buf once host_doorbell
+// says they are posted, instead of the host DMAing them to the bf ring
+struct SMARTNS_SET_SEND_WQ_PULL_PARAMS {
+    struct SMARTNS_KERNEL_COMMON_PARAMS common_params;
+    unsigned long int context_number;
+    unsigned long int datapath_send_wq_id;
+    void *host_send_wq_buf;
+    void *host_doorbell;
+    void *bf_doorbell;
+};
+
 struct SMARTNS_DESTROY_QP_PARAMS {
     struct SMARTNS_KERNEL_COMMON_PARAMS common_params;
     unsigned long int context_number;
@@ -210,3 +279,7 @@ struct SMARTNS_DESTROY_QP_PARAMS {
 #define SMARTNS_IOC_DEALLOC_PD _IOWR(SMARTNS_IOCTL, 10, struct SMARTNS_DEALLOC_PD_PARAMS)
 
 #define SMARTNS_IOC_CLOSE_DEVICE _IOWR(SMARTNS_IOCTL, 11, struct SMARTNS_CLOSE_DEVICE_PARAMS)
+
+#define SMARTNS_IOC_SET_QP_SCHED _IOWR(SMARTNS_IOCTL, 12, struct SMARTNS_SET_QP_SCHED_PARAMS)
+
+#define SMARTNS_IOC_SET_SEND_WQ_PULL _IOWR(SMARTNS_IOCTL, 13, struct SMARTNS_SET_SEND_WQ_PULL_PARAMS)
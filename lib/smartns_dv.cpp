@@ -50,6 +50,8 @@ struct ibv_context *smartns_open_device(struct ibv_device *ib_dev) {
     s_ctx->inner_bf_mr = devx_create_crossing_mr(pd, params.bf_addr, params.bf_size, params.bf_vhca_id, params.bf_mkey, vhca_access_key, sizeof(vhca_access_key));
 
     s_ctx->context_number = params.context_number;
+    s_ctx->wqe_dma_max_batch = SMARTNS_WQE_DMA_MAX_BATCH;
+    s_ctx->wqe_dma_delay_tsc = SMARTNS_WQE_DMA_DELAY_NS * get_tsc_freq_per_ns();
 
     void *bf_base_addr = params.bf_addr;
     size_t bf_total_size = params.bf_size;
@@ -71,13 +73,17 @@ struct ibv_context *smartns_open_device(struct ibv_device *ib_dev) {
         send_wq->wqe_size = sizeof(smartns_send_wqe);
         send_wq->wqe_cnt = params.send_wq_capacity;
         send_wq->wqe_shift = std::log2(send_wq->wqe_size);
-        send_wq->max_sge = 1;
+        send_wq->max_sge = SMARTNS_MAX_SEND_SGE;
         send_wq->wrid = reinterpret_cast<uint64_t *>(malloc(sizeof(uint64_t) * send_wq->wqe_cnt));
 
+        send_wq->reserve = 0;
         send_wq->head = 0;
         send_wq->tail = 0;
 
         send_wq->own_flag = 1;
+        send_wq->pull = false;
+        send_wq->host_doorbell = nullptr;
+        send_wq->bf_doorbell = nullptr;
 
         send_wq->dma_wq.dma_send_recv_cq = create_dma_cq(context, 256);
         send_wq->dma_wq.start_index = 0;
@@ -86,6 +92,8 @@ struct ibv_context *smartns_open_device(struct ibv_device *ib_dev) {
         send_wq->dma_wq.finish_index = 0;
         send_wq->dma_wq.max_num = 256;
         send_wq->dma_wq.dma_batch_size = 1;
+        send_wq->dma_wq.max_batch_size = s_ctx->wqe_dma_max_batch;
+        send_wq->dma_wq.delay_tsc = s_ctx->wqe_dma_delay_tsc;
         send_wq->dma_wq.host_addr = send_wq->host_send_wq_buf;
         send_wq->dma_wq.bf_addr = send_wq->bf_send_wq_buf;
         send_wq->dma_wq.wqe_size = sizeof(smartns_send_wqe);
@@ -232,6 +240,7 @@ struct ibv_mr *smartns_reg_mr(struct ibv_pd *pd, void *addr, size_t length, unsi
     params.host_mkey = devx_mr_query_mkey(s_mr->dev_mr);
     params.host_size = length;
     params.host_addr = addr;
+    params.access = access;
 
     int retcode = ioctl(s_ctx->kernel_fd, SMARTNS_IOC_REG_MR, &params);
     if (retcode < 0) {
@@ -405,10 +414,14 @@ ibv_qp *smartns_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_at
     uint32_t		max_inline_data = qp_init_attr->cap.max_inline_data;
     enum ibv_qp_type	qp_type = qp_init_attr->qp_type;
 
-    // only support max_send_sge == 1 at now
-    assert(max_send_sge == 1);
-    // don't support inline data at now
-    assert(max_inline_data == 0);
+    if (max_send_sge > SMARTNS_MAX_SEND_SGE) {
+        fprintf(stderr, "Error, max send sge %u above %u\n", max_send_sge, SMARTNS_MAX_SEND_SGE);
+        return nullptr;
+    }
+    if (max_inline_data > SMARTNS_MAX_INLINE_DATA) {
+        fprintf(stderr, "Error, max inline data %u above %u\n", max_inline_data, SMARTNS_MAX_INLINE_DATA);
+        return nullptr;
+    }
 
     uint32_t recv_wqe_size = max_(1, max_recv_sge) * sizeof(smartns_recv_wqe);
     recv_wqe_size = std::bit_ceil(recv_wqe_size);
@@ -438,7 +451,7 @@ ibv_qp *smartns_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_at
     params.max_recv_wr = recv_wqe_cnt;
     params.max_send_sge = max_send_sge;
     params.max_recv_sge = recv_wqe_size / sizeof(smartns_recv_wqe);
-    params.max_inline_data = 0;
+    params.max_inline_data = max_inline_data;
     params.qp_type = qp_type;
 
     int retcode = ioctl(s_ctx->kernel_fd, SMARTNS_IOC_CREATE_QP, &params);
@@ -480,6 +493,7 @@ ibv_qp *smartns_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_at
     s_qp->recv_wq->wqe_cnt = recv_wqe_cnt;
     s_qp->recv_wq->wqe_shift = std::log2(recv_wqe_size);
     s_qp->recv_wq->max_sge = max_(1, max_recv_sge);
+    s_qp->recv_wq->reserve = 0;
     s_qp->recv_wq->head = 0;
     s_qp->recv_wq->tail = 0;
     s_qp->recv_wq->own_flag = 1;
@@ -490,8 +504,9 @@ ibv_qp *smartns_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_at
     s_qp->recv_wq->dma_wq.dma_index = 0;
     s_qp->recv_wq->dma_wq.finish_index = 0;
     s_qp->recv_wq->dma_wq.max_num = 256;
-    // 16 * 4 = 64B
-    s_qp->recv_wq->dma_wq.dma_batch_size = 4;
+    s_qp->recv_wq->dma_wq.dma_batch_size = 1;
+    s_qp->recv_wq->dma_wq.max_batch_size = s_ctx->wqe_dma_max_batch;
+    s_qp->recv_wq->dma_wq.delay_tsc = s_ctx->wqe_dma_delay_tsc;
     s_qp->recv_wq->dma_wq.host_addr = s_qp->recv_wq->host_recv_wq_buf;
     s_qp->recv_wq->dma_wq.bf_addr = s_qp->recv_wq->bf_recv_wq_buf;
     s_qp->recv_wq->dma_wq.wqe_size = recv_wqe_size;
@@ -538,6 +553,31 @@ int smartns_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask
     return 0;
 }
 
+int smartns_set_qp_sched(struct ibv_qp *qp, uint32_t weight, uint64_t rate_limit_mbps) {
+    struct smartns_qp *s_qp = reinterpret_cast<smartns_qp *>(qp);
+    struct smartns_context *s_ctx = s_qp->context;
+
+    struct SMARTNS_SET_QP_SCHED_PARAMS params;
+    memset(&params, 0, sizeof(params));
+
+    params.context_number = s_ctx->context_number;
+    params.qp_number = s_qp->qp_number;
+    params.weight = weight;
+    params.rate_limit_mbps = rate_limit_mbps;
+
+    int retcode = ioctl(s_ctx->kernel_fd, SMARTNS_IOC_SET_QP_SCHED, &params);
+    if (retcode < 0) {
+        fprintf(stderr, "Error, failed to ioctl SMARTNS_IOC_SET_QP_SCHED %d\n", retcode);
+        return -1;
+    }
+
+    if (params.common_params.success == 0) {
+        fprintf(stderr, "Error, failed to exec ioctl SMARTNS_IOC_SET_QP_SCHED\n");
+        return -1;
+    }
+    return 0;
+}
+
 int smartns_destroy_qp(struct ibv_qp *qp) {
     struct smartns_qp *s_qp = reinterpret_cast<smartns_qp *>(qp);
     struct smartns_context *s_ctx = s_qp->context;
@@ -574,122 +614,340 @@ int smartns_destroy_qp(struct ibv_qp *qp) {
 }
 
 
+// a poster publishes the WQEs it reserved at start once all earlier ones are
+// published, then DMAs everything published so far to the DPU, which is the
+// only step posters serialize on
+template <typename WQ>
+static inline void publish_and_flush(WQ *wq, uint32_t start, uint32_t nreq) {
+    while (wq->head.load(std::memory_order_acquire) != start) {
+    }
+    wq->head.store(start + nreq, std::memory_order_release);
+
+    wq->lock.lock();
+    size_t now = get_tsc();
+    uint32_t published = wq->head.load(std::memory_order_acquire);
+    uint64_t end = wq->dma_wq.start_index + static_cast<uint32_t>(published - static_cast<uint32_t>(wq->dma_wq.start_index));
+    wq->dma_wq.adapt_batch(now);
+    wq->dma_wq.flush_dma_to(wq->bf_mr_lkey, wq->host_mr_lkey, end, now);
+    wq->dma_wq.flush_held(wq->bf_mr_lkey, wq->host_mr_lkey, now, false);
+    wq->dma_wq.poll_dma_cq();
+    wq->lock.unlock();
+}
+
+// pull mode, the WQEs are written before the producer index on x86 and the
+// DPU reads them after it, nothing else to do
+static inline void publish_to_doorbell(smartns_send_wq *wq, uint32_t start, uint32_t nreq) {
+    while (wq->head.load(std::memory_order_acquire) != start) {
+    }
+    __atomic_store_n(&wq->host_doorbell->producer_index, start + nreq, __ATOMIC_RELEASE);
+    wq->head.store(start + nreq, std::memory_order_release);
+}
+
+// pushes held WQEs past their delay, or all of them with force, skips a wq
+// another thread is flushing unless forced
+template <typename WQ>
+static inline void flush_held_wqes(WQ *wq, bool force) {
+    if (wq->dma_wq.start_index == wq->dma_wq.dma_index && !force) {
+        return;
+    }
+    if (force) {
+        wq->lock.lock();
+    } else if (!wq->lock.try_lock()) {
+        return;
+    }
+    wq->dma_wq.flush_held(wq->bf_mr_lkey, wq->host_mr_lkey, get_tsc(), force);
+    wq->lock.unlock();
+}
+
+// ring slots the inline payload of wr takes after its WQE
+static inline uint32_t send_inline_segs(struct smartns_qp *s_qp, struct ibv_send_wr *wr) {
+    if (!(wr->send_flags & IBV_SEND_INLINE)) {
+        return 0;
+    }
+    uint32_t length = 0;
+    for (int i = 0;i < wr->num_sge;i++) {
+        length += wr->sg_list[i].length;
+    }
+    if (unlikely(length > s_qp->max_inline_data || (wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_RDMA_WRITE))) {
+        fprintf(stderr, "Error, post send inline %u bytes of opcode %d\n", length, wr->opcode);
+        exit(1);
+    }
+    return (length + SMARTNS_SEND_INLINE_SEG_SIZE - 1) / SMARTNS_SEND_INLINE_SEG_SIZE;
+}
+
+// gather the SGEs of wr into the slots after its WQE at pos, returns the length
+static inline uint32_t write_inline_segs(struct smartns_send_wq *send_wq, struct ibv_send_wr *wr, uint32_t pos) {
+    struct smartns_send_inline_seg *seg = nullptr;
+    uint32_t seg_offset = SMARTNS_SEND_INLINE_SEG_SIZE;
+    uint32_t length = 0;
+    for (int i = 0;i < wr->num_sge;i++) {
+        uint8_t *src = reinterpret_cast<uint8_t *>(wr->sg_list[i].addr);
+        uint32_t left = wr->sg_list[i].length;
+        while (left > 0) {
+            if (seg_offset == SMARTNS_SEND_INLINE_SEG_SIZE) {
+                ++pos;
+                uint32_t ind = pos & (send_wq->wqe_cnt - 1);
+                seg = reinterpret_cast<struct smartns_send_inline_seg *>(reinterpret_cast<uint8_t *>(send_wq->host_send_wq_buf) + (ind << send_wq->wqe_shift));
+                seg->op_own = (pos & send_wq->wqe_cnt) ? send_wq->own_flag ^ SMARTNS_SEND_WQE_OWNER_MASK : send_wq->own_flag;
+                seg_offset = 0;
+            }
+            uint32_t n = std::min(left, SMARTNS_SEND_INLINE_SEG_SIZE - seg_offset);
+            memcpy(seg->data + seg_offset, src, n);
+            seg_offset += n;
+            src += n;
+            left -= n;
+            length += n;
+        }
+    }
+    return length;
+}
+
+// ring slots the SGE list of wr takes after its WQE, one SGE goes in the WQE
+static inline uint32_t send_sge_segs(struct ibv_send_wr *wr, uint32_t inline_segs) {
+    if (inline_segs || wr->num_sge <= 1) {
+        return 0;
+    }
+    if (unlikely(wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_RDMA_WRITE)) {
+        fprintf(stderr, "Error, post send %d sges of opcode %d\n", wr->num_sge, wr->opcode);
+        exit(1);
+    }
+    return (wr->num_sge + SMARTNS_SEND_SGE_PER_SEG - 1) / SMARTNS_SEND_SGE_PER_SEG;
+}
+
+// the SGEs of wr with DPU lkeys into the slots after its WQE at pos, returns the length
+static inline uint32_t write_sge_segs(struct smartns_qp *s_qp, struct ibv_send_wr *wr, uint32_t pos) {
+    struct smartns_send_wq *send_wq = s_qp->send_wq;
+    struct smartns_send_sge_seg *seg = nullptr;
+    uint32_t length = 0;
+    for (int i = 0;i < wr->num_sge;i++) {
+        if (i % SMARTNS_SEND_SGE_PER_SEG == 0) {
+            ++pos;
+            uint32_t ind = pos & (send_wq->wqe_cnt - 1);
+            seg = reinterpret_cast<struct smartns_send_sge_seg *>(reinterpret_cast<uint8_t *>(send_wq->host_send_wq_buf) + (ind << send_wq->wqe_shift));
+            seg->op_own = (pos & send_wq->wqe_cnt) ? send_wq->own_flag ^ SMARTNS_SEND_WQE_OWNER_MASK : send_wq->own_flag;
+        }
+        struct smartns_send_sge *sge = seg->sge + i % SMARTNS_SEND_SGE_PER_SEG;
+        assert(s_qp->context->mr_list.count(wr->sg_list[i].lkey));
+        sge->addr = wr->sg_list[i].addr;
+        sge->lkey = s_qp->context->mr_list[wr->sg_list[i].lkey]->bf_mkey;
+        sge->byte_count = wr->sg_list[i].length;
+        length += wr->sg_list[i].length;
+    }
+    return length;
+}
+
 int smartns_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr) {
     struct smartns_qp *s_qp = reinterpret_cast<smartns_qp *>(qp);
+    struct smartns_send_wq *send_wq = s_qp->send_wq;
 
     struct smartns_send_wqe *scat;
-    int nreq;
-    int ind;
-
-    s_qp->send_wq->lock.lock();
-    ind = s_qp->send_wq->head & (s_qp->send_wq->wqe_cnt - 1);
+    uint32_t nreq = 0;
+    uint32_t pos;
 
-    for (nreq = 0;wr;++nreq, wr = wr->next) {
-        if (unlikely(s_qp->send_wq->head - s_qp->send_wq->tail + nreq >= s_qp->send_wq->wqe_cnt)) {
-            fprintf(stderr, "Error, post send wq full\n");
-            exit(1);
-        }
-        if (unlikely(static_cast<uint32_t>(wr->num_sge) > s_qp->max_send_sge)) {
+    for (struct ibv_send_wr *it = wr;it;it = it->next) {
+        if (unlikely(static_cast<uint32_t>(it->num_sge) > s_qp->max_send_sge)) {
             fprintf(stderr, "Error, post send sge too many\n");
             exit(1);
         }
+        uint32_t inline_segs = send_inline_segs(s_qp, it);
+        nreq += 1 + inline_segs + send_sge_segs(it, inline_segs);
+    }
+    if (nreq == 0) {
+        return 0;
+    }
+
+    // WQEs of other threads may sit before and after ours, each is written
+    // without a lock
+    uint32_t start = send_wq->reserve.fetch_add(nreq, std::memory_order_relaxed);
+    if (unlikely(start + nreq - send_wq->tail > send_wq->wqe_cnt)) {
+        fprintf(stderr, "Error, post send wq full\n");
+        exit(1);
+    }
 
-        scat = reinterpret_cast<struct smartns_send_wqe *>(reinterpret_cast<uint8_t *>(s_qp->send_wq->host_send_wq_buf) + (ind << s_qp->send_wq->wqe_shift));
+    for (pos = start;wr;wr = wr->next) {
+        uint32_t ind = pos & (send_wq->wqe_cnt - 1);
+        uint32_t inline_segs = send_inline_segs(s_qp, wr);
+        uint32_t sge_segs = send_sge_segs(wr, inline_segs);
+        scat = reinterpret_cast<struct smartns_send_wqe *>(reinterpret_cast<uint8_t *>(send_wq->host_send_wq_buf) + (ind << send_wq->wqe_shift));
         scat->qpn = s_qp->qp_number;
         scat->opcode = wr->opcode;
         scat->imm = 0;
-        scat->local_addr = wr->sg_list[0].addr;
 
-        assert(s_qp->context->mr_list.count(wr->sg_list[0].lkey));
-        scat->local_lkey = s_qp->context->mr_list[wr->sg_list[0].lkey]->bf_mkey;
-        scat->byte_count = wr->sg_list[0].length;
+        // the DPU sends an inline payload without reading host memory, the
+        // lkey isn't checked
+        if (inline_segs) {
+            scat->local_addr = 0;
+            scat->local_lkey = 0;
+            scat->byte_count = write_inline_segs(send_wq, wr, pos);
+        } else if (sge_segs) {
+            // byte_count is the sum, the DPU splits packets across the SGEs
+            scat->local_addr = 0;
+            scat->local_lkey = 0;
+            scat->byte_count = write_sge_segs(s_qp, wr, pos);
+        } else {
+            scat->local_addr = wr->sg_list[0].addr;
+            assert(s_qp->context->mr_list.count(wr->sg_list[0].lkey));
+            scat->local_lkey = s_qp->context->mr_list[wr->sg_list[0].lkey]->bf_mkey;
+            scat->byte_count = wr->sg_list[0].length;
+        }
+        scat->inline_segs = inline_segs;
+        scat->num_sge = sge_segs ? wr->num_sge : 1;
 
         if (wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_READ) {
             scat->remote_addr = wr->wr.rdma.remote_addr;
             scat->remote_rkey = wr->wr.rdma.rkey;
+        } else if (wr->opcode == IBV_WR_ATOMIC_CMP_AND_SWP || wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+            if (unlikely(wr->sg_list[0].length != sizeof(uint64_t) || (wr->wr.atomic.remote_addr & (sizeof(uint64_t) - 1)))) {
+                fprintf(stderr, "Error, atomic needs 8 bytes aligned to 8 bytes\n");
+                exit(1);
+            }
+            scat->remote_addr = wr->wr.atomic.remote_addr;
+            scat->remote_rkey = wr->wr.atomic.rkey;
+            scat->atomic.compare_add = wr->wr.atomic.compare_add;
+            scat->atomic.swap = wr->wr.atomic.swap;
         }
-        scat->cur_pos = s_qp->send_wq->head + nreq;
+        scat->cur_pos = pos;
         scat->is_signal = wr->send_flags & IBV_SEND_SIGNALED;
-        scat->op_own = s_qp->send_wq->own_flag;
-
-        s_qp->send_wq->wrid[ind] = wr->wr_id;
+        scat->op_own = (pos & send_wq->wqe_cnt) ? send_wq->own_flag ^ SMARTNS_SEND_WQE_OWNER_MASK : send_wq->own_flag;
 
-        ind++;
-        s_qp->send_wq->dma_wq.step_dma_req(s_qp->send_wq->bf_mr_lkey, s_qp->send_wq->host_mr_lkey);
-
-        if (static_cast<uint32_t>(ind) == s_qp->send_wq->wqe_cnt) {
-            s_qp->send_wq->dma_wq.flush_dma_req(s_qp->send_wq->bf_mr_lkey, s_qp->send_wq->host_mr_lkey);
-            ind = 0;
-            s_qp->send_wq->own_flag = s_qp->send_wq->own_flag ^ SMARTNS_SEND_WQE_OWNER_MASK;
-        }
-    }
-    if (nreq) {
-        s_qp->send_wq->head += nreq;
-        s_qp->send_wq->dma_wq.flush_dma_req(s_qp->send_wq->bf_mr_lkey, s_qp->send_wq->host_mr_lkey);
+        send_wq->wrid[ind] = wr->wr_id;
+        pos += 1 + inline_segs + sge_segs;
     }
 
-    s_qp->send_wq->dma_wq.poll_dma_cq();
-
-    s_qp->send_wq->lock.unlock();
+    if (send_wq->pull) {
+        publish_to_doorbell(send_wq, start, nreq);
+    } else {
+        publish_and_flush(send_wq, start, nreq);
+    }
     return 0;
 }
 
 int smartns_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr) {
     struct smartns_qp *s_qp = reinterpret_cast<smartns_qp *>(qp);
+    struct smartns_recv_wq *recv_wq = s_qp->recv_wq;
 
     struct smartns_recv_wqe *scat;
-    int nreq;
-    int ind;
+    uint32_t nreq = 0;
+    uint32_t pos;
     int i, j;
 
-    s_qp->recv_wq->lock.lock();
-    ind = s_qp->recv_wq->head & (s_qp->recv_wq->wqe_cnt - 1);
-
-    for (nreq = 0;wr;++nreq, wr = wr->next) {
-        if (unlikely(s_qp->recv_wq->head - s_qp->recv_wq->tail + nreq >= s_qp->recv_wq->wqe_cnt)) {
-            fprintf(stderr, "Error, post recv wq full\n");
-            exit(1);
-        }
-        if (unlikely(static_cast<uint32_t>(wr->num_sge) > s_qp->max_recv_sge)) {
+    for (struct ibv_recv_wr *it = wr;it;it = it->next) {
+        if (unlikely(static_cast<uint32_t>(it->num_sge) > s_qp->max_recv_sge)) {
             fprintf(stderr, "Error, post recv sge too many\n");
             exit(1);
         }
+        nreq++;
+    }
+    if (nreq == 0) {
+        return 0;
+    }
+
+    uint32_t start = recv_wq->reserve.fetch_add(nreq, std::memory_order_relaxed);
+    if (unlikely(start + nreq - recv_wq->tail > recv_wq->wqe_cnt)) {
+        fprintf(stderr, "Error, post recv wq full\n");
+        exit(1);
+    }
 
-        scat = reinterpret_cast<struct smartns_recv_wqe *>(reinterpret_cast<uint8_t *>(s_qp->recv_wq->host_recv_wq_buf) + (ind << s_qp->recv_wq->wqe_shift));
+    for (pos = start;wr;++pos, wr = wr->next) {
+        uint32_t ind = pos & (recv_wq->wqe_cnt - 1);
+        uint8_t own_flag = (pos & recv_wq->wqe_cnt) ? recv_wq->own_flag ^ SMARTNS_RECV_WQE_OWNER_MASK : recv_wq->own_flag;
+        scat = reinterpret_cast<struct smartns_recv_wqe *>(reinterpret_cast<uint8_t *>(recv_wq->host_recv_wq_buf) + (ind << recv_wq->wqe_shift));
         for (i = 0, j = 0;i < wr->num_sge;++i) {
             scat[j].addr = wr->sg_list[i].addr;
 
             assert(s_qp->context->mr_list.count(wr->sg_list[i].lkey));
             scat[j].lkey = s_qp->context->mr_list[wr->sg_list[i].lkey]->bf_mkey;
             scat[j].byte_count = wr->sg_list[i].length;
-            scat[j].op_own = s_qp->recv_wq->own_flag;
+            scat[j].op_own = own_flag;
             j++;
         }
-        if (static_cast<uint32_t>(j) < s_qp->recv_wq->max_sge) {
+        if (static_cast<uint32_t>(j) < recv_wq->max_sge) {
             scat[j].addr = 0;
             scat[j].lkey = 100;
             scat[j].byte_count = 0;
-            scat[j].op_own = s_qp->recv_wq->own_flag;
+            scat[j].op_own = own_flag;
         }
 
-        s_qp->recv_wq->wrid[ind] = wr->wr_id;
+        recv_wq->wrid[ind] = wr->wr_id;
+    }
 
-        ind++;
-        s_qp->recv_wq->dma_wq.step_dma_req(s_qp->recv_wq->bf_mr_lkey, s_qp->recv_wq->host_mr_lkey);
-        if (static_cast<uint32_t>(ind) == s_qp->recv_wq->wqe_cnt) {
-            s_qp->recv_wq->dma_wq.flush_dma_req(s_qp->recv_wq->bf_mr_lkey, s_qp->recv_wq->host_mr_lkey);
-            ind = 0;
-            s_qp->recv_wq->own_flag = s_qp->recv_wq->own_flag ^ SMARTNS_RECV_WQE_OWNER_MASK;
-        }
+    publish_and_flush(recv_wq, start, nreq);
+    return 0;
+}
+
+int smartns_flush(struct ibv_qp *qp) {
+    struct smartns_qp *s_qp = reinterpret_cast<smartns_qp *>(qp);
+    flush_held_wqes(s_qp->send_wq, true);
+    flush_held_wqes(s_qp->recv_wq, true);
+    return 0;
+}
+
+int smartns_set_wqe_dma_batch(struct ibv_context *context, uint32_t max_batch, uint64_t delay_ns) {
+    struct smartns_context *s_ctx = reinterpret_cast<smartns_context *>(context);
+    if (max_batch == 0) {
+        fprintf(stderr, "Error, wqe dma batch must be at least 1\n");
+        return -1;
+    }
+    s_ctx->wqe_dma_max_batch = max_batch;
+    s_ctx->wqe_dma_delay_tsc = delay_ns * get_tsc_freq_per_ns();
+
+    for (auto &send_wq : s_ctx->send_wq_list) {
+        send_wq->lock.lock();
+        send_wq->dma_wq.max_batch_size = s_ctx->wqe_dma_max_batch;
+        send_wq->dma_wq.delay_tsc = s_ctx->wqe_dma_delay_tsc;
+        send_wq->lock.unlock();
+        flush_held_wqes(send_wq, true);
     }
-    if (nreq) {
-        s_qp->recv_wq->head += nreq;
-        s_qp->recv_wq->dma_wq.flush_dma_req(s_qp->recv_wq->bf_mr_lkey, s_qp->recv_wq->host_mr_lkey);
+    for (auto &[qpn, s_qp] : s_ctx->qp_list) {
+        s_qp->recv_wq->lock.lock();
+        s_qp->recv_wq->dma_wq.max_batch_size = s_ctx->wqe_dma_max_batch;
+        s_qp->recv_wq->dma_wq.delay_tsc = s_ctx->wqe_dma_delay_tsc;
+        s_qp->recv_wq->lock.unlock();
+        flush_held_wqes(s_qp->recv_wq, true);
     }
+    return 0;
+}
 
-    s_qp->recv_wq->dma_wq.poll_dma_cq();
+int smartns_set_send_wq_pull(struct ibv_context *context) {
+    struct smartns_context *s_ctx = reinterpret_cast<smartns_context *>(context);
 
-    s_qp->recv_wq->lock.unlock();
+    for (auto &send_wq : s_ctx->send_wq_list) {
+        if (send_wq->pull) {
+            continue;
+        }
+        if (send_wq->reserve.load() != 0) {
+            fprintf(stderr, "Error, send wq %lu switched to pull mode after a post\n", send_wq->datapath_send_wq_id);
+            return -1;
+        }
+        void *host_doorbell = s_ctx->host_mr_allocator->alloc(sizeof(struct smartns_wq_doorbell), sizeof(struct smartns_wq_doorbell));
+        void *bf_doorbell = s_ctx->bf_mr_allocator->alloc(sizeof(struct smartns_wq_doorbell), sizeof(struct smartns_wq_doorbell));
+        assert(host_doorbell != nullptr);
+        assert(bf_doorbell != nullptr);
+        memset(host_doorbell, 0, sizeof(struct smartns_wq_doorbell));
+
+        struct SMARTNS_SET_SEND_WQ_PULL_PARAMS params;
+        memset(&params, 0, sizeof(params));
+        params.context_number = s_ctx->context_number;
+        params.datapath_send_wq_id = send_wq->datapath_send_wq_id;
+        params.host_send_wq_buf = send_wq->host_send_wq_buf;
+        params.host_doorbell = host_doorbell;
+        params.bf_doorbell = bf_doorbell;
+
+        int retcode = ioctl(s_ctx->kernel_fd, SMARTNS_IOC_SET_SEND_WQ_PULL, &params);
+        if (retcode < 0) {
+            fprintf(stderr, "Error, failed to ioctl SMARTNS_IOC_SET_SEND_WQ_PULL %d\n", retcode);
+            return -1;
+        }
+
+        if (params.common_params.success == 0) {
+            fprintf(stderr, "Error, failed to exec ioctl SMARTNS_IOC_SET_SEND_WQ_PULL\n");
+            return -1;
+        }
+
+        send_wq->host_doorbell = reinterpret_cast<smartns_wq_doorbell *>(host_doorbell);
+        send_wq->bf_doorbell = reinterpret_cast<smartns_wq_doorbell *>(bf_doorbell);
+        send_wq->pull = true;
+    }
     return 0;
 }
 
@@ -699,6 +957,12 @@ int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
 
     int npolled;
 
+    // the latency bound of WQEs held for batching is kept while the
+    // application polls
+    for (auto &send_wq : s_ctx->send_wq_list) {
+        flush_held_wqes(send_wq, false);
+    }
+
     s_cq->lock.lock();
 
     for (npolled = 0; npolled < num_entries;++npolled, ++wc) {
@@ -709,7 +973,8 @@ int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
         struct smartns_qp *qp = s_ctx->qp_list[cqe->qpn];
         assert(qp);
         switch (cqe->cq_opcode) {
-        case MLX5_CQE_REQ: {
+        case MLX5_CQE_REQ:
+        case MLX5_CQE_REQ_ERR: {
             wc->byte_len = cqe->byte_count;
             if (cqe->mlx5_opcode == IBV_WR_SEND) {
                 wc->opcode = IBV_WC_SEND;
@@ -717,6 +982,10 @@ int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
                 wc->opcode = IBV_WC_RDMA_WRITE;
             } else if (cqe->mlx5_opcode == IBV_WR_RDMA_READ) {
                 wc->opcode = IBV_WC_RDMA_READ;
+            } else if (cqe->mlx5_opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+                wc->opcode = IBV_WC_COMP_SWAP;
+            } else if (cqe->mlx5_opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+                wc->opcode = IBV_WC_FETCH_ADD;
             } else if (cqe->mlx5_opcode == IBV_WR_DRIVER1) {
                 wc->opcode = IBV_WC_DRIVER1;
             } else {
@@ -727,7 +996,7 @@ int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
 
             uint16_t wqe_ctr = cqe->wqe_counter & (qp->send_wq->wqe_cnt - 1);
             wc->wr_id = qp->send_wq->wrid[wqe_ctr];
-            wc->status = IBV_WC_SUCCESS;
+            wc->status = cqe->cq_opcode == MLX5_CQE_REQ ? IBV_WC_SUCCESS : static_cast<ibv_wc_status>(cqe->status);
             if (qp->send_wq->tail > cqe->wqe_counter) {
                 printf("Warning, send wq tail %u, cqe wqe counter %u\n", qp->send_wq->tail, cqe->wqe_counter);
 
@@ -754,6 +1023,7 @@ int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc) {
             wc->wr_id = qp->recv_wq->wrid[wqe_ctr];
             wc->status = IBV_WC_SUCCESS;
             qp->recv_wq->tail++;
+            flush_held_wqes(qp->recv_wq, false);
             break;
         }
 
@@ -21,6 +21,12 @@ static_assert(sizeof(smartns_recv_wqe) == 16);
 static_assert(sizeof(smartns_cqe) == 64);
 static_assert(sizeof(smartns_cq_doorbell) == 64);
 
+// WQEs pushed to the DPU in one DMA at most, and how long a partial batch may
+// wait for more posts. Batching is off by default, its latency and throughput
+// effect is unmeasured; raise it with smartns_set_wqe_dma_batch()
+#define SMARTNS_WQE_DMA_MAX_BATCH 1
+#define SMARTNS_WQE_DMA_DELAY_NS 1000
+
 struct alignas(64) smartns_dma_wq {
     const size_t signal_batch_size = 16;
     struct ibv_qp *dma_qp;
@@ -33,6 +39,14 @@ struct alignas(64) smartns_dma_wq {
     uint64_t max_num;
     size_t dma_batch_size = 1;
 
+    // dma_batch_size follows the posts expected within delay_tsc, a partial
+    // batch is pushed once it waited delay_tsc
+    size_t max_batch_size = 1;
+    size_t delay_tsc = 0;
+    size_t last_post_tsc = 0;
+    size_t avg_gap_tsc = 0;
+    size_t hold_tsc = 0;
+
     void *host_addr;
     void *bf_addr;
     uint32_t wqe_size;
@@ -58,13 +72,58 @@ struct alignas(64) smartns_dma_wq {
 
     inline void flush_dma_req(uint32_t bf_lkey, uint32_t host_lkey) {
         if (start_index > dma_index && start_index - dma_index >= dma_batch_size) {
-            uint32_t offset = (dma_index & (wqe_cnt - 1)) * wqe_size;
-            dma_qpx->wr_id = start_index;
-            dma_qpx->wr_flags = start_index - last_signal_index >= signal_batch_size ? IBV_SEND_SIGNALED : 0;
-            dma_mqpx->wr_memcpy_direct(dma_mqpx, bf_lkey, reinterpret_cast<uint64_t>(bf_addr) + offset, host_lkey, reinterpret_cast<uint64_t>(host_addr) + offset, (start_index - dma_index) * wqe_size);
-            dma_index = start_index;
-            if (dma_qpx->wr_flags == IBV_SEND_SIGNALED) {
-                last_signal_index = start_index;
+            post_dma_run(bf_lkey, host_lkey);
+        }
+    }
+
+    // a post after an idle gap is pushed at once, closer posts are coalesced
+    inline void adapt_batch(size_t now) {
+        size_t gap = now - last_post_tsc;
+        last_post_tsc = now;
+        if (gap >= delay_tsc) {
+            avg_gap_tsc = delay_tsc;
+            dma_batch_size = 1;
+            return;
+        }
+        avg_gap_tsc = (avg_gap_tsc * 7 + gap) / 8;
+        dma_batch_size = std::clamp<size_t>(delay_tsc / std::max<size_t>(avg_gap_tsc, 1), 1, max_batch_size);
+    }
+
+    // push a partial batch that waited delay_tsc, or any with force
+    inline void flush_held(uint32_t bf_lkey, uint32_t host_lkey, size_t now, bool force) {
+        if (start_index > dma_index && (force || now - hold_tsc >= delay_tsc)) {
+            post_dma_run(bf_lkey, host_lkey);
+        }
+    }
+
+    // WQEs from dma_index to start_index, which must not cross the ring end
+    inline void post_dma_run(uint32_t bf_lkey, uint32_t host_lkey) {
+        uint32_t offset = (dma_index & (wqe_cnt - 1)) * wqe_size;
+        dma_qpx->wr_id = start_index;
+        dma_qpx->wr_flags = start_index - last_signal_index >= signal_batch_size ? IBV_SEND_SIGNALED : 0;
+        dma_mqpx->wr_memcpy_direct(dma_mqpx, bf_lkey, reinterpret_cast<uint64_t>(bf_addr) + offset, host_lkey, reinterpret_cast<uint64_t>(host_addr) + offset, (start_index - dma_index) * wqe_size);
+        dma_index = start_index;
+        if (dma_qpx->wr_flags == IBV_SEND_SIGNALED) {
+            last_signal_index = start_index;
+        }
+    }
+
+    // DMA the WQEs written before end, split at the ring end and into runs the
+    // dma qp has room for, a partial batch still waits for the next post
+    inline void flush_dma_to(uint32_t bf_lkey, uint32_t host_lkey, uint64_t end, size_t now) {
+        if (start_index == dma_index) {
+            hold_tsc = now;
+        }
+        while (start_index < end) {
+            uint64_t ring_end = (start_index | (wqe_cnt - 1)) + 1;
+            start_index = std::min(std::min(end, ring_end), dma_index + max_num / 2);
+            while (start_index - finish_index > max_num) {
+                poll_dma_cq();
+            }
+            if (start_index == ring_end) {
+                post_dma_run(bf_lkey, host_lkey);
+            } else {
+                flush_dma_req(bf_lkey, host_lkey);
             }
         }
     }
@@ -93,12 +152,23 @@ struct alignas(64) smartns_send_wq {
     uint32_t wqe_shift;
     uint32_t max_sge;
 
-    uint32_t head;
+    // posters reserve WQEs at reserve and publish them in order at head
+    std::atomic<uint32_t> reserve;
+    std::atomic<uint32_t> head;
     uint32_t tail;
 
+    // owner bit of the first lap, it flips every lap
     uint8_t own_flag;
     struct smartns_dma_wq dma_wq;
+    // held only to DMA published WQEs to the DPU
     spinlock_mutex lock;
+
+    // pull mode, posters only write head to host_doorbell and the DPU reads
+    // the WQEs itself, see smartns_set_send_wq_pull
+    bool pull;
+    smartns_wq_doorbell *host_doorbell;
+    // the DPU's copy, can't direct load/store
+    smartns_wq_doorbell *bf_doorbell;
 };
 
 struct alignas(64) smartns_recv_wq {
@@ -113,7 +183,8 @@ struct alignas(64) smartns_recv_wq {
     uint32_t wqe_cnt;
     uint32_t wqe_shift;
     uint32_t max_sge;
-    uint32_t	head;
+    std::atomic<uint32_t> reserve;
+    std::atomic<uint32_t> head;
     uint32_t	tail;
 
     uint8_t own_flag;
@@ -203,6 +274,10 @@ struct smartns_context {
 
     size_t context_number;
 
+    // WQE DMA batching of every wq, see smartns_set_wqe_dma_batch
+    uint32_t wqe_dma_max_batch;
+    size_t wqe_dma_delay_tsc;
+
     std::vector<smartns_send_wq *> send_wq_list;
     // qpn to struct qp
     phmap::parallel_flat_hash_map<size_t, smartns_qp *>qp_list;
@@ -234,6 +309,9 @@ ibv_qp *smartns_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_at
 
 int smartns_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask);
 
+// weighted share and optional rate limit of the QP on its DPU datapath thread
+int smartns_set_qp_sched(struct ibv_qp *qp, uint32_t weight, uint64_t rate_limit_mbps);
+
 int smartns_destroy_qp(struct ibv_qp *qp);
 
 int smartns_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr);
@@ -242,4 +320,17 @@ int smartns_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv
 
 int smartns_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
 
+// push WQEs still held for batching to the DPU, for applications that post a
+// burst and then wait without polling
+int smartns_flush(struct ibv_qp *qp);
+
+// WQEs coalesced into one DMA to the DPU at most, 1 pushes every post at once,
+// and how long posted WQEs may be held. Unverified, the default is 1
+int smartns_set_wqe_dma_batch(struct ibv_context *context, uint32_t max_batch, uint64_t delay_ns);
+
+// the DPU fetches send WQEs of the context from host memory after a post
+// moves the producer index, instead of the post DMAing them. Before any post.
+// Experimental: not yet compared against push mode on hardware
+int smartns_set_send_wq_pull(struct ibv_context *context);
+
 
@@ -1,3 +1,4 @@
+import sys
 import time
 
 
@@ -53,7 +54,14 @@ for i in range(CHANNELS):
         old_cache_miss_write_all[i],
     ) = read_channel_counters(i)
 
-while True:
+# With a duration in seconds, print the per second average of all samples
+# at the end, e.g. to compare -rx_invalidate policies under the same load.
+duration = int(sys.argv[1]) if len(sys.argv) > 1 else 0
+samples = 0
+sum_read = sum_write = sum_miss_read = sum_miss_write = 0.0
+
+while duration == 0 or samples < duration:
+    time.sleep(1)
     for i in range(CHANNELS):
         new_cache_read, new_cache_write, new_cache_miss_read, new_cache_miss_write = read_channel_counters(i)
         diff_cache_read_all[i] = calculate_hex_diff(new_cache_read, old_cache_read_all[i])
@@ -74,4 +82,12 @@ while True:
     print(f"Cache Read: {sum(diff_cache_read_all):.2f} MB   Write: {sum(diff_cache_write_all):.2f} MB")
     print(f"Miss Read: {sum(diff_cache_miss_read_all):.2f} MB   Write: {sum(diff_cache_miss_write_all):.2f} MB")
     print("---------------")
-    time.sleep(1)
+    samples += 1
+    sum_read += sum(diff_cache_read_all)
+    sum_write += sum(diff_cache_write_all)
+    sum_miss_read += sum(diff_cache_miss_read_all)
+    sum_miss_write += sum(diff_cache_miss_write_all)
+
+if samples:
+    print(f"Average over {samples}s Cache Read: {sum_read / samples:.2f} MB   Write: {sum_write / samples:.2f} MB")
+    print(f"Average over {samples}s Miss Read: {sum_miss_read / samples:.2f} MB   Write: {sum_miss_write / samples:.2f} MB")
@@ -1,6 +1,7 @@
 #include "smartns.h"
 #include "numautil.h"
 #include "rdma_cm/libr.h"
+#include "rxe/rxe_param.h"
 
 controlpath_manager::controlpath_manager(std::string device_name, size_t numa_node, bool is_server) {
     this->numa_node = numa_node;
@@ -84,6 +85,20 @@ void controlpath_manager::handle_open_device(SMARTNS_OPEN_DEVICE_PARAMS *param)
         datapath_send_wq.wqe_shift = std::log2(datapath_send_wq.wqe_size);
         datapath_send_wq.head = 0;
         datapath_send_wq.own_flag = 1;
+        datapath_send_wq.pull = false;
+        datapath_send_wq.pull_state = dpu_send_wq_pull_idle;
+        datapath_send_wq.pulled = 0;
+        datapath_send_wq.pull_producer = 0;
+        datapath_send_wq.pull_end = 0;
+        datapath_send_wq.pull_ready = 0;
+        datapath_send_wq.pull_ticket = 0;
+        datapath_send_wq.pull_next_tsc = 0;
+        datapath_send_wq.pull_idle_tsc = 0;
+        datapath_send_wq.bf_mkey = dpu_ctx->inner_bf_mr->lkey;
+        datapath_send_wq.host_mkey = dpu_ctx->inner_host_mr->lkey;
+        datapath_send_wq.host_send_wq_buf = nullptr;
+        datapath_send_wq.host_doorbell = nullptr;
+        datapath_send_wq.bf_doorbell = nullptr;
 
         bf_mr_base = reinterpret_cast<void *>(reinterpret_cast<size_t>(bf_mr_base) + sizeof(smartns_send_wqe) * SMARTNS_TX_DEPTH);
     }
@@ -217,11 +232,20 @@ void controlpath_manager::handle_reg_mr(SMARTNS_REG_MR_PARAMS *param) {
 
     dpu_mr *mr = new dpu_mr();
     mr->host_mkey = param->host_mkey;
+    mr->dpu_pd = pd;
+    mr->access = param->access;
 
     mr->devx_mr = devx_create_crossing_mr(global_pd, param->host_addr, param->host_size, param->host_vhca_id, param->host_mkey, vhca_access_key, sizeof(vhca_access_key));
     assert(mr->devx_mr);
 
+    // datapath threads look MRs up under their own lock
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        data_manager->datapath_handler_list[i].mr_list_mutex.lock();
+    }
     dpu_ctx->mr_list[mr->host_mkey] = mr;
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        data_manager->datapath_handler_list[i].mr_list_mutex.unlock();
+    }
 
     param->bf_mkey = mr->devx_mr->lkey;
     param->common_params.success = 1;
@@ -239,13 +263,21 @@ void controlpath_manager::handle_destory_mr(SMARTNS_DESTROY_MR_PARAMS *param) {
         SMARTNS_ERROR("context number %lu pd number %lu not found", param->context_number, param->pd_number);
         exit(1);
     }
-    dpu_mr *mr = dpu_ctx->mr_list[param->host_mkey];
+    auto it = dpu_ctx->mr_list.find(param->host_mkey);
+    dpu_mr *mr = it == dpu_ctx->mr_list.end() ? nullptr : it->second;
     if (!mr) {
         SMARTNS_ERROR("context number %lu mr host mkey %u not found", param->context_number, param->host_mkey);
         exit(1);
     }
 
+    // no datapath thread is between its lookup and reading the MR
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        data_manager->datapath_handler_list[i].mr_list_mutex.lock();
+    }
     dpu_ctx->mr_list.erase(param->host_mkey);
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        data_manager->datapath_handler_list[i].mr_list_mutex.unlock();
+    }
     assert(devx_dereg_mr(mr->devx_mr) == 0);
     delete mr;
 
@@ -268,6 +300,12 @@ void controlpath_manager::handle_create_cq(SMARTNS_CREATE_CQ_PARAMS *param) {
     cq->wqe_shift = std::log2(cq->wqe_size);
     cq->head = 0;
     cq->tail = 0;
+    cq->dma_pending = 0;
+    cq->produced = 0;
+    cq->host_consumed = 0;
+    cq->reserved = 0;
+    cq->refreshing = 0;
+    cq->refresh_ticket = 0;
     cq->bf_mkey = dpu_ctx->inner_bf_mr->lkey;
     cq->host_mkey = dpu_ctx->inner_host_mr->lkey;
     cq->own_flag = 1;
@@ -332,18 +370,30 @@ void controlpath_manager::handle_create_qp(SMARTNS_CREATE_QP_PARAMS *param) {
     assert(param->datapath_send_wq_id < SMARTNS_TX_RX_CORE);
     struct dpu_datapath_send_wq *datapath_send_wq = &dpu_ctx->datapath_send_wq_list[param->datapath_send_wq_id];
 
+    size_t qp_number = generate_qp_number();
+    if (qp_number == SMARTNS_MAX_QP) {
+        SMARTNS_WARN("context number %lu out of qp numbers, at most %d QPs\n", param->context_number, SMARTNS_MAX_QP);
+        param->common_params.success = 0;
+        return;
+    }
+
     struct dpu_send_wq *send_wq = new dpu_send_wq();
     send_wq->dpu_ctx = dpu_ctx;
-    send_wq->bf_send_wq_buf = calloc(param->max_send_wr, sizeof(smartns_send_wqe));
-    send_wq->wqe_size = sizeof(smartns_send_wqe);
+    send_wq->bf_send_wq_buf = calloc(param->max_send_wr, sizeof(dpu_send_wqe));
+    send_wq->wqe_size = sizeof(dpu_send_wqe);
     send_wq->wqe_cnt = param->max_send_wr;
     send_wq->wqe_shift = std::log2(send_wq->wqe_size);
     send_wq->head = 0;
     send_wq->wqe_index = 0;
     send_wq->psn = 0;
-    send_wq->opcode = 0;
+    send_wq->opcode = -1;
     send_wq->noack_pkts = 0;
+    send_wq->pending_rd_atomic = 0;
+    send_wq->error_status = IBV_WC_SUCCESS;
     send_wq->tail = 0;
+    rxe_cc_init(&send_wq->cc, &data_manager->datapath_handler_list[param->datapath_send_wq_id].cc_param, get_tsc());
+    send_wq->rtt_probe_psn = 0;
+    send_wq->rtt_probe_tsc = 0;
 
     struct dpu_recv_wq *recv_wq = new dpu_recv_wq();
     recv_wq->dpu_ctx = dpu_ctx;
@@ -354,6 +404,7 @@ void controlpath_manager::handle_create_qp(SMARTNS_CREATE_QP_PARAMS *param) {
     recv_wq->wqe_shift = std::log2(recv_wq->wqe_size);
     recv_wq->max_sge = param->max_recv_sge;
     recv_wq->head = 0;
+    recv_wq->wqe_seq = 0;
     recv_wq->now_sge_num = 0;
     recv_wq->now_sge_offset = 0;
     recv_wq->now_total_dma_byte = 0;
@@ -362,17 +413,36 @@ void controlpath_manager::handle_create_qp(SMARTNS_CREATE_QP_PARAMS *param) {
     recv_wq->msn = 0;
     recv_wq->opcode = 0;
     recv_wq->sent_psn_nak = 0;
+    recv_wq->access_nak = 0;
+    recv_wq->ecn_echo = 0;
+    recv_wq->reorder_buf = new rxe_reorder_slot[RXE_REORDER_WINDOW]();
+    recv_wq->reorder_cnt = 0;
+    recv_wq->resp_res = new rxe_resp_res[RXE_MAX_RESP_RES]();
+    recv_wq->res_head = 0;
+    recv_wq->res_tail = 0;
+    recv_wq->ack_deferred = 0;
+    recv_wq->ack_pending = 0;
+    recv_wq->ack_owed = 0;
+    recv_wq->ack_deadline_tsc = 0;
+    recv_wq->ack_timer_queued = 0;
+    recv_wq->res_cache = new rxe_resp_cache[RXE_MAX_RESP_RES]();
+    recv_wq->cache_head = 0;
+    recv_wq->zc = nullptr;
     recv_wq->own_flag = 1;
 
     struct dpu_comp_info *comp_info = new dpu_comp_info();
     comp_info->psn = 0;
     comp_info->opcode = -1;
     comp_info->timeout = 0;
+    comp_info->resp_gap_rewind = 0;
+    comp_info->timer_queued = 0;
+    comp_info->deadline = 0;
 
     dpu_qp *qp = new dpu_qp();
     qp->dpu_ctx = dpu_ctx;
     qp->dpu_pd = pd;
-    qp->qp_number = generate_qp_number();
+    qp->qp_number = qp_number;
+    qp->zc_dst_port = 0;
     qp->qp_type = static_cast<ibv_qp_type>(param->qp_type);
     qp->mtu = SMARTNS_MTU;
     qp->max_send_wr = param->max_send_wr;
@@ -389,10 +459,23 @@ void controlpath_manager::handle_create_qp(SMARTNS_CREATE_QP_PARAMS *param) {
     qp->comp_info = comp_info;
     qp->recv_wq = recv_wq;
 
+    qp->sched.prev = nullptr;
+    qp->sched.next = nullptr;
+    qp->sched.ready = 0;
+    qp->sched.weight = 1;
+    qp->sched.deficit = 0;
+    qp->sched.rate = 0;
+    qp->sched.tokens = 0;
+    qp->sched.last_tsc = get_tsc();
+
+    if (data_manager->datapath_handler_list[param->datapath_send_wq_id].rx_zero_copy && qp->qp_number < SMARTNS_RX_ZC_QPS) {
+        data_manager->create_zc_rq(qp, param->datapath_send_wq_id);
+    }
+
     dpu_ctx->qp_list[qp->qp_number] = qp;
 
-    // add to special datapath
-    data_manager->datapath_handler_list[param->datapath_send_wq_id].local_qpn_to_qp_list[qp->qp_number] = qp;
+    // add to special datapath, publish after the qp is fully initialized
+    __atomic_store_n(&data_manager->datapath_handler_list[param->datapath_send_wq_id].qp_table[qp->qp_number], qp, __ATOMIC_RELEASE);
 
     param->qp_number = qp->qp_number;
     param->common_params.success = 1;
@@ -419,15 +502,22 @@ void controlpath_manager::handle_destory_qp(SMARTNS_DESTROY_QP_PARAMS *param) {
     }
 
     // remove from special datapath
-    data_manager->datapath_handler_list[qp->datapath_send_wq->datapath_send_wq_id].local_qpn_to_qp_list.erase(param->qp_number);
+    __atomic_store_n(&data_manager->datapath_handler_list[qp->datapath_send_wq->datapath_send_wq_id].qp_table[param->qp_number], nullptr, __ATOMIC_RELEASE);
 
     free(qp->send_wq->bf_send_wq_buf);
     delete qp->send_wq;
     delete qp->comp_info;
     // don't need to free
+    delete[] qp->recv_wq->reorder_buf;
+    delete[] qp->recv_wq->resp_res;
+    delete[] qp->recv_wq->res_cache;
+    if (qp->recv_wq->zc) {
+        data_manager->destroy_zc_rq(qp);
+    }
     delete qp->recv_wq;
 
     dpu_ctx->qp_list.erase(param->qp_number);
+    release_qp_number(param->qp_number);
     delete qp;
 
     param->common_params.success = 1;
@@ -455,6 +545,63 @@ void controlpath_manager::handle_modify_qp(SMARTNS_MODIFY_QP_PARAMS *param) {
     }
 
     qp->remote_qp_number = param->remote_qp_number;
+    // the peer runs with the same flags and has a zero-copy queue for the first QP numbers
+    qp->zc_dst_port = 0;
+    if (data_manager->datapath_handler_list[qp->datapath_send_wq->datapath_send_wq_id].rx_zero_copy && qp->remote_qp_number < SMARTNS_RX_ZC_QPS) {
+        qp->zc_dst_port = htons(SMARTNS_UDP_ZC_PORT + qp->remote_qp_number);
+    }
+
+    param->common_params.success = 1;
+    return;
+}
+
+void controlpath_manager::handle_set_qp_sched(SMARTNS_SET_QP_SCHED_PARAMS *param) {
+    struct dpu_context *dpu_ctx = context_list[param->context_number];
+    if (!dpu_ctx) {
+        SMARTNS_ERROR("context number %lu not found", param->context_number);
+        exit(1);
+    }
+
+    struct dpu_qp *qp = dpu_ctx->qp_list[param->qp_number];
+    if (!qp) {
+        SMARTNS_ERROR("context number %lu qp number %lu not found", param->context_number, param->qp_number);
+        exit(1);
+    }
+
+    // picked up by the datapath on the next round
+    qp->sched.weight = max_t(uint32_t, param->weight, 1);
+    qp->sched.rate = param->rate_limit_mbps * 1e6 / 8 / (get_tsc_freq_per_ns() * 1e9);
+
+    param->common_params.success = 1;
+    return;
+}
+
+void controlpath_manager::handle_set_send_wq_pull(SMARTNS_SET_SEND_WQ_PULL_PARAMS *param) {
+    struct dpu_context *dpu_ctx = context_list[param->context_number];
+    if (!dpu_ctx) {
+        SMARTNS_ERROR("context number %lu not found", param->context_number);
+        exit(1);
+    }
+    if (param->datapath_send_wq_id >= dpu_ctx->datapath_send_wq_list.size()) {
+        SMARTNS_ERROR("context number %lu datapath send wq %lu not found", param->context_number, param->datapath_send_wq_id);
+        exit(1);
+    }
+
+    // the host switches before its first post, so nothing is in flight
+    datapath_handler &handler = data_manager->datapath_handler_list[param->datapath_send_wq_id];
+    dpu_datapath_send_wq &datapath_send_wq = dpu_ctx->datapath_send_wq_list[param->datapath_send_wq_id];
+    handler.active_datapath_send_wq_list_mutex.lock();
+    datapath_send_wq.host_send_wq_buf = param->host_send_wq_buf;
+    datapath_send_wq.host_doorbell = reinterpret_cast<smartns_wq_doorbell *>(param->host_doorbell);
+    datapath_send_wq.bf_doorbell = reinterpret_cast<smartns_wq_doorbell *>(param->bf_doorbell);
+    datapath_send_wq.pull_state = dpu_send_wq_pull_idle;
+    datapath_send_wq.pulled = 0;
+    datapath_send_wq.pull_producer = 0;
+    datapath_send_wq.pull_ready = 0;
+    datapath_send_wq.pull_next_tsc = 0;
+    datapath_send_wq.pull_idle_tsc = SMARTNS_SEND_WQ_PULL_IDLE_NS * get_tsc_freq_per_ns();
+    datapath_send_wq.pull = true;
+    handler.active_datapath_send_wq_list_mutex.unlock();
 
     param->common_params.success = 1;
     return;
@@ -475,7 +622,21 @@ size_t controlpath_manager::generate_cq_number() {
     return cq_number++;
 }
 
+// SMARTNS_MAX_QP when all numbers are taken
 size_t controlpath_manager::generate_qp_number() {
     static size_t qp_number = 0;
-    return qp_number++;
+    // fresh numbers first, reusing late keeps stale packets of a destroyed qp off its successor
+    if (qp_number < SMARTNS_MAX_QP) {
+        return qp_number++;
+    }
+    if (free_qp_numbers.empty()) {
+        return SMARTNS_MAX_QP;
+    }
+    size_t number = free_qp_numbers.front();
+    free_qp_numbers.pop_front();
+    return number;
+}
+
+void controlpath_manager::release_qp_number(size_t qp_number) {
+    free_qp_numbers.push_back(qp_number);
 }
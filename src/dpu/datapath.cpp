@@ -2,8 +2,23 @@
 #include "numautil.h"
 #include "dma/dma.h"
 #include "rxe/rxe.h"
+#include "rxe/rxe_param.h"
 #include "raw_packet/raw_packet.h"
 
+// frames to this node's mac
+static void init_flow_spec_eth(ibv_flow_spec_eth *flow_spec_eth, bool is_server) {
+    flow_spec_eth->type = IBV_FLOW_SPEC_ETH;
+    flow_spec_eth->size = sizeof(ibv_flow_spec_eth);
+    flow_spec_eth->val.ether_type = htons(0x0800);
+    flow_spec_eth->mask.ether_type = 0xffff;
+    if (is_server) {
+        memcpy(flow_spec_eth->val.dst_mac, server_mac, 6);
+    } else {
+        memcpy(flow_spec_eth->val.dst_mac, client_mac, 6);
+    }
+    memset(flow_spec_eth->mask.dst_mac, 0xFF, 6);
+}
+
 void datapath_manager::create_main_flow() {
     assert(global_context != nullptr);
     assert(datapath_handler_list.size() == SMARTNS_TX_RX_CORE);
@@ -22,16 +37,7 @@ void datapath_manager::create_main_flow() {
     flow_attr->flags = 0;
     flow_attr->type = IBV_FLOW_ATTR_NORMAL;
 
-    flow_spec_eth->type = IBV_FLOW_SPEC_ETH;
-    flow_spec_eth->size = sizeof(ibv_flow_spec_eth);
-    flow_spec_eth->val.ether_type = htons(0x0800);
-    flow_spec_eth->mask.ether_type = 0xffff;
-    if (is_server) {
-        memcpy(flow_spec_eth->val.dst_mac, server_mac, 6);
-    } else {
-        memcpy(flow_spec_eth->val.dst_mac, client_mac, 6);
-    }
-    memset(flow_spec_eth->mask.dst_mac, 0xFF, 6);
+    init_flow_spec_eth(flow_spec_eth, is_server);
 
     for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
         flow_spec_udp->type = IBV_FLOW_SPEC_UDP;
@@ -40,7 +46,21 @@ void datapath_manager::create_main_flow() {
         flow_spec_udp->mask.dst_port = 0xFFFF;
         // flow_spec_udp->val.src_port = htons(SMARTNS_UDP_MAGIC_PORT + i);
         // flow_spec_udp->mask.src_port = 0xFFFF;
-        ibv_flow *flow = ibv_create_flow(datapath_handler_list[i].txpath_handler->send_recv_qp, flow_attr);
+        ibv_flow *flow = ibv_create_flow(datapath_handler_list[i].rxpath_handler->recv_qp, flow_attr);
+        assert(flow);
+        main_flows.push_back(flow);
+    }
+
+    // zero-copy ports of QPs whose queue isn't armed, to the thread of the sender's
+    // src port. Below the per QP flows, which are installed at priority 0
+    static_assert(SMARTNS_RX_ZC_QPS <= 0x100 && (SMARTNS_UDP_ZC_PORT & 0xFF) == 0);
+    flow_attr->priority = 1;
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        flow_spec_udp->val.dst_port = htons(SMARTNS_UDP_ZC_PORT);
+        flow_spec_udp->mask.dst_port = htons(0xFF00);
+        flow_spec_udp->val.src_port = htons(SMARTNS_UDP_MAGIC_PORT + i);
+        flow_spec_udp->mask.src_port = 0xFFFF;
+        ibv_flow *flow = ibv_create_flow(datapath_handler_list[i].rxpath_handler->recv_qp, flow_attr);
         assert(flow);
         main_flows.push_back(flow);
     }
@@ -48,7 +68,7 @@ void datapath_manager::create_main_flow() {
     free(header_buff);
 }
 
-datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, size_t numa_node, bool is_server) {
+datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, size_t numa_node, bool is_server, uint32_t dma_group_size) {
     this->numa_node = numa_node;
     this->is_server = is_server;
 
@@ -66,8 +86,8 @@ datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, siz
         }
         txpath_send_buf_list.push_back(send_buf);
 
-        void *recv_buf = get_huge_mem(numa_node, SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER);
-        for (size_t j = 0;j < SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER / sizeof(size_t);j++) {
+        void *recv_buf = get_huge_mem(numa_node, SMARTNS_RX_BUF_SIZE);
+        for (size_t j = 0;j < SMARTNS_RX_BUF_SIZE / sizeof(size_t);j++) {
             ((size_t *)recv_buf)[j] = 0;
         }
         rxpath_recv_buf_list.push_back(recv_buf);
@@ -76,9 +96,38 @@ datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, siz
     for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
         datapath_handler &handler = datapath_handler_list[i];
         handler.txpath_handler = new txpath_handler(global_context, global_pd, txpath_send_buf_list[i], SMARTNS_TX_DEPTH * SMARTNS_TX_PACKET_BUFFER);
-        handler.rxpath_handler = new rxpath_handler(global_context, global_pd, handler.txpath_handler, rxpath_recv_buf_list[i], SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER);
-        handler.dma_handler = new dma_handler(global_context, global_pd);
+        handler.rxpath_handler = new rxpath_handler(global_context, global_pd, handler.txpath_handler, rxpath_recv_buf_list[i], SMARTNS_RX_BUF_SIZE);
+        handler.dma_handler = new dma_handler(global_context, global_pd, dma_group_size);
         handler.wc_send_recv = new ibv_wc[CTX_POLL_BATCH];
+        handler.rx_batch = new rxe_rx_pkt[CTX_POLL_BATCH];
+        // the zero-copy completions of a batch owe acks as well
+        handler.ack_pending_qps = new dpu_qp *[CTX_POLL_BATCH + RXE_ZC_POLL_BATCH];
+        handler.ack_pending_cnt = 0;
+        handler.cqe_pending_cqs = new dpu_cq *[SMARTNS_CQE_PENDING_CQS];
+        handler.cqe_pending_cnt = 0;
+
+        handler.retrans_timeout_tsc = RXE_RETRANS_TIMEOUT_US * 1000 * get_tsc_freq_per_ns();
+        handler.retrans_timer.init(RXE_TIMER_WHEEL_SLOTS, RXE_TIMER_TICK_US * 1000 * get_tsc_freq_per_ns(), get_tsc());
+        handler.ack_coalesce_pkts = RXE_ACK_COALESCE_PKTS;
+        handler.ack_delay_tsc = RXE_ACK_DELAY_US * 1000 * get_tsc_freq_per_ns();
+        handler.ack_timer.init(RXE_ACK_TIMER_SLOTS, 1000 * get_tsc_freq_per_ns(), get_tsc());
+        handler.rx_zero_copy = false;
+        // bounds the WQEs of every zero-copy queue the thread may have
+        assert(handler.zc_cq = ibv_create_cq(global_context, SMARTNS_RX_ZC_QPS * SMARTNS_RX_ZC_DEPTH, NULL, NULL, 0));
+        handler.zc_rearm_tsc = RXE_ZC_REARM_US * 1000 * get_tsc_freq_per_ns();
+        handler.zc_scan_tsc = 0;
+        handler.rx_drop_threshold = 0;
+        handler.rx_reorder_threshold = 0;
+        handler.fault_rand_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+        handler.qp_table = new dpu_qp *[SMARTNS_MAX_QP]();
+        handler.ready_head = nullptr;
+        handler.ready_tail = nullptr;
+        handler.sched_quantum = RXE_SCHED_QUANTUM;
+        handler.sched_burst = RXE_SCHED_BURST;
+        handler.invalidate_policy = RX_INVALIDATE_ALWAYS;
+        handler.invalidate_llc_bytes = SMARTNS_RX_LLC_KB * 1024 / SMARTNS_TX_RX_CORE;
+        rxe_cc_default_param(&handler.cc_param, RXE_CC_NONE, get_tsc_freq_per_ns(), 128 << port_attr.active_mtu, RXE_CC_LINE_GBPS, RXE_CC_TARGET_DELAY_US);
+        memset(&handler.counters, 0, sizeof(datapath_counters));
     }
 
     create_main_flow();
@@ -90,6 +139,9 @@ datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, siz
         v4_tuple.dst_addr = is_server ? ip_to_uint32(client_ip) : ip_to_uint32(server_ip);
         v4_tuple.dport = SMARTNS_UDP_MAGIC_PORT + i;
         v4_tuple.sport = SMARTNS_UDP_MAGIC_PORT + i;
+        datapath_handler_list[i].txpath_handler->src_port = htons(v4_tuple.sport);
+        datapath_handler_list[i].txpath_handler->dst_port = htons(v4_tuple.dport);
+        datapath_handler_list[i].txpath_handler->pkt_dst_port = htons(v4_tuple.dport);
         for (size_t j = 0;j < SMARTNS_TX_DEPTH;j++) {
             udp_packet *packet = reinterpret_cast<udp_packet *>(reinterpret_cast<size_t>(txpath_send_buf_list[i]) + j * SMARTNS_TX_PACKET_BUFFER);
 
@@ -99,6 +151,15 @@ datapath_manager::datapath_manager(ibv_context *all_context, ibv_pd *all_pd, siz
     SMARTNS_INFO("Datapath manager initialized\n");
 }
 
+void datapath_manager::set_ecn_capable() {
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        for (size_t j = 0;j < SMARTNS_TX_DEPTH;j++) {
+            udp_packet *packet = reinterpret_cast<udp_packet *>(reinterpret_cast<size_t>(txpath_send_buf_list[i]) + j * SMARTNS_TX_PACKET_BUFFER);
+            packet->ip_hdr.type_of_service = (packet->ip_hdr.type_of_service & ~IP_ECN_MASK) | IP_ECN_ECT0;
+        }
+    }
+}
+
 datapath_manager::~datapath_manager() {
     for (size_t i = 0;i < main_flows.size();i++) {
         ibv_destroy_flow(main_flows[i]);
@@ -112,10 +173,67 @@ datapath_manager::~datapath_manager() {
         delete datapath_handler_list[i].rxpath_handler;
         delete datapath_handler_list[i].dma_handler;
         delete[]datapath_handler_list[i].wc_send_recv;
+        delete[]datapath_handler_list[i].rx_batch;
+        delete[]datapath_handler_list[i].ack_pending_qps;
+        delete[]datapath_handler_list[i].cqe_pending_cqs;
+        delete[]datapath_handler_list[i].qp_table;
+        ibv_destroy_cq(datapath_handler_list[i].zc_cq);
     }
     // free context and pd at control manager destructor
 }
 
+void datapath_manager::create_zc_rq(dpu_qp *qp, size_t thread_id) {
+    rxe_zc_rq *zc = new rxe_zc_rq();
+    // header slots, then the spill buffer
+    size_t buf_size = SMARTNS_RX_ZC_DEPTH * SMARTNS_RX_HDR_SLOT + SMARTNS_MTU;
+    ALLOCATE(zc->buf, uint8_t, buf_size);
+    assert(zc->mr = ibv_reg_mr(global_pd, zc->buf, buf_size, IBV_ACCESS_LOCAL_WRITE));
+    zc->target = new uint32_t[SMARTNS_RX_ZC_DEPTH]();
+    zc->host_len = new uint32_t[SMARTNS_RX_ZC_DEPTH]();
+
+    struct ibv_qp_init_attr qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.send_cq = datapath_handler_list[thread_id].zc_cq;
+    qp_init_attr.recv_cq = datapath_handler_list[thread_id].zc_cq;
+    qp_init_attr.cap.max_send_wr = 1;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_wr = SMARTNS_RX_ZC_DEPTH;
+    qp_init_attr.cap.max_recv_sge = 3;
+    qp_init_attr.qp_type = IBV_QPT_RAW_PACKET;
+    assert(zc->qp = ibv_create_qp(global_pd, &qp_init_attr));
+
+    memset(zc->flow_attr, 0, sizeof(zc->flow_attr));
+    ibv_flow_attr *flow_attr = reinterpret_cast<ibv_flow_attr *>(zc->flow_attr);
+    ibv_flow_spec_eth *flow_spec_eth = reinterpret_cast<ibv_flow_spec_eth *>(flow_attr + 1);
+    ibv_flow_spec_tcp_udp *flow_spec_udp = reinterpret_cast<ibv_flow_spec_tcp_udp *>(flow_spec_eth + 1);
+    flow_attr->size = sizeof(zc->flow_attr);
+    flow_attr->priority = 0;
+    flow_attr->num_of_specs = 2;
+    flow_attr->port = RDMA_IB_PORT;
+    flow_attr->type = IBV_FLOW_ATTR_NORMAL;
+    init_flow_spec_eth(flow_spec_eth, is_server);
+    flow_spec_udp->type = IBV_FLOW_SPEC_UDP;
+    flow_spec_udp->size = sizeof(ibv_flow_spec_tcp_udp);
+    flow_spec_udp->val.dst_port = htons(SMARTNS_UDP_ZC_PORT + qp->qp_number);
+    flow_spec_udp->mask.dst_port = 0xFFFF;
+
+    qp->recv_wq->zc = zc;
+}
+
+void datapath_manager::destroy_zc_rq(dpu_qp *qp) {
+    rxe_zc_rq *zc = qp->recv_wq->zc;
+    if (zc->flow) {
+        ibv_destroy_flow(zc->flow);
+    }
+    ibv_destroy_qp(zc->qp);
+    ibv_dereg_mr(zc->mr);
+    free(zc->buf);
+    delete[]zc->target;
+    delete[]zc->host_len;
+    delete zc;
+    qp->recv_wq->zc = nullptr;
+}
+
 
 txpath_handler::txpath_handler(ibv_context *context, ibv_pd *pd, void *buf_addr, size_t send_buf_size):
     send_offset_handler(SMARTNS_TX_DEPTH, SMARTNS_TX_PACKET_BUFFER, 0),
@@ -126,6 +244,7 @@ txpath_handler::txpath_handler(ibv_context *context, ibv_pd *pd, void *buf_addr,
     send_buf_addr = reinterpret_cast<size_t>(buf_addr);
     batch_index = 0;
     wr_index = 0;
+    tx_bytes = 0;
 
     num_wrs = SMARTNS_TX_BATCH;
     num_sges_per_wr = SMARTNS_TX_SEG;
@@ -144,7 +263,7 @@ txpath_handler::txpath_handler(ibv_context *context, ibv_pd *pd, void *buf_addr,
     tx_qp_init_attr.recv_cq = recv_cq;
     tx_qp_init_attr.cap.max_send_wr = tx_depth;
     tx_qp_init_attr.cap.max_send_sge = num_sges_per_wr;
-    tx_qp_init_attr.cap.max_recv_wr = SMARTNS_RX_DEPTH;
+    tx_qp_init_attr.cap.max_recv_wr = SMARTNS_RX_MPRQ ? 0 : SMARTNS_RX_DEPTH;
     tx_qp_init_attr.cap.max_recv_sge = SMARTNS_RX_SEG;
     tx_qp_init_attr.cap.max_inline_data = 0;
     tx_qp_init_attr.qp_type = IBV_QPT_RAW_PACKET;
@@ -198,6 +317,10 @@ rxpath_handler::rxpath_handler(ibv_context *all_rx_context, ibv_pd *all_rx_pd, t
     pd = all_rx_pd;
     rx_depth = SMARTNS_RX_DEPTH;
     recv_buf_addr = reinterpret_cast<size_t>(buf_addr);
+    hdr_ring_addr = recv_buf_addr + SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER;
+    wr_index = 0;
+    held_buffers = 0;
+    posted_buffers = 0;
 
     num_wrs = SMARTNS_RX_BATCH;
     num_sges_per_wr = SMARTNS_RX_SEG;
@@ -211,19 +334,16 @@ rxpath_handler::rxpath_handler(ibv_context *all_rx_context, ibv_pd *all_rx_pd, t
 
     recv_cq = tx_handler->recv_cq;
     send_recv_qp = tx_handler->send_recv_qp;
+    recv_qp = send_recv_qp;
+    recv_buf_ref = nullptr;
 
-    for (size_t i = 0;i < rx_depth;i++) {
-        recv_sge_list[0].addr = recv_offset_handler.offset() + recv_buf_addr;
-        recv_sge_list[0].length = SMARTNS_RX_PACKET_BUFFER;
-        recv_sge_list[0].lkey = mr->lkey;
-        recv_wr->num_sge = 1;
-        recv_wr->sg_list = recv_sge_list;
-        recv_wr->wr_id = recv_offset_handler.offset() + recv_buf_addr;
-        recv_wr->next = nullptr;
-        assert(ibv_post_recv(send_recv_qp, recv_wr, &recv_bad_wr) == 0);
-        recv_offset_handler.step();
+    if (SMARTNS_RX_MPRQ) {
+        init_mprq();
+        return;
     }
 
+    recv_buf_ref = new uint16_t[rx_depth]();
+
     for (size_t i = 0;i < num_wrs;i++) {
         for (size_t j = 0;j < num_sges_per_wr;j++) {
             recv_sge_list[i * num_sges_per_wr + j].lkey = mr->lkey;
@@ -236,39 +356,162 @@ rxpath_handler::rxpath_handler(ibv_context *all_rx_context, ibv_pd *all_rx_pd, t
         }
         recv_wr[i].next = nullptr;
     }
+
+    // post every buffer as if the protocol just released it
+    for (size_t i = 0;i < rx_depth;i++) {
+        recv_buf_ref[i] = 1;
+        release_recv_buffer(recv_offset_handler.offset() + recv_buf_addr);
+        recv_offset_handler.step();
+    }
+    flush_recv_buffer();
+}
+
+void rxpath_handler::init_mprq() {
+    assert(recv_cq = ibv_create_cq(context, SMARTNS_RX_MPRQ_CQ_DEPTH, NULL, NULL, 0));
+
+    struct ibv_wq_init_attr wq_init_attr;
+    memset(&wq_init_attr, 0, sizeof(wq_init_attr));
+    wq_init_attr.wq_type = IBV_WQT_RQ;
+    wq_init_attr.max_wr = SMARTNS_RX_MPRQ_WQES;
+    wq_init_attr.max_sge = 1;
+    wq_init_attr.pd = pd;
+    wq_init_attr.cq = recv_cq;
+    struct mlx5dv_wq_init_attr mlx5_wq_init_attr;
+    memset(&mlx5_wq_init_attr, 0, sizeof(mlx5_wq_init_attr));
+    mlx5_wq_init_attr.comp_mask = MLX5DV_WQ_INIT_ATTR_MASK_STRIDING_RQ;
+    mlx5_wq_init_attr.striding_rq_attrs.single_stride_log_num_of_bytes = SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE;
+    mlx5_wq_init_attr.striding_rq_attrs.single_wqe_log_num_of_strides = SMARTNS_RX_MPRQ_LOG_STRIDES;
+    mlx5_wq_init_attr.striding_rq_attrs.two_byte_shift_en = 0;
+    mprq_wq = mlx5dv_create_wq(context, &wq_init_attr, &mlx5_wq_init_attr);
+    if (mprq_wq == nullptr) {
+        SMARTNS_ERROR("failed to create striding rq, stride 2^%d bytes, 2^%d strides\n", SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE, SMARTNS_RX_MPRQ_LOG_STRIDES);
+        exit(1);
+    }
+
+    struct ibv_wq_attr wq_attr;
+    memset(&wq_attr, 0, sizeof(wq_attr));
+    wq_attr.attr_mask = IBV_WQ_ATTR_STATE;
+    wq_attr.wq_state = IBV_WQS_RDY;
+    assert(ibv_modify_wq(mprq_wq, &wq_attr) == 0);
+
+    // a single queue table, the flow decides which thread gets the frame
+    struct ibv_rwq_ind_table_init_attr ind_table_attr;
+    memset(&ind_table_attr, 0, sizeof(ind_table_attr));
+    ind_table_attr.log_ind_tbl_size = 0;
+    ind_table_attr.ind_tbl = &mprq_wq;
+    assert(mprq_ind_table = ibv_create_rwq_ind_table(context, &ind_table_attr));
+
+    struct ibv_qp_init_attr_ex qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = IBV_QPT_RAW_PACKET;
+    qp_init_attr.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_IND_TABLE | IBV_QP_INIT_ATTR_RX_HASH;
+    qp_init_attr.pd = pd;
+    qp_init_attr.rwq_ind_tbl = mprq_ind_table;
+    qp_init_attr.rx_hash_conf.rx_hash_function = IBV_RX_HASH_FUNC_TOEPLITZ;
+    qp_init_attr.rx_hash_conf.rx_hash_key_len = RSS_HASH_KEY_LENGTH;
+    qp_init_attr.rx_hash_conf.rx_hash_key = RSS_KEY;
+    qp_init_attr.rx_hash_conf.rx_hash_fields_mask = 0;
+    assert(recv_qp = ibv_create_qp_ex(context, &qp_init_attr));
+
+    struct mlx5dv_cq dv_cq;
+    struct mlx5dv_rwq dv_rwq;
+    struct mlx5dv_obj dv_obj;
+    dv_obj.cq.in = recv_cq;
+    dv_obj.cq.out = &dv_cq;
+    dv_obj.rwq.in = mprq_wq;
+    dv_obj.rwq.out = &dv_rwq;
+    assert(mlx5dv_init_obj(&dv_obj, MLX5DV_OBJ_CQ | MLX5DV_OBJ_RWQ) == 0);
+
+    mprq_wqes = reinterpret_cast<uint8_t *>(dv_rwq.buf);
+    mprq_wq_dbrec = dv_rwq.dbrec;
+    mprq_wqe_cnt = dv_rwq.wqe_cnt;
+    mprq_wqe_stride = dv_rwq.stride;
+    mprq_wq_pi = 0;
+    mprq_wq_ci = 0;
+    mprq_consumed_strides = 0;
+    mprq_cqes = reinterpret_cast<uint8_t *>(dv_cq.buf);
+    mprq_cq_dbrec = dv_cq.dbrec;
+    mprq_cqe_cnt = dv_cq.cqe_cnt;
+    mprq_cqe_size = dv_cq.cqe_size;
+    mprq_cq_ci = 0;
+    assert(is_log2(mprq_wqe_cnt) && mprq_wqe_cnt < SMARTNS_RX_MPRQ_BUFS);
+
+    for (uint32_t i = 0;i < mprq_wqe_cnt;i++) {
+        mlx5_mprq_wqe *wqe = reinterpret_cast<mlx5_mprq_wqe *>(mprq_wqes + i * mprq_wqe_stride);
+        memset(wqe, 0, sizeof(mlx5_mprq_wqe));
+        wqe->dseg.byte_count = htobe32(1u << SMARTNS_RX_MPRQ_LOG_BUF_SIZE);
+        wqe->dseg.lkey = htobe32(mr->lkey);
+    }
+
+    mprq_slot_buf = new uint32_t[mprq_wqe_cnt]();
+    mprq_buf_ref = new uint32_t[SMARTNS_RX_MPRQ_BUFS]();
+    mprq_free_bufs = new uint32_t[SMARTNS_RX_MPRQ_BUFS];
+    mprq_free_cnt = 0;
+    for (uint32_t i = SMARTNS_RX_MPRQ_BUFS;i > 0;i--) {
+        mprq_free_bufs[mprq_free_cnt++] = i - 1;
+    }
+    flush_recv_buffer();
 }
 
 rxpath_handler::~rxpath_handler() {
     free(recv_sge_list);
     free(recv_wr);
     free(recv_bad_wr);
-
+    delete[]recv_buf_ref;
+
+    if (SMARTNS_RX_MPRQ) {
+        ibv_destroy_qp(recv_qp);
+        ibv_destroy_rwq_ind_table(mprq_ind_table);
+        ibv_destroy_wq(mprq_wq);
+        ibv_destroy_cq(recv_cq);
+        delete[]mprq_slot_buf;
+        delete[]mprq_buf_ref;
+        delete[]mprq_free_bufs;
+    }
     ibv_dereg_mr(mr);
 }
 
-dma_handler::dma_handler(ibv_context *context, ibv_pd *pd) {
+dma_handler::dma_handler(ibv_context *context, ibv_pd *pd, uint32_t group_size) {
     this->context = context;
     this->pd = pd;
-
-    assert(dma_send_recv_cq = create_dma_cq(context, 256 * SMARTNS_DMA_GROUP_SIZE));
-    assert(invalid_send_recv_cq = create_dma_cq(context, 256 * SMARTNS_DMA_GROUP_SIZE));
-
-    dma_qp_list = new ibv_qp * [SMARTNS_DMA_GROUP_SIZE];
-    dma_qpx_list = new ibv_qp_ex * [SMARTNS_DMA_GROUP_SIZE];
-    dma_mqpx_list = new mlx5dv_qp_ex * [SMARTNS_DMA_GROUP_SIZE];
-    dma_count_list = new uint32_t[SMARTNS_DMA_GROUP_SIZE];
-    payload_count_list = new uint64_t[SMARTNS_DMA_GROUP_SIZE];
-
-    invalid_qp_list = new ibv_qp * [SMARTNS_DMA_GROUP_SIZE];
-    invalid_qpx_list = new ibv_qp_ex * [SMARTNS_DMA_GROUP_SIZE];
-    invalid_mqpx_list = new mlx5dv_qp_ex * [SMARTNS_DMA_GROUP_SIZE];
-    invalid_start_index_list = new uint32_t[SMARTNS_DMA_GROUP_SIZE];
-    invalid_finish_index_list = new uint32_t[SMARTNS_DMA_GROUP_SIZE];
+    this->group_size = group_size;
+    assert(group_size >= 1 && group_size <= SMARTNS_DMA_MAX_GROUP_SIZE);
+
+    assert(dma_send_recv_cq = create_dma_cq(context, 256 * group_size));
+    assert(invalid_send_recv_cq = create_dma_cq(context, 256 * group_size));
+
+    dma_qp_list = new ibv_qp * [group_size];
+    dma_qpx_list = new ibv_qp_ex * [group_size];
+    dma_mqpx_list = new mlx5dv_qp_ex * [group_size];
+    dma_count_list = new uint32_t[group_size];
+    payload_count_list = new uint64_t[group_size];
+    pending_buf_list = new uint64_t[group_size * dma_depth];
+    pending_len_list = new uint32_t[group_size * dma_depth];
+    pending_head_list = new uint32_t[group_size];
+    pending_tail_list = new uint32_t[group_size];
+    outstanding_bytes_list = new uint64_t[group_size];
+
+    invalid_qp_list = new ibv_qp * [group_size];
+    invalid_qpx_list = new ibv_qp_ex * [group_size];
+    invalid_mqpx_list = new mlx5dv_qp_ex * [group_size];
+    invalid_start_index_list = new uint32_t[group_size];
+    invalid_finish_index_list = new uint32_t[group_size];
+    invalid_count_list = new uint32_t[group_size];
+    invalid_buf_list = new uint64_t[group_size * invalid_depth];
+    invalid_deferred_list = new uint32_t[group_size];
+    // at most one deferred invalidate per pending dma
+    pending_deferred_list = new uint32_t[group_size * dma_depth];
+    deferred_list = new deferred_invalidate[group_size * dma_depth];
+    deferred_free_list = new uint32_t[group_size * dma_depth];
+    for (uint32_t i = 0;i < group_size * dma_depth;i++) {
+        deferred_free_list[i] = i;
+    }
+    deferred_free_cnt = group_size * dma_depth;
 
     now_use_qp_index = 0;
 
-    for (size_t i = 0;i < SMARTNS_DMA_GROUP_SIZE;i++) {
-        ibv_qp *dma_qp = create_dma_qp(context, pd, dma_send_recv_cq, dma_send_recv_cq, 256);
+    for (size_t i = 0;i < group_size;i++) {
+        ibv_qp *dma_qp = create_dma_qp(context, pd, dma_send_recv_cq, dma_send_recv_cq, dma_depth);
         init_dma_qp(dma_qp);
         dma_qp_self_connected(dma_qp);
 
@@ -281,7 +524,14 @@ dma_handler::dma_handler(ibv_context *context, ibv_pd *pd) {
         dma_mqpx_list[i] = dma_mqpx;
         dma_count_list[i] = 0;
         payload_count_list[i] = 0;
+        pending_head_list[i] = 0;
+        pending_tail_list[i] = 0;
+        outstanding_bytes_list[i] = 0;
     }
+    // two cache lines, one of them whole for the fence invalidate
+    ALLOCATE(fence_buf, uint64_t, 16);
+    assert(fence_mr = ibv_reg_mr(pd, fence_buf, 16 * sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE));
+    fence_line = round_up(reinterpret_cast<uint64_t>(fence_buf), 64);
 
     cqe_qp = create_dma_qp(context, pd, invalid_send_recv_cq, invalid_send_recv_cq, 256);
     init_dma_qp(cqe_qp);
@@ -290,9 +540,32 @@ dma_handler::dma_handler(ibv_context *context, ibv_pd *pd) {
     cqe_mqpx = mlx5dv_qp_ex_from_ibv_qp_ex(cqe_qpx);
     cqe_mqpx->wr_memcpy_direct_init(cqe_mqpx);
     cqe_count = 0;
+    cqe_run_list = new cqe_run[SMARTNS_CQE_RUN_DEPTH];
+    cqe_run_head = 0;
+    cqe_run_tail = 0;
+    cqe_fence_list = new cqe_fence[SMARTNS_CQE_FENCE_DEPTH];
+    cqe_fence_head = 0;
+    cqe_fence_tail = 0;
+
+    assert(atomic_cq = create_dma_cq(context, SMARTNS_ATOMIC_DEPTH));
+    atomic_qp = create_dma_qp(context, pd, atomic_cq, atomic_cq, SMARTNS_ATOMIC_DEPTH);
+    init_dma_qp(atomic_qp);
+    dma_qp_self_connected(atomic_qp);
+    atomic_qpx = ibv_qp_to_qp_ex(atomic_qp);
+    atomic_mqpx = mlx5dv_qp_ex_from_ibv_qp_ex(atomic_qpx);
+    atomic_mqpx->wr_memcpy_direct_init(atomic_mqpx);
+    ALLOCATE(atomic_buf, uint64_t, SMARTNS_ATOMIC_DEPTH + SMARTNS_ATOMIC_INFLIGHT);
+    assert(atomic_mr = ibv_reg_mr(pd, atomic_buf, (SMARTNS_ATOMIC_DEPTH + SMARTNS_ATOMIC_INFLIGHT) * sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE));
+    atomic_stage_free_list = new uint32_t[SMARTNS_ATOMIC_INFLIGHT];
+    for (uint32_t i = 0;i < SMARTNS_ATOMIC_INFLIGHT;i++) {
+        atomic_stage_free_list[i] = i;
+    }
+    atomic_stage_free_cnt = SMARTNS_ATOMIC_INFLIGHT;
+    atomic_head = 0;
+    atomic_tail = 0;
 
-    for (size_t i = 0;i < SMARTNS_DMA_GROUP_SIZE;i++) {
-        ibv_qp *dma_qp = create_dma_qp(context, pd, invalid_send_recv_cq, invalid_send_recv_cq, 256);
+    for (size_t i = 0;i < group_size;i++) {
+        ibv_qp *dma_qp = create_dma_qp(context, pd, invalid_send_recv_cq, invalid_send_recv_cq, invalid_depth);
         init_dma_qp(dma_qp);
         dma_qp_self_connected(dma_qp);
 
@@ -305,93 +578,375 @@ dma_handler::dma_handler(ibv_context *context, ibv_pd *pd) {
         invalid_mqpx_list[i] = dma_mqpx;
         invalid_start_index_list[i] = 0;
         invalid_finish_index_list[i] = 0;
+        invalid_count_list[i] = 0;
+        invalid_deferred_list[i] = 0;
     }
 }
 
 dma_handler::~dma_handler() {
-    for (size_t i = 0;i < SMARTNS_DMA_GROUP_SIZE;i++) {
+    for (size_t i = 0;i < group_size;i++) {
         ibv_destroy_qp(dma_qp_list[i]);
         ibv_destroy_qp(invalid_qp_list[i]);
     }
     ibv_destroy_qp(cqe_qp);
+    ibv_destroy_qp(atomic_qp);
+    ibv_dereg_mr(atomic_mr);
+    free(atomic_buf);
+    ibv_dereg_mr(fence_mr);
+    free(fence_buf);
 
     ibv_destroy_cq(dma_send_recv_cq);
     ibv_destroy_cq(invalid_send_recv_cq);
+    ibv_destroy_cq(atomic_cq);
 
     delete[]dma_qp_list;
     delete[]dma_qpx_list;
     delete[]dma_mqpx_list;
     delete[]dma_count_list;
     delete[]payload_count_list;
+    delete[]pending_buf_list;
+    delete[]pending_len_list;
+    delete[]pending_head_list;
+    delete[]pending_tail_list;
+    delete[]outstanding_bytes_list;
 
     delete[]invalid_qp_list;
     delete[]invalid_qpx_list;
     delete[]invalid_mqpx_list;
     delete[]invalid_start_index_list;
     delete[]invalid_finish_index_list;
+    delete[]invalid_count_list;
+    delete[]invalid_buf_list;
+    delete[]invalid_deferred_list;
+    delete[]pending_deferred_list;
+    delete[]deferred_list;
+    delete[]deferred_free_list;
+    delete[]cqe_run_list;
+    delete[]cqe_fence_list;
+    delete[]atomic_stage_free_list;
 }
 
+void datapath_handler::sched_activate(dpu_qp *qp) {
+    if (qp->sched.ready) {
+        return;
+    }
+    qp->sched.ready = 1;
+    qp->sched.prev = ready_tail;
+    qp->sched.next = nullptr;
+    if (ready_tail) {
+        ready_tail->sched.next = qp;
+    } else {
+        ready_head = qp;
+    }
+    ready_tail = qp;
+}
+
+void datapath_handler::sched_deactivate(dpu_qp *qp) {
+    if (!qp->sched.ready) {
+        return;
+    }
+    if (qp->sched.prev) {
+        qp->sched.prev->sched.next = qp->sched.next;
+    } else {
+        ready_head = qp->sched.next;
+    }
+    if (qp->sched.next) {
+        qp->sched.next->sched.prev = qp->sched.prev;
+    } else {
+        ready_tail = qp->sched.prev;
+    }
+    qp->sched.ready = 0;
+    qp->sched.prev = nullptr;
+    qp->sched.next = nullptr;
+    qp->sched.deficit = 0;
+}
+
+// one round over the ready QPs, each may send weight * quantum bytes within its token bucket
 size_t datapath_handler::handle_send() {
-    for (auto qp = active_qp_list.begin();qp != active_qp_list.end();) {
-        int ret = rxe_handle_req(this, *qp);
-        if (ret == -1) {
-            qp = active_qp_list.erase(qp);
-        } else {
-            qp++;
+    size_t now = get_tsc();
+    for (dpu_qp *qp = ready_head;qp != nullptr;) {
+        dpu_qp *next = qp->sched.next;
+        dpu_qp_sched *sched = &qp->sched;
+        int64_t quantum = static_cast<int64_t>(sched_quantum) * sched->weight;
+
+        // no credit is saved up while blocked
+        sched->deficit = min_t(int64_t, sched->deficit + quantum, quantum);
+        int64_t budget = sched->deficit;
+        if (sched->rate > 0) {
+            sched->tokens = min_t(double, sched->tokens + (now - sched->last_tsc) * sched->rate, sched_burst);
+            sched->last_tsc = now;
+            budget = min_t(int64_t, budget, static_cast<int64_t>(sched->tokens));
+        }
+        if (budget <= 0) {
+            qp = next;
+            continue;
+        }
+
+        // read responses owed to the peer, then our own requests
+        size_t start_bytes = txpath_handler->tx_bytes;
+        int resp = rxe_handle_resp(this, qp, budget);
+        size_t resp_bytes = txpath_handler->tx_bytes - start_bytes;
+        int ret = resp_bytes < static_cast<size_t>(budget) ? rxe_handle_req(this, qp, budget - resp_bytes) : 0;
+        int64_t sent = txpath_handler->tx_bytes - start_bytes;
+
+        sched->deficit -= sent;
+        if (sched->rate > 0) {
+            sched->tokens -= sent;
+        }
+        if (ret == -1 && resp == -1) {
+            sched_deactivate(qp);
         }
+        qp = next;
     }
 
+    flush_cqes();
     txpath_handler->commit_flush();
     txpath_handler->poll_tx_cq();
     return 0;
 }
 
+// host recv WQE ahead of head a zero-copy WQE may target, nullptr if it isn't
+// posted yet or a single packet send may not fit its first sge
+static smartns_recv_wqe *zc_target_wqe(dpu_qp *qp, uint32_t ahead) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    if (ahead >= recv_wq->wqe_cnt) {
+        return nullptr;
+    }
+    smartns_recv_wqe *wqe = recv_wq->peek_wqe(ahead);
+    if (wqe == nullptr || (recv_wq->max_sge > 1 && wqe->byte_count < static_cast<uint32_t>(qp->mtu))) {
+        return nullptr;
+    }
+    return wqe;
+}
+
+bool datapath_handler::zc_arm(dpu_qp *qp) {
+    rxe_zc_rq *zc = qp->recv_wq->zc;
+    if (zc_target_wqe(qp, 0) == nullptr) {
+        return false;
+    }
+
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = 1;
+    assert(ibv_modify_qp(zc->qp, &attr, IBV_QP_STATE | IBV_QP_PORT) == 0);
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    assert(ibv_modify_qp(zc->qp, &attr, IBV_QP_STATE) == 0);
+
+    zc->posted = 0;
+    zc->done = 0;
+    zc->next_target = qp->recv_wq->wqe_seq;
+    zc_refill(qp);
+    assert(zc->flow = ibv_create_flow(zc->qp, reinterpret_cast<ibv_flow_attr *>(zc->flow_attr)));
+    zc->armed = 1;
+    zc->hit = 0;
+    counters.zc_arm++;
+    return true;
+}
+
+void datapath_handler::zc_disarm(dpu_qp *qp) {
+    rxe_zc_rq *zc = qp->recv_wq->zc;
+    ibv_destroy_flow(zc->flow);
+    zc->flow = nullptr;
+
+    // drops the posted WQEs, nothing lands in a host buffer the staged path fills from now on
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    assert(ibv_modify_qp(zc->qp, &attr, IBV_QP_STATE) == 0);
+    zc->armed = 0;
+    zc->epoch++;
+    counters.zc_disarm++;
+}
+
+void datapath_handler::zc_refill(dpu_qp *qp) {
+    rxe_zc_rq *zc = qp->recv_wq->zc;
+    ibv_recv_wr wr[SMARTNS_RX_ZC_DEPTH];
+    ibv_sge sge[SMARTNS_RX_ZC_DEPTH][3];
+    uint32_t cnt = 0;
+
+    while (zc->posted - zc->done < SMARTNS_RX_ZC_DEPTH) {
+        smartns_recv_wqe *recv_wqe = zc_target_wqe(qp, zc->next_target - qp->recv_wq->wqe_seq);
+        if (recv_wqe == nullptr) {
+            break;
+        }
+        uint32_t slot = zc->posted % SMARTNS_RX_ZC_DEPTH;
+        zc->target[slot] = zc->next_target;
+        zc->host_len[slot] = min_t(uint32_t, recv_wqe->byte_count, qp->mtu);
+
+        sge[cnt][0].addr = reinterpret_cast<uint64_t>(zc->buf) + slot * SMARTNS_RX_HDR_SLOT;
+        sge[cnt][0].length = rxpath_handler::hdr_split_bytes;
+        sge[cnt][0].lkey = zc->mr->lkey;
+        sge[cnt][1].addr = recv_wqe->addr;
+        sge[cnt][1].length = zc->host_len[slot];
+        sge[cnt][1].lkey = recv_wqe->lkey;
+        sge[cnt][2].addr = reinterpret_cast<uint64_t>(zc->buf) + SMARTNS_RX_ZC_DEPTH * SMARTNS_RX_HDR_SLOT;
+        sge[cnt][2].length = SMARTNS_MTU;
+        sge[cnt][2].lkey = zc->mr->lkey;
+        wr[cnt].wr_id = (qp->qp_number << 32) | zc->epoch;
+        wr[cnt].sg_list = sge[cnt];
+        wr[cnt].num_sge = 3;
+        wr[cnt].next = nullptr;
+        if (cnt > 0) {
+            wr[cnt - 1].next = wr + cnt;
+        }
+        cnt++;
+        zc->posted++;
+        zc->next_target++;
+    }
+
+    if (cnt) {
+        ibv_recv_wr *bad_wr;
+        assert(ibv_post_recv(zc->qp, wr, &bad_wr) == 0);
+    }
+}
+
 size_t datapath_handler::handle_recv() {
     size_t recv = rxe_handle_recv(this);
     return recv;
 }
 
+size_t datapath_handler::handle_timer() {
+    size_t now = get_tsc();
+    size_t expired = ack_timer.advance(now, [this, now](size_t qpn) {
+        dpu_qp *qp = lookup_qp(qpn);
+        if (qp == nullptr) {
+            return;
+        }
+        rxe_handle_ack_timer(this, qp, now);
+    });
+    if (rx_zero_copy && now >= zc_scan_tsc) {
+        zc_scan_tsc = now + zc_rearm_tsc;
+        for (size_t qpn = 0;qpn < SMARTNS_RX_ZC_QPS;qpn++) {
+            dpu_qp *qp = lookup_qp(qpn);
+            if (qp && qp->recv_wq->zc) {
+                rxe_handle_zc_scan(this, qp, now);
+            }
+        }
+    }
+    if (expired) {
+        txpath_handler->commit_flush();
+    }
+
+    return expired + retrans_timer.advance(now, [this, now](size_t qpn) {
+        dpu_qp *qp = lookup_qp(qpn);
+        // qp already destroyed
+        if (qp == nullptr) {
+            return;
+        }
+        rxe_handle_timer(this, qp, now);
+    });
+}
+
+// drop or swap adjacent frames before protocol processing, used to test recovery on a lossless link
+// return the number of frames left in wc
+int datapath_handler::inject_rx_fault(ibv_wc *wc, int recv) {
+    auto next_rand = [this]() {
+        fault_rand_state ^= fault_rand_state << 13;
+        fault_rand_state ^= fault_rand_state >> 7;
+        fault_rand_state ^= fault_rand_state << 17;
+        return fault_rand_state & 0xFFFFFFFF;
+    };
+
+    int now_index = 0;
+    for (int i = 0;i < recv;i++) {
+        if (rx_drop_threshold && next_rand() < rx_drop_threshold) {
+            rxpath_handler->release_recv_buffer(wc[i].wr_id);
+            counters.rx_fault_drop++;
+            continue;
+        }
+        wc[now_index++] = wc[i];
+    }
+
+    for (int i = 0;i + 1 < now_index;i++) {
+        if (rx_reorder_threshold && next_rand() < rx_reorder_threshold) {
+            std::swap(wc[i], wc[i + 1]);
+            i++;
+            counters.rx_fault_reorder++;
+        }
+    }
+    return now_index;
+}
+
+void datapath_handler::print_counters() {
+    SMARTNS_INFO("thread[%ld] retransmit %lu events %lu pkts %lu timeouts, nak sent %lu recv %lu, fault drop %lu reorder %lu",
+        thread_id, counters.retrans_events, counters.retrans_pkts, counters.retrans_timeouts,
+        counters.nak_sent, counters.nak_recv, counters.rx_fault_drop, counters.rx_fault_reorder);
+    SMARTNS_INFO("thread[%ld] access nak sent %lu recv %lu", thread_id, counters.access_nak_sent, counters.access_nak_recv);
+    SMARTNS_INFO("thread[%ld] reorder buffered %lu drained %lu overflow %lu, duplicate replay %lu drop %lu",
+        thread_id, counters.reorder_buffered, counters.reorder_drained, counters.reorder_overflow,
+        counters.dup_replay, counters.dup_drop);
+    SMARTNS_INFO("thread[%ld] ecn marked %lu, cnp recv %lu, unknown qpn %lu", thread_id, counters.ecn_marked, counters.cnp_recv,
+        counters.unknown_qpn);
+    SMARTNS_INFO("thread[%ld] ack coalesced %lu, ack delay fired %lu", thread_id, counters.ack_coalesced, counters.ack_delay_fired);
+    SMARTNS_INFO("thread[%ld] zero-copy hit %lu miss %lu stale %lu, arm %lu disarm %lu", thread_id, counters.zc_hit, counters.zc_miss,
+        counters.zc_stale, counters.zc_arm, counters.zc_disarm);
+    SMARTNS_INFO("thread[%ld] rx invalidate %lu skip %lu", thread_id, counters.rx_invalidate, counters.rx_invalidate_skip);
+    SMARTNS_INFO("thread[%ld] cq refresh %lu full %lu overflow %lu", thread_id, counters.cq_refresh, counters.cq_full, counters.cq_overflow);
+    SMARTNS_INFO("thread[%ld] send wq pull doorbell reads %lu wqe reads %lu wqes %lu", thread_id, counters.pull_doorbell_reads,
+        counters.pull_wqe_reads, counters.pull_wqes);
+}
+
+rx_invalidate_policy parse_rx_invalidate_policy(const char *name) {
+    if (strcmp(name, "never") == 0) {
+        return RX_INVALIDATE_NEVER;
+    } else if (strcmp(name, "auto") == 0) {
+        return RX_INVALIDATE_AUTO;
+    }
+    return RX_INVALIDATE_ALWAYS;
+}
+
 void datapath_handler::dma_send_payload_to_host(dpu_qp *qp, uint64_t paylod_buf, uint64_t pkt_buf, size_t payload_size) {
     dpu_recv_wq *recv_wq = qp->recv_wq;
     smartns_recv_wqe *recv_wqe = qp->recv_wq->get_next_wqe();
     size_t now_size = payload_size;
     uint64_t now_buf_addr = paylod_buf;
-    // only first pkt have header
-    // we need to record which dma is first pkt
-    uint64_t now_pkt_buf = pkt_buf;
-    for (;recv_wq->now_sge_num < recv_wq->max_sge;recv_wq->now_sge_num++) {
+    // fragments per host SGE, posted together
+    dma_vec vec[SMARTNS_DMA_VEC_MAX];
+    uint32_t cnt = 0;
+    for (;recv_wq->now_sge_num < recv_wq->max_sge && now_size;) {
         assert(recv_wqe[recv_wq->now_sge_num].lkey != 100);
         uint32_t remain_sge_byte = recv_wqe[recv_wq->now_sge_num].byte_count - recv_wq->now_sge_offset;
-        if (remain_sge_byte >= now_size) {
-            dma_handler->post_dma_req_without_cq(recv_wqe[recv_wq->now_sge_num].lkey, recv_wqe[recv_wq->now_sge_num].addr + recv_wq->now_sge_offset, rxpath_handler->mr->lkey, now_buf_addr, now_pkt_buf, now_size);
-
-            recv_wq->now_total_dma_byte += now_size;
-            recv_wq->now_sge_offset += now_size;
-            now_size = 0;
-            if (recv_wq->now_sge_offset == recv_wqe[recv_wq->now_sge_num].byte_count) {
-                recv_wq->now_sge_offset = 0;
-                recv_wq->now_sge_num++;
-            }
-            break;
-        } else {
-            dma_handler->post_dma_req_without_cq(recv_wqe[recv_wq->now_sge_num].lkey, recv_wqe[recv_wq->now_sge_num].addr + recv_wq->now_sge_offset, rxpath_handler->mr->lkey, now_buf_addr, now_pkt_buf, remain_sge_byte);
-            recv_wq->now_total_dma_byte += remain_sge_byte;
-            now_buf_addr += remain_sge_byte;
-            // set to same as buf_addr, means without pkt header
-            now_pkt_buf = now_buf_addr;
-            now_size -= remain_sge_byte;
+        uint32_t len = min_t(size_t, remain_sge_byte, now_size);
+        if (cnt == SMARTNS_DMA_VEC_MAX) {
+            post_payload_dma_vec(vec, cnt, pkt_buf);
+            // only the first batch starts at the pkt header
+            pkt_buf = now_buf_addr;
+            cnt = 0;
+        }
+        if (len) {
+            vec[cnt].dest_lkey = recv_wqe[recv_wq->now_sge_num].lkey;
+            vec[cnt].dest_addr = recv_wqe[recv_wq->now_sge_num].addr + recv_wq->now_sge_offset;
+            vec[cnt].src_addr = now_buf_addr;
+            vec[cnt].length = len;
+            cnt++;
+        }
+
+        recv_wq->now_total_dma_byte += len;
+        recv_wq->now_sge_offset += len;
+        now_buf_addr += len;
+        now_size -= len;
+        if (recv_wq->now_sge_offset == recv_wqe[recv_wq->now_sge_num].byte_count) {
             recv_wq->now_sge_offset = 0;
+            recv_wq->now_sge_num++;
         }
     }
     assert(now_size == 0);
+
+    if (cnt == 1) {
+        // a single fragment may still be split over the dma qps
+        post_payload_dma(vec[0].dest_lkey, vec[0].dest_addr, vec[0].src_addr, pkt_buf, vec[0].length);
+    } else if (cnt) {
+        post_payload_dma_vec(vec, cnt, pkt_buf);
+    }
     return;
 }
 
 void datapath_handler::dma_write_payload_to_host(dpu_qp *qp, uint64_t paylod_buf, uint64_t pkt_buf, size_t payload_size) {
     dpu_recv_wq *recv_wq = qp->recv_wq;
 
-    dma_handler->post_dma_req_without_cq(recv_wq->mr->devx_mr->lkey, recv_wq->host_va + recv_wq->offset,
-        rxpath_handler->mr->lkey, reinterpret_cast<size_t>(paylod_buf), pkt_buf, payload_size);
+    post_payload_dma(recv_wq->host_lkey, recv_wq->host_va + recv_wq->offset, paylod_buf, pkt_buf, payload_size);
 
     recv_wq->offset += payload_size;
     recv_wq->resid -= payload_size;
@@ -399,33 +954,114 @@ void datapath_handler::dma_write_payload_to_host(dpu_qp *qp, uint64_t paylod_buf
 }
 
 void datapath_handler::dma_send_cq_to_host(dpu_qp *qp) {
-    dma_handler->post_send_recv_cqe(qp->send_cq);
     // don't forget to step send_wq !!!
     // 
-    qp->send_cq->step_cq();
+    queue_cqe(qp->send_cq);
 }
 
 void datapath_handler::dma_recv_cq_to_host(dpu_qp *qp) {
-    dma_handler->post_send_recv_cqe(qp->recv_cq);
     qp->recv_wq->step_wq();
-    qp->recv_cq->step_cq();
+    queue_cqe(qp->recv_cq);
+}
+
+// one step of a send wq in pull mode, never waits for a dma. The producer
+// index is read while the wq is busy and every SMARTNS_SEND_WQ_PULL_IDLE_NS
+// once it's idle, then the WQEs up to it in runs that don't cross the ring end.
+// The host never laps WQEs get_next_wqe hasn't taken yet
+void datapath_handler::pull_send_wq(dpu_datapath_send_wq *datapath_send_wq) {
+    switch (datapath_send_wq->pull_state) {
+    case dpu_send_wq_pull_idle:
+        if (datapath_send_wq->pull_next_tsc != 0 && get_tsc() < datapath_send_wq->pull_next_tsc) {
+            return;
+        }
+        datapath_send_wq->pull_ticket = dma_handler->post_atomic_copy(datapath_send_wq->bf_mkey, reinterpret_cast<uint64_t>(datapath_send_wq->bf_doorbell),
+            datapath_send_wq->host_mkey, reinterpret_cast<uint64_t>(datapath_send_wq->host_doorbell), sizeof(uint64_t));
+        datapath_send_wq->pull_state = dpu_send_wq_pull_doorbell;
+        counters.pull_doorbell_reads++;
+        return;
+    case dpu_send_wq_pull_doorbell:
+        if (!dma_handler->atomic_done(datapath_send_wq->pull_ticket)) {
+            return;
+        }
+        datapath_send_wq->pull_producer = datapath_send_wq->bf_doorbell->producer_index;
+        if (datapath_send_wq->pull_producer == datapath_send_wq->pulled) {
+            datapath_send_wq->pull_state = dpu_send_wq_pull_idle;
+            datapath_send_wq->pull_next_tsc = get_tsc() + datapath_send_wq->pull_idle_tsc;
+            return;
+        }
+        break;
+    case dpu_send_wq_pull_wqes:
+        if (!dma_handler->atomic_done(datapath_send_wq->pull_ticket)) {
+            return;
+        }
+        datapath_send_wq->pull_ready += datapath_send_wq->pull_end - datapath_send_wq->pulled;
+        datapath_send_wq->pulled = datapath_send_wq->pull_end;
+        if (datapath_send_wq->pull_producer == datapath_send_wq->pulled) {
+            // more may have been posted meanwhile, look again at once
+            datapath_send_wq->pull_state = dpu_send_wq_pull_idle;
+            datapath_send_wq->pull_next_tsc = 0;
+            return;
+        }
+        break;
+    }
+
+    uint32_t first = datapath_send_wq->pulled & (datapath_send_wq->wqe_cnt - 1);
+    uint32_t cnt = min_t(uint32_t, datapath_send_wq->pull_producer - datapath_send_wq->pulled, datapath_send_wq->wqe_cnt - first);
+    cnt = min_t(uint32_t, cnt, SMARTNS_SEND_WQ_PULL_BATCH);
+    size_t offset = static_cast<size_t>(first) << datapath_send_wq->wqe_shift;
+    datapath_send_wq->pull_ticket = dma_handler->post_atomic_copy(datapath_send_wq->bf_mkey, reinterpret_cast<uint64_t>(datapath_send_wq->bf_datapath_send_wq_buf) + offset,
+        datapath_send_wq->host_mkey, reinterpret_cast<uint64_t>(datapath_send_wq->host_send_wq_buf) + offset, cnt << datapath_send_wq->wqe_shift);
+    datapath_send_wq->pull_end = datapath_send_wq->pulled + cnt;
+    datapath_send_wq->pull_state = dpu_send_wq_pull_wqes;
+    counters.pull_wqe_reads++;
+    counters.pull_wqes += cnt;
 }
 
 void datapath_handler::loop_datapath_send_wq() {
     active_datapath_send_wq_list_mutex.lock();
     for (auto datapath_send_wq : active_datapath_send_wq_list) {
+        if (datapath_send_wq->pull) {
+            pull_send_wq(datapath_send_wq);
+        }
         smartns_send_wqe *wqe;
         while ((wqe = datapath_send_wq->get_next_wqe()) != nullptr) {
-            datapath_send_wq->step_wq();
+            if (unlikely(wqe->inline_segs && (wqe->inline_segs > SMARTNS_SEND_INLINE_SEGS || wqe->byte_count > wqe->inline_segs * SMARTNS_SEND_INLINE_SEG_SIZE))) {
+                SMARTNS_ERROR("thread[%ld] send wqe of qp %u has %u inline bytes in %u segments\n", thread_id, wqe->qpn, wqe->byte_count, wqe->inline_segs);
+                exit(1);
+            }
+            if (unlikely(wqe->num_sge > SMARTNS_MAX_SEND_SGE || (wqe->num_sge > 1 && (wqe->inline_segs || (wqe->opcode != IBV_WR_SEND && wqe->opcode != IBV_WR_RDMA_WRITE))))) {
+                SMARTNS_ERROR("thread[%ld] send wqe of qp %u opcode %u has %u sges and %u inline segments\n", thread_id, wqe->qpn, wqe->opcode, wqe->num_sge, wqe->inline_segs);
+                exit(1);
+            }
+            uint32_t sge_segs = wqe->num_sge > 1 ? (wqe->num_sge + SMARTNS_SEND_SGE_PER_SEG - 1) / SMARTNS_SEND_SGE_PER_SEG : 0;
+            uint32_t slots = 1 + wqe->inline_segs + sge_segs;
+            // a WQE being read may show its owner bit before the rest is
+            // written, and its inline payload or sges may come in a later dma
+            if (datapath_send_wq->pull && datapath_send_wq->pull_ready < slots) {
+                break;
+            }
+            if (wqe->inline_segs && !datapath_send_wq->segs_ready<smartns_send_inline_seg>(wqe->inline_segs)) {
+                break;
+            }
+            if (sge_segs && !datapath_send_wq->segs_ready<smartns_send_sge_seg>(sge_segs)) {
+                break;
+            }
+            if (datapath_send_wq->pull) {
+                datapath_send_wq->pull_ready -= slots;
+            }
 
-            dpu_qp *qp = local_qpn_to_qp_list[wqe->qpn];
-            assert(qp);
+            dpu_qp *qp = lookup_qp(wqe->qpn);
+            if (unlikely(qp == nullptr)) {
+                SMARTNS_WARN("thread[%ld] drop send wqe of unknown qp %u\n", thread_id, wqe->qpn);
+                datapath_send_wq->step_wq(slots);
+                continue;
+            }
 
             dpu_send_wq *send_wq = qp->send_wq;
 
             // ADD to active list
             if (send_wq->is_empty()) {
-                active_qp_list.insert(qp);
+                sched_activate(qp);
             }
 
             dpu_send_wqe *send_wqe = send_wq->get_next_wqe();
@@ -438,6 +1074,21 @@ void datapath_handler::loop_datapath_send_wq() {
             send_wqe->opcode = wqe->opcode;
             send_wqe->cur_pos = wqe->cur_pos;
             send_wqe->is_signal = wqe->is_signal;
+            send_wqe->cqe_reserved = 0;
+            send_wqe->is_inline = wqe->inline_segs != 0;
+            send_wqe->num_sge = sge_segs ? wqe->num_sge : 1;
+            if (wqe->opcode == IBV_WR_ATOMIC_CMP_AND_SWP || wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+                send_wqe->compare_add = wqe->atomic.compare_add;
+                send_wqe->swap = wqe->atomic.swap;
+            }
+            for (uint32_t i = 0, offset = 0;i < wqe->inline_segs;i++, offset += SMARTNS_SEND_INLINE_SEG_SIZE) {
+                memcpy(send_wqe->inline_data + offset, datapath_send_wq->get_seg<smartns_send_inline_seg>(i)->data,
+                    min_t(uint32_t, SMARTNS_SEND_INLINE_SEG_SIZE, wqe->byte_count - offset));
+            }
+            for (uint32_t i = 0, n = 0;i < sge_segs;i++, n += SMARTNS_SEND_SGE_PER_SEG) {
+                memcpy(send_wqe->sge_list + n, datapath_send_wq->get_seg<smartns_send_sge_seg>(i)->sge,
+                    min_t(uint32_t, SMARTNS_SEND_SGE_PER_SEG, wqe->num_sge - n) * sizeof(smartns_send_sge));
+            }
 
             send_wqe->state = dpu_send_wqe_state_posted;
             send_wqe->first_psn = 0;
@@ -445,6 +1096,7 @@ void datapath_handler::loop_datapath_send_wq() {
             send_wqe->cur_pkt_num = 0;
             send_wqe->cur_pkt_offset = 0;
             send_wq->step_head();
+            datapath_send_wq->step_wq(slots);
         }
     }
     active_datapath_send_wq_list_mutex.unlock();
@@ -2,6 +2,33 @@
 #include "gflags_common.h"
 #include "tcp_cm/tcp_cm.h"
 #include "rdma_cm/libr.h"
+#include "rxe/rxe_param.h"
+
+DEFINE_double(rx_drop_rate, 0, "fault injection, probability to drop a received frame");
+
+DEFINE_double(rx_reorder_rate, 0, "fault injection, probability to swap a received frame with the next one");
+
+DEFINE_uint64(retrans_timeout_us, 1000, "retransmit timeout in us, doubled on each consecutive timeout");
+
+DEFINE_string(cc, "none", "congestion control of every QP, none, window (delay based) or rate (ECN based)");
+
+DEFINE_uint64(cc_target_delay_us, RXE_CC_TARGET_DELAY_US, "congestion control, rtt the window algorithm keeps below");
+
+DEFINE_double(cc_line_gbps, RXE_CC_LINE_GBPS, "congestion control, link bandwidth the rate algorithm starts and recovers to");
+
+DEFINE_uint64(sched_quantum, RXE_SCHED_QUANTUM, "bytes a weight 1 QP may send per scheduling round");
+
+DEFINE_uint64(ack_coalesce, RXE_ACK_COALESCE_PKTS, "ack requests a QP answers with one ack, 1 still coalesces within a receive batch");
+
+DEFINE_uint64(ack_delay_us, RXE_ACK_DELAY_US, "longest an ack is held back waiting for more ack requests");
+
+DEFINE_bool(rx_zero_copy, false, "receive single packet sends straight into host recv buffers, set on both ends");
+
+DEFINE_uint64(dma_group_size, SMARTNS_DMA_GROUP_SIZE, "dma qps per datapath thread, payload dmas go to the least loaded one");
+
+DEFINE_string(rx_invalidate, "always", "drop received payloads from the LLC once dmaed to the host, always, never or auto (skip buffers the NIC rewrites while cached)");
+
+DEFINE_uint64(rx_llc_kb, SMARTNS_RX_LLC_KB, "LLC the rx buffers of all datapath threads may take under -rx_invalidate auto");
 
 std::atomic<bool> stop_flag = false;
 
@@ -14,6 +41,7 @@ void server_datapath(datapath_manager *data_manager, datapath_handler *handler)
         handler->loop_datapath_send_wq();
         handler->handle_send();
         handler->handle_recv();
+        handler->handle_timer();
     }
     return;
 }
@@ -85,6 +113,12 @@ void host_controlpath(controlpath_manager *control_manager) {
             case SMARTNS_IOC_MODIFY_QP:
                 control_manager->handle_modify_qp(reinterpret_cast<SMARTNS_MODIFY_QP_PARAMS *>(common_param));
                 break;
+            case SMARTNS_IOC_SET_QP_SCHED:
+                control_manager->handle_set_qp_sched(reinterpret_cast<SMARTNS_SET_QP_SCHED_PARAMS *>(common_param));
+                break;
+            case SMARTNS_IOC_SET_SEND_WQ_PULL:
+                control_manager->handle_set_send_wq_pull(reinterpret_cast<SMARTNS_SET_SEND_WQ_PULL_PARAMS *>(common_param));
+                break;
             default:
                 SMARTNS_ERROR("invalid ioctl cmd %d\n", common_param->cmd);
                 exit(1);
@@ -125,11 +159,44 @@ int main(int argc, char *argv[]) {
 
     controlpath_manager *control_manager = new controlpath_manager(FLAGS_deviceName, FLAGS_numaNode, FLAGS_is_server);
 
-    datapath_manager *data_manager = new datapath_manager(control_manager->global_context, control_manager->global_pd, FLAGS_numaNode, FLAGS_is_server);
+    if (FLAGS_dma_group_size < 1 || FLAGS_dma_group_size > SMARTNS_DMA_MAX_GROUP_SIZE) {
+        SMARTNS_ERROR("dma group size %lu out of [1, %d]", FLAGS_dma_group_size, SMARTNS_DMA_MAX_GROUP_SIZE);
+        exit(1);
+    }
+
+    datapath_manager *data_manager = new datapath_manager(control_manager->global_context, control_manager->global_pd, FLAGS_numaNode, FLAGS_is_server, FLAGS_dma_group_size);
 
     // add datamanager to control manager for qp initial
     control_manager->data_manager = data_manager;
 
+    rxe_cc_algo cc_algo = rxe_cc_parse_algo(FLAGS_cc.c_str());
+    if (cc_algo == RXE_CC_NONE && FLAGS_cc != "none") {
+        SMARTNS_ERROR("unknown congestion control %s", FLAGS_cc.c_str());
+        exit(1);
+    }
+    rx_invalidate_policy invalidate_policy = parse_rx_invalidate_policy(FLAGS_rx_invalidate.c_str());
+    if (invalidate_policy == RX_INVALIDATE_ALWAYS && FLAGS_rx_invalidate != "always") {
+        SMARTNS_ERROR("unknown rx invalidate policy %s", FLAGS_rx_invalidate.c_str());
+        exit(1);
+    }
+
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        datapath_handler &handler = data_manager->datapath_handler_list[i];
+        handler.retrans_timeout_tsc = FLAGS_retrans_timeout_us * 1000 * get_tsc_freq_per_ns();
+        handler.rx_drop_threshold = FLAGS_rx_drop_rate * (1ULL << 32);
+        handler.rx_reorder_threshold = FLAGS_rx_reorder_rate * (1ULL << 32);
+        handler.sched_quantum = FLAGS_sched_quantum;
+        handler.ack_coalesce_pkts = max_t(uint64_t, FLAGS_ack_coalesce, 1);
+        handler.ack_delay_tsc = FLAGS_ack_delay_us * 1000 * get_tsc_freq_per_ns();
+        handler.rx_zero_copy = FLAGS_rx_zero_copy;
+        handler.invalidate_policy = invalidate_policy;
+        handler.invalidate_llc_bytes = FLAGS_rx_llc_kb * 1024 / SMARTNS_TX_RX_CORE;
+        rxe_cc_default_param(&handler.cc_param, cc_algo, get_tsc_freq_per_ns(), handler.cc_param.mtu, FLAGS_cc_line_gbps, FLAGS_cc_target_delay_us);
+    }
+    if (cc_algo != RXE_CC_NONE) {
+        data_manager->set_ecn_capable();
+    }
+
     size_t num_threads = SMARTNS_TX_RX_CORE + SMARTNS_CONTROL_CORE;
     std::vector<std::thread> threads;
     threads.reserve(num_threads);
@@ -154,6 +221,10 @@ int main(int argc, char *argv[]) {
         threads[i].join();
     }
 
+    for (size_t i = 0;i < SMARTNS_TX_RX_CORE;i++) {
+        data_manager->datapath_handler_list[i].print_counters();
+    }
+
     delete data_manager;
     delete control_manager;
     exit(0);
@@ -453,8 +453,10 @@ void init_wr_base_write(qp_handler &qp_handler) {
     ibv_sge *send_sge_list = qp_handler.send_sge_list;
 
     for (int i = 0;i < qp_handler.num_wrs;i++) {
-        send_sge_list[i].addr = qp_handler.buf;
-        send_sge_list[i].lkey = qp_handler.mr->lkey;
+        for (int j = 0;j < qp_handler.num_sges_per_wr;j++) {
+            send_sge_list[i * qp_handler.num_sges_per_wr + j].addr = qp_handler.buf;
+            send_sge_list[i * qp_handler.num_sges_per_wr + j].lkey = qp_handler.mr->lkey;
+        }
         send_wr[i].wr.rdma.remote_addr = qp_handler.remote_buf;
         send_wr[i].wr.rdma.rkey = qp_handler.remote_rkey;
 
@@ -485,8 +487,10 @@ void init_wr_base_read(qp_handler &qp_handler) {
     ibv_sge *send_sge_list = qp_handler.send_sge_list;
 
     for (int i = 0;i < qp_handler.num_wrs;i++) {
-        send_sge_list[i].addr = qp_handler.buf;
-        send_sge_list[i].lkey = qp_handler.mr->lkey;
+        for (int j = 0;j < qp_handler.num_sges_per_wr;j++) {
+            send_sge_list[i * qp_handler.num_sges_per_wr + j].addr = qp_handler.buf;
+            send_sge_list[i * qp_handler.num_sges_per_wr + j].lkey = qp_handler.mr->lkey;
+        }
         send_wr[i].wr.rdma.remote_addr = qp_handler.remote_buf;
         send_wr[i].wr.rdma.rkey = qp_handler.remote_rkey;
 
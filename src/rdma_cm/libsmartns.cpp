@@ -84,7 +84,7 @@ qp_handler *smartns_create_qp_rc(rdma_param &rdma_param, void *buf, size_t size,
     qp_handler->buf = reinterpret_cast<size_t> (buf);
     qp_handler->send_cq = send_cq;
     qp_handler->recv_cq = recv_cq;
-    qp_handler->max_inline_size = rdma_param.max_out_read;
+    qp_handler->max_inline_size = rdma_param.max_inline_size;
     qp_handler->qp = qp;
     qp_handler->pd = pd;
     qp_handler->mr = mr;
@@ -123,6 +123,9 @@ void smartns_post_send(qp_handler &qp_handler, size_t offset, int length) {
     qp_handler.send_sge_list[0].addr = qp_handler.buf + offset;
     qp_handler.send_sge_list[0].length = length;
     qp_handler.send_wr[0].send_flags = IBV_SEND_SIGNALED;
+    if (length <= qp_handler.max_inline_size) {
+        qp_handler.send_wr[0].send_flags |= IBV_SEND_INLINE;
+    }
     qp_handler.send_wr->wr_id = offset;
     qp_handler.send_wr->wr.rdma.remote_addr = qp_handler.remote_buf + offset;
     qp_handler.send_wr->next = NULL;
@@ -133,10 +136,12 @@ void smartns_post_send(qp_handler &qp_handler, size_t offset, int length) {
 void smartns_post_send_batch(qp_handler &qp_handler, int batch_size, offset_handler &handler, int length) {
     assert(batch_size <= qp_handler.num_wrs);
     for (int i = 0;i < batch_size;i++) {
-        qp_handler.send_sge_list[i].addr = qp_handler.buf + handler.offset();
-        qp_handler.send_sge_list[i].length = length;
-        if (length <= qp_handler.max_inline_size) {
-            qp_handler.send_wr[i].send_flags |= IBV_SEND_INLINE;
+        // a payload of several sges is split evenly across them
+        ibv_sge *sge = qp_handler.send_wr[i].sg_list;
+        int piece = length / qp_handler.num_sges_per_wr;
+        for (int j = 0;j < qp_handler.num_sges_per_wr;j++) {
+            sge[j].addr = qp_handler.buf + handler.offset() + j * piece;
+            sge[j].length = j == qp_handler.num_sges_per_wr - 1 ? length - j * piece : piece;
         }
         qp_handler.send_wr[i].wr_id = handler.offset();
         qp_handler.send_wr->wr.rdma.remote_addr = qp_handler.remote_buf + handler.offset();
@@ -146,6 +151,9 @@ void smartns_post_send_batch(qp_handler &qp_handler, int batch_size, offset_hand
         } else {
             qp_handler.send_wr[i].send_flags = 0;
         }
+        if (length <= qp_handler.max_inline_size) {
+            qp_handler.send_wr[i].send_flags |= IBV_SEND_INLINE;
+        }
 
         if (i > 0) {
             qp_handler.send_wr[i - 1].next = &qp_handler.send_wr[i];
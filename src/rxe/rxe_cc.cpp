@@ -0,0 +1,205 @@
+#include "rxe/rxe_cc.h"
+#include "rxe/rxe_param.h"
+#include "log.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+rxe_cc_algo rxe_cc_parse_algo(const char *name) {
+    if (strcmp(name, "window") == 0) {
+        return RXE_CC_WINDOW;
+    } else if (strcmp(name, "rate") == 0) {
+        return RXE_CC_RATE;
+    }
+    return RXE_CC_NONE;
+}
+
+void rxe_cc_default_param(rxe_cc_param *param, rxe_cc_algo algo, double tsc_per_ns, uint32_t mtu, double line_gbps, size_t target_delay_us) {
+    memset(param, 0, sizeof(rxe_cc_param));
+    param->algo = algo;
+    param->mtu = mtu;
+
+    param->min_cwnd = 0.01;
+    param->max_cwnd = RXE_MAX_UNACKED_PSNS;
+    param->ai = 1.0;
+    param->beta = 0.8;
+    param->max_mdf = 0.5;
+    param->target_delay_tsc = target_delay_us * 1000 * tsc_per_ns;
+
+    // Gbps to bytes per tsc
+    param->line_rate = line_gbps / 8 / tsc_per_ns;
+    param->min_rate = param->line_rate / 1000;
+    param->g = 1.0 / 256;
+    param->rai = param->line_rate / 500;
+    param->rhai = param->line_rate / 100;
+    param->fast_recovery_stages = 5;
+    param->rate_timer_tsc = 55 * 1000 * tsc_per_ns;
+    param->alpha_timer_tsc = 55 * 1000 * tsc_per_ns;
+    param->min_decrease_tsc = 50 * 1000 * tsc_per_ns;
+}
+
+void rxe_cc_init(rxe_cc *cc, const rxe_cc_param *param, size_t now) {
+    memset(cc, 0, sizeof(rxe_cc));
+    cc->param = param;
+    cc->next_send_tsc = now;
+    cc->cwnd = param->max_cwnd;
+    cc->rate = param->line_rate;
+    cc->target_rate = param->line_rate;
+    cc->alpha = 1.0;
+    cc->rate_timer_tsc = now + param->rate_timer_tsc;
+    cc->alpha_timer_tsc = now + param->alpha_timer_tsc;
+}
+
+// periods a lazily evaluated timer missed, at most limit
+static size_t timer_periods(size_t *timer, size_t period, size_t now, size_t limit) {
+    if (now < *timer) {
+        return 0;
+    }
+    size_t periods = (now - *timer) / period + 1;
+    *timer += periods * period;
+    return std::min(periods, limit);
+}
+
+// DCQCN alpha decay and rate recovery, run before any rate decision
+static void rate_update(rxe_cc *cc, size_t now) {
+    const rxe_cc_param *param = cc->param;
+
+    size_t periods = timer_periods(&cc->alpha_timer_tsc, param->alpha_timer_tsc, now, 1024);
+    if (periods) {
+        // the period the last cut happened in doesn't decay
+        if (cc->cnp_in_period) {
+            periods--;
+            cc->cnp_in_period = false;
+        }
+        cc->alpha *= pow(1 - param->g, periods);
+    }
+
+    periods = timer_periods(&cc->rate_timer_tsc, param->rate_timer_tsc, now, 64);
+    for (size_t i = 0;i < periods && cc->rate < param->line_rate;i++) {
+        cc->stage++;
+        if (cc->stage > 2 * param->fast_recovery_stages) {
+            cc->target_rate += param->rhai;
+        } else if (cc->stage > param->fast_recovery_stages) {
+            cc->target_rate += param->rai;
+        }
+        cc->target_rate = std::min(cc->target_rate, param->line_rate);
+        cc->rate = (cc->rate + cc->target_rate) / 2;
+    }
+}
+
+static void clamp_cwnd(rxe_cc *cc) {
+    cc->cwnd = std::clamp(cc->cwnd, cc->param->min_cwnd, cc->param->max_cwnd);
+}
+
+bool rxe_cc_can_send(rxe_cc *cc, size_t now, uint32_t inflight) {
+    switch (cc->param->algo) {
+    case RXE_CC_WINDOW:
+        if (cc->cwnd >= 1) {
+            return inflight < static_cast<uint32_t>(cc->cwnd);
+        }
+        return inflight == 0 && now >= cc->next_send_tsc;
+    case RXE_CC_RATE:
+        rate_update(cc, now);
+        return now >= cc->next_send_tsc;
+    default:
+        return true;
+    }
+}
+
+void rxe_cc_on_send(rxe_cc *cc, size_t now, uint32_t bytes) {
+    switch (cc->param->algo) {
+    case RXE_CC_WINDOW:
+        if (cc->cwnd < 1) {
+            cc->next_send_tsc = now + static_cast<size_t>(cc->srtt_tsc / cc->cwnd);
+        }
+        break;
+    case RXE_CC_RATE:
+        // no credit is saved up while idle
+        cc->next_send_tsc = std::max(cc->next_send_tsc, now) + static_cast<size_t>(bytes / cc->rate);
+        break;
+    default:
+        break;
+    }
+}
+
+void rxe_cc_on_ack(rxe_cc *cc, size_t now, uint32_t acked_pkts, size_t rtt_tsc) {
+    const rxe_cc_param *param = cc->param;
+    if (rtt_tsc) {
+        cc->srtt_tsc = cc->srtt_tsc ? (7 * cc->srtt_tsc + rtt_tsc) / 8 : rtt_tsc;
+    }
+
+    switch (param->algo) {
+    case RXE_CC_WINDOW: {
+        size_t delay = rtt_tsc ? rtt_tsc : cc->srtt_tsc;
+        if (delay < param->target_delay_tsc) {
+            if (cc->cwnd >= 1) {
+                cc->cwnd += param->ai * acked_pkts / cc->cwnd;
+            } else {
+                cc->cwnd += param->ai * acked_pkts;
+            }
+        } else if (now - cc->last_decrease_tsc >= cc->srtt_tsc) {
+            double factor = 1 - param->beta * (delay - param->target_delay_tsc) / delay;
+            cc->cwnd *= std::max(factor, 1 - param->max_mdf);
+            cc->last_decrease_tsc = now;
+            SMARTNS_CC("cc window delay %lu cut cwnd to %.3f", delay, cc->cwnd);
+        }
+        clamp_cwnd(cc);
+        break;
+    }
+    case RXE_CC_RATE:
+        rate_update(cc, now);
+        break;
+    default:
+        break;
+    }
+}
+
+void rxe_cc_on_congestion(rxe_cc *cc, size_t now) {
+    const rxe_cc_param *param = cc->param;
+    switch (param->algo) {
+    case RXE_CC_WINDOW:
+        if (now - cc->last_decrease_tsc >= cc->srtt_tsc) {
+            cc->cwnd *= 1 - param->max_mdf;
+            cc->last_decrease_tsc = now;
+            clamp_cwnd(cc);
+            SMARTNS_CC("cc window ecn cut cwnd to %.3f", cc->cwnd);
+        }
+        break;
+    case RXE_CC_RATE:
+        rate_update(cc, now);
+        if (now - cc->last_decrease_tsc >= param->min_decrease_tsc) {
+            cc->target_rate = cc->rate;
+            cc->rate = std::max(cc->rate * (1 - cc->alpha / 2), param->min_rate);
+            cc->alpha = (1 - param->g) * cc->alpha + param->g;
+            cc->stage = 0;
+            cc->cnp_in_period = true;
+            cc->rate_timer_tsc = now + param->rate_timer_tsc;
+            cc->last_decrease_tsc = now;
+            SMARTNS_CC("cc rate cnp cut rate to %.6f alpha %.4f", cc->rate, cc->alpha);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void rxe_cc_on_timeout(rxe_cc *cc, size_t now) {
+    const rxe_cc_param *param = cc->param;
+    switch (param->algo) {
+    case RXE_CC_WINDOW:
+        // timeouts also come from plain loss, cut like a full delay overshoot
+        cc->cwnd *= 1 - param->max_mdf;
+        cc->last_decrease_tsc = now;
+        clamp_cwnd(cc);
+        break;
+    case RXE_CC_RATE:
+        cc->target_rate = cc->rate;
+        cc->rate = std::max(cc->rate / 2, param->min_rate);
+        cc->stage = 0;
+        cc->rate_timer_tsc = now + param->rate_timer_tsc;
+        cc->last_decrease_tsc = now;
+        break;
+    default:
+        break;
+    }
+}
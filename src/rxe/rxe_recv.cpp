@@ -5,6 +5,15 @@
 #include "raw_packet/raw_packet.h"
 #include "smartns.h"
 
+// BECN for the peer if one of its requests arrived CE marked
+static inline uint32_t take_ecn_echo(dpu_recv_wq *recv_wq) {
+    if (likely(!recv_wq->ecn_echo)) {
+        return 0;
+    }
+    recv_wq->ecn_echo = 0;
+    return BTH_BECN_MASK;
+}
+
 void send_ack(datapath_handler *handler, dpu_qp *qp, uint8_t syndrome, uint32_t psn) {
     void *header_addr = handler->txpath_handler->get_next_pktheader_addr();
     struct rxe_bth *bth = reinterpret_cast<rxe_bth *>(reinterpret_cast<size_t>(header_addr) + sizeof(udp_packet));
@@ -13,7 +22,7 @@ void send_ack(datapath_handler *handler, dpu_qp *qp, uint8_t syndrome, uint32_t
     bth->opcode = IB_OPCODE_RC_ACKNOWLEDGE;
     bth->flags = 0;
     bth->pkey = 0xFFFF;
-    bth->qpn = qp->remote_qp_number & BTH_QPN_MASK;
+    bth->qpn = (qp->remote_qp_number & BTH_QPN_MASK) | take_ecn_echo(qp->recv_wq);
     bth->apsn = psn;
 
     rxe_aeth *aeth = reinterpret_cast<rxe_aeth *>(bth + 1);
@@ -22,12 +31,34 @@ void send_ack(datapath_handler *handler, dpu_qp *qp, uint8_t syndrome, uint32_t
     handler->txpath_handler->commit_pkt_without_payload(header_size);
 }
 
+static void send_atomic_ack(datapath_handler *handler, dpu_qp *qp, uint64_t orig, uint32_t psn) {
+    int opcode = IB_OPCODE_RC_ATOMIC_ACKNOWLEDGE;
+    int header_size = rxe_opcode[opcode].length + sizeof(udp_packet);
+    void *header_addr = handler->txpath_handler->get_next_pktheader_addr();
+    struct rxe_bth *bth = reinterpret_cast<rxe_bth *>(reinterpret_cast<size_t>(header_addr) + sizeof(udp_packet));
+
+    bth->opcode = opcode;
+    bth->flags = 0;
+    bth->pkey = 0xFFFF;
+    bth->qpn = (qp->remote_qp_number & BTH_QPN_MASK) | take_ecn_echo(qp->recv_wq);
+    bth->apsn = psn;
+
+    rxe_aeth *aeth = reinterpret_cast<rxe_aeth *>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_AETH]);
+    aeth->smsn = (AETH_SYN_MASK & (AETH_ACK_UNLIMITED << 24)) | (AETH_MSN_MASK & qp->recv_wq->msn);
+    rxe_atmack *atmack = reinterpret_cast<rxe_atmack *>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_ATMACK]);
+    atmack->orig = orig;
+
+    handler->txpath_handler->commit_pkt_without_payload(header_size);
+}
+
 void complete_send_wqe(datapath_handler *handler, dpu_qp *qp, dpu_send_wqe *wqe) {
-    if (wqe->state == dpu_send_wqe_state_pending) {
-        if (psn_compare(wqe->last_psn, qp->recv_wq->psn) >= 0) {
-            qp->recv_wq->psn = (wqe->last_psn + 1) & BTH_PSN_MASK;
-            qp->recv_wq->opcode = -1;
-        }
+    dpu_send_wq *send_wq = qp->send_wq;
+    if (psn_compare(wqe->last_psn, qp->comp_info->psn) >= 0) {
+        qp->comp_info->psn = (wqe->last_psn + 1) & BTH_PSN_MASK;
+        qp->comp_info->opcode = -1;
+    }
+    if (rxe_wqe_is_rd_atomic(wqe)) {
+        send_wq->pending_rd_atomic--;
     }
     bool post = wqe->is_signal;
 
@@ -41,173 +72,1004 @@ void complete_send_wqe(datapath_handler *handler, dpu_qp *qp, dpu_send_wqe *wqe)
         cqe->wqe_counter = wqe->cur_pos;
 
         handler->dma_send_cq_to_host(qp);
+        if (wqe->cqe_reserved) {
+            qp->send_cq->reserved--;
+            wqe->cqe_reserved = 0;
+        }
     }
+    wqe->state = dpu_send_wqe_state_done;
 
-    qp->send_wq->step_tail();
+    // a rewound wqe got acked before being resent, don't send it again
+    if (send_wq->wqe_index == send_wq->tail) {
+        send_wq->step_wqe_index();
+        if (psn_compare(send_wq->psn, wqe->last_psn) <= 0) {
+            send_wq->psn = (wqe->last_psn + 1) & BTH_PSN_MASK;
+        }
+        send_wq->opcode = -1;
+    }
+    send_wq->step_tail();
 }
 
-int rxe_handle_recv(datapath_handler *handler) {
-    int recv = ibv_poll_cq(handler->rxpath_handler->recv_cq, CTX_POLL_BATCH, handler->wc_send_recv);
+// complete wqes up to acked_psn, return false if a read in between is missing responses
+static bool complete_acked_wqes(datapath_handler *handler, dpu_qp *qp, uint32_t acked_psn) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    dpu_comp_info *comp_info = qp->comp_info;
+    while (!send_wq->is_empty()) {
+        dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->tail);
+        // acked beyond the next psn to send, so the posted wqe is a rewound one the responder already has
+        if (send_wqe->state == dpu_send_wqe_state_posted) {
+            if (psn_compare(acked_psn, send_wq->psn) < 0 || psn_compare(acked_psn, send_wqe->last_psn) < 0) {
+                break;
+            }
+            // completed psn stays behind a rewound read or atomic, or its responses are taken for stale ones
+            if (rxe_wqe_is_rd_atomic(send_wqe)) {
+                return false;
+            }
+            complete_send_wqe(handler, qp, send_wqe);
+            continue;
+        }
+        if (psn_compare(acked_psn, send_wqe->last_psn) < 0) {
+            break;
+        }
+        // responses are sent before any later ack, so the read or atomic lost its response
+        if (rxe_wqe_is_rd_atomic(send_wqe)) {
+            if (!comp_info->resp_gap_rewind) {
+                comp_info->resp_gap_rewind = 1;
+                rxe_rewind_send_wq(handler, qp, comp_info->psn);
+            }
+            return false;
+        }
+        complete_send_wqe(handler, qp, send_wqe);
+    }
+    return true;
+}
 
-    uint32_t ack_pkt_num = 0;
-    for (int i = 0;i < recv;i++) {
-        if (handler->wc_send_recv[i].status != IBV_WC_SUCCESS || handler->wc_send_recv[i].opcode != IBV_WC_RECV) {
-            fprintf(stderr, "Recv error %d\n", handler->wc_send_recv[i].status);
-            exit(1);
+// ack progress, restart the retransmit timer and feed congestion control
+static void comp_progress(datapath_handler *handler, dpu_qp *qp, uint32_t prev_comp_psn) {
+    dpu_comp_info *comp_info = qp->comp_info;
+    dpu_send_wq *send_wq = qp->send_wq;
+    if (comp_info->psn == prev_comp_psn) {
+        return;
+    }
+    comp_info->timeout = 0;
+    comp_info->deadline = 0;
+    comp_info->resp_gap_rewind = 0;
+    if (rxe_cc_enabled(&send_wq->cc)) {
+        size_t now = get_tsc();
+        size_t rtt = 0;
+        if (send_wq->rtt_probe_tsc && psn_compare(comp_info->psn, send_wq->rtt_probe_psn) > 0) {
+            rtt = now - send_wq->rtt_probe_tsc;
+            send_wq->rtt_probe_tsc = 0;
         }
-        struct rxe_bth *bth = reinterpret_cast<struct rxe_bth *>(handler->wc_send_recv[i].wr_id + sizeof(udp_packet));
-        uint8_t opcode = bth->opcode;
-        uint32_t psn = BTH_PSN_MASK & bth->apsn;
-        uint32_t local_qpn = bth->qpn & BTH_QPN_MASK;
-        dpu_qp *qp = handler->local_qpn_to_qp_list[local_qpn];
-        assert(qp);
-
-        int mask = rxe_opcode[opcode].mask;
-
-        if (mask & RXE_REQ_MASK) {
-            uint32_t payload_size = handler->wc_send_recv[i].byte_len - sizeof(udp_packet) - rxe_opcode[opcode].offset[RXE_PAYLOAD];
-            int diff = psn_compare(psn, qp->recv_wq->psn);
-            if (diff > 0) {
-                SMARTNS_INFO("thread[%ld] Recv out of order psn %u, want %u, send nak\n", handler->thread_id, psn, qp->recv_wq->psn);
-                if (qp->recv_wq->sent_psn_nak == 1) {
-                    continue;
-                }
-                qp->recv_wq->sent_psn_nak = 1;
-                send_ack(handler, qp, AETH_NAK_PSN_SEQ_ERROR, qp->recv_wq->psn);
-                continue;
-            } else if (diff < 0) {
-                uint32_t prev_psn = (qp->recv_wq->ack_psn - 1) & BTH_PSN_MASK;
-                if (mask & RXE_SEND_MASK || mask & RXE_WRITE_MASK) {
-                    SMARTNS_INFO("Recv duplicate packet psn %u, send ack\n", psn);
-                    send_ack(handler, qp, AETH_ACK_UNLIMITED, prev_psn);
-                    continue;
-                } else {
-                    fprintf(stderr, "TODO waiting for implementation\n");
-                    assert(false);
+        rxe_cc_on_ack(&send_wq->cc, now, (comp_info->psn - prev_comp_psn) & BTH_PSN_MASK, rtt);
+    }
+    if (psn_compare(qp->send_wq->psn, comp_info->psn) > 0) {
+        rxe_arm_retrans_timer(handler, qp, get_tsc());
+    }
+}
+
+static inline rxe_bth *rx_bth(datapath_handler *handler, uint64_t pkt_buf) {
+    return reinterpret_cast<rxe_bth *>(handler->rxpath_handler->frame_hdr(pkt_buf) + sizeof(udp_packet));
+}
+
+// extension header or payload of a received frame, they aren't next to the bth under header split
+static inline char *rx_field(datapath_handler *handler, uint64_t pkt_buf, uint8_t opcode, rxe_hdr_type type) {
+    return reinterpret_cast<char *>(handler->rxpath_handler->frame_data(pkt_buf)) + rxe_opcode[opcode].offset[type] - RXE_BTH_BYTES;
+}
+
+static void handle_read_resp(datapath_handler *handler, dpu_qp *qp, rxe_bth *bth, uint64_t pkt_buf, uint32_t byte_len) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    dpu_comp_info *comp_info = qp->comp_info;
+    uint8_t opcode = bth->opcode;
+    uint32_t psn = BTH_PSN_MASK & bth->apsn;
+    uint32_t prev_comp_psn = comp_info->psn;
+
+    // response to a request we already sent again
+    if (psn_compare(psn, comp_info->psn) < 0) {
+        return;
+    }
+    if (!complete_acked_wqes(handler, qp, (psn - 1) & BTH_PSN_MASK)) {
+        return;
+    }
+    // compared after the writes and sends before the read completed
+    if (psn_compare(psn, comp_info->psn) > 0 || send_wq->is_empty()) {
+        // lost earlier responses, ask for the rest of the read again
+        comp_progress(handler, qp, prev_comp_psn);
+        if (!comp_info->resp_gap_rewind) {
+            comp_info->resp_gap_rewind = 1;
+            rxe_rewind_send_wq(handler, qp, comp_info->psn);
+        }
+        return;
+    }
+
+    dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->tail);
+    if (send_wqe->opcode != IBV_WR_RDMA_READ) {
+        SMARTNS_ERROR("qp %lu recv read response psn %u without read request", qp->qp_number, psn);
+        exit(1);
+    }
+    // stale response of a read rewound to be requested again
+    if (send_wqe->state == dpu_send_wqe_state_posted) {
+        return;
+    }
+    uint32_t payload_size = byte_len - sizeof(udp_packet) - rxe_opcode[opcode].offset[RXE_PAYLOAD];
+    uint64_t offset = static_cast<uint64_t>((psn - send_wqe->first_psn) & BTH_PSN_MASK) * qp->mtu;
+    assert(offset + payload_size <= send_wqe->byte_count);
+    if (payload_size) {
+        handler->post_payload_dma(send_wqe->local_lkey, send_wqe->local_addr + offset,
+            reinterpret_cast<uint64_t>(rx_field(handler, pkt_buf, opcode, RXE_PAYLOAD)), pkt_buf, payload_size);
+    }
+
+    comp_info->psn = (psn + 1) & BTH_PSN_MASK;
+    comp_info->opcode = opcode;
+    if (psn == send_wqe->last_psn) {
+        complete_send_wqe(handler, qp, send_wqe);
+    }
+    comp_progress(handler, qp, prev_comp_psn);
+}
+
+static void handle_atomic_ack(datapath_handler *handler, dpu_qp *qp, rxe_bth *bth, uint64_t pkt_buf) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    dpu_comp_info *comp_info = qp->comp_info;
+    uint32_t psn = BTH_PSN_MASK & bth->apsn;
+    uint32_t prev_comp_psn = comp_info->psn;
+
+    if (psn_compare(psn, comp_info->psn) < 0) {
+        return;
+    }
+    if (!complete_acked_wqes(handler, qp, (psn - 1) & BTH_PSN_MASK)) {
+        return;
+    }
+    // stale ack of an atomic rewound to be requested again
+    dpu_send_wqe *send_wqe = send_wq->is_empty() ? nullptr : send_wq->get_wqe(send_wq->tail);
+    if (send_wqe == nullptr || send_wqe->state == dpu_send_wqe_state_posted || send_wqe->first_psn != psn) {
+        comp_progress(handler, qp, prev_comp_psn);
+        return;
+    }
+    if (send_wqe->opcode != IBV_WR_ATOMIC_CMP_AND_SWP && send_wqe->opcode != IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        SMARTNS_ERROR("qp %lu recv atomic ack psn %u without atomic request", qp->qp_number, psn);
+        exit(1);
+    }
+
+    rxe_atmack *atmack = reinterpret_cast<rxe_atmack *>(rx_field(handler, pkt_buf, bth->opcode, RXE_ATMACK));
+    handler->dma_handler->post_atomic_result(send_wqe->local_lkey, send_wqe->local_addr, atmack->orig);
+    complete_send_wqe(handler, qp, send_wqe);
+    comp_progress(handler, qp, prev_comp_psn);
+}
+
+static ibv_wc_status nak_wc_status(uint8_t syn) {
+    switch (syn) {
+    case AETH_NAK_INVALID_REQ:
+        return IBV_WC_REM_INV_REQ_ERR;
+    case AETH_NAK_REM_ACC_ERR:
+        return IBV_WC_REM_ACCESS_ERR;
+    case AETH_NAK_INV_RD_REQ:
+        return IBV_WC_REM_INV_RD_REQ_ERR;
+    default:
+        return IBV_WC_REM_OP_ERR;
+    }
+}
+
+// the request at psn was refused, those before it executed even if a rewind
+// put them up for sending again. A read or atomic still missing its response
+// is flushed with the rest
+static void handle_fatal_nak(datapath_handler *handler, dpu_qp *qp, uint8_t syn, uint32_t psn) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    handler->counters.access_nak_recv++;
+    SMARTNS_WARN("qp %lu recv nak syndrome 0x%x psn %u\n", qp->qp_number, syn, psn);
+    while (!send_wq->is_empty()) {
+        dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->tail);
+        if (psn_compare(psn, send_wqe->last_psn) <= 0 || rxe_wqe_is_rd_atomic(send_wqe)) {
+            break;
+        }
+        complete_send_wqe(handler, qp, send_wqe);
+    }
+    rxe_fail_send_wq(handler, qp, nak_wc_status(syn), psn);
+}
+
+static void handle_ack(datapath_handler *handler, dpu_qp *qp, uint64_t pkt_buf, uint8_t opcode, uint32_t psn) {
+    dpu_comp_info *comp_info = qp->comp_info;
+    int mask = rxe_opcode[opcode].mask;
+    uint32_t prev_comp_psn = comp_info->psn;
+
+    assert(opcode == IB_OPCODE_RC_ACKNOWLEDGE);
+    rxe_aeth *aeth = reinterpret_cast<rxe_aeth *>(rx_field(handler, pkt_buf, opcode, RXE_AETH));
+    uint8_t syn = (AETH_SYN_MASK & aeth->smsn) >> 24;
+    uint32_t acked_psn = psn;
+    switch (syn & AETH_TYPE_MASK) {
+    case AETH_ACK:
+        break;
+    case AETH_NAK:
+        if (syn != AETH_NAK_PSN_SEQ_ERROR) {
+            handle_fatal_nak(handler, qp, syn, psn);
+            return;
+        }
+        // nak carries the first psn the responder is missing
+        acked_psn = (psn - 1) & BTH_PSN_MASK;
+        break;
+    default:
+        SMARTNS_ERROR("qp %lu recv unsupported aeth syndrome 0x%x\n", qp->qp_number, syn);
+        exit(1);
+    }
+
+    // everything up to acked_psn arrived, wqes rewound by a spurious timeout complete as well
+    if (!complete_acked_wqes(handler, qp, acked_psn)) {
+        comp_progress(handler, qp, prev_comp_psn);
+        return;
+    }
+
+    if (psn_compare((acked_psn + 1) & BTH_PSN_MASK, comp_info->psn) > 0) {
+        comp_info->psn = (acked_psn + 1) & BTH_PSN_MASK;
+        comp_info->opcode = (mask & RXE_END_MASK) ? -1 : opcode;
+    }
+    comp_progress(handler, qp, prev_comp_psn);
+
+    if (syn == AETH_NAK_PSN_SEQ_ERROR) {
+        handler->counters.nak_recv++;
+        SMARTNS_REORDER("thread[%ld] qp %lu recv nak psn %u", handler->thread_id, qp->qp_number, psn);
+        rxe_rewind_send_wq(handler, qp, psn);
+    }
+}
+
+// take a response resource for a read or atomic starting at psn, nullptr if none is left
+static rxe_resp_res *alloc_resp_res(datapath_handler *handler, dpu_qp *qp, int opcode, uint32_t psn) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    if (recv_wq->res_head - recv_wq->res_tail >= RXE_MAX_RESP_RES) {
+        return nullptr;
+    }
+
+    rxe_resp_res *res = &recv_wq->resp_res[recv_wq->res_head % RXE_MAX_RESP_RES];
+    res->opcode = opcode;
+    res->offset = 0;
+    res->first_psn = psn;
+    res->cur_psn = psn;
+    res->atomic_state = rxe_atomic_state_done;
+    handler->dma_handler->take_fence(&res->fence);
+    recv_wq->res_head++;
+
+    handler->sched_activate(qp);
+    return res;
+}
+
+static void queue_read_resp(rxe_resp_res *res, uint32_t rkey, uint64_t va, uint32_t length) {
+    res->va = va;
+    res->rkey = rkey;
+    res->length = length;
+}
+
+// an atomic is cached before it executed, progress_atomic fills in its result
+static void cache_resp(dpu_qp *qp, int opcode, uint32_t psn, uint32_t num_pkts, uint32_t rkey, uint64_t va, uint32_t length) {
+    rxe_resp_cache *entry = &qp->recv_wq->res_cache[qp->recv_wq->cache_head % RXE_MAX_RESP_RES];
+    entry->first_psn = psn;
+    entry->last_psn = (psn + num_pkts - 1) & BTH_PSN_MASK;
+    entry->opcode = opcode;
+    entry->length = length;
+    entry->va = va;
+    entry->rkey = rkey;
+    entry->atomic_orig = 0;
+    entry->atomic_pending = opcode != IB_OPCODE_RC_RDMA_READ_REQUEST;
+    qp->recv_wq->cache_head++;
+}
+
+static rxe_resp_cache *find_resp_cache(dpu_recv_wq *recv_wq, uint32_t psn) {
+    uint32_t cached = min_t(uint32_t, recv_wq->cache_head, RXE_MAX_RESP_RES);
+    for (uint32_t i = 1;i <= cached;i++) {
+        rxe_resp_cache *entry = &recv_wq->res_cache[(recv_wq->cache_head - i) % RXE_MAX_RESP_RES];
+        if (psn_compare(psn, entry->first_psn) >= 0 && psn_compare(psn, entry->last_psn) <= 0) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+// answer a duplicate read or atomic from the responder resources, the requester
+// may ask for the tail of a read only, an atomic is never executed twice
+static void replay_resp(datapath_handler *handler, dpu_qp *qp, int opcode, uint32_t psn) {
+    // a response refused after its MR went away, the nak may have been lost
+    if (unlikely(qp->recv_wq->access_nak)) {
+        handler->counters.access_nak_sent++;
+        send_ack(handler, qp, qp->recv_wq->access_nak, psn);
+        return;
+    }
+    rxe_resp_cache *entry = find_resp_cache(qp->recv_wq, psn);
+    // an atomic still executing answers the duplicate once it is done
+    if (entry == nullptr || entry->opcode != opcode || entry->atomic_pending) {
+        // older than any resource we keep, the requester can't be waiting for it
+        handler->counters.dup_drop++;
+        return;
+    }
+    uint32_t offset = ((psn - entry->first_psn) & BTH_PSN_MASK) * qp->mtu;
+    rxe_resp_res *res = offset <= entry->length ? alloc_resp_res(handler, qp, opcode, psn) : nullptr;
+    if (res == nullptr) {
+        handler->counters.dup_drop++;
+        return;
+    }
+    if (opcode == IB_OPCODE_RC_RDMA_READ_REQUEST) {
+        queue_read_resp(res, entry->rkey, entry->va + offset, entry->length - offset);
+    } else {
+        res->atomic_orig = entry->atomic_orig;
+    }
+    handler->counters.dup_replay++;
+}
+
+// the QP's sends go the staged path for a while, longer if arming didn't pay off
+static void zc_fall_back(datapath_handler *handler, dpu_qp *qp, size_t now) {
+    rxe_zc_rq *zc = qp->recv_wq->zc;
+    handler->zc_disarm(qp);
+    zc->backoff = zc->hit ? 0 : min_t(uint8_t, zc->backoff + 1, RXE_ZC_MAX_BACKOFF);
+    zc->rearm_tsc = now + (handler->zc_rearm_tsc << zc->backoff);
+}
+
+// drop the early packets held, the QP won't execute them
+static void reorder_release(datapath_handler *handler, dpu_qp *qp) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    for (uint32_t i = 0;i < RXE_REORDER_WINDOW && recv_wq->reorder_cnt;i++) {
+        rxe_reorder_slot *slot = &recv_wq->reorder_buf[i];
+        if (slot->pkt_buf) {
+            handler->rxpath_handler->release_recv_buffer(slot->pkt_buf);
+            slot->pkt_buf = 0;
+            recv_wq->reorder_cnt--;
+            handler->rxpath_handler->held_buffers--;
+        }
+    }
+}
+
+// lkey of the MR [va, va + len) of a remote request falls in, false if the rkey is
+// unknown, registered on another pd or doesn't grant access
+static bool check_rkey(datapath_handler *handler, dpu_qp *qp, uint32_t rkey, uint64_t va, uint32_t len, unsigned int access, uint32_t *host_lkey) {
+    bool ok = false;
+    handler->mr_list_mutex.lock();
+    auto it = qp->dpu_ctx->mr_list.find(rkey);
+    if (it != qp->dpu_ctx->mr_list.end() && it->second != nullptr) {
+        dpu_mr *mr = it->second;
+        uint64_t start = reinterpret_cast<uint64_t>(mr->devx_mr->addr);
+        ok = mr->dpu_pd == qp->dpu_pd && (mr->access & access) == access &&
+            va >= start && va - start <= mr->devx_mr->length && len <= mr->devx_mr->length - (va - start);
+        *host_lkey = mr->devx_mr->lkey;
+    }
+    handler->mr_list_mutex.unlock();
+    return ok;
+}
+
+// the nak syndrome a request is refused with, 0 if it may execute on *host_lkey
+static uint8_t check_req_access(datapath_handler *handler, dpu_qp *qp, uint8_t opcode, uint64_t pkt_buf, uint32_t payload_size, uint32_t *host_lkey) {
+    int mask = rxe_opcode[opcode].mask;
+    if (mask & RXE_ATOMIC_MASK) {
+        rxe_atmeth *atmeth = reinterpret_cast<rxe_atmeth *>(rx_field(handler, pkt_buf, opcode, RXE_ATMETH));
+        if (atmeth->va & (sizeof(uint64_t) - 1)) {
+            return AETH_NAK_INVALID_REQ;
+        }
+        return check_rkey(handler, qp, atmeth->rkey, atmeth->va, sizeof(uint64_t), IBV_ACCESS_REMOTE_ATOMIC, host_lkey) ? 0 : AETH_NAK_REM_ACC_ERR;
+    }
+    if (!(mask & (RXE_READ_MASK | RXE_WRITE_MASK))) {
+        return 0;
+    }
+    if (!(mask & RXE_RETH_MASK)) {
+        return payload_size > qp->recv_wq->resid ? AETH_NAK_INVALID_REQ : 0;
+    }
+    rxe_reth *reth = reinterpret_cast<rxe_reth *>(rx_field(handler, pkt_buf, opcode, RXE_RETH));
+    if (payload_size > reth->len) {
+        return AETH_NAK_INVALID_REQ;
+    }
+    // a zero length read or write touches no memory, its rkey isn't checked
+    if (reth->len == 0) {
+        *host_lkey = 0;
+        return 0;
+    }
+    unsigned int access = (mask & RXE_READ_MASK) ? IBV_ACCESS_REMOTE_READ : IBV_ACCESS_REMOTE_WRITE;
+    return check_rkey(handler, qp, reth->rkey, reth->va, reth->len, access, host_lkey) ? 0 : AETH_NAK_REM_ACC_ERR;
+}
+
+// execute an in order request packet, psn must equal recv_wq->psn. pkt_buf is 0
+// for a single packet send the NIC already scattered into the host recv WQE
+static bool execute_req(datapath_handler *handler, dpu_qp *qp, rxe_bth *bth, uint64_t pkt_buf, uint32_t byte_len) {
+    uint8_t opcode = bth->opcode;
+    uint32_t psn = BTH_PSN_MASK & bth->apsn;
+    int mask = rxe_opcode[opcode].mask;
+    uint32_t payload_size = byte_len - sizeof(udp_packet) - rxe_opcode[opcode].offset[RXE_PAYLOAD];
+
+    // the refused request sent again, the nak may have been lost
+    if (unlikely(qp->recv_wq->access_nak)) {
+        handler->counters.access_nak_sent++;
+        send_ack(handler, qp, qp->recv_wq->access_nak, psn);
+        return true;
+    }
+    // the host hasn't made room for the completion, the requester sends it again
+    if ((mask & RXE_COMP_MASK) && !handler->cq_has_room(qp->recv_cq, 1)) {
+        handler->counters.cq_full++;
+        return false;
+    }
+    // refused without executing or moving psn, both QPs go to error
+    uint32_t host_lkey = 0;
+    uint8_t syndrome = check_req_access(handler, qp, opcode, pkt_buf, payload_size, &host_lkey);
+    if (unlikely(syndrome)) {
+        handler->counters.access_nak_sent++;
+        send_ack(handler, qp, syndrome, psn);
+        qp->recv_wq->access_nak = syndrome;
+        reorder_release(handler, qp);
+        return true;
+    }
+
+    // a read takes one psn per response packet
+    uint32_t num_pkts = 1;
+    if (mask & RXE_READ_MASK) {
+        rxe_reth *reth = reinterpret_cast<rxe_reth *>(rx_field(handler, pkt_buf, opcode, RXE_RETH));
+        rxe_resp_res *res = alloc_resp_res(handler, qp, opcode, psn);
+        if (res == nullptr) {
+            return false;
+        }
+        queue_read_resp(res, reth->rkey, reth->va, reth->len);
+        num_pkts = max_t(uint32_t, (reth->len + qp->mtu - 1) / qp->mtu, 1);
+        cache_resp(qp, opcode, psn, num_pkts, reth->rkey, reth->va, reth->len);
+    } else if (mask & RXE_ATOMIC_MASK) {
+        rxe_atmeth *atmeth = reinterpret_cast<rxe_atmeth *>(rx_field(handler, pkt_buf, opcode, RXE_ATMETH));
+        rxe_resp_res *res = alloc_resp_res(handler, qp, opcode, psn);
+        if (res == nullptr) {
+            return false;
+        }
+        // executed by rxe_handle_resp without waiting for the host
+        res->va = atmeth->va;
+        res->rkey = atmeth->rkey;
+        res->compare_add = opcode == IB_OPCODE_RC_COMPARE_SWAP ? atmeth->comp : atmeth->swap_add;
+        res->swap = opcode == IB_OPCODE_RC_COMPARE_SWAP ? atmeth->swap_add : 0;
+        res->atomic_state = rxe_atomic_state_lock;
+        cache_resp(qp, opcode, psn, 1, atmeth->rkey, atmeth->va, sizeof(uint64_t));
+    }
+
+    if (qp->recv_wq->sent_psn_nak) {
+        qp->recv_wq->sent_psn_nak = 0;
+    }
+    if (mask & RXE_WRITE_MASK) {
+        rxe_reth *reth = reinterpret_cast<rxe_reth *>(rx_field(handler, pkt_buf, opcode, RXE_RETH));
+        if (mask & RXE_RETH_MASK) {
+            qp->recv_wq->host_va = reth->va;
+            qp->recv_wq->offset = 0;
+            qp->recv_wq->host_rkey = reth->rkey;
+            qp->recv_wq->byte_count = reth->len;
+            qp->recv_wq->resid = reth->len;
+            qp->recv_wq->host_lkey = host_lkey;
+        }
+    }
+
+    // a zero-copy WQE may target the host recv WQE this fills
+    if (unlikely(qp->recv_wq->zc && qp->recv_wq->zc->armed && pkt_buf && (mask & (RXE_SEND_MASK | RXE_COMP_MASK)))) {
+        zc_fall_back(handler, qp, get_tsc());
+    }
+
+    // execute the operation
+    if (mask & RXE_SEND_MASK && !pkt_buf) {
+        qp->recv_wq->now_total_dma_byte += payload_size;
+    } else if (mask & RXE_SEND_MASK) {
+        handler->dma_send_payload_to_host(qp, reinterpret_cast<uint64_t>(rx_field(handler, pkt_buf, opcode, RXE_PAYLOAD)), pkt_buf, payload_size);
+    } else if ((mask & RXE_WRITE_MASK) && payload_size) {
+        handler->dma_write_payload_to_host(qp, reinterpret_cast<uint64_t>(rx_field(handler, pkt_buf, opcode, RXE_PAYLOAD)), pkt_buf, payload_size);
+    }
+
+    qp->recv_wq->psn = (psn + num_pkts) & BTH_PSN_MASK;
+    qp->recv_wq->ack_psn = qp->recv_wq->psn;
+    qp->recv_wq->opcode = opcode;
+
+    if (mask & RXE_COMP_MASK) {
+        qp->recv_wq->msn++;
+        smartns_cqe *cqe = qp->recv_cq->get_next_cqe();
+        cqe->byte_count = qp->recv_wq->now_total_dma_byte;
+        cqe->cq_opcode = MLX5_CQE_RESP_SEND;
+        cqe->mlx5_opcode = 0;
+        cqe->op_own = qp->recv_cq->own_flag;
+        cqe->qpn = qp->qp_number;
+        cqe->wqe_counter = qp->recv_wq->head;
+
+        handler->dma_recv_cq_to_host(qp);
+    }
+
+    if (mask & RXE_READ_OR_ATOMIC) {
+        return true;
+    }
+    if (bth->apsn & BTH_ACK_MASK) {
+        qp->recv_wq->ack_owed++;
+        // decided on when the whole batch is processed
+        if (!qp->recv_wq->ack_pending) {
+            qp->recv_wq->ack_pending = 1;
+            handler->ack_pending_qps[handler->ack_pending_cnt++] = qp;
+        }
+    }
+    return true;
+}
+
+// hold an early packet until the hole before it is filled, return false if it doesn't fit
+static bool reorder_insert(datapath_handler *handler, dpu_qp *qp, uint64_t pkt_buf, uint32_t byte_len, uint32_t psn) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    uint32_t distance = (psn - recv_wq->psn) & BTH_PSN_MASK;
+    if (distance >= RXE_REORDER_WINDOW || !handler->rxpath_handler->can_hold_recv_buffer()) {
+        handler->counters.reorder_overflow++;
+        return false;
+    }
+
+    rxe_reorder_slot *slot = &recv_wq->reorder_buf[psn & (RXE_REORDER_WINDOW - 1)];
+    if (slot->pkt_buf) {
+        // retransmitted copy of a packet we already hold
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+    } else {
+        slot->pkt_buf = pkt_buf;
+        slot->byte_len = byte_len;
+        slot->psn = psn;
+        recv_wq->reorder_cnt++;
+        handler->rxpath_handler->held_buffers++;
+        handler->counters.reorder_buffered++;
+    }
+
+    // too many packets behind the hole, more likely a loss than a reorder
+    if (recv_wq->reorder_cnt >= RXE_REORDER_NAK_THRESHOLD && !recv_wq->sent_psn_nak) {
+        recv_wq->sent_psn_nak = 1;
+        handler->counters.nak_sent++;
+        send_ack(handler, qp, AETH_NAK_PSN_SEQ_ERROR, recv_wq->psn);
+    }
+    return true;
+}
+
+static void reorder_drain(datapath_handler *handler, dpu_qp *qp) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    while (recv_wq->reorder_cnt) {
+        rxe_reorder_slot *slot = &recv_wq->reorder_buf[recv_wq->psn & (RXE_REORDER_WINDOW - 1)];
+        if (!slot->pkt_buf) {
+            return;
+        }
+        assert(slot->psn == recv_wq->psn);
+        uint64_t pkt_buf = slot->pkt_buf;
+        slot->pkt_buf = 0;
+        recv_wq->reorder_cnt--;
+        handler->rxpath_handler->held_buffers--;
+        handler->counters.reorder_drained++;
+
+        bool done = execute_req(handler, qp, rx_bth(handler, pkt_buf), pkt_buf, slot->byte_len);
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+        if (!done) {
+            return;
+        }
+    }
+}
+
+// requests marked CE are echoed to the peer, responses marked CE or carrying BECN slow us down
+static inline void check_congestion(datapath_handler *handler, dpu_qp *qp, udp_packet *packet, rxe_bth *bth, int mask) {
+    bool ce = (packet->ip_hdr.type_of_service & IP_ECN_MASK) == IP_ECN_CE;
+    if (mask & RXE_REQ_MASK) {
+        if (unlikely(ce)) {
+            handler->counters.ecn_marked++;
+            qp->recv_wq->ecn_echo = 1;
+        }
+        return;
+    }
+    if (unlikely(bth->qpn & BTH_BECN_MASK || (ce && (mask & RXE_PAYLOAD_MASK)))) {
+        handler->counters.cnp_recv++;
+        rxe_cc_on_congestion(&qp->send_wq->cc, get_tsc());
+    }
+}
+
+// one cumulative ack for everything executed so far, answers every owed ack request
+static void send_coalesced_ack(datapath_handler *handler, dpu_qp *qp) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    if (recv_wq->ack_owed > 1) {
+        handler->counters.ack_coalesced += recv_wq->ack_owed - 1;
+    }
+    recv_wq->ack_owed = 0;
+    recv_wq->ack_deadline_tsc = 0;
+    if (recv_wq->res_head != recv_wq->res_tail) {
+        recv_wq->ack_deferred = 1;
+    } else {
+        send_ack(handler, qp, AETH_ACK_UNLIMITED, (recv_wq->ack_psn - 1) & BTH_PSN_MASK);
+    }
+}
+
+// QPs owing at least ack_coalesce_pkts acks send one now, the others within the ack delay
+static void flush_pending_acks(datapath_handler *handler) {
+    size_t now = 0;
+    for (size_t i = 0;i < handler->ack_pending_cnt;i++) {
+        dpu_qp *qp = handler->ack_pending_qps[i];
+        dpu_recv_wq *recv_wq = qp->recv_wq;
+        recv_wq->ack_pending = 0;
+        if (recv_wq->ack_owed >= handler->ack_coalesce_pkts) {
+            send_coalesced_ack(handler, qp);
+        } else if (recv_wq->ack_deadline_tsc == 0) {
+            now = now ? now : get_tsc();
+            recv_wq->ack_deadline_tsc = now + handler->ack_delay_tsc;
+            if (!recv_wq->ack_timer_queued) {
+                recv_wq->ack_timer_queued = 1;
+                handler->ack_timer.schedule(qp->qp_number, recv_wq->ack_deadline_tsc);
+            }
+        }
+    }
+    handler->ack_pending_cnt = 0;
+}
+
+void rxe_handle_ack_timer(datapath_handler *handler, dpu_qp *qp, size_t now) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    recv_wq->ack_timer_queued = 0;
+    // the ack went out with an earlier batch
+    if (recv_wq->ack_deadline_tsc == 0) {
+        return;
+    }
+    if (now < recv_wq->ack_deadline_tsc) {
+        recv_wq->ack_timer_queued = 1;
+        handler->ack_timer.schedule(qp->qp_number, recv_wq->ack_deadline_tsc);
+        return;
+    }
+    handler->counters.ack_delay_fired++;
+    send_coalesced_ack(handler, qp);
+}
+
+// a zero-copy completion, headers are in the WQE's slot and the payload in the
+// host recv WQE it targeted. It's a hit if that is the WQE an in order single
+// packet send fills, anything else falls back to the staged path and is
+// delivered again by retransmission
+static void zc_recv(datapath_handler *handler, dpu_qp *qp, uint32_t slot, ibv_wc *wc) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    rxe_zc_rq *zc = recv_wq->zc;
+    udp_packet *packet = reinterpret_cast<udp_packet *>(zc->buf + slot * SMARTNS_RX_HDR_SLOT);
+    rxe_bth *bth = reinterpret_cast<rxe_bth *>(packet + 1);
+    uint8_t opcode = bth->opcode;
+    uint32_t psn = BTH_PSN_MASK & bth->apsn;
+    uint32_t payload_size = wc->byte_len - rxpath_handler::hdr_split_bytes;
+    int diff = psn_compare(psn, recv_wq->psn);
+
+    if (wc->status == IBV_WC_SUCCESS && opcode == IB_OPCODE_RC_SEND_ONLY && (bth->qpn & BTH_QPN_MASK) == qp->qp_number) {
+        if (diff == 0 && zc->target[slot] == recv_wq->wqe_seq && payload_size <= zc->host_len[slot]) {
+            handler->counters.zc_hit++;
+            zc->hit = 1;
+            check_congestion(handler, qp, packet, bth, rxe_opcode[opcode].mask);
+            if (!execute_req(handler, qp, bth, 0, wc->byte_len)) {
+                // recv cq full, the slot is used up and the retransmission goes the staged path
+                zc_fall_back(handler, qp, get_tsc());
+                if (!recv_wq->sent_psn_nak) {
+                    recv_wq->sent_psn_nak = 1;
+                    handler->counters.nak_sent++;
+                    send_ack(handler, qp, AETH_NAK_PSN_SEQ_ERROR, recv_wq->psn);
                 }
+                return;
             }
-            if (qp->recv_wq->sent_psn_nak) {
-                qp->recv_wq->sent_psn_nak = 0;
+            if (unlikely(recv_wq->reorder_cnt)) {
+                reorder_drain(handler, qp);
             }
-            if (mask & (RXE_READ_MASK | RXE_WRITE_MASK)) {
-                rxe_reth *reth = reinterpret_cast<rxe_reth *>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_RETH]);
-                if (mask & RXE_RETH_MASK) {
-                    qp->recv_wq->host_va = reth->va;
-                    qp->recv_wq->offset = 0;
-                    qp->recv_wq->host_rkey = reth->rkey;
-                    qp->recv_wq->byte_count = reth->len;
-                    qp->recv_wq->resid = reth->len;
-                    qp->recv_wq->mr = qp->dpu_ctx->mr_list[reth->rkey];
-                    assert(qp->recv_wq->mr);
+            // out of host recv WQEs to target, the next send would be dropped by the NIC
+            if (zc->armed && zc->posted - zc->done <= SMARTNS_RX_ZC_DEPTH / 2) {
+                handler->zc_refill(qp);
+                if (zc->posted == zc->done) {
+                    zc_fall_back(handler, qp, get_tsc());
                 }
             }
+            return;
+        }
+        if (diff < 0) {
+            handler->counters.zc_miss++;
+            zc_fall_back(handler, qp, get_tsc());
+            send_coalesced_ack(handler, qp);
+            return;
+        }
+    }
+
+    handler->counters.zc_miss++;
+    zc_fall_back(handler, qp, get_tsc());
+    if (!recv_wq->sent_psn_nak) {
+        recv_wq->sent_psn_nak = 1;
+        handler->counters.nak_sent++;
+        send_ack(handler, qp, AETH_NAK_PSN_SEQ_ERROR, recv_wq->psn);
+    }
+}
 
-            // execute the operation
-            if (mask & RXE_SEND_MASK) {
-                handler->dma_send_payload_to_host(qp, reinterpret_cast<uint64_t>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_PAYLOAD]), handler->wc_send_recv[i].wr_id, payload_size);
-            } else if (mask & RXE_WRITE_MASK) {
-                handler->dma_write_payload_to_host(qp, reinterpret_cast<uint64_t>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_PAYLOAD]), handler->wc_send_recv[i].wr_id, payload_size);
-            } else if (mask & RXE_READ_MASK) {
-                fprintf(stderr, "TODO waiting for implementation\n");
-                assert(false);
+static void zc_handle_recv(datapath_handler *handler) {
+    ibv_wc wc[RXE_ZC_POLL_BATCH];
+    int recv = ibv_poll_cq(handler->zc_cq, RXE_ZC_POLL_BATCH, wc);
+    for (int i = 0;i < recv;i++) {
+        dpu_qp *qp = handler->lookup_qp(wc[i].wr_id >> 32);
+        rxe_zc_rq *zc = qp ? qp->recv_wq->zc : nullptr;
+        // WQEs dropped by a disarm
+        if (zc == nullptr || !zc->armed || static_cast<uint16_t>(wc[i].wr_id) != zc->epoch) {
+            handler->counters.zc_stale++;
+            continue;
+        }
+        uint32_t slot = zc->done % SMARTNS_RX_ZC_DEPTH;
+        zc->done++;
+        zc_recv(handler, qp, slot, &wc[i]);
+    }
+}
+
+// refill with host recv WQEs posted since, or arm again once the backoff passed.
+// A message half delivered, packets held out of order or a loss not recovered yet
+// stay on the staged path
+void rxe_handle_zc_scan(datapath_handler *handler, dpu_qp *qp, size_t now) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    rxe_zc_rq *zc = recv_wq->zc;
+    if (zc->armed) {
+        handler->zc_refill(qp);
+        return;
+    }
+    if (now >= zc->rearm_tsc && !recv_wq->now_total_dma_byte && !recv_wq->reorder_cnt && !recv_wq->sent_psn_nak) {
+        handler->zc_arm(qp);
+    }
+}
+
+static void process_pkt(datapath_handler *handler, dpu_qp *qp, uint64_t pkt_buf, uint32_t byte_len) {
+    struct rxe_bth *bth = rx_bth(handler, pkt_buf);
+    uint8_t opcode = bth->opcode;
+    uint32_t psn = BTH_PSN_MASK & bth->apsn;
+    int mask = rxe_opcode[opcode].mask;
+
+    check_congestion(handler, qp, reinterpret_cast<udp_packet *>(handler->rxpath_handler->frame_hdr(pkt_buf)), bth, mask);
+
+    if (mask & RXE_REQ_MASK) {
+        int diff = psn_compare(psn, qp->recv_wq->psn);
+        if (diff > 0) {
+            // nothing after a refused request is held or executed
+            if (unlikely(qp->recv_wq->access_nak)) {
+                handler->counters.dup_drop++;
+                handler->rxpath_handler->release_recv_buffer(pkt_buf);
+                return;
             }
-            // free the buffer immediately due to care about lossy
-            ack_pkt_num++;
-
-            qp->recv_wq->psn = (psn + 1) & BTH_PSN_MASK;
-            qp->recv_wq->ack_psn = qp->recv_wq->psn;
-            qp->recv_wq->opcode = opcode;
-
-            if (mask & RXE_COMP_MASK) {
-                qp->recv_wq->msn++;
-                smartns_cqe *cqe = qp->recv_cq->get_next_cqe();
-                cqe->byte_count = qp->recv_wq->now_total_dma_byte;
-                cqe->cq_opcode = MLX5_CQE_RESP_SEND;
-                cqe->mlx5_opcode = 0;
-                cqe->op_own = qp->recv_cq->own_flag;
-                cqe->qpn = qp->qp_number;
-                cqe->wqe_counter = qp->recv_wq->head;
-
-                handler->dma_recv_cq_to_host(qp);
+            SMARTNS_REORDER("thread[%ld] Recv out of order psn %u, want %u", handler->thread_id, psn, qp->recv_wq->psn);
+            if (reorder_insert(handler, qp, pkt_buf, byte_len, psn)) {
+                return;
             }
-
-            if (bth->apsn & BTH_ACK_MASK) {
-                send_ack(handler, qp, AETH_ACK_UNLIMITED, psn);
+            handler->rxpath_handler->release_recv_buffer(pkt_buf);
+            if (qp->recv_wq->sent_psn_nak == 1) {
+                return;
             }
-            // recv ack or nack packet
-        } else {
-            ack_pkt_num++;
-            dpu_send_wq *send_wq = qp->send_wq;
+            qp->recv_wq->sent_psn_nak = 1;
+            handler->counters.nak_sent++;
+            send_ack(handler, qp, AETH_NAK_PSN_SEQ_ERROR, qp->recv_wq->psn);
+            return;
+        } else if (diff < 0) {
+            if (mask & RXE_SEND_MASK || mask & RXE_WRITE_MASK) {
+                SMARTNS_REORDER("Recv duplicate packet psn %u, send ack", psn);
+                send_coalesced_ack(handler, qp);
+            } else if (mask & RXE_READ_OR_ATOMIC) {
+                SMARTNS_REORDER("Recv duplicate read or atomic psn %u, replay response", psn);
+                replay_resp(handler, qp, opcode, psn);
+            } else {
+                handler->counters.dup_drop++;
+            }
+            handler->rxpath_handler->release_recv_buffer(pkt_buf);
+            return;
+        }
 
-            while (true) {
-                dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->tail);
-                if (send_wq->is_empty() || send_wqe->state == dpu_send_wqe_state_posted) {
-                    break;
-                }
-                int diff = psn_compare(psn, send_wqe->last_psn);
-                if (diff > 0) {
-                    if (send_wqe->state == dpu_send_wqe_state_pending) {
-                        complete_send_wqe(handler, qp, send_wqe);
-                        continue;
-                    } else {
-                        fprintf(stderr, "TODO waiting for implementation\n");
-                        assert(false);
-                    }
-                }
-                diff = psn_compare(psn, qp->comp_info->psn);
-                if (diff < 0) {
-                    if (psn == send_wqe->last_psn) {
-                        complete_send_wqe(handler, qp, send_wqe);
-                        break;
-                    } else {
-                        break;
-                    }
-                }
+        bool done = execute_req(handler, qp, bth, pkt_buf, byte_len);
+        // payload dmas hold the buffer until they finished
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
 
-                assert(opcode == IB_OPCODE_RC_ACKNOWLEDGE);
-                rxe_aeth *aeth = reinterpret_cast<rxe_aeth *>(bth + 1);
-                uint8_t syn = (AETH_SYN_MASK & aeth->smsn) >> 24;
-                switch (syn & AETH_TYPE_MASK) {
-                case AETH_ACK:
-                    break;
-                case AETH_NAK:
-                    fprintf(stderr, "TODO waiting for implementation\n");
-                    assert(false);
-                }
+        if (unlikely(done && qp->recv_wq->reorder_cnt)) {
+            reorder_drain(handler, qp);
+        }
+    } else if (unlikely(qp->send_wq->error_status)) {
+        // responses and acks of a send wq already flushed
+        handler->counters.dup_drop++;
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+    } else if (mask & RXE_PAYLOAD_MASK) {
+        // read response
+        handle_read_resp(handler, qp, bth, pkt_buf, byte_len);
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+    } else if (mask & RXE_ATMACK_MASK) {
+        handle_atomic_ack(handler, qp, bth, pkt_buf);
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+    } else {
+        // recv ack or nack packet
+        handle_ack(handler, qp, pkt_buf, opcode, psn);
+        handler->rxpath_handler->release_recv_buffer(pkt_buf);
+    }
+}
 
-                if (send_wqe->state == dpu_send_wqe_state_pending && send_wqe->last_psn == psn) {
-                    complete_send_wqe(handler, qp, send_wqe);
-                }
+// Three stages so the cache misses of a batch overlap instead of serializing:
+// parse every header and prefetch the QPs, then the state each packet touches,
+// execute the packets in order, and send the acks and flush tx, DMA and rx once.
+int rxe_handle_recv(datapath_handler *handler) {
+    if (handler->rx_zero_copy) {
+        zc_handle_recv(handler);
+    }
 
-                if (mask & RXE_END_MASK) {
-                    qp->comp_info->opcode = -1;
-                } else {
-                    qp->comp_info->opcode = opcode;
-                }
-                qp->comp_info->psn = (psn + 1) & BTH_PSN_MASK;
-                break;
-            }
+    int recv = handler->rxpath_handler->poll_recv_cq(handler->wc_send_recv, CTX_POLL_BATCH);
+
+    if (unlikely(handler->rx_drop_threshold || handler->rx_reorder_threshold)) {
+        recv = handler->inject_rx_fault(handler->wc_send_recv, recv);
+    }
+
+    rxe_rx_pkt *batch = handler->rx_batch;
+    int cnt = 0;
+    for (int i = 0;i < recv;i++) {
+        if (handler->wc_send_recv[i].status != IBV_WC_SUCCESS || handler->wc_send_recv[i].opcode != IBV_WC_RECV) {
+            fprintf(stderr, "Recv error %d\n", handler->wc_send_recv[i].status);
+            exit(1);
+        }
+        uint64_t pkt_buf = handler->wc_send_recv[i].wr_id;
+        struct rxe_bth *bth = rx_bth(handler, pkt_buf);
+        dpu_qp *qp = handler->lookup_qp(bth->qpn & BTH_QPN_MASK);
+        if (unlikely(qp == nullptr)) {
+            handler->counters.unknown_qpn++;
+            handler->rxpath_handler->release_recv_buffer(pkt_buf);
+            continue;
+        }
+        __builtin_prefetch(qp);
+        __builtin_prefetch(reinterpret_cast<char *>(qp) + 64);
+        batch[cnt].pkt_buf = pkt_buf;
+        batch[cnt].byte_len = handler->wc_send_recv[i].byte_len;
+        batch[cnt].qp = qp;
+        cnt++;
+    }
+
+    // requests go to the recv wq and cq, responses and acks to the send side
+    for (int i = 0;i < cnt;i++) {
+        dpu_qp *qp = batch[i].qp;
+        struct rxe_bth *bth = rx_bth(handler, batch[i].pkt_buf);
+        if (rxe_opcode[bth->opcode].mask & RXE_REQ_MASK) {
+            __builtin_prefetch(qp->recv_wq);
+            __builtin_prefetch(reinterpret_cast<char *>(qp->recv_wq) + 64);
+            __builtin_prefetch(qp->recv_cq);
+        } else {
+            __builtin_prefetch(qp->send_wq);
+            __builtin_prefetch(qp->comp_info);
         }
     }
+
+    for (int i = 0;i < cnt;i++) {
+        process_pkt(handler, batch[i].qp, batch[i].pkt_buf, batch[i].byte_len);
+    }
+
+    flush_pending_acks(handler);
     handler->txpath_handler->commit_flush();
+    // after the payload dmas of the batch
+    handler->flush_cqes();
+
+    // a short batch means traffic is thin, don't let buffers wait for the next signaled dma
+    if (recv < CTX_POLL_BATCH) {
+        handler->dma_handler->flush_dma();
+    }
+    handler->dma_handler->poll_dma_cq([handler](uint64_t buf_addr) {
+        handler->rxpath_handler->release_recv_buffer(buf_addr);
+    });
+    handler->rxpath_handler->flush_recv_buffer();
+
+    return recv;
+}
+
+// one step of the atomic at the head of the responder resources, true once
+// its original value is known. Other QPs and threads go on meanwhile
+static bool progress_atomic(datapath_handler *handler, dpu_qp *qp, rxe_resp_res *res) {
+    dma_handler *dma = handler->dma_handler;
+    uint32_t host_lkey = res->host_lkey;
+    switch (res->atomic_state) {
+    case rxe_atomic_state_lock:
+        if (!dma->start_host_atomic(host_lkey, res->va, &res->atomic_stage, &res->atomic_ticket)) {
+            return false;
+        }
+        res->atomic_state = rxe_atomic_state_read;
+        [[fallthrough]];
+    case rxe_atomic_state_read: {
+        if (!dma->atomic_done(res->atomic_ticket)) {
+            return false;
+        }
+        uint64_t *word = dma->atomic_stage(res->atomic_stage);
+        res->atomic_orig = *word;
+        if (res->opcode == IB_OPCODE_RC_COMPARE_SWAP) {
+            *word = res->atomic_orig == res->compare_add ? res->swap : res->atomic_orig;
+        } else {
+            *word = res->atomic_orig + res->compare_add;
+        }
+        if (*word != res->atomic_orig) {
+            res->atomic_ticket = dma->write_host_atomic(host_lkey, res->va, res->atomic_stage);
+            res->atomic_state = rxe_atomic_state_write;
+            return false;
+        }
+        break;
+    }
+    case rxe_atomic_state_write:
+        if (!dma->atomic_done(res->atomic_ticket)) {
+            return false;
+        }
+        break;
+    }
+    dma->finish_host_atomic(res->va, res->atomic_stage);
+    res->atomic_state = rxe_atomic_state_done;
+    rxe_resp_cache *entry = find_resp_cache(qp->recv_wq, res->first_psn);
+    if (entry != nullptr) {
+        entry->atomic_orig = res->atomic_orig;
+        entry->atomic_pending = false;
+    }
+    return true;
+}
+
+// the MR a read or atomic was checked against may have been deregistered since,
+// or before a duplicate asks for the response again. Checked per read response
+// packet, the MR can go away halfway through a read
+static bool check_resp_rkey(datapath_handler *handler, dpu_qp *qp, rxe_resp_res *res) {
+    if (res->opcode != IB_OPCODE_RC_RDMA_READ_REQUEST) {
+        return res->atomic_state != rxe_atomic_state_lock ||
+            check_rkey(handler, qp, res->rkey, res->va, sizeof(uint64_t), IBV_ACCESS_REMOTE_ATOMIC, &res->host_lkey);
+    }
+    // a zero length read touches no memory
+    return res->offset == res->length ||
+        check_rkey(handler, qp, res->rkey, res->va + res->offset, res->length - res->offset, IBV_ACCESS_REMOTE_READ, &res->host_lkey);
+}
+
+// nak the response, the QP goes to error like for a request refused on arrival
+static void refuse_resp(datapath_handler *handler, dpu_qp *qp, rxe_resp_res *res) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    handler->counters.access_nak_sent++;
+    send_ack(handler, qp, AETH_NAK_REM_ACC_ERR, res->cur_psn);
+    recv_wq->access_nak = AETH_NAK_REM_ACC_ERR;
+    reorder_release(handler, qp);
+    recv_wq->res_tail = recv_wq->res_head;
+    recv_wq->ack_deferred = 0;
+}
+
+int rxe_handle_resp(datapath_handler *handler, dpu_qp *qp, size_t budget) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    if (recv_wq->res_head == recv_wq->res_tail) {
+        return -1;
+    }
 
-    uint32_t recv_finish = handler->dma_handler->poll_dma_cq() + ack_pkt_num;
-    while (recv_finish) {
-        uint32_t now_post_recv = min_(SMARTNS_RX_BATCH, recv_finish);
-        for (uint32_t i = 0;i < now_post_recv;i++) {
-            handler->rxpath_handler->recv_sge_list[i * SMARTNS_RX_SEG].addr = handler->rxpath_handler->recv_offset_handler.offset() + handler->rxpath_handler->recv_buf_addr;
-            handler->rxpath_handler->recv_sge_list[i * SMARTNS_RX_SEG].length = SMARTNS_RX_PACKET_BUFFER;
-            handler->rxpath_handler->recv_wr[i].wr_id = handler->rxpath_handler->recv_offset_handler.offset() + handler->rxpath_handler->recv_buf_addr;
-            handler->rxpath_handler->recv_wr[i].next = nullptr;
-
-            if (i > 0) {
-                handler->rxpath_handler->recv_wr[i - 1].next = handler->rxpath_handler->recv_wr + i;
+    int total_send = 0;
+    size_t start_bytes = handler->txpath_handler->tx_bytes;
+    while (recv_wq->res_head != recv_wq->res_tail && total_send < RXE_MAX_RESP_BURST && handler->txpath_handler->tx_bytes - start_bytes < budget) {
+        rxe_resp_res *res = &recv_wq->resp_res[recv_wq->res_tail % RXE_MAX_RESP_RES];
+        // RC ordering, the payload dmas and atomics of earlier requests land before host memory is read
+        bool reads_host = res->opcode == IB_OPCODE_RC_RDMA_READ_REQUEST ? res->cur_psn == res->first_psn :
+            res->atomic_state == rxe_atomic_state_lock;
+        if (reads_host && !handler->dma_handler->fence_passed(&res->fence)) {
+            handler->dma_handler->flush_dma();
+            break;
+        }
+        if (!check_resp_rkey(handler, qp, res)) {
+            refuse_resp(handler, qp, res);
+            break;
+        }
+        if (res->opcode != IB_OPCODE_RC_RDMA_READ_REQUEST) {
+            if (res->atomic_state != rxe_atomic_state_done && !progress_atomic(handler, qp, res)) {
+                break;
             }
-            handler->rxpath_handler->recv_offset_handler.step();
+            send_atomic_ack(handler, qp, res->atomic_orig, res->first_psn);
+            total_send++;
+            recv_wq->res_tail++;
+            continue;
+        }
+        uint32_t payload = res->length - res->offset;
+        if (payload > static_cast<uint32_t>(qp->mtu)) {
+            payload = qp->mtu;
+        }
+        bool first = res->offset == 0;
+        bool last = res->offset + payload == res->length;
+        int opcode;
+        if (first) {
+            opcode = last ? IB_OPCODE_RC_RDMA_READ_RESPONSE_ONLY : IB_OPCODE_RC_RDMA_READ_RESPONSE_FIRST;
+        } else {
+            opcode = last ? IB_OPCODE_RC_RDMA_READ_RESPONSE_LAST : IB_OPCODE_RC_RDMA_READ_RESPONSE_MIDDLE;
+        }
+        int header_size = rxe_opcode[opcode].length + sizeof(udp_packet);
+
+        void *header_addr = handler->txpath_handler->get_next_pktheader_addr();
+        struct rxe_bth *bth = reinterpret_cast<rxe_bth *>(reinterpret_cast<size_t>(header_addr) + sizeof(udp_packet));
+        bth->opcode = opcode;
+        bth->flags = 0;
+        bth->pkey = 0xFFFF;
+        bth->qpn = (qp->remote_qp_number & BTH_QPN_MASK) | take_ecn_echo(recv_wq);
+        bth->apsn = res->cur_psn & BTH_PSN_MASK;
+        if (rxe_opcode[opcode].mask & RXE_AETH_MASK) {
+            rxe_aeth *aeth = reinterpret_cast<rxe_aeth *>(reinterpret_cast<char *>(bth) + rxe_opcode[opcode].offset[RXE_AETH]);
+            aeth->smsn = (AETH_SYN_MASK & (AETH_ACK_UNLIMITED << 24)) | (AETH_MSN_MASK & recv_wq->msn);
+        }
+
+        // payload is gathered by the NIC straight from the host MR
+        if (payload) {
+            handler->txpath_handler->commit_pkt_with_payload(res->va + res->offset, res->host_lkey, header_size, payload);
+        } else {
+            handler->txpath_handler->commit_pkt_without_payload(header_size);
+        }
+        total_send++;
+
+        res->offset += payload;
+        res->cur_psn = (res->cur_psn + 1) & BTH_PSN_MASK;
+        if (last) {
+            recv_wq->res_tail++;
         }
-        assert(ibv_post_recv(handler->rxpath_handler->send_recv_qp, handler->rxpath_handler->recv_wr, &handler->rxpath_handler->recv_bad_wr) == 0);
-        recv_finish -= now_post_recv;
     }
 
-    return recv;
-}
\ No newline at end of file
+    if (recv_wq->res_head == recv_wq->res_tail && recv_wq->ack_deferred) {
+        recv_wq->ack_deferred = 0;
+        send_ack(handler, qp, AETH_ACK_UNLIMITED, (recv_wq->ack_psn - 1) & BTH_PSN_MASK);
+    }
+    return total_send;
+}
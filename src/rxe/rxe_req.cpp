@@ -24,6 +24,10 @@ int next_opcode(dpu_qp *qp, dpu_send_wqe *wqe, int opcode) {
         }
     case IBV_WR_RDMA_READ:
         return IB_OPCODE_RC_RDMA_READ_REQUEST;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+        return IB_OPCODE_RC_COMPARE_SWAP;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+        return IB_OPCODE_RC_FETCH_ADD;
     case IBV_WR_DRIVER1:
         return IB_OPCODE_DRIVER1;
     }
@@ -57,11 +61,34 @@ void init_req_packet(datapath_handler *handler, dpu_qp *qp, dpu_send_wqe *wqe, i
     if (mask & RXE_RETH_MASK) {
         struct rxe_reth *reth = reinterpret_cast<rxe_reth *>(reinterpret_cast<size_t>(bth) + rxe_opcode[opcode].offset[RXE_RETH]);
         reth->rkey = wqe->remote_rkey;
-        reth->va = wqe->remote_addr;
-        reth->len = wqe->byte_count;
+        // a re-requested read only asks for the responses not received yet
+        reth->va = wqe->remote_addr + wqe->cur_pkt_offset;
+        reth->len = wqe->byte_count - wqe->cur_pkt_offset;
+    }
+    if (mask & RXE_ATMETH_MASK) {
+        struct rxe_atmeth *atmeth = reinterpret_cast<rxe_atmeth *>(reinterpret_cast<size_t>(bth) + rxe_opcode[opcode].offset[RXE_ATMETH]);
+        atmeth->va = wqe->remote_addr;
+        atmeth->rkey = wqe->remote_rkey;
+        if (opcode == IB_OPCODE_RC_COMPARE_SWAP) {
+            atmeth->swap_add = wqe->swap;
+            atmeth->comp = wqe->compare_add;
+        } else {
+            atmeth->swap_add = wqe->compare_add;
+            atmeth->comp = 0;
+        }
     }
     // printf("[%ld] index %ld, psn %u\n", handler->thread_id, handler->txpath_handler->send_offset_handler.index(), psn);
-    if (mask & RXE_WRITE_OR_SEND) {
+    // the peer's zero-copy queue of the QP takes it if armed
+    if (opcode == IB_OPCODE_RC_SEND_ONLY && qp->zc_dst_port) {
+        handler->txpath_handler->pkt_dst_port = qp->zc_dst_port;
+    }
+    if ((mask & RXE_WRITE_OR_SEND) && wqe->is_inline) {
+        // no read of host memory, the payload goes right behind the headers
+        memcpy(reinterpret_cast<uint8_t *>(header_addr) + header_size, wqe->inline_data + wqe->cur_pkt_offset, payload);
+        handler->txpath_handler->commit_pkt_without_payload(header_size + payload);
+    } else if ((mask & RXE_WRITE_OR_SEND) && wqe->num_sge > 1) {
+        handler->txpath_handler->commit_pkt_with_gather(wqe->sge_list, wqe->num_sge, wqe->cur_pkt_offset, header_size, payload);
+    } else if (mask & RXE_WRITE_OR_SEND) {
         handler->txpath_handler->commit_pkt_with_payload(wqe->local_addr + wqe->cur_pkt_offset, wqe->local_lkey, header_size, payload);
     } else {
         handler->txpath_handler->commit_pkt_without_payload(header_size);
@@ -69,30 +96,53 @@ void init_req_packet(datapath_handler *handler, dpu_qp *qp, dpu_send_wqe *wqe, i
 
 }
 
-int rxe_handle_req(datapath_handler *handler, dpu_qp *qp) {
+int rxe_handle_req(datapath_handler *handler, dpu_qp *qp, size_t budget) {
     dpu_send_wq *send_wq = qp->send_wq;
     int total_send = 0;
+    size_t start_bytes = handler->txpath_handler->tx_bytes;
 
     // delete from active qp list
     if (send_wq->is_empty()) {
         return -1;
     }
+    if (unlikely(send_wq->error_status)) {
+        rxe_flush_send_wq(handler, qp);
+        return send_wq->is_empty() ? -1 : 0;
+    }
+
+    bool cc_enabled = rxe_cc_enabled(&send_wq->cc);
+    size_t now = cc_enabled ? get_tsc() : 0;
 
     for (;send_wq->wqe_index != send_wq->head;) {
         // TODO
         dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->wqe_index);
-        if (send_wqe->state == dpu_send_wqe_state_done || send_wqe->state == dpu_send_wqe_state_pending || send_wqe->cur_pkt_offset == send_wqe->byte_count) {
+        if (send_wqe->state == dpu_send_wqe_state_done || send_wqe->state == dpu_send_wqe_state_pending) {
             send_wq->step_wqe_index();
             continue;
         }
 
+        // window full, the timer below still arms for what this pass sent
         if (unlikely(psn_compare(qp->send_wq->psn, (qp->comp_info->psn + RXE_MAX_UNACKED_PSNS)) > 0)) {
-            return total_send;
+            break;
+        }
+        if (handler->txpath_handler->tx_bytes - start_bytes >= budget) {
+            break;
+        }
+        if (cc_enabled) {
+            // a rewind may leave psn behind the completed psn
+            int inflight = psn_compare(send_wq->psn, qp->comp_info->psn) >> 8;
+            if (!rxe_cc_can_send(&send_wq->cc, now, inflight > 0 ? inflight : 0)) {
+                break;
+            }
         }
 
         int opcode = next_opcode(qp, send_wqe, send_wqe->opcode);
         // reserved opcode, used for pipe RTT test
         if (opcode == IB_OPCODE_DRIVER1) {
+            if (!handler->cq_has_room(qp->send_cq, 1)) {
+                handler->counters.cq_full++;
+                break;
+            }
             send_wq->step_wqe_index();
 
             smartns_cqe *cqe = qp->send_cq->get_next_cqe();
@@ -109,13 +159,33 @@ int rxe_handle_req(datapath_handler *handler, dpu_qp *qp) {
             continue;
         }
         int mask = rxe_opcode[opcode].mask;
+        // responder keeps at most RXE_MAX_RESP_RES reads and atomics in flight
+        if ((mask & RXE_READ_OR_ATOMIC) && send_wqe->state == dpu_send_wqe_state_posted &&
+            send_wq->pending_rd_atomic >= RXE_MAX_RESP_RES) {
+            break;
+        }
+        // the host CQ has no room for the completion yet, a rewind keeps the reservation
+        if (!handler->reserve_send_cqe(qp, send_wqe)) {
+            break;
+        }
+        if ((mask & RXE_READ_OR_ATOMIC) && send_wqe->state == dpu_send_wqe_state_posted) {
+            send_wq->pending_rd_atomic++;
+        }
         int payload = (mask & RXE_WRITE_OR_SEND) ? send_wqe->byte_count - send_wqe->cur_pkt_offset : 0;
         if (payload >= qp->mtu) {
             payload = qp->mtu;
         }
         init_req_packet(handler, qp, send_wqe, opcode, payload);
         total_send++;
+        if (cc_enabled) {
+            rxe_cc_on_send(&send_wq->cc, now, rxe_opcode[opcode].length + sizeof(udp_packet) + payload);
+            if (send_wq->rtt_probe_tsc == 0) {
+                send_wq->rtt_probe_psn = send_wq->psn;
+                send_wq->rtt_probe_tsc = now;
+            }
+        }
 
+        bool first_pkt = send_wqe->cur_pkt_num == 0;
         send_wqe->cur_pkt_offset += payload;
         send_wqe->cur_pkt_num += 1;
 
@@ -130,13 +200,13 @@ int rxe_handle_req(datapath_handler *handler, dpu_qp *qp) {
             num_pkt = 1;
         }
 
-        if (mask & RXE_START_MASK) {
+        if (first_pkt) {
             send_wqe->first_psn = qp->send_wq->psn;
             send_wqe->last_psn = (qp->send_wq->psn + num_pkt - 1) & BTH_PSN_MASK;
         }
 
         if (mask & RXE_READ_MASK) {
-            qp->send_wq->psn = (send_wqe->first_psn + num_pkt) & BTH_PSN_MASK;
+            qp->send_wq->psn = (send_wqe->last_psn + 1) & BTH_PSN_MASK;
         } else {
             qp->send_wq->psn = (qp->send_wq->psn + 1) & BTH_PSN_MASK;
         }
@@ -148,5 +218,168 @@ int rxe_handle_req(datapath_handler *handler, dpu_qp *qp) {
         }
     }
 
+    if (total_send) {
+        rxe_arm_retrans_timer(handler, qp, cc_enabled ? now : get_tsc());
+    }
+
     return total_send;
+}
+
+// go back to psn, WQEs before it are untouched and the WQE containing it
+// restarts from the packet offset, WQEs after it are sent again from scratch
+void rxe_rewind_send_wq(datapath_handler *handler, dpu_qp *qp, uint32_t psn) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    if (psn_compare(psn, send_wq->psn) >= 0) {
+        return;
+    }
+
+    bool found = false;
+    for (uint32_t index = send_wq->tail;index != send_wq->head;index = (index + 1) % send_wq->wqe_cnt) {
+        dpu_send_wqe *send_wqe = send_wq->get_wqe(index);
+        if (send_wqe->state == dpu_send_wqe_state_posted) {
+            break;
+        }
+        if (found) {
+            if (rxe_wqe_is_rd_atomic(send_wqe)) {
+                send_wq->pending_rd_atomic--;
+            }
+            send_wqe->state = dpu_send_wqe_state_posted;
+            send_wqe->cur_pkt_num = 0;
+            send_wqe->cur_pkt_offset = 0;
+            continue;
+        }
+        if (psn_compare(psn, send_wqe->last_psn) > 0) {
+            continue;
+        }
+
+        found = true;
+        handler->counters.retrans_events++;
+        handler->counters.retrans_pkts += (send_wq->psn - psn) & BTH_PSN_MASK;
+        send_wq->wqe_index = index;
+
+        uint32_t skip_pkts = 0;
+        if (psn_compare(psn, send_wqe->first_psn) > 0) {
+            skip_pkts = (psn - send_wqe->first_psn) & BTH_PSN_MASK;
+        }
+        if (skip_pkts) {
+            // a read is requested again for the remaining responses only
+            send_wqe->state = dpu_send_wqe_state_processing;
+            send_wqe->cur_pkt_num = skip_pkts;
+            send_wqe->cur_pkt_offset = skip_pkts * qp->mtu;
+            send_wq->psn = psn;
+            if (send_wqe->opcode == IBV_WR_RDMA_READ) {
+                send_wq->opcode = -1;
+            } else {
+                send_wq->opcode = send_wqe->opcode == IBV_WR_SEND ? IB_OPCODE_RC_SEND_MIDDLE : IB_OPCODE_RC_RDMA_WRITE_MIDDLE;
+            }
+        } else {
+            if (rxe_wqe_is_rd_atomic(send_wqe)) {
+                send_wq->pending_rd_atomic--;
+            }
+            send_wqe->state = dpu_send_wqe_state_posted;
+            send_wqe->cur_pkt_num = 0;
+            send_wqe->cur_pkt_offset = 0;
+            send_wq->psn = send_wqe->first_psn;
+            send_wq->opcode = -1;
+        }
+    }
+
+    send_wq->noack_pkts = 0;
+    // a resent psn gives no rtt sample
+    send_wq->rtt_probe_tsc = 0;
+    SMARTNS_REORDER("qp %lu rewind send wq to psn %u, index %u", qp->qp_number, send_wq->psn, send_wq->wqe_index);
+}
+
+// complete the WQEs of a QP in error, the one the nak was for with its status and
+// the others as flushed. Stops while the host CQ is full, rxe_handle_req goes on
+void rxe_flush_send_wq(datapath_handler *handler, dpu_qp *qp) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    while (!send_wq->is_empty()) {
+        dpu_send_wqe *send_wqe = send_wq->get_wqe(send_wq->tail);
+        if (!send_wqe->cqe_reserved && !handler->cq_has_room(qp->send_cq, 1)) {
+            handler->counters.cq_full++;
+            break;
+        }
+        smartns_cqe *cqe = qp->send_cq->get_next_cqe();
+        cqe->byte_count = 0;
+        cqe->cq_opcode = MLX5_CQE_REQ_ERR;
+        cqe->status = send_wqe->state == dpu_send_wqe_state_error ? send_wq->error_status : IBV_WC_WR_FLUSH_ERR;
+        cqe->mlx5_opcode = send_wqe->opcode;
+        cqe->op_own = qp->send_cq->own_flag;
+        cqe->qpn = qp->qp_number;
+        cqe->wqe_counter = send_wqe->cur_pos;
+
+        handler->dma_send_cq_to_host(qp);
+        if (send_wqe->cqe_reserved) {
+            qp->send_cq->reserved--;
+            send_wqe->cqe_reserved = 0;
+        }
+        send_wqe->state = dpu_send_wqe_state_done;
+        send_wq->step_tail();
+    }
+    send_wq->wqe_index = send_wq->tail;
+}
+
+// the peer refused the request at psn, nothing is sent or retransmitted from then on
+void rxe_fail_send_wq(datapath_handler *handler, dpu_qp *qp, ibv_wc_status status, uint32_t psn) {
+    dpu_send_wq *send_wq = qp->send_wq;
+    for (uint32_t index = send_wq->tail;index != send_wq->head;index = (index + 1) % send_wq->wqe_cnt) {
+        dpu_send_wqe *send_wqe = send_wq->get_wqe(index);
+        if (psn_compare(psn, send_wqe->last_psn) <= 0) {
+            if (psn_compare(psn, send_wqe->first_psn) >= 0) {
+                send_wqe->state = dpu_send_wqe_state_error;
+            }
+            break;
+        }
+    }
+    send_wq->error_status = status;
+    send_wq->pending_rd_atomic = 0;
+    qp->comp_info->deadline = 0;
+    rxe_flush_send_wq(handler, qp);
+}
+
+void rxe_arm_retrans_timer(datapath_handler *handler, dpu_qp *qp, size_t now) {
+    dpu_comp_info *comp_info = qp->comp_info;
+    if (comp_info->deadline == 0) {
+        comp_info->deadline = now + (handler->retrans_timeout_tsc << comp_info->timeout);
+    }
+    if (!comp_info->timer_queued) {
+        comp_info->timer_queued = 1;
+        handler->retrans_timer.schedule(qp->qp_number, comp_info->deadline);
+    }
+}
+
+void rxe_handle_timer(datapath_handler *handler, dpu_qp *qp, size_t now) {
+    dpu_comp_info *comp_info = qp->comp_info;
+    comp_info->timer_queued = 0;
+    if (comp_info->deadline == 0) {
+        return;
+    }
+    // deadline was pushed back by ack progress
+    if (now < comp_info->deadline) {
+        rxe_arm_retrans_timer(handler, qp, now);
+        return;
+    }
+    comp_info->deadline = 0;
+    dpu_send_wq *send_wq = qp->send_wq;
+    uint32_t resend_psn = comp_info->psn;
+    if (psn_compare(send_wq->psn, comp_info->psn) <= 0) {
+        // a late ack moved the completed psn past a rewound wqe that was resent
+        // since, its own ack is lost and only sending it again brings another
+        if (send_wq->tail == send_wq->wqe_index) {
+            return;
+        }
+        resend_psn = send_wq->get_wqe(send_wq->tail)->first_psn;
+    }
+
+    handler->counters.retrans_timeouts++;
+    if (comp_info->timeout < RXE_MAX_RETRANS_BACKOFF) {
+        comp_info->timeout++;
+    }
+    SMARTNS_REORDER("thread[%ld] qp %lu retransmit timeout, resend from psn %u", handler->thread_id, qp->qp_number, resend_psn);
+    if (rxe_cc_enabled(&send_wq->cc)) {
+        rxe_cc_on_timeout(&send_wq->cc, now);
+    }
+    rxe_rewind_send_wq(handler, qp, resend_psn);
+    rxe_arm_retrans_timer(handler, qp, now);
 }
\ No newline at end of file
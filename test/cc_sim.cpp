@@ -0,0 +1,153 @@
+#include "rxe/rxe_cc.h"
+#include <gflags/gflags.h>
+#include <stdio.h>
+#include <deque>
+#include <vector>
+#include <random>
+
+// Congestion control against a simulated bottleneck, no NIC needed.
+// N senders share one link with a FIFO queue that ECN marks between
+// ecn_kmin_kb and ecn_kmax_kb and drops above buffer_kb, time unit is 1ns.
+//  ./cc_sim -cc_algo window -flows 4
+//  ./cc_sim -cc_algo rate -flows 8 -late_start
+
+DEFINE_string(cc_algo, "window", "window or rate");
+DEFINE_uint64(flows, 4, "senders sharing the bottleneck");
+DEFINE_double(link_gbps, 100, "bottleneck bandwidth");
+DEFINE_uint64(base_rtt_ns, 8000, "round trip time without queueing");
+DEFINE_uint64(mtu, 4096, "packet size");
+DEFINE_uint64(ecn_kmin_kb, 100, "queue length marking starts");
+DEFINE_uint64(ecn_kmax_kb, 400, "queue length every packet is marked");
+DEFINE_uint64(buffer_kb, 4096, "queue length packets are dropped");
+DEFINE_uint64(target_delay_us, 25, "window algorithm target delay");
+DEFINE_uint64(duration_us, 20000, "simulated time");
+DEFINE_bool(late_start, false, "start the senders one after another");
+
+struct sim_pkt {
+    uint32_t flow;
+    size_t send_ns;
+    bool ecn;
+    bool lost;
+    size_t arrive_ns;
+};
+
+struct sim_flow {
+    rxe_cc cc;
+    uint32_t inflight;
+    size_t start_ns;
+    size_t delivered;
+    std::deque<sim_pkt> acks;
+};
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    rxe_cc_param param;
+    rxe_cc_default_param(&param, rxe_cc_parse_algo(FLAGS_cc_algo.c_str()), 1.0, FLAGS_mtu, FLAGS_link_gbps, FLAGS_target_delay_us);
+    if (param.algo == RXE_CC_NONE) {
+        fprintf(stderr, "unknown cc algo %s\n", FLAGS_cc_algo.c_str());
+        return 1;
+    }
+
+    const size_t duration = FLAGS_duration_us * 1000;
+    const size_t warmup = duration / 5;
+    const double link_rate = FLAGS_link_gbps / 8;
+    const size_t serialize_ns = FLAGS_mtu / link_rate;
+    const size_t kmin = FLAGS_ecn_kmin_kb * 1024, kmax = FLAGS_ecn_kmax_kb * 1024, buffer = FLAGS_buffer_kb * 1024;
+    const size_t rto_ns = 1000 * 1000;
+
+    std::vector<sim_flow> flows(FLAGS_flows);
+    for (size_t i = 0;i < flows.size();i++) {
+        flows[i].start_ns = FLAGS_late_start ? i * warmup / flows.size() : 0;
+        rxe_cc_init(&flows[i].cc, &param, flows[i].start_ns);
+        flows[i].inflight = 0;
+        flows[i].delivered = 0;
+    }
+
+    std::mt19937_64 rng(1);
+    std::deque<sim_pkt> queue;
+    size_t queue_bytes = 0, link_free_ns = 0;
+    size_t drops = 0, marks = 0, queue_sum = 0, queue_max = 0, samples = 0;
+
+    for (size_t now = 0;now < duration;now += 10) {
+        // the link serves the queue head
+        while (!queue.empty() && link_free_ns <= now) {
+            sim_pkt pkt = queue.front();
+            queue.pop_front();
+            queue_bytes -= FLAGS_mtu;
+            link_free_ns = std::max(link_free_ns, now) + serialize_ns;
+            pkt.arrive_ns = link_free_ns + FLAGS_base_rtt_ns;
+            flows[pkt.flow].acks.push_back(pkt);
+            if (now >= warmup) {
+                flows[pkt.flow].delivered += FLAGS_mtu;
+            }
+        }
+
+        for (size_t i = 0;i < flows.size();i++) {
+            sim_flow &flow = flows[i];
+            if (now < flow.start_ns) {
+                continue;
+            }
+            while (!flow.acks.empty() && flow.acks.front().arrive_ns <= now) {
+                sim_pkt pkt = flow.acks.front();
+                flow.acks.pop_front();
+                flow.inflight--;
+                if (pkt.lost) {
+                    rxe_cc_on_timeout(&flow.cc, now);
+                    continue;
+                }
+                rxe_cc_on_ack(&flow.cc, now, 1, now - pkt.send_ns);
+                if (pkt.ecn) {
+                    rxe_cc_on_congestion(&flow.cc, now);
+                }
+            }
+            while (flow.inflight < param.max_cwnd && rxe_cc_can_send(&flow.cc, now, flow.inflight)) {
+                sim_pkt pkt = { static_cast<uint32_t>(i), now, false, false, 0 };
+                rxe_cc_on_send(&flow.cc, now, FLAGS_mtu);
+                flow.inflight++;
+                if (queue_bytes + FLAGS_mtu > buffer) {
+                    drops++;
+                    pkt.lost = true;
+                    pkt.arrive_ns = now + rto_ns;
+                    // keeps the ack list ordered, a lost packet is rare
+                    auto it = flow.acks.begin();
+                    while (it != flow.acks.end() && it->arrive_ns <= pkt.arrive_ns) {
+                        it++;
+                    }
+                    flow.acks.insert(it, pkt);
+                    continue;
+                }
+                if (queue_bytes > kmin) {
+                    double prob = queue_bytes >= kmax ? 1.0 : static_cast<double>(queue_bytes - kmin) / (kmax - kmin);
+                    pkt.ecn = std::uniform_real_distribution<double>(0, 1)(rng) < prob;
+                    marks += pkt.ecn;
+                }
+                queue.push_back(pkt);
+                queue_bytes += FLAGS_mtu;
+            }
+        }
+
+        if (now >= warmup) {
+            queue_sum += queue_bytes;
+            queue_max = std::max(queue_max, queue_bytes);
+            samples++;
+        }
+    }
+
+    double total = 0, square = 0;
+    for (size_t i = 0;i < flows.size();i++) {
+        double gbps = flows[i].delivered * 8.0 / (duration - warmup);
+        printf("flow %zu: %.2f Gbps\n", i, gbps);
+        total += gbps;
+        square += gbps * gbps;
+    }
+    double utilization = total / FLAGS_link_gbps;
+    double jain = total * total / (flows.size() * square);
+    double queue_avg_kb = queue_sum / 1024.0 / samples;
+    printf("%s: utilization %.3f, jain fairness %.3f, queue avg %.1f KB max %.1f KB, ecn marks %zu, drops %zu\n",
+        FLAGS_cc_algo.c_str(), utilization, jain, queue_avg_kb, queue_max / 1024.0, marks, drops);
+
+    bool pass = utilization > 0.85 && jain > 0.9 && queue_avg_kb < FLAGS_buffer_kb / 2;
+    printf(pass ? "PASS\n" : "FAIL\n");
+    return pass ? 0 : 1;
+}
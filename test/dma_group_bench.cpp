@@ -0,0 +1,86 @@
+#include "smartns.h"
+#include "gflags_common.h"
+#include <stdio.h>
+
+// DMA throughput of dma_handler against its group size and the payload size,
+// on the DPU. Source and destination are both DPU memory, so this measures
+// the dma engine and the qp selection, not PCIe.
+//  sudo ./dma_group_bench -deviceName mlx5_2
+
+DEFINE_uint64(dma_ops, 1 << 18, "payload dmas per group size and payload size");
+DEFINE_uint64(dma_window, 64, "payload dmas in flight per dma qp");
+
+static const size_t region_size = 1 << 22;
+
+static double run(dma_handler *dma, ibv_mr *src_mr, ibv_mr *dst_mr, size_t payload_size) {
+    uint64_t src = reinterpret_cast<uint64_t>(src_mr->addr);
+    uint64_t dst = reinterpret_cast<uint64_t>(dst_mr->addr);
+    size_t window = FLAGS_dma_window * dma->group_size;
+    size_t posted = 0, done = 0, offset = 0;
+
+    size_t begin = get_tsc();
+    for (size_t i = 0;i < FLAGS_dma_ops;i++) {
+        while (posted - done + dma->dma_parts(payload_size) > window) {
+            dma->flush_dma();
+            dma->poll_dma_cq([&done](uint64_t) { done++; });
+        }
+        if (offset + payload_size > region_size) {
+            offset = 0;
+        }
+        dma->post_dma_req_without_cq(dst_mr->lkey, dst + offset, src_mr->lkey, src + offset, src + offset, payload_size, false);
+        posted += dma->dma_parts(payload_size);
+        offset += round_up(payload_size, 64);
+    }
+    while (done != posted) {
+        dma->flush_dma();
+        dma->poll_dma_cq([&done](uint64_t) { done++; });
+    }
+    size_t end = get_tsc();
+
+    double ns = (end - begin) / get_tsc_freq_per_ns();
+    return FLAGS_dma_ops * payload_size * 8 / ns;
+}
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    rdma_param param;
+    param.device_name = FLAGS_deviceName;
+    param.numa_node = FLAGS_numaNode;
+    roce_init(param, 1);
+    ibv_context *context = param.contexts[0];
+    ibv_pd *pd;
+    assert(pd = ibv_alloc_pd(context));
+
+    void *src_buf = get_huge_mem(FLAGS_numaNode, region_size);
+    void *dst_buf = get_huge_mem(FLAGS_numaNode, region_size);
+    memset(src_buf, 0x5a, region_size);
+    ibv_mr *src_mr, *dst_mr;
+    assert(src_mr = ibv_reg_mr(pd, src_buf, region_size, IBV_ACCESS_LOCAL_WRITE));
+    assert(dst_mr = ibv_reg_mr(pd, dst_buf, region_size, IBV_ACCESS_LOCAL_WRITE));
+
+    const size_t payload_sizes[] = { 64, 256, 1024, 4096, 8192, 16384, 65536 };
+    printf("%8s", "group");
+    for (size_t payload_size : payload_sizes) {
+        printf(" %8zuB", payload_size);
+    }
+    printf("   (Gbps)\n");
+
+    for (uint32_t group_size = 1;group_size <= SMARTNS_DMA_MAX_GROUP_SIZE;group_size *= 2) {
+        dma_handler *dma = new dma_handler(context, pd, group_size);
+        printf("%8u", group_size);
+        for (size_t payload_size : payload_sizes) {
+            printf(" %9.1f", run(dma, src_mr, dst_mr, payload_size));
+            fflush(stdout);
+        }
+        printf("\n");
+        delete dma;
+    }
+
+    ibv_dereg_mr(src_mr);
+    ibv_dereg_mr(dst_mr);
+    free_huge_mem(src_buf);
+    free_huge_mem(dst_buf);
+    ibv_dealloc_pd(pd);
+    return 0;
+}
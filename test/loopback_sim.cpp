@@ -0,0 +1,873 @@
+#include "loopback_sim.h"
+#include <algorithm>
+#include <bit>
+
+DEFINE_bool(async_dma, false, "DMA QPs finish a random prefix of their ops per poll instead of at once");
+DEFINE_uint64(dma_group, 1, "payload DMA QPs per datapath thread");
+DEFINE_bool(zero_copy, false, "receive single packet sends into host buffers");
+DEFINE_uint64(ack_coalesce, RXE_ACK_COALESCE_PKTS, "requests a QP acks at once");
+DEFINE_uint64(sched_quantum, RXE_SCHED_QUANTUM, "bytes a weight 1 QP may send per round");
+DEFINE_string(rx_invalidate, "always", "rx buffer invalidation: always, never or auto");
+DEFINE_uint64(llc_bytes, SMARTNS_RX_LLC_KB * 1024 / SMARTNS_TX_RX_CORE, "rx bytes in flight the auto policy assumes still cached");
+DEFINE_string(cc_algo, "none", "none, window or rate");
+DEFINE_bool(send_wq_pull, false, "the DPU reads send WQEs from host memory");
+DEFINE_uint64(inline_size, 0, "sends and writes up to this size are posted inline");
+DEFINE_uint64(send_sge, 1, "SGEs a send or write payload is split into");
+
+std::atomic<bool> stop_flag = false;
+
+size_t sim_doorbells = 0;
+size_t sim_invalidates = 0;
+size_t sim_inline_sends = 0;
+size_t sim_sge_sends = 0;
+
+static ibv_context fake_ctx;
+static std::mt19937_64 dma_rng(7);
+static std::vector<fake_dma_qp *> async_dma_qps;
+static sim_node *creating_node;
+static bool in_dma_batch = false;
+static uint32_t next_mkey = 1000;
+// the fence dmas and invalidates of flush_dma share a line on purpose
+static const uint32_t fence_lkey = 78;
+
+static void push_wc(fake_cq *cq, uint64_t wr_id, ibv_wc_opcode opcode, uint32_t qp_num, uint32_t byte_len) {
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = wr_id;
+    wc.status = IBV_WC_SUCCESS;
+    wc.opcode = opcode;
+    wc.qp_num = qp_num;
+    wc.byte_len = byte_len;
+    cq->wcs.push_back(wc);
+}
+
+static int fake_poll_cq(ibv_cq *cq, int num_entries, ibv_wc *wc) {
+    fake_cq *fcq = reinterpret_cast<fake_cq *>(cq);
+    for (fake_dma_qp *dma : fcq->async_qps) {
+        size_t done = dma->pending.empty() ? 0 : dma_rng() % (dma->pending.size() + 1);
+        for (size_t i = 0;i < done;i++) {
+            fake_dma_op op = dma->pending.front();
+            dma->pending.pop_front();
+            if (op.dst) {
+                memcpy(reinterpret_cast<void *>(op.dst), reinterpret_cast<void *>(op.src), op.len);
+            }
+            if (op.signaled) {
+                push_wc(fcq, op.wr_id, IBV_WC_DRIVER1, dma->qpx.qp_base.qp_num, 0);
+            }
+        }
+    }
+    int polled = 0;
+    while (polled < num_entries && !fcq->wcs.empty()) {
+        wc[polled++] = fcq->wcs.front();
+        fcq->wcs.pop_front();
+    }
+    return polled;
+}
+
+// a frame per send WR onto the sender's link
+static int fake_post_send(ibv_qp *qp, ibv_send_wr *wr, ibv_send_wr **bad_wr) {
+    fake_qp *fqp = reinterpret_cast<fake_qp *>(qp);
+    for (;wr;wr = wr->next) {
+        std::vector<uint8_t> frame;
+        for (int i = 0;i < wr->num_sge;i++) {
+            uint8_t *addr = reinterpret_cast<uint8_t *>(wr->sg_list[i].addr);
+            frame.insert(frame.end(), addr, addr + wr->sg_list[i].length);
+        }
+        fqp->owner->out.inflight.push_back(std::move(frame));
+        if (wr->send_flags & IBV_SEND_SIGNALED) {
+            push_wc(fqp->scq, wr->wr_id, IBV_WC_SEND, 0, 0);
+        }
+    }
+    return 0;
+}
+
+// a buffer back in the recv queue must not be read or invalidated anymore
+static void check_no_pending_dma(uint64_t addr, size_t len) {
+    for (fake_dma_qp *dma : async_dma_qps) {
+        for (fake_dma_op &op : dma->pending) {
+            if (op.src < addr + len && addr < op.src + op.len) {
+                fprintf(stderr, "buffer %lx reused with a pending %s\n", addr, op.dst ? "dma" : "invalidate");
+                abort();
+            }
+        }
+    }
+}
+
+// an invalidate may drop cache lines a pending dma has still to read
+static void check_no_pending_read(uint64_t addr, size_t len) {
+    for (fake_dma_qp *dma : async_dma_qps) {
+        for (fake_dma_op &op : dma->pending) {
+            if (op.dst && op.src < addr + len && addr < op.src + op.len) {
+                fprintf(stderr, "invalidate of %lx overlaps a pending dma from %lx\n", addr, op.src);
+                abort();
+            }
+        }
+    }
+}
+
+static int fake_post_recv(ibv_qp *qp, ibv_recv_wr *wr, ibv_recv_wr **bad_wr) {
+    fake_qp *fqp = reinterpret_cast<fake_qp *>(qp);
+    for (;wr;wr = wr->next) {
+        for (int i = 0;i < wr->num_sge;i++) {
+            check_no_pending_dma(wr->sg_list[i].addr, wr->sg_list[i].length);
+        }
+        fake_rx_buf buf;
+        buf.wr_id = wr->wr_id;
+        buf.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+        fqp->rq.push_back(buf);
+    }
+    return 0;
+}
+
+static fake_dma_qp *dma_of(mlx5dv_qp_ex *mqpx) {
+    return reinterpret_cast<fake_dma_qp *>(reinterpret_cast<char *>(mqpx) - offsetof(fake_dma_qp, mqpx));
+}
+
+static bool is_async(fake_dma_qp *dma) {
+    return std::find(dma->cq->async_qps.begin(), dma->cq->async_qps.end(), dma) != dma->cq->async_qps.end();
+}
+
+static void fake_wr_start(ibv_qp_ex *qpx) {
+    assert(!in_dma_batch);
+    in_dma_batch = true;
+}
+
+static int fake_wr_complete(ibv_qp_ex *qpx) {
+    assert(in_dma_batch);
+    in_dma_batch = false;
+    sim_doorbells++;
+    return 0;
+}
+
+static void fake_memcpy_direct(mlx5dv_qp_ex *mqpx, uint32_t dest_lkey, uint64_t dest_addr, uint32_t src_lkey, uint64_t src_addr, size_t length) {
+    fake_dma_qp *dma = dma_of(mqpx);
+    bool signaled = dma->qpx.wr_flags & IBV_SEND_SIGNALED;
+    assert(length > 0);
+    if (!in_dma_batch) {
+        sim_doorbells++;
+    }
+    if (is_async(dma)) {
+        dma->pending.push_back({ dest_addr, src_addr, length, signaled, dma->qpx.wr_id });
+        return;
+    }
+    memcpy(reinterpret_cast<void *>(dest_addr), reinterpret_cast<void *>(src_addr), length);
+    if (signaled) {
+        push_wc(dma->cq, dma->qpx.wr_id, IBV_WC_DRIVER1, dma->qpx.qp_base.qp_num, 0);
+    }
+}
+
+static void fake_invcache_direct(mlx5dv_qp_ex *mqpx, uint32_t lkey, uint64_t addr, size_t length, bool flag) {
+    fake_dma_qp *dma = dma_of(mqpx);
+    bool signaled = dma->qpx.wr_flags & IBV_SEND_SIGNALED;
+    assert(length > 0 && length % 64 == 0);
+    sim_invalidates++;
+    if (!in_dma_batch) {
+        sim_doorbells++;
+    }
+    if (lkey != fence_lkey) {
+        check_no_pending_read(addr, length);
+    }
+    if (is_async(dma)) {
+        dma->pending.push_back({ 0, addr, length, signaled, dma->qpx.wr_id });
+        return;
+    }
+    if (signaled) {
+        push_wc(dma->cq, dma->qpx.wr_id, IBV_WC_DRIVER1, dma->qpx.qp_base.qp_num, 0);
+    }
+}
+
+static void fake_wr_init(mlx5dv_qp_ex *mqpx) {
+}
+
+ibv_qp *sim_create_qp(ibv_pd *pd, ibv_qp_init_attr *attr) {
+    fake_qp *fqp = new fake_qp();
+    fqp->qp.context = &fake_ctx;
+    fqp->owner = creating_node;
+    fqp->scq = reinterpret_cast<fake_cq *>(attr->send_cq);
+    fqp->rcq = reinterpret_cast<fake_cq *>(attr->recv_cq);
+    return &fqp->qp;
+}
+
+int sim_modify_qp(ibv_qp *qp, ibv_qp_attr *attr, int mask) {
+    fake_qp *fqp = reinterpret_cast<fake_qp *>(qp);
+    if (attr->qp_state == IBV_QPS_RESET) {
+        // like mlx5 cq clean, unpolled completions of the qp go with its WQEs
+        uint32_t qp_num = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(fqp));
+        std::deque<ibv_wc> &wcs = fqp->rcq->wcs;
+        fqp->rq.clear();
+        wcs.erase(std::remove_if(wcs.begin(), wcs.end(), [qp_num](const ibv_wc &wc) { return wc.qp_num == qp_num; }), wcs.end());
+    }
+    return 0;
+}
+
+int sim_destroy_qp(ibv_qp *qp) {
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    sim_modify_qp(qp, &attr, IBV_QP_STATE);
+    delete reinterpret_cast<fake_qp *>(qp);
+    return 0;
+}
+
+ibv_flow *sim_create_flow(ibv_qp *qp, ibv_flow_attr *attr) {
+    fake_qp *fqp = reinterpret_cast<fake_qp *>(qp);
+    ibv_flow_spec_tcp_udp *udp = reinterpret_cast<ibv_flow_spec_tcp_udp *>(reinterpret_cast<ibv_flow_spec_eth *>(attr + 1) + 1);
+    fake_flow *flow = new fake_flow();
+    flow->qp = fqp;
+    flow->port = ntohs(udp->val.dst_port);
+    assert(!fqp->owner->zc_flows.count(flow->port));
+    fqp->owner->zc_flows[flow->port] = fqp;
+    return &flow->flow;
+}
+
+int sim_destroy_flow(ibv_flow *flow) {
+    fake_flow *fflow = reinterpret_cast<fake_flow *>(flow);
+    fflow->qp->owner->zc_flows.erase(fflow->port);
+    delete fflow;
+    return 0;
+}
+
+static ibv_mr *fake_mr(uint32_t lkey) {
+    ibv_mr *mr = new ibv_mr();
+    memset(mr, 0, sizeof(*mr));
+    mr->lkey = lkey;
+    return mr;
+}
+
+ibv_mr *sim_reg_mr(ibv_pd *pd, void *addr, size_t length, int access) {
+    return fake_mr(3);
+}
+
+int sim_dereg_mr(ibv_mr *mr) {
+    delete mr;
+    return 0;
+}
+
+static fake_cq *new_fake_cq() {
+    fake_cq *cq = new fake_cq();
+    cq->cq.context = &fake_ctx;
+    return cq;
+}
+
+static fake_dma_qp *new_fake_dma_qp(fake_cq *cq, bool async) {
+    static uint32_t qp_num = 1000;
+    fake_dma_qp *dma = new fake_dma_qp();
+    dma->qpx.qp_base.context = &fake_ctx;
+    dma->qpx.qp_base.qp_num = qp_num++;
+    dma->qpx.wr_start = fake_wr_start;
+    dma->qpx.wr_complete = fake_wr_complete;
+    dma->mqpx.wr_memcpy_direct_init = fake_wr_init;
+    dma->mqpx.wr_memcpy_direct = fake_memcpy_direct;
+    dma->mqpx.wr_memcpy = fake_memcpy_direct;
+    dma->mqpx.wr_invcache_direct_init = fake_wr_init;
+    dma->mqpx.wr_invcache_direct = fake_invcache_direct;
+    dma->cq = cq;
+    if (async) {
+        cq->async_qps.push_back(dma);
+        async_dma_qps.push_back(dma);
+    }
+    return dma;
+}
+
+void sim_init() {
+    memset(&fake_ctx, 0, sizeof(fake_ctx));
+    fake_ctx.ops.poll_cq = fake_poll_cq;
+    fake_ctx.ops.post_send = fake_post_send;
+    fake_ctx.ops.post_recv = fake_post_recv;
+}
+
+// zeroed and cache line aligned, the handlers are set up field by field
+template <typename T>
+static T *zeroed_new() {
+    void *addr = aligned_alloc(64, round_up(sizeof(T), 64));
+    memset(addr, 0, sizeof(T));
+    return reinterpret_cast<T *>(addr);
+}
+
+static void *zeroed_buf(size_t size) {
+    void *addr = aligned_alloc(4096, round_up(size, 4096));
+    memset(addr, 0, size);
+    return addr;
+}
+
+static txpath_handler *make_txpath(sim_node *n) {
+    txpath_handler *tx = zeroed_new<txpath_handler>();
+    new (&tx->send_offset_handler) offset_handler(SMARTNS_TX_DEPTH, SMARTNS_TX_PACKET_BUFFER, 0);
+    new (&tx->send_comp_offset_handler) offset_handler(SMARTNS_TX_DEPTH, SMARTNS_TX_PACKET_BUFFER, 0);
+    tx->send_buf_addr = reinterpret_cast<size_t>(zeroed_buf(SMARTNS_TX_DEPTH * SMARTNS_TX_PACKET_BUFFER));
+    tx->tx_depth = SMARTNS_TX_DEPTH;
+    tx->num_wrs = SMARTNS_TX_BATCH;
+    tx->num_sges_per_wr = SMARTNS_TX_SEG;
+    tx->num_sges = tx->num_wrs * tx->num_sges_per_wr;
+    tx->send_sge_list = new ibv_sge[tx->num_sges]();
+    tx->send_wr = new ibv_send_wr[tx->num_wrs]();
+    for (size_t i = 0;i < tx->num_wrs;i++) {
+        tx->send_wr[i].sg_list = tx->send_sge_list + i * tx->num_sges_per_wr;
+        tx->send_wr[i].num_sge = tx->num_sges_per_wr;
+        tx->send_wr[i].opcode = IBV_WR_SEND;
+    }
+    tx->mr = fake_mr(1);
+
+    n->raw_send_cq = new_fake_cq();
+    n->raw_recv_cq = new_fake_cq();
+    n->raw_qp = new fake_qp();
+    n->raw_qp->qp.context = &fake_ctx;
+    n->raw_qp->owner = n;
+    n->raw_qp->scq = n->raw_send_cq;
+    n->raw_qp->rcq = n->raw_recv_cq;
+    tx->send_cq = &n->raw_send_cq->cq;
+    tx->recv_cq = &n->raw_recv_cq->cq;
+    tx->send_recv_qp = &n->raw_qp->qp;
+    tx->dst_port = tx->pkt_dst_port = htons(SMARTNS_UDP_MAGIC_PORT);
+    return tx;
+}
+
+static rxpath_handler *make_rxpath(sim_node *n, txpath_handler *tx) {
+    rxpath_handler *rx = zeroed_new<rxpath_handler>();
+    new (&rx->recv_offset_handler) offset_handler(SMARTNS_RX_DEPTH, SMARTNS_RX_PACKET_BUFFER, 0);
+    new (&rx->recv_comp_offset_handler) offset_handler(SMARTNS_RX_DEPTH, SMARTNS_RX_PACKET_BUFFER, 0);
+    rx->recv_buf_addr = reinterpret_cast<size_t>(zeroed_buf(SMARTNS_RX_BUF_SIZE));
+    rx->hdr_ring_addr = rx->recv_buf_addr + SMARTNS_RX_DEPTH * SMARTNS_RX_PACKET_BUFFER;
+    rx->rx_depth = SMARTNS_RX_DEPTH;
+    rx->num_wrs = SMARTNS_RX_BATCH;
+    rx->num_sges_per_wr = SMARTNS_RX_SEG;
+    rx->num_sges = rx->num_wrs * rx->num_sges_per_wr;
+    rx->recv_sge_list = new ibv_sge[rx->num_sges]();
+    rx->recv_wr = new ibv_recv_wr[rx->num_wrs]();
+    for (size_t i = 0;i < rx->num_wrs;i++) {
+        rx->recv_wr[i].sg_list = rx->recv_sge_list + i * rx->num_sges_per_wr;
+        rx->recv_wr[i].num_sge = rx->num_sges_per_wr;
+    }
+    rx->mr = fake_mr(2);
+    rx->recv_cq = tx->recv_cq;
+    rx->send_recv_qp = tx->send_recv_qp;
+    rx->recv_buf_ref = new uint16_t[SMARTNS_RX_DEPTH]();
+#if SMARTNS_RX_MPRQ
+    uint32_t wqes = SMARTNS_RX_MPRQ_WQES;
+    uint32_t cqes = SMARTNS_RX_MPRQ_CQ_DEPTH;
+    rx->mprq_wqes = reinterpret_cast<uint8_t *>(zeroed_buf(wqes * sizeof(mlx5_mprq_wqe)));
+    rx->mprq_wqe_cnt = wqes;
+    rx->mprq_wqe_stride = sizeof(mlx5_mprq_wqe);
+    rx->mprq_wq_dbrec = &n->mprq.wq_db;
+    for (uint32_t i = 0;i < wqes;i++) {
+        mlx5_mprq_wqe *wqe = reinterpret_cast<mlx5_mprq_wqe *>(rx->mprq_wqes + i * rx->mprq_wqe_stride);
+        wqe->dseg.byte_count = htobe32(1u << SMARTNS_RX_MPRQ_LOG_BUF_SIZE);
+        wqe->dseg.lkey = htobe32(rx->mr->lkey);
+    }
+    rx->mprq_cqes = reinterpret_cast<uint8_t *>(zeroed_buf(cqes * sizeof(mlx5_cqe64)));
+    rx->mprq_cqe_cnt = cqes;
+    rx->mprq_cqe_size = sizeof(mlx5_cqe64);
+    rx->mprq_cq_dbrec = &n->mprq.cq_db;
+    for (uint32_t i = 0;i < cqes;i++) {
+        reinterpret_cast<mlx5_cqe64 *>(rx->mprq_cqes + i * rx->mprq_cqe_size)->op_own = (MLX5_CQE_INVALID << 4) | 1;
+    }
+    rx->mprq_slot_buf = new uint32_t[wqes]();
+    rx->mprq_buf_ref = new uint32_t[SMARTNS_RX_MPRQ_BUFS]();
+    rx->mprq_free_bufs = new uint32_t[SMARTNS_RX_MPRQ_BUFS];
+    rx->mprq_free_cnt = 0;
+    for (uint32_t i = SMARTNS_RX_MPRQ_BUFS;i > 0;i--) {
+        rx->mprq_free_bufs[rx->mprq_free_cnt++] = i - 1;
+    }
+    rx->flush_recv_buffer();
+#else
+    for (size_t i = 0;i < SMARTNS_RX_DEPTH;i++) {
+        fake_rx_buf buf;
+        buf.wr_id = rx->recv_offset_handler.offset() + rx->recv_buf_addr;
+        if (SMARTNS_RX_HDR_SPLIT) {
+            buf.sges.push_back({ rx->frame_hdr(buf.wr_id), rxpath_handler::hdr_split_bytes, 0 });
+        }
+        buf.sges.push_back({ buf.wr_id, SMARTNS_RX_PACKET_BUFFER, 0 });
+        n->raw_qp->rq.push_back(buf);
+        rx->recv_offset_handler.step();
+    }
+    rx->posted_buffers = SMARTNS_RX_DEPTH;
+#endif
+    return rx;
+}
+
+static dma_handler *make_dma() {
+    dma_handler *dma = zeroed_new<dma_handler>();
+    fake_cq *dma_cq = new_fake_cq();
+    fake_cq *invalid_cq = new_fake_cq();
+    fake_cq *atomic_cq = new_fake_cq();
+    uint32_t group = FLAGS_dma_group;
+    dma->dma_send_recv_cq = &dma_cq->cq;
+    dma->invalid_send_recv_cq = &invalid_cq->cq;
+    dma->group_size = group;
+    dma->now_use_qp_index = 0;
+    dma->outstanding_bytes_list = new uint64_t[group]();
+    dma->pending_len_list = new uint32_t[group * dma_handler::dma_depth]();
+    dma->pending_buf_list = new uint64_t[group * dma_handler::dma_depth]();
+    dma->pending_head_list = new uint32_t[group]();
+    dma->pending_tail_list = new uint32_t[group]();
+    dma->dma_qp_list = new ibv_qp *[group];
+    dma->dma_qpx_list = new ibv_qp_ex *[group];
+    dma->dma_mqpx_list = new mlx5dv_qp_ex *[group];
+    dma->dma_count_list = new uint32_t[group]();
+    dma->payload_count_list = new uint64_t[group]();
+    dma->invalid_qp_list = new ibv_qp *[group];
+    dma->invalid_qpx_list = new ibv_qp_ex *[group];
+    dma->invalid_mqpx_list = new mlx5dv_qp_ex *[group];
+    dma->invalid_start_index_list = new uint32_t[group]();
+    dma->invalid_finish_index_list = new uint32_t[group]();
+    dma->invalid_count_list = new uint32_t[group]();
+    dma->invalid_buf_list = new uint64_t[group * dma_handler::invalid_depth]();
+    dma->invalid_deferred_list = new uint32_t[group]();
+    dma->pending_deferred_list = new uint32_t[group * dma_handler::dma_depth]();
+    dma->deferred_list = new deferred_invalidate[group * dma_handler::dma_depth]();
+    dma->deferred_free_list = new uint32_t[group * dma_handler::dma_depth];
+    for (uint32_t i = 0;i < group * dma_handler::dma_depth;i++) {
+        dma->deferred_free_list[i] = i;
+    }
+    dma->deferred_free_cnt = group * dma_handler::dma_depth;
+    for (uint32_t i = 0;i < group;i++) {
+        fake_dma_qp *payload = new_fake_dma_qp(dma_cq, FLAGS_async_dma);
+        dma->dma_qp_list[i] = &payload->qpx.qp_base;
+        dma->dma_qpx_list[i] = &payload->qpx;
+        dma->dma_mqpx_list[i] = &payload->mqpx;
+        fake_dma_qp *invalid = new_fake_dma_qp(invalid_cq, FLAGS_async_dma);
+        dma->invalid_qp_list[i] = &invalid->qpx.qp_base;
+        dma->invalid_qpx_list[i] = &invalid->qpx;
+        dma->invalid_mqpx_list[i] = &invalid->mqpx;
+    }
+    fake_dma_qp *cqe = new_fake_dma_qp(invalid_cq, false);
+    dma->cqe_qp = &cqe->qpx.qp_base;
+    dma->cqe_qpx = &cqe->qpx;
+    dma->cqe_mqpx = &cqe->mqpx;
+    dma->cqe_run_list = new cqe_run[SMARTNS_CQE_RUN_DEPTH]();
+    dma->cqe_fence_list = new cqe_fence[SMARTNS_CQE_FENCE_DEPTH]();
+    fake_dma_qp *atomic = new_fake_dma_qp(atomic_cq, FLAGS_async_dma);
+    dma->atomic_cq = &atomic_cq->cq;
+    dma->atomic_qp = &atomic->qpx.qp_base;
+    dma->atomic_qpx = &atomic->qpx;
+    dma->atomic_mqpx = &atomic->mqpx;
+    dma->atomic_buf = new uint64_t[SMARTNS_ATOMIC_DEPTH + SMARTNS_ATOMIC_INFLIGHT]();
+    dma->atomic_stage_free_list = new uint32_t[SMARTNS_ATOMIC_INFLIGHT];
+    for (uint32_t i = 0;i < SMARTNS_ATOMIC_INFLIGHT;i++) {
+        dma->atomic_stage_free_list[i] = i;
+    }
+    dma->atomic_stage_free_cnt = SMARTNS_ATOMIC_INFLIGHT;
+    dma->atomic_mr = fake_mr(77);
+    dma->fence_buf = new uint64_t[16]();
+    dma->fence_mr = fake_mr(fence_lkey);
+    dma->fence_line = round_up(reinterpret_cast<uint64_t>(dma->fence_buf), 64);
+    return dma;
+}
+
+sim_node *sim_make_node(const char *name, sim_node *peer) {
+    sim_node *n = new sim_node();
+    n->name = name;
+    n->peer = peer;
+    if (peer) {
+        peer->peer = n;
+    }
+    n->send_own = 1;
+
+    datapath_manager *data_manager = zeroed_new<datapath_manager>();
+    new (&data_manager->datapath_handler_list) std::array<datapath_handler, SMARTNS_TX_RX_CORE>();
+    datapath_handler &h = data_manager->datapath_handler_list[0];
+    n->handler = &h;
+    h.thread_id = 0;
+    h.txpath_handler = make_txpath(n);
+    h.rxpath_handler = make_rxpath(n, h.txpath_handler);
+    h.dma_handler = make_dma();
+    h.wc_send_recv = new ibv_wc[CTX_POLL_BATCH];
+    h.rx_batch = new rxe_rx_pkt[CTX_POLL_BATCH];
+    h.ack_pending_qps = new dpu_qp *[CTX_POLL_BATCH + RXE_ZC_POLL_BATCH];
+    h.ack_pending_cnt = 0;
+    h.cqe_pending_cqs = new dpu_cq *[SMARTNS_CQE_PENDING_CQS];
+    h.cqe_pending_cnt = 0;
+    h.rx_zero_copy = FLAGS_zero_copy;
+    h.zc_cq = &new_fake_cq()->cq;
+    h.zc_scan_tsc = 0;
+    h.zc_rearm_tsc = RXE_ZC_REARM_US * 1000 * get_tsc_freq_per_ns();
+    h.retrans_timeout_tsc = 200 * 1000 * get_tsc_freq_per_ns();
+    h.retrans_timer.init(RXE_TIMER_WHEEL_SLOTS, RXE_TIMER_TICK_US * 1000 * get_tsc_freq_per_ns(), get_tsc());
+    h.ack_coalesce_pkts = FLAGS_ack_coalesce;
+    h.ack_delay_tsc = RXE_ACK_DELAY_US * 1000 * get_tsc_freq_per_ns();
+    h.ack_timer.init(RXE_ACK_TIMER_SLOTS, 1000 * get_tsc_freq_per_ns(), get_tsc());
+    h.rx_drop_threshold = 0;
+    h.rx_reorder_threshold = 0;
+    h.fault_rand_state = 0x9E3779B97F4A7C15ULL;
+    h.sched_quantum = FLAGS_sched_quantum;
+    h.sched_burst = RXE_SCHED_BURST;
+    h.invalidate_policy = parse_rx_invalidate_policy(FLAGS_rx_invalidate.c_str());
+    if (h.invalidate_policy == RX_INVALIDATE_ALWAYS && FLAGS_rx_invalidate != "always") {
+        SMARTNS_ERROR("unknown rx invalidate policy %s", FLAGS_rx_invalidate.c_str());
+        exit(1);
+    }
+    h.invalidate_llc_bytes = FLAGS_llc_bytes;
+    h.qp_table = new dpu_qp *[SMARTNS_MAX_QP]();
+    rxe_cc_default_param(&h.cc_param, rxe_cc_parse_algo(FLAGS_cc_algo.c_str()), get_tsc_freq_per_ns(), 4096, 10, 25);
+    memset(&h.counters, 0, sizeof(h.counters));
+
+    controlpath_manager *control = zeroed_new<controlpath_manager>();
+    new (&control->context_list) decltype(control->context_list)();
+    control->data_manager = data_manager;
+    n->control = control;
+
+    dpu_context *ctx = new dpu_context();
+    ctx->context_number = 0;
+    ctx->inner_bf_mr = new devx_mr();
+    ctx->inner_bf_mr->lkey = 10;
+    ctx->inner_host_mr = new devx_mr();
+    ctx->inner_host_mr->lkey = 11;
+    ctx->datapath_send_wq_list.resize(SMARTNS_TX_RX_CORE);
+    dpu_datapath_send_wq &wq = ctx->datapath_send_wq_list[0];
+    wq.dpu_ctx = ctx;
+    wq.datapath_send_wq_id = 0;
+    wq.bf_datapath_send_wq_buf = zeroed_buf(sizeof(smartns_send_wqe) * SMARTNS_TX_DEPTH);
+    wq.wqe_size = sizeof(smartns_send_wqe);
+    wq.wqe_cnt = SMARTNS_TX_DEPTH;
+    wq.wqe_shift = std::log2(wq.wqe_size);
+    wq.head = 0;
+    wq.own_flag = 1;
+    h.active_datapath_send_wq_list.insert(&wq);
+    dpu_pd *pd = new dpu_pd();
+    pd->dpu_ctx = ctx;
+    pd->pd_number = 0;
+    ctx->pd_list[0] = pd;
+    control->context_list[0] = ctx;
+    n->ctx = ctx;
+
+    if (FLAGS_send_wq_pull) {
+        n->pull_sq = zeroed_buf(sizeof(smartns_send_wqe) * SMARTNS_TX_DEPTH);
+        n->pull_db = reinterpret_cast<smartns_wq_doorbell *>(zeroed_buf(sizeof(smartns_wq_doorbell)));
+        SMARTNS_SET_SEND_WQ_PULL_PARAMS param;
+        memset(&param, 0, sizeof(param));
+        param.context_number = 0;
+        param.datapath_send_wq_id = 0;
+        param.host_send_wq_buf = n->pull_sq;
+        param.host_doorbell = n->pull_db;
+        param.bf_doorbell = zeroed_buf(sizeof(smartns_wq_doorbell));
+        wq.bf_mkey = ctx->inner_bf_mr->lkey;
+        wq.host_mkey = ctx->inner_host_mr->lkey;
+        control->handle_set_send_wq_pull(&param);
+        assert(param.common_params.success && wq.pull);
+    }
+
+    n->out.rng.seed(42);
+    return n;
+}
+
+dpu_cq *sim_make_cq(sim_node *n, uint32_t depth) {
+    SMARTNS_CREATE_CQ_PARAMS param;
+    memset(&param, 0, sizeof(param));
+    param.context_number = 0;
+    param.max_num = depth;
+    param.host_cq_buf = zeroed_buf(depth * sizeof(smartns_cqe));
+    param.bf_cq_buf = zeroed_buf(depth * sizeof(smartns_cqe));
+    param.host_cq_doorbell = zeroed_buf(sizeof(smartns_cq_doorbell));
+    param.bf_cq_doorbell = zeroed_buf(sizeof(smartns_cq_doorbell));
+    n->control->handle_create_cq(&param);
+    return n->ctx->cq_list[param.cq_number];
+}
+
+dpu_qp *sim_make_qp(sim_node *n, dpu_cq *send_cq, dpu_cq *recv_cq, uint32_t max_send_wr, uint32_t max_recv_wr, uint32_t max_recv_sge) {
+    SMARTNS_CREATE_QP_PARAMS param;
+    memset(&param, 0, sizeof(param));
+    param.context_number = 0;
+    param.pd_number = 0;
+    param.datapath_send_wq_id = 0;
+    param.send_cq_number = send_cq->cq_number;
+    param.recv_cq_number = recv_cq->cq_number;
+    param.max_send_wr = max_send_wr;
+    param.max_recv_wr = max_recv_wr;
+    param.max_send_sge = SMARTNS_MAX_SEND_SGE;
+    // rounded up like smartns_create_qp does
+    param.max_recv_sge = std::bit_ceil(max_recv_sge);
+    param.bf_recv_wq_addr = zeroed_buf(static_cast<size_t>(max_recv_wr) * param.max_recv_sge * sizeof(smartns_recv_wqe));
+    param.qp_type = IBV_QPT_RC;
+    creating_node = n;
+    n->control->handle_create_qp(&param);
+    return n->ctx->qp_list[param.qp_number];
+}
+
+void sim_connect_qp(sim_node *a, dpu_qp *qa, sim_node *b, dpu_qp *qb) {
+    SMARTNS_MODIFY_QP_PARAMS param;
+    memset(&param, 0, sizeof(param));
+    param.context_number = 0;
+    param.pd_number = 0;
+    param.qp_number = qa->qp_number;
+    param.remote_qp_number = qb->qp_number;
+    a->control->handle_modify_qp(&param);
+    param.qp_number = qb->qp_number;
+    param.remote_qp_number = qa->qp_number;
+    b->control->handle_modify_qp(&param);
+}
+
+dpu_mr *sim_make_mr(sim_node *n, void *addr, size_t len) {
+    dpu_mr *mr = new dpu_mr();
+    mr->host_mkey = next_mkey++;
+    mr->devx_mr = new devx_mr();
+    mr->devx_mr->lkey = mr->host_mkey;
+    mr->devx_mr->addr = addr;
+    mr->devx_mr->length = len;
+    mr->dpu_pd = n->ctx->pd_list[0];
+    mr->access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC;
+    n->ctx->mr_list[mr->host_mkey] = mr;
+    return mr;
+}
+
+void sim_dereg_mr(sim_node *n, dpu_mr *mr) {
+    n->handler->mr_list_mutex.lock();
+    n->ctx->mr_list.erase(mr->host_mkey);
+    n->handler->mr_list_mutex.unlock();
+    delete mr->devx_mr;
+    delete mr;
+}
+
+static uint8_t *send_wq_base(sim_node *n) {
+    dpu_datapath_send_wq &wq = n->ctx->datapath_send_wq_list[0];
+    return reinterpret_cast<uint8_t *>(n->pull_sq ? n->pull_sq : wq.bf_datapath_send_wq_buf);
+}
+
+// slot pos of the host send ring, with the owner bit it gets on this lap
+template <typename SEG>
+static SEG *send_wq_slot(sim_node *n, uint32_t pos) {
+    dpu_datapath_send_wq &wq = n->ctx->datapath_send_wq_list[0];
+    return reinterpret_cast<SEG *>(send_wq_base(n) + ((pos % wq.wqe_cnt) << wq.wqe_shift));
+}
+
+static uint8_t lap_own(sim_node *n, uint32_t pos) {
+    return ((pos / n->ctx->datapath_send_wq_list[0].wqe_cnt) & 1) ? 0 : 1;
+}
+
+// the owner bit of the WQE is written last, after its extra slots
+static uint32_t publish_send(sim_node *n, smartns_send_wqe *wqe, uint32_t segs) {
+    uint32_t pos = n->send_head;
+    wqe->op_own = n->send_own;
+    n->send_head += 1 + segs;
+    if (n->pull_db) {
+        n->pull_db->producer_index = n->send_head;
+    }
+    n->send_own = lap_own(n, n->send_head);
+    return pos;
+}
+
+uint32_t sim_post_send(sim_node *n, dpu_qp *qp, int opcode, void *local, uint32_t len, uint64_t remote, uint32_t rkey, bool signal) {
+    smartns_send_wqe *wqe = send_wq_slot<smartns_send_wqe>(n, n->send_head);
+    bool has_payload = len > 0 && (opcode == IBV_WR_SEND || opcode == IBV_WR_RDMA_WRITE);
+    wqe->qpn = qp->qp_number;
+    wqe->opcode = opcode;
+    wqe->imm = 0;
+    wqe->local_addr = reinterpret_cast<uint64_t>(local);
+    wqe->local_lkey = 1;
+    wqe->byte_count = len;
+    wqe->remote_addr = remote;
+    wqe->remote_rkey = rkey;
+    wqe->cur_pos = n->send_head;
+    wqe->is_signal = signal;
+    wqe->inline_segs = 0;
+    wqe->num_sge = 1;
+
+    uint32_t segs = 0;
+    if (has_payload && len <= FLAGS_inline_size) {
+        segs = (len + SMARTNS_SEND_INLINE_SEG_SIZE - 1) / SMARTNS_SEND_INLINE_SEG_SIZE;
+        for (uint32_t i = 0;i < segs;i++) {
+            uint32_t pos = n->send_head + 1 + i;
+            uint32_t offset = i * SMARTNS_SEND_INLINE_SEG_SIZE;
+            smartns_send_inline_seg *seg = send_wq_slot<smartns_send_inline_seg>(n, pos);
+            memcpy(seg->data, reinterpret_cast<uint8_t *>(local) + offset, min_t(uint32_t, SMARTNS_SEND_INLINE_SEG_SIZE, len - offset));
+            seg->op_own = lap_own(n, pos);
+        }
+        wqe->inline_segs = segs;
+        wqe->local_addr = 0xdead;
+        sim_inline_sends++;
+    } else if (has_payload && FLAGS_send_sge > 1) {
+        // uneven pieces with an empty one second
+        uint32_t num_sge = FLAGS_send_sge;
+        uint32_t offset = 0;
+        std::vector<smartns_send_sge> sge_list;
+        for (uint32_t j = 0;j < num_sge;j++) {
+            uint32_t piece = j + 1 == num_sge ? len - offset : (j == 1 ? 0 : min_t(uint32_t, len - offset, len / num_sge + 37 * j));
+            sge_list.push_back({ reinterpret_cast<uint64_t>(local) + offset, 1, piece });
+            offset += piece;
+        }
+        segs = (num_sge + SMARTNS_SEND_SGE_PER_SEG - 1) / SMARTNS_SEND_SGE_PER_SEG;
+        for (uint32_t i = 0;i < segs;i++) {
+            uint32_t pos = n->send_head + 1 + i;
+            smartns_send_sge_seg *seg = send_wq_slot<smartns_send_sge_seg>(n, pos);
+            for (uint32_t j = 0;j < SMARTNS_SEND_SGE_PER_SEG && i * SMARTNS_SEND_SGE_PER_SEG + j < num_sge;j++) {
+                seg->sge[j] = sge_list[i * SMARTNS_SEND_SGE_PER_SEG + j];
+            }
+            seg->op_own = lap_own(n, pos);
+        }
+        wqe->num_sge = num_sge;
+        wqe->local_addr = 0xdead;
+        wqe->local_lkey = 0;
+        sim_sge_sends++;
+    }
+    return publish_send(n, wqe, segs);
+}
+
+uint32_t sim_post_atomic(sim_node *n, dpu_qp *qp, int opcode, uint64_t *local, uint64_t remote, uint32_t rkey, uint64_t compare_add, uint64_t swap) {
+    smartns_send_wqe *wqe = send_wq_slot<smartns_send_wqe>(n, n->send_head);
+    wqe->qpn = qp->qp_number;
+    wqe->opcode = opcode;
+    wqe->local_addr = reinterpret_cast<uint64_t>(local);
+    wqe->local_lkey = 1;
+    wqe->byte_count = sizeof(uint64_t);
+    wqe->remote_addr = remote;
+    wqe->remote_rkey = rkey;
+    wqe->atomic.compare_add = compare_add;
+    wqe->atomic.swap = swap;
+    wqe->inline_segs = 0;
+    wqe->num_sge = 1;
+    wqe->cur_pos = n->send_head;
+    wqe->is_signal = true;
+    return publish_send(n, wqe, 0);
+}
+
+// more SGEs split the buffer into growing contiguous pieces
+void sim_post_recv(dpu_qp *qp, sim_ring *ring, void *addr, uint32_t len) {
+    dpu_recv_wq *recv_wq = qp->recv_wq;
+    uint32_t index = ring->head % recv_wq->wqe_cnt;
+    smartns_recv_wqe *scat = reinterpret_cast<smartns_recv_wqe *>(reinterpret_cast<uint8_t *>(recv_wq->bf_recv_wq_buf) + (index << recv_wq->wqe_shift));
+    uint32_t offset = 0, j = 0;
+    for (;j < recv_wq->max_sge && offset < len;j++) {
+        uint32_t piece = j + 1 == recv_wq->max_sge ? len - offset : min_t(uint32_t, len - offset, 100u << j);
+        scat[j].addr = reinterpret_cast<uint64_t>(addr) + offset;
+        scat[j].lkey = 1;
+        scat[j].byte_count = piece;
+        scat[j].op_own = ring->own;
+        offset += piece;
+    }
+    for (;j < recv_wq->max_sge;j++) {
+        scat[j].addr = 0;
+        scat[j].lkey = 100;
+        scat[j].byte_count = 0;
+        scat[j].op_own = ring->own;
+    }
+    ring->head++;
+    if (ring->head % recv_wq->wqe_cnt == 0) {
+        ring->own ^= 1;
+    }
+}
+
+bool sim_poll_cq(dpu_cq *cq, sim_ring *ring, smartns_cqe *out) {
+    smartns_cqe *cqe = reinterpret_cast<smartns_cqe *>(reinterpret_cast<uint8_t *>(cq->host_cq_buf) + ((ring->head % cq->wqe_cnt) << cq->wqe_shift));
+    if (cqe->op_own != ring->own) {
+        return false;
+    }
+    *out = *cqe;
+    ring->head++;
+    if (ring->head % cq->wqe_cnt == 0) {
+        ring->own ^= 1;
+    }
+    cq->host_cq_doorbell->consumer_index = ring->head;
+    return true;
+}
+
+#if SMARTNS_RX_MPRQ
+// place the frame in the strides of the current WQE like the NIC does, a frame
+// that doesn't fit the rest of the WQE gets a filler CQE for it first
+static bool deliver_mprq(sim_node *to, std::vector<uint8_t> &frame) {
+    rxpath_handler *rx = to->handler->rxpath_handler;
+    fake_mprq &mprq = to->mprq;
+    const uint32_t strides = 1u << SMARTNS_RX_MPRQ_LOG_STRIDES;
+    const uint32_t stride_size = 1u << SMARTNS_RX_MPRQ_LOG_STRIDE_SIZE;
+    uint32_t need = (frame.size() + stride_size - 1) / stride_size;
+    auto posted = [&]() { return static_cast<uint16_t>(be32toh(mprq.wq_db) - mprq.wq_ci) != 0; };
+    auto cq_room = [&]() { return mprq.cq_pi - be32toh(mprq.cq_db) < rx->mprq_cqe_cnt; };
+    auto put_cqe = [&](uint32_t byte_cnt, uint16_t stride) {
+        mlx5_cqe64 *cqe = reinterpret_cast<mlx5_cqe64 *>(rx->mprq_cqes + (mprq.cq_pi & (rx->mprq_cqe_cnt - 1)) * rx->mprq_cqe_size);
+        cqe->byte_cnt = htobe32(byte_cnt);
+        cqe->wqe_counter = htobe16(stride);
+        cqe->op_own = (MLX5_CQE_RESP_SEND << 4) | !!(mprq.cq_pi & rx->mprq_cqe_cnt);
+        mprq.cq_pi++;
+    };
+
+    if (!posted() || !cq_room()) {
+        return false;
+    }
+    if (mprq.stride + need > strides) {
+        put_cqe(MLX5_MPRQ_FILLER_MASK | ((strides - mprq.stride) << 16), mprq.stride);
+        mprq.fillers++;
+        mprq.wq_ci++;
+        mprq.stride = 0;
+        if (!posted() || !cq_room()) {
+            return false;
+        }
+    }
+    mlx5_mprq_wqe *wqe = reinterpret_cast<mlx5_mprq_wqe *>(rx->mprq_wqes + (mprq.wq_ci & (rx->mprq_wqe_cnt - 1)) * rx->mprq_wqe_stride);
+    uint64_t addr = be64toh(wqe->dseg.addr) + static_cast<size_t>(mprq.stride) * stride_size;
+    check_no_pending_dma(addr, frame.size());
+    memcpy(reinterpret_cast<void *>(addr), frame.data(), frame.size());
+    put_cqe(frame.size() | (need << 16), mprq.stride);
+    mprq.multi_stride += need > 1;
+    mprq.stride += need;
+    if (mprq.stride == strides) {
+        mprq.wq_ci++;
+        mprq.stride = 0;
+    }
+    return true;
+}
+#endif
+
+// scatter the frame into the next buffer of the raw QP, or of the zero-copy
+// QP its udp port is steered to
+static bool deliver_rq(sim_node *to, std::vector<uint8_t> &frame) {
+    fake_qp *qp = to->raw_qp;
+    uint16_t dst_port = ntohs(reinterpret_cast<udp_packet *>(frame.data())->udp_hdr.dst_port);
+    if (dst_port >= SMARTNS_UDP_ZC_PORT && dst_port < SMARTNS_UDP_ZC_PORT + 0x100 && to->zc_flows.count(dst_port)) {
+        qp = to->zc_flows[dst_port];
+        to->zc_delivered++;
+    }
+    if (qp->rq.empty()) {
+        return false;
+    }
+    fake_rx_buf buf = qp->rq.front();
+    qp->rq.pop_front();
+    size_t offset = 0;
+    for (ibv_sge &sge : buf.sges) {
+        size_t copy = min_t(size_t, sge.length, frame.size() - offset);
+        memcpy(reinterpret_cast<void *>(sge.addr), frame.data() + offset, copy);
+        offset += copy;
+        if (offset == frame.size()) {
+            break;
+        }
+    }
+    assert(offset == frame.size());
+    push_wc(qp->rcq, buf.wr_id, IBV_WC_RECV, static_cast<uint32_t>(reinterpret_cast<uintptr_t>(qp)), frame.size());
+    return true;
+}
+
+static void link_deliver(sim_node *from, size_t max_frames) {
+    sim_link &link = from->out;
+    std::uniform_real_distribution<double> coin(0, 1);
+    for (size_t i = 0;i < max_frames && !link.inflight.empty();i++) {
+        if (link.reorder > 0 && link.inflight.size() > 1 && coin(link.rng) < link.reorder) {
+            std::swap(link.inflight[0], link.inflight[1]);
+        }
+        std::vector<uint8_t> frame = std::move(link.inflight.front());
+        link.inflight.pop_front();
+        if (link.drop_first > 0) {
+            link.drop_first--;
+            link.dropped++;
+            continue;
+        }
+        if (link.drop > 0 && coin(link.rng) < link.drop) {
+            link.dropped++;
+            continue;
+        }
+#if SMARTNS_RX_MPRQ
+        bool delivered = deliver_mprq(from->peer, frame);
+#else
+        bool delivered = deliver_rq(from->peer, frame);
+#endif
+        if (delivered) {
+            link.delivered++;
+        } else {
+            link.no_buf++;
+        }
+    }
+}
+
+void sim_step(sim_node *n, size_t max_frames) {
+    n->handler->loop_datapath_send_wq();
+    n->handler->handle_send();
+    n->handler->handle_recv();
+    n->handler->handle_timer();
+    link_deliver(n, max_frames);
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "smartns.h"
+#include "rxe/rxe.h"
+#include "rxe/rxe_hdr.h"
+#include "rxe/rxe_opcode.h"
+#include "rxe/rxe_param.h"
+#include <gflags/gflags.h>
+#include <deque>
+#include <random>
+#include <map>
+
+// Two datapath threads joined by an in-memory link that may drop and reorder
+// frames, no NIC needed. The raw packet QP, the DMA QPs and their CQs are
+// faked behind the verbs context ops, host rings are plain memory the test
+// reads and writes like the library would.
+
+DECLARE_bool(async_dma);
+DECLARE_uint64(dma_group);
+DECLARE_bool(zero_copy);
+DECLARE_uint64(ack_coalesce);
+DECLARE_uint64(sched_quantum);
+DECLARE_string(rx_invalidate);
+DECLARE_uint64(llc_bytes);
+DECLARE_string(cc_algo);
+DECLARE_bool(send_wq_pull);
+DECLARE_uint64(inline_size);
+DECLARE_uint64(send_sge);
+
+struct fake_cq;
+struct sim_node;
+
+// memcpy or invalidate queued on an async DMA QP, dst 0 is an invalidate
+struct fake_dma_op {
+    uint64_t dst;
+    uint64_t src;
+    size_t len;
+    bool signaled;
+    uint64_t wr_id;
+};
+
+struct fake_dma_qp {
+    ibv_qp_ex qpx;
+    mlx5dv_qp_ex mqpx;
+    fake_cq *cq;
+    std::deque<fake_dma_op> pending;
+};
+
+struct fake_cq {
+    ibv_cq cq;
+    std::deque<ibv_wc> wcs;
+    // DMA QPs whose ops finish a random prefix at a time when the cq is polled
+    std::vector<fake_dma_qp *> async_qps;
+};
+
+struct fake_rx_buf {
+    uint64_t wr_id;
+    std::vector<ibv_sge> sges;
+};
+
+struct fake_qp {
+    ibv_qp qp;
+    sim_node *owner;
+    std::deque<fake_rx_buf> rq;
+    fake_cq *scq;
+    fake_cq *rcq;
+};
+
+struct fake_flow {
+    ibv_flow flow;
+    fake_qp *qp;
+    uint16_t port;
+};
+
+// NIC side of the striding rq, free running wqe and cqe counters
+struct fake_mprq {
+    uint32_t wq_ci;
+    uint32_t stride;
+    uint32_t cq_pi;
+    __be32 wq_db;
+    __be32 cq_db;
+    // frames over more than one stride, and WQEs closed by a filler CQE
+    size_t multi_stride;
+    size_t fillers;
+};
+
+struct sim_link {
+    std::deque<std::vector<uint8_t>> inflight;
+    double drop;
+    double reorder;
+    // frames dropped before drop applies
+    size_t drop_first;
+    size_t delivered;
+    size_t dropped;
+    size_t no_buf;
+    std::mt19937_64 rng;
+};
+
+struct sim_node {
+    const char *name;
+    sim_node *peer;
+    // frames to peer
+    sim_link out;
+    datapath_handler *handler;
+    controlpath_manager *control;
+    dpu_context *ctx;
+    fake_qp *raw_qp;
+    fake_cq *raw_send_cq;
+    fake_cq *raw_recv_cq;
+    // host side of datapath send wq 0
+    uint32_t send_head;
+    uint8_t send_own;
+    // host ring and doorbell the DPU reads in pull mode
+    void *pull_sq;
+    smartns_wq_doorbell *pull_db;
+    fake_mprq mprq;
+    std::map<uint16_t, fake_qp *> zc_flows;
+    size_t zc_delivered;
+};
+
+// host view of a recv wq or a cq, free running index and owner bit
+struct sim_ring {
+    uint32_t head;
+    uint8_t own;
+};
+
+extern size_t sim_doorbells;
+extern size_t sim_invalidates;
+extern size_t sim_inline_sends;
+extern size_t sim_sge_sends;
+
+void sim_init();
+sim_node *sim_make_node(const char *name, sim_node *peer);
+dpu_cq *sim_make_cq(sim_node *n, uint32_t depth);
+dpu_qp *sim_make_qp(sim_node *n, dpu_cq *send_cq, dpu_cq *recv_cq, uint32_t max_send_wr, uint32_t max_recv_wr, uint32_t max_recv_sge);
+void sim_connect_qp(sim_node *a, dpu_qp *qa, sim_node *b, dpu_qp *qb);
+dpu_mr *sim_make_mr(sim_node *n, void *addr, size_t len);
+// handle_destory_mr without the devx call the fake MR has no object for
+void sim_dereg_mr(sim_node *n, dpu_mr *mr);
+
+// host posts, written into the rings the DPU reads. Returns the ring position
+// of the send WQE, which its CQE carries as wqe_counter
+uint32_t sim_post_send(sim_node *n, dpu_qp *qp, int opcode, void *local, uint32_t len, uint64_t remote, uint32_t rkey, bool signal);
+uint32_t sim_post_atomic(sim_node *n, dpu_qp *qp, int opcode, uint64_t *local, uint64_t remote, uint32_t rkey, uint64_t compare_add, uint64_t swap);
+void sim_post_recv(dpu_qp *qp, sim_ring *ring, void *addr, uint32_t len);
+bool sim_poll_cq(dpu_cq *cq, sim_ring *ring, smartns_cqe *out);
+
+// one pass of the datapath loop, then up to max_frames frames onto the wire
+void sim_step(sim_node *n, size_t max_frames);
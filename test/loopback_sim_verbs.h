@@ -0,0 +1,22 @@
+#pragma once
+
+// Verbs calls the datapath makes outside the context ops, redirected into the
+// loopback simulator. Force included into every source of loopback_test.
+#include <infiniband/verbs.h>
+
+struct ibv_qp *sim_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr);
+int sim_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int mask);
+int sim_destroy_qp(struct ibv_qp *qp);
+struct ibv_flow *sim_create_flow(struct ibv_qp *qp, struct ibv_flow_attr *attr);
+int sim_destroy_flow(struct ibv_flow *flow);
+struct ibv_mr *sim_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access);
+int sim_dereg_mr(struct ibv_mr *mr);
+
+#define ibv_create_qp sim_create_qp
+#define ibv_modify_qp sim_modify_qp
+#define ibv_destroy_qp sim_destroy_qp
+#define ibv_create_flow sim_create_flow
+#define ibv_destroy_flow sim_destroy_flow
+#undef ibv_reg_mr
+#define ibv_reg_mr sim_reg_mr
+#define ibv_dereg_mr sim_dereg_mr
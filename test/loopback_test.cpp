@@ -0,0 +1,645 @@
+#include "loopback_sim.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// RC sends, writes, reads and atomics between two datapath threads over the
+// loopback simulator, with frames dropped and reordered on the link. Every
+// scenario checks each WQE completes exactly once and in post order, that
+// lost frames were retransmitted, and that nothing leaks.
+//  ./loopback_test
+//  ./loopback_test -async_dma -check_data -dma_group 4
+//  ./loopback_test -zero_copy -recv_sge 3 -cq_depth 64
+// loopback_test_mprq is the same test with SMARTNS_RX_MPRQ set, payloads are
+// read back from the strides they were placed in with -check_data.
+// loopback_test_hdr_split sets SMARTNS_RX_HDR_SPLIT, headers land in the
+// header ring and the rest of the frame in the packet buffer.
+
+DEFINE_bool(check_data, false, "compare received payloads with what was sent");
+DEFINE_uint64(recv_sge, 1, "SGEs per receive WQE of the responder");
+DEFINE_uint64(cq_depth, 1024, "CQ depth");
+DEFINE_uint64(peer_cq_depth, 0, "responder CQ depth, 0 is cq_depth");
+DEFINE_uint64(slow_host, 1, "the host polls its CQs every this many steps");
+
+static const uint32_t slot = 64 * 1024;
+static const uint32_t recv_slots = 256;
+static const uint32_t outstanding = 200;
+
+static uint8_t pattern(uint32_t msg, uint32_t j) {
+    return static_cast<uint8_t>(msg * 131 + j * 7 + 1);
+}
+
+static void settle(sim_node *a, sim_node *b, int steps) {
+    for (int i = 0;i < steps;i++) {
+        sim_step(a, 8);
+        sim_step(b, 8);
+    }
+}
+
+static void print_counters(sim_node *a, sim_node *b) {
+    datapath_counters &ca = a->handler->counters, &cb = b->handler->counters;
+    printf("  A retrans ev %zu pkts %zu to %zu nak_recv %zu | B nak_sent %zu buf %zu drain %zu ovf %zu | link drop %zu/%zu nobuf %zu/%zu\n",
+        ca.retrans_events, ca.retrans_pkts, ca.retrans_timeouts, ca.nak_recv, cb.nak_sent,
+        cb.reorder_buffered, cb.reorder_drained, cb.reorder_overflow,
+        a->out.dropped, b->out.dropped, a->out.no_buf, b->out.no_buf);
+    printf("  B ack coalesced %zu delay fired %zu | zc hit %zu miss %zu stale %zu arm %zu disarm %zu delivered %zu\n",
+        cb.ack_coalesced, cb.ack_delay_fired, cb.zc_hit, cb.zc_miss, cb.zc_stale, cb.zc_arm, cb.zc_disarm, b->zc_delivered);
+    printf("  dma doorbells %zu invalidates %zu | B rx invalidate %zu skip %zu | cq refresh %zu/%zu full %zu/%zu\n",
+        sim_doorbells, sim_invalidates, cb.rx_invalidate, cb.rx_invalidate_skip, ca.cq_refresh, cb.cq_refresh, ca.cq_full, cb.cq_full);
+    printf("  inline sends %zu gather sends %zu | pull doorbell reads %zu/%zu wqe reads %zu/%zu wqes %zu/%zu\n",
+        sim_inline_sends, sim_sge_sends, ca.pull_doorbell_reads, cb.pull_doorbell_reads, ca.pull_wqe_reads, cb.pull_wqe_reads, ca.pull_wqes, cb.pull_wqes);
+}
+
+// every rx buffer is back in the receive queue or waiting in its completions
+static bool check_rx_buffers(sim_node *n) {
+    rxpath_handler *rx = n->handler->rxpath_handler;
+    if (rx->held_buffers != 0) {
+        printf("%s rx buffer leak, %u held\n", n->name, rx->held_buffers);
+        return false;
+    }
+#if SMARTNS_RX_MPRQ
+    if (rx->mprq_free_cnt + (rx->mprq_wq_pi - rx->mprq_wq_ci) != SMARTNS_RX_MPRQ_BUFS) {
+        printf("%s mprq buffer leak, free %u posted %u\n", n->name, rx->mprq_free_cnt, rx->mprq_wq_pi - rx->mprq_wq_ci);
+        return false;
+    }
+#else
+    if (rx->posted_buffers != SMARTNS_RX_DEPTH || n->raw_qp->rq.size() + n->raw_recv_cq->wcs.size() != SMARTNS_RX_DEPTH) {
+        printf("%s rx buffer leak, posted %u rq %zu\n", n->name, rx->posted_buffers, n->raw_qp->rq.size());
+        return false;
+    }
+#endif
+    return true;
+}
+
+// nmsg messages of 1 to max_size bytes from A to B with op, each signaled
+static int run(const char *name, double drop, double reorder, int op, uint32_t nmsg, uint32_t max_size, double dpu_fault, int seed) {
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.drop = b->out.drop = drop;
+    a->out.reorder = b->out.reorder = reorder;
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    b->handler->rx_drop_threshold = dpu_fault * (1ULL << 32);
+    a->handler->rx_reorder_threshold = dpu_fault * (1ULL << 32);
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth);
+    dpu_cq *bcq = sim_make_cq(b, FLAGS_peer_cq_depth ? FLAGS_peer_cq_depth : FLAGS_cq_depth);
+    dpu_qp *qa = sim_make_qp(a, acq, acq, 256, 256, 1);
+    dpu_qp *qb = sim_make_qp(b, bcq, bcq, 256, 256, FLAGS_recv_sge);
+    sim_connect_qp(a, qa, b, qb);
+    sim_doorbells = sim_invalidates = sim_inline_sends = sim_sge_sends = 0;
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> src(static_cast<size_t>(nmsg) * slot);
+    // receive slots, then one slot per written message
+    std::vector<uint8_t> dst(static_cast<size_t>(recv_slots + nmsg) * slot);
+    uint8_t *write_dst = dst.data() + static_cast<size_t>(recv_slots) * slot;
+    std::vector<uint32_t> size(nmsg);
+    for (uint32_t i = 0;i < nmsg;i++) {
+        size[i] = 1 + rng() % max_size;
+        for (uint32_t j = 0;j < size[i];j++) {
+            src[static_cast<size_t>(i) * slot + j] = pattern(i, j);
+        }
+    }
+    dpu_mr *bmr = op == IBV_WR_RDMA_READ ? sim_make_mr(b, src.data(), src.size()) : sim_make_mr(b, dst.data(), dst.size());
+
+    sim_ring recv_ring = { 0, 1 };
+    uint32_t posted_recv = 0;
+    if (op == IBV_WR_SEND) {
+        for (;posted_recv < outstanding && posted_recv < nmsg;posted_recv++) {
+            sim_post_recv(qb, &recv_ring, dst.data() + static_cast<size_t>(posted_recv % recv_slots) * slot, slot);
+        }
+    }
+
+    uint32_t posted = 0, sent_done = 0, recv_done = 0;
+    std::vector<uint32_t> wqe_pos(nmsg);
+    sim_ring acq_ring = { 0, 1 }, bcq_ring = { 0, 1 };
+    auto start = std::chrono::steady_clock::now();
+    size_t iter = 0;
+    while (sent_done < nmsg || (op == IBV_WR_SEND && recv_done < nmsg)) {
+        while (posted < nmsg && posted - sent_done < outstanding) {
+            uint8_t *local = src.data() + static_cast<size_t>(posted) * slot;
+            uint8_t *remote = write_dst + static_cast<size_t>(posted) * slot;
+            if (op == IBV_WR_RDMA_READ) {
+                std::swap(local, remote);
+            }
+            wqe_pos[posted] = sim_post_send(a, qa, op, local, size[posted], reinterpret_cast<uint64_t>(remote), bmr->host_mkey, true);
+            posted++;
+        }
+        sim_step(a, 8);
+        sim_step(b, 8);
+
+        smartns_cqe cqe;
+        while (iter % FLAGS_slow_host == 0 && sim_poll_cq(acq, &acq_ring, &cqe)) {
+            if (cqe.cq_opcode != MLX5_CQE_REQ || cqe.wqe_counter != wqe_pos[sent_done]) {
+                printf("%s: bad send cqe %u want %u\n", name, cqe.wqe_counter, wqe_pos[sent_done]);
+                return 1;
+            }
+            // the read payload is in place when its CQE is
+            for (uint32_t j = 0;op == IBV_WR_RDMA_READ && FLAGS_check_data && j < size[sent_done];j++) {
+                if (write_dst[static_cast<size_t>(sent_done) * slot + j] != pattern(sent_done, j)) {
+                    printf("%s: read %u not in place at its cqe, corrupt at %u\n", name, sent_done, j);
+                    return 1;
+                }
+            }
+            sent_done++;
+        }
+        while (iter % FLAGS_slow_host == 0 && sim_poll_cq(bcq, &bcq_ring, &cqe)) {
+            uint8_t *buf = dst.data() + static_cast<size_t>(recv_done % recv_slots) * slot;
+            if (cqe.byte_count != size[recv_done]) {
+                printf("%s: msg %u bad len %u want %u\n", name, recv_done, cqe.byte_count, size[recv_done]);
+                return 1;
+            }
+            // the CQE must not overtake its payload DMA
+            for (uint32_t j = 0;FLAGS_check_data && j < size[recv_done];j++) {
+                if (buf[j] != pattern(recv_done, j)) {
+                    printf("%s: msg %u corrupt at %u\n", name, recv_done, j);
+                    return 1;
+                }
+            }
+            recv_done++;
+            if (posted_recv < nmsg) {
+                sim_post_recv(qb, &recv_ring, dst.data() + static_cast<size_t>(posted_recv % recv_slots) * slot, slot);
+                posted_recv++;
+            }
+        }
+
+        if (++iter % 100000 == 0 && std::chrono::steady_clock::now() - start > std::chrono::seconds(20)) {
+            dpu_send_wq *send_wq = qa->send_wq;
+            printf("%s: TIMEOUT sent %u/%u recv %u\n", name, sent_done, nmsg, recv_done);
+            printf("  A sq head %u tail %u index %u psn %u comp psn %u | B rq psn %u nak %d\n", send_wq->head, send_wq->tail,
+                send_wq->wqe_index, send_wq->psn, qa->comp_info->psn, qb->recv_wq->psn, qb->recv_wq->sent_psn_nak);
+            for (uint32_t i = send_wq->tail;i != send_wq->head && i != send_wq->tail + 4;i = (i + 1) % send_wq->wqe_cnt) {
+                dpu_send_wqe *wqe = send_wq->get_wqe(i);
+                printf("  wqe %u state %d psn %u to %u pkt %u offset %u bytes %u\n", i, wqe->state, wqe->first_psn, wqe->last_psn,
+                    wqe->cur_pkt_num, wqe->cur_pkt_offset, wqe->byte_count);
+            }
+            printf("  A cq produced %u host consumed %u reserved %u dma pending %u\n", acq->produced, acq->host_consumed, acq->reserved, acq->dma_pending);
+            return 1;
+        }
+    }
+
+    // let async payload DMAs and trailing acks settle, then every WQE must
+    // have completed exactly once
+    settle(a, b, 2000);
+    smartns_cqe extra;
+    if (sim_poll_cq(acq, &acq_ring, &extra) || sim_poll_cq(bcq, &bcq_ring, &extra)) {
+        printf("%s: extra cqe %u opcode %u\n", name, extra.wqe_counter, extra.cq_opcode);
+        return 1;
+    }
+    if (drop > 0 && a->handler->counters.retrans_events == 0) {
+        printf("%s: frames were lost but nothing was retransmitted\n", name);
+        return 1;
+    }
+    if ((op == IBV_WR_RDMA_WRITE || op == IBV_WR_RDMA_READ) && FLAGS_check_data) {
+        for (uint32_t i = 0;i < nmsg;i++) {
+            for (uint32_t j = 0;j < size[i];j++) {
+                if (write_dst[static_cast<size_t>(i) * slot + j] != pattern(i, j)) {
+                    printf("%s: message %u corrupt at %u\n", name, i, j);
+                    return 1;
+                }
+            }
+        }
+    }
+    printf("%s: ok, %zu steps\n", name, iter);
+    print_counters(a, b);
+    if (a->handler->counters.cq_overflow || b->handler->counters.cq_overflow) {
+        printf("%s: cq overflow %zu %zu\n", name, a->handler->counters.cq_overflow, b->handler->counters.cq_overflow);
+        return 1;
+    }
+    if (!check_rx_buffers(a) || !check_rx_buffers(b)) {
+        return 1;
+    }
+#if SMARTNS_RX_MPRQ
+    // frames must have been split over strides and WQEs closed early. With
+    // more WQEs than buffers, check_rx_buffers proved released buffers were
+    // reposted
+    size_t multi_stride = a->mprq.multi_stride + b->mprq.multi_stride;
+    size_t fillers = a->mprq.fillers + b->mprq.fillers;
+    size_t wqes = a->mprq.wq_ci + b->mprq.wq_ci;
+    printf("  mprq multi stride frames %zu fillers %zu wqes %zu\n", multi_stride, fillers, wqes);
+    if (multi_stride == 0 || fillers == 0) {
+        printf("%s: mprq strides not exercised\n", name);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// small writes from A that fill the unacked psn window in one pass, with
+// every frame of that window lost. Only the retransmit timer recovers them
+static int run_lost_window(const char *name, int seed) {
+    const uint32_t nmsg = 2 * RXE_MAX_UNACKED_PSNS, size = 64;
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    a->out.drop_first = RXE_MAX_UNACKED_PSNS + 1;
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth), *bcq = sim_make_cq(b, FLAGS_cq_depth);
+    dpu_qp *qa = sim_make_qp(a, acq, acq, 512, 256, 1);
+    dpu_qp *qb = sim_make_qp(b, bcq, bcq, 256, 256, 1);
+    sim_connect_qp(a, qa, b, qb);
+
+    std::vector<uint8_t> src(static_cast<size_t>(nmsg) * size), dst(src.size(), 0);
+    for (size_t j = 0;j < src.size();j++) {
+        src[j] = pattern(j / size, j % size);
+    }
+    dpu_mr *bmr = sim_make_mr(b, dst.data(), dst.size());
+    std::vector<uint32_t> wqe_pos(nmsg);
+    for (uint32_t i = 0;i < nmsg;i++) {
+        size_t offset = static_cast<size_t>(i) * size;
+        wqe_pos[i] = sim_post_send(a, qa, IBV_WR_RDMA_WRITE, src.data() + offset, size,
+            reinterpret_cast<uint64_t>(dst.data()) + offset, bmr->host_mkey, true);
+    }
+
+    sim_ring acq_ring = { 0, 1 };
+    uint32_t done = 0;
+    size_t iter = 0;
+    while (done < nmsg) {
+        sim_step(a, 8);
+        sim_step(b, 8);
+        smartns_cqe cqe;
+        while (sim_poll_cq(acq, &acq_ring, &cqe)) {
+            if (cqe.cq_opcode != MLX5_CQE_REQ || cqe.wqe_counter != wqe_pos[done]) {
+                printf("%s: bad cqe %u want %u\n", name, cqe.wqe_counter, wqe_pos[done]);
+                return 1;
+            }
+            done++;
+        }
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT %u/%u, A psn %u comp psn %u\n", name, done, nmsg, qa->send_wq->psn, qa->comp_info->psn);
+            return 1;
+        }
+    }
+    settle(a, b, 2000);
+    if (a->handler->counters.retrans_timeouts == 0 || dst != src) {
+        printf("%s: lost window not resent by the timer\n", name);
+        return 1;
+    }
+    if (!check_rx_buffers(a) || !check_rx_buffers(b)) {
+        return 1;
+    }
+    printf("%s: ok, %zu steps | A retrans timeouts %zu\n", name, iter, a->handler->counters.retrans_timeouts);
+    return 0;
+}
+
+// a read from A whose responses are lost, B's MR is deregistered before A
+// asks again. The replay must not read the MR, A completes with an access error
+static int run_read_after_dereg(const char *name, int seed) {
+    const uint32_t size = 8000;
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    b->out.drop_first = SIZE_MAX;
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth), *bcq = sim_make_cq(b, FLAGS_cq_depth);
+    dpu_qp *qa = sim_make_qp(a, acq, acq, 256, 256, 1);
+    dpu_qp *qb = sim_make_qp(b, bcq, bcq, 256, 256, 1);
+    sim_connect_qp(a, qa, b, qb);
+
+    std::vector<uint8_t> src(size), back(size, 0);
+    for (uint32_t j = 0;j < size;j++) {
+        src[j] = pattern(0, j);
+    }
+    dpu_mr *bmr = sim_make_mr(b, src.data(), src.size());
+    uint32_t wqe_pos = sim_post_send(a, qa, IBV_WR_RDMA_READ, back.data(), size, reinterpret_cast<uint64_t>(src.data()), bmr->host_mkey, true);
+
+    size_t iter = 0;
+    while (b->out.dropped == 0) {
+        sim_step(a, 8);
+        sim_step(b, 8);
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT waiting for the read to execute\n", name);
+            return 1;
+        }
+    }
+    settle(a, b, 100);
+    sim_dereg_mr(b, bmr);
+    b->out.drop_first = 0;
+
+    sim_ring acq_ring = { 0, 1 };
+    smartns_cqe cqe;
+    while (!sim_poll_cq(acq, &acq_ring, &cqe)) {
+        sim_step(a, 8);
+        sim_step(b, 8);
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT\n", name);
+            return 1;
+        }
+    }
+    if (cqe.wqe_counter != wqe_pos || cqe.cq_opcode != MLX5_CQE_REQ_ERR || cqe.status != IBV_WC_REM_ACCESS_ERR) {
+        printf("%s: cqe %u opcode %u status %u\n", name, cqe.wqe_counter, cqe.cq_opcode, cqe.status);
+        return 1;
+    }
+    settle(a, b, 2000);
+    if (std::any_of(back.begin(), back.end(), [](uint8_t v) { return v != 0; })) {
+        printf("%s: deregistered MR was read\n", name);
+        return 1;
+    }
+    if (!check_rx_buffers(a) || !check_rx_buffers(b)) {
+        return 1;
+    }
+    printf("%s: ok, %zu steps | B replay %zu access nak sent %zu\n", name, iter, b->handler->counters.dup_replay,
+        b->handler->counters.access_nak_sent);
+    return 0;
+}
+
+// nmsg atomics from A on one counter of B, fetch and add 1 or a chain of
+// compare and swap from i to i + 1. Fetch and add may spread over nqp QPs,
+// whose atomics on the counter then contend for its lock
+static int run_atomic(const char *name, double drop, double reorder, int op, uint32_t nmsg, uint32_t nqp, int seed) {
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.drop = b->out.drop = drop;
+    a->out.reorder = b->out.reorder = reorder;
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth), *bcq = sim_make_cq(b, FLAGS_cq_depth);
+    std::vector<dpu_qp *> qa(nqp);
+    for (uint32_t i = 0;i < nqp;i++) {
+        qa[i] = sim_make_qp(a, acq, acq, 256, 256, 1);
+        sim_connect_qp(a, qa[i], b, sim_make_qp(b, bcq, bcq, 256, 256, 1));
+    }
+
+    std::vector<uint64_t> counter(8, 0), result(nmsg, ~0ULL);
+    dpu_mr *bmr = sim_make_mr(b, counter.data(), counter.size() * sizeof(uint64_t));
+    uint64_t remote = reinterpret_cast<uint64_t>(&counter[1]);
+    uint32_t posted = 0, done = 0;
+    // message and ring position of each atomic per QP, completed in order
+    std::vector<std::vector<uint32_t>> msg(nqp), wqe_pos(nqp);
+    std::vector<uint32_t> qp_done(nqp, 0);
+    sim_ring acq_ring = { 0, 1 };
+    size_t iter = 0;
+    while (done < nmsg) {
+        while (posted < nmsg && posted - done < outstanding) {
+            bool add = op == IBV_WR_ATOMIC_FETCH_AND_ADD;
+            uint32_t q = posted % nqp;
+            msg[q].push_back(posted);
+            wqe_pos[q].push_back(sim_post_atomic(a, qa[q], op, &result[posted], remote, bmr->host_mkey, add ? 1 : posted, add ? 0 : posted + 1));
+            posted++;
+        }
+        sim_step(a, 8);
+        sim_step(b, 8);
+        smartns_cqe cqe;
+        while (sim_poll_cq(acq, &acq_ring, &cqe)) {
+            uint32_t q = 0;
+            while (q < nqp && qa[q]->qp_number != cqe.qpn) {
+                q++;
+            }
+            if (q == nqp || cqe.wqe_counter != wqe_pos[q][qp_done[q]] || cqe.mlx5_opcode != static_cast<uint32_t>(op)) {
+                printf("%s: bad atomic cqe qpn %u counter %u\n", name, cqe.qpn, cqe.wqe_counter);
+                return 1;
+            }
+            if (result[msg[q][qp_done[q]]] == ~0ULL) {
+                printf("%s: atomic %u result not in place at its cqe\n", name, msg[q][qp_done[q]]);
+                return 1;
+            }
+            qp_done[q]++;
+            done++;
+        }
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT %u/%u\n", name, done, nmsg);
+            return 1;
+        }
+    }
+    settle(a, b, 100);
+    if (counter[1] != nmsg || counter[0] || counter[2]) {
+        printf("%s: counter %lu want %u\n", name, counter[1], nmsg);
+        return 1;
+    }
+    // every old value once, and in post order for the swap chain
+    std::vector<uint64_t> sorted = result;
+    std::sort(sorted.begin(), sorted.end());
+    for (uint32_t i = 0;i < nmsg;i++) {
+        if (sorted[i] != i || (op == IBV_WR_ATOMIC_CMP_AND_SWP && result[i] != i)) {
+            printf("%s: result %u = %lu\n", name, i, result[i]);
+            return 1;
+        }
+    }
+    printf("%s: ok | A retrans ev %zu to %zu | B replay %zu drop %zu\n", name,
+        a->handler->counters.retrans_events, a->handler->counters.retrans_timeouts, b->handler->counters.dup_replay, b->handler->counters.dup_drop);
+    return 0;
+}
+
+// nmsg writes from A to B, each followed by a read of what it wrote or a
+// fetch and add on its first word. The read or atomic must see the write
+// even while its payload dmas are still in flight on B
+static int run_read_after_write(const char *name, double drop, double reorder, bool atomic, uint32_t nmsg, int seed) {
+    const uint32_t size = atomic ? sizeof(uint64_t) : 6000;
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.drop = b->out.drop = drop;
+    a->out.reorder = b->out.reorder = reorder;
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth), *bcq = sim_make_cq(b, FLAGS_cq_depth);
+    dpu_qp *qa = sim_make_qp(a, acq, acq, 256, 256, 1);
+    dpu_qp *qb = sim_make_qp(b, bcq, bcq, 256, 256, 1);
+    sim_connect_qp(a, qa, b, qb);
+
+    std::vector<uint8_t> src(static_cast<size_t>(nmsg) * size), dst(src.size(), 0), back(src.size(), 0);
+    for (size_t j = 0;j < src.size();j++) {
+        src[j] = pattern(j / size, j % size);
+    }
+    dpu_mr *bmr = sim_make_mr(b, dst.data(), dst.size());
+    std::vector<uint64_t> result(nmsg, ~0ULL);
+    std::vector<uint32_t> wqe_pos(2 * nmsg);
+    uint32_t posted = 0, done = 0;
+    sim_ring acq_ring = { 0, 1 };
+    size_t iter = 0;
+    while (done < 2 * nmsg) {
+        while (posted < nmsg && 2 * posted - done < outstanding) {
+            size_t offset = static_cast<size_t>(posted) * size;
+            uint64_t remote = reinterpret_cast<uint64_t>(dst.data()) + offset;
+            wqe_pos[2 * posted] = sim_post_send(a, qa, IBV_WR_RDMA_WRITE, src.data() + offset, size, remote, bmr->host_mkey, true);
+            if (atomic) {
+                wqe_pos[2 * posted + 1] = sim_post_atomic(a, qa, IBV_WR_ATOMIC_FETCH_AND_ADD, &result[posted], remote, bmr->host_mkey, 1, 0);
+            } else {
+                wqe_pos[2 * posted + 1] = sim_post_send(a, qa, IBV_WR_RDMA_READ, back.data() + offset, size, remote, bmr->host_mkey, true);
+            }
+            posted++;
+        }
+        sim_step(a, 8);
+        sim_step(b, 8);
+        smartns_cqe cqe;
+        while (sim_poll_cq(acq, &acq_ring, &cqe)) {
+            if (cqe.cq_opcode != MLX5_CQE_REQ || cqe.wqe_counter != wqe_pos[done]) {
+                printf("%s: bad cqe %u want %u\n", name, cqe.wqe_counter, wqe_pos[done]);
+                return 1;
+            }
+            uint32_t i = done / 2;
+            size_t offset = static_cast<size_t>(i) * size;
+            if (done % 2 && atomic && memcmp(&result[i], src.data() + offset, size) != 0) {
+                printf("%s: atomic %u missed the write before it\n", name, i);
+                return 1;
+            }
+            if (done % 2 && !atomic && memcmp(back.data() + offset, src.data() + offset, size) != 0) {
+                printf("%s: read %u missed the write before it\n", name, i);
+                return 1;
+            }
+            done++;
+        }
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT %u/%u\n", name, done, 2 * nmsg);
+            return 1;
+        }
+    }
+    settle(a, b, 2000);
+    if (!check_rx_buffers(a) || !check_rx_buffers(b)) {
+        return 1;
+    }
+    printf("%s: ok, %zu steps | A retrans ev %zu | B replay %zu\n", name, iter, a->handler->counters.retrans_events,
+        b->handler->counters.dup_replay);
+    return 0;
+}
+
+enum access_case {
+    access_bad_rkey,
+    access_out_of_bounds,
+    access_no_atomic,
+    access_misaligned_atomic,
+    access_read_bad_rkey,
+    access_read_out_of_bounds,
+};
+
+// nmsg writes from A to B, message bad breaks the rules of B's MR, which
+// doesn't grant remote atomics. B naks it, A completes it with status and
+// flushes the messages after it
+static int run_access_error(const char *name, double drop, access_case kind, ibv_wc_status status, int seed) {
+    const uint32_t nmsg = 32, bad = 10, size = 8000;
+    sim_node *a = sim_make_node("A", nullptr);
+    sim_node *b = sim_make_node("B", a);
+    a->out.drop = b->out.drop = drop;
+    a->out.rng.seed(seed);
+    b->out.rng.seed(seed + 1);
+    dpu_cq *acq = sim_make_cq(a, FLAGS_cq_depth), *bcq = sim_make_cq(b, FLAGS_cq_depth);
+    dpu_qp *qa = sim_make_qp(a, acq, acq, 256, 256, 1);
+    dpu_qp *qb = sim_make_qp(b, bcq, bcq, 256, 256, 1);
+    sim_connect_qp(a, qa, b, qb);
+
+    std::vector<uint8_t> src(static_cast<size_t>(nmsg) * slot), dst(static_cast<size_t>(nmsg) * slot, 0);
+    for (uint32_t i = 0;i < nmsg;i++) {
+        for (uint32_t j = 0;j < size;j++) {
+            src[static_cast<size_t>(i) * slot + j] = pattern(i, j);
+        }
+    }
+    dpu_mr *bmr = sim_make_mr(b, dst.data(), dst.size());
+    bmr->access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    uint64_t result = 0;
+    std::vector<uint8_t> back(size);
+    std::vector<uint32_t> wqe_pos(nmsg);
+    for (uint32_t i = 0;i < nmsg;i++) {
+        uint64_t remote = reinterpret_cast<uint64_t>(dst.data()) + static_cast<uint64_t>(i) * slot;
+        uint32_t rkey = bmr->host_mkey;
+        if (i == bad && (kind == access_no_atomic || kind == access_misaligned_atomic)) {
+            remote += kind == access_misaligned_atomic ? 4 : 0;
+            wqe_pos[i] = sim_post_atomic(a, qa, IBV_WR_ATOMIC_FETCH_AND_ADD, &result, remote, rkey, 1, 0);
+            continue;
+        }
+        if (i == bad) {
+            rkey += kind == access_bad_rkey || kind == access_read_bad_rkey ? 100 : 0;
+            if (kind == access_out_of_bounds || kind == access_read_out_of_bounds) {
+                remote += dst.size() - size / 2 - static_cast<uint64_t>(i) * slot;
+            }
+        }
+        if (i == bad && (kind == access_read_bad_rkey || kind == access_read_out_of_bounds)) {
+            wqe_pos[i] = sim_post_send(a, qa, IBV_WR_RDMA_READ, back.data(), size, remote, rkey, true);
+            continue;
+        }
+        wqe_pos[i] = sim_post_send(a, qa, IBV_WR_RDMA_WRITE, src.data() + static_cast<size_t>(i) * slot, size, remote, rkey, true);
+    }
+
+    sim_ring acq_ring = { 0, 1 };
+    uint32_t done = 0;
+    size_t iter = 0;
+    while (done < nmsg) {
+        sim_step(a, 8);
+        sim_step(b, 8);
+        smartns_cqe cqe;
+        while (sim_poll_cq(acq, &acq_ring, &cqe)) {
+            uint8_t want = done < bad ? IBV_WC_SUCCESS : done == bad ? status : IBV_WC_WR_FLUSH_ERR;
+            uint8_t got = cqe.cq_opcode == MLX5_CQE_REQ ? IBV_WC_SUCCESS : cqe.status;
+            if (cqe.wqe_counter != wqe_pos[done] || (cqe.cq_opcode != MLX5_CQE_REQ && cqe.cq_opcode != MLX5_CQE_REQ_ERR) || got != want) {
+                printf("%s: cqe %u opcode %u status %u want %u\n", name, done, cqe.cq_opcode, got, want);
+                return 1;
+            }
+            done++;
+        }
+        if (++iter > 5000000) {
+            printf("%s: TIMEOUT %u/%u\n", name, done, nmsg);
+            return 1;
+        }
+    }
+    settle(a, b, 2000);
+    smartns_cqe extra;
+    sim_ring bcq_ring = { 0, 1 };
+    if (sim_poll_cq(acq, &acq_ring, &extra) || sim_poll_cq(bcq, &bcq_ring, &extra)) {
+        printf("%s: extra cqe %u opcode %u\n", name, extra.wqe_counter, extra.cq_opcode);
+        return 1;
+    }
+    // the writes before the refused one landed, nothing after it did
+    for (uint32_t i = 0;i < nmsg;i++) {
+        for (uint32_t j = 0;j < size;j++) {
+            uint8_t want = i < bad ? pattern(i, j) : 0;
+            if (dst[static_cast<size_t>(i) * slot + j] != want) {
+                printf("%s: message %u byte %u is %u want %u\n", name, i, j, dst[static_cast<size_t>(i) * slot + j], want);
+                return 1;
+            }
+        }
+    }
+    if (std::any_of(dst.end() - size / 2, dst.end(), [](uint8_t v) { return v != 0; })) {
+        printf("%s: out of bounds write landed\n", name);
+        return 1;
+    }
+    if (std::any_of(back.begin(), back.end(), [](uint8_t v) { return v != 0; })) {
+        printf("%s: refused read returned data\n", name);
+        return 1;
+    }
+    if (!check_rx_buffers(a) || !check_rx_buffers(b)) {
+        return 1;
+    }
+    printf("%s: ok | A access nak recv %zu | B access nak sent %zu drop %zu\n", name, a->handler->counters.access_nak_recv,
+        b->handler->counters.access_nak_sent, b->handler->counters.dup_drop);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    sim_init();
+
+    int ret = 0;
+    ret |= run("send", 0, 0, IBV_WR_SEND, 2000, 20000, 0, 1);
+    ret |= run("send drop", 0.01, 0, IBV_WR_SEND, 2000, 20000, 0, 2);
+    ret |= run("send drop reorder", 0.02, 0.05, IBV_WR_SEND, 2000, 30000, 0, 3);
+    ret |= run("write drop reorder", 0.05, 0.1, IBV_WR_RDMA_WRITE, 1000, 30000, 0, 4);
+    ret |= run("write dpu fault", 0, 0, IBV_WR_RDMA_WRITE, 1000, 30000, 0.02, 5);
+    ret |= run("send reorder", 0, 0.3, IBV_WR_SEND, 2000, 20000, 0, 6);
+    ret |= run_lost_window("first window lost", 31);
+    // go-back-N under heavy loss, most messages span several packets
+    ret |= run("go-back-N send", 0.1, 0.2, IBV_WR_SEND, 1000, 20000, 0, 17);
+    ret |= run("go-back-N write", 0.1, 0.2, IBV_WR_RDMA_WRITE, 1000, 20000, 0.02, 18);
+    ret |= run("go-back-N read", 0.1, 0.2, IBV_WR_RDMA_READ, 500, 20000, 0, 19);
+    ret |= run("read", 0, 0, IBV_WR_RDMA_READ, 1000, 30000, 0, 7);
+    ret |= run("read drop reorder", 0.02, 0.05, IBV_WR_RDMA_READ, 1000, 30000, 0, 8);
+    ret |= run("read dpu fault", 0, 0, IBV_WR_RDMA_READ, 1000, 30000, 0.02, 9);
+    ret |= run("send mid", 0, 0, IBV_WR_SEND, 2000, 8000, 0, 13);
+    ret |= run("send mid drop reorder", 0.02, 0.05, IBV_WR_SEND, 2000, 8000, 0, 14);
+    ret |= run("send small", 0, 0, IBV_WR_SEND, 2000, 1024, 0, 15);
+    ret |= run("send small drop reorder", 0.01, 0.02, IBV_WR_SEND, 2000, 1024, 0, 16);
+    ret |= run_atomic("fetch add", 0, 0, IBV_WR_ATOMIC_FETCH_AND_ADD, 3000, 1, 10);
+    ret |= run_atomic("fetch add drop reorder", 0.05, 0.1, IBV_WR_ATOMIC_FETCH_AND_ADD, 3000, 1, 11);
+    ret |= run_atomic("cmp swap drop reorder", 0.05, 0.1, IBV_WR_ATOMIC_CMP_AND_SWP, 3000, 1, 12);
+    ret |= run_atomic("fetch add 4 qps drop reorder", 0.05, 0.1, IBV_WR_ATOMIC_FETCH_AND_ADD, 3000, 4, 20);
+    ret |= run_read_after_write("read after write", 0, 0, false, 500, 26);
+    ret |= run_read_after_write("read after write drop reorder", 0.02, 0.05, false, 500, 27);
+    ret |= run_read_after_write("atomic after write drop reorder", 0.02, 0.05, true, 1000, 28);
+    ret |= run_access_error("write bad rkey", 0, access_bad_rkey, IBV_WC_REM_ACCESS_ERR, 21);
+    ret |= run_access_error("write bad rkey drop", 0.05, access_bad_rkey, IBV_WC_REM_ACCESS_ERR, 22);
+    ret |= run_access_error("write out of bounds", 0, access_out_of_bounds, IBV_WC_REM_ACCESS_ERR, 23);
+    ret |= run_access_error("atomic without access", 0.05, access_no_atomic, IBV_WC_REM_ACCESS_ERR, 24);
+    ret |= run_access_error("atomic misaligned", 0, access_misaligned_atomic, IBV_WC_REM_INV_REQ_ERR, 25);
+    ret |= run_access_error("read bad rkey drop", 0.05, access_read_bad_rkey, IBV_WC_REM_ACCESS_ERR, 29);
+    ret |= run_access_error("read out of bounds", 0, access_read_out_of_bounds, IBV_WC_REM_ACCESS_ERR, 30);
+    ret |= run_read_after_dereg("read after dereg", 32);
+    printf(ret ? "FAIL\n" : "ALL OK\n");
+    return ret;
+}
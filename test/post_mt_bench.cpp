@@ -0,0 +1,170 @@
+#include "smartns_dv.h"
+#include "rdma_cm/libsmartns.h"
+#include "tcp_cm/tcp_cm.h"
+#include "gflags_common.h"
+#include "numautil.h"
+
+// Cost of smartns_post_send when many threads post to one datapath send wq,
+// every thread has its own QP and all QPs share send wq -send_wq. Keep
+// threads * outstanding below the send wq capacity. -send_wq_pull compares the
+// DPU reading the WQEs against posts DMAing them.
+//  ./post_mt_bench -deviceName mlx5_0 -batch_size 1 -threads 8 -outstanding 64 -payload_size 64 -serverIp 10.0.0.200 -iterations 10
+//  ./post_mt_bench -deviceName mlx5_0 -batch_size 1 -threads 8 -outstanding 64 -payload_size 64 -is_server -iterations 10
+
+DEFINE_uint64(send_wq, 0, "datapath send wq all QPs post to");
+DEFINE_bool(send_wq_pull, false, "experimental, the DPU reads send WQEs from host memory instead of posts DMAing them");
+
+std::atomic<bool> stop_flag = false;
+std::atomic<size_t> ready_threads = 0;
+size_t base_alloc_size = 16 * 1024 * 1024;
+
+void ctrl_c_handler(int) { stop_flag = true; }
+
+struct post_result {
+    size_t posts;
+    size_t post_tsc;
+    double duration;
+};
+
+void sub_task_client(size_t thread_index, qp_handler *handler, post_result *result) {
+    wait_scheduling(FLAGS_numaNode, thread_index);
+
+    sleep(2);
+
+    size_t send_recv_buf_size = base_alloc_size / 2;
+    offset_handler send(send_recv_buf_size / FLAGS_payload_size, FLAGS_payload_size, 0);
+    offset_handler send_comp(send_recv_buf_size / FLAGS_payload_size, FLAGS_payload_size, 0);
+
+    struct ibv_wc *wc_send = NULL;
+    ALLOCATE(wc_send, struct ibv_wc, CTX_POLL_BATCH);
+
+    size_t tx_depth = FLAGS_outstanding;
+    size_t batch_size = FLAGS_batch_size;
+    size_t ops = FLAGS_iterations * send_recv_buf_size / FLAGS_payload_size;
+    ops = round_up(ops, batch_size);
+    ops = round_up(ops, SEND_CQ_BATCH);
+
+    // start posting together so the threads contend from the first post
+    ready_threads++;
+    while (ready_threads != FLAGS_threads) {
+    }
+
+    size_t post_tsc = 0;
+    struct timespec begin_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &begin_time);
+    while (send.index() < ops && !stop_flag) {
+        size_t ne_send = smartns_poll_send_cq(*handler, wc_send);
+        for (size_t i = 0;i < ne_send;i++) {
+            assert(wc_send[i].status == IBV_WC_SUCCESS);
+            send_comp.step(SEND_CQ_BATCH);
+        }
+
+        if (send.index() - send_comp.index() <= tx_depth - batch_size) {
+            size_t now_send_num = std::min(ops - send.index(), batch_size);
+            size_t begin = get_tsc();
+            smartns_post_send_batch(*handler, now_send_num, send, FLAGS_payload_size);
+            post_tsc += get_tsc() - begin;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    result->posts = send.index();
+    result->post_tsc = post_tsc;
+    result->duration = (end_time.tv_sec - begin_time.tv_sec) + (end_time.tv_nsec - begin_time.tv_nsec) / 1e9;
+
+    printf("thread [%ld], duration [%f]s, posts [%f] Mops, post [%f] ns\n", thread_index, result->duration,
+        result->posts / result->duration / 1e6, post_tsc / get_tsc_freq_per_ns() / (result->posts / batch_size));
+
+    free(wc_send);
+    sleep(1);
+}
+
+void sub_task_server(size_t thread_index, qp_handler *handler) {
+    wait_scheduling(FLAGS_numaNode, thread_index);
+
+    while (!stop_flag) {
+        sleep(1);
+    }
+}
+
+void benchmark() {
+    tcp_param net_param;
+    net_param.isServer = FLAGS_is_server;
+    net_param.serverIp = FLAGS_serverIp;
+    net_param.sock_port = FLAGS_port;
+    socket_init(net_param);
+
+    rdma_param rdma_param;
+    rdma_param.device_name = FLAGS_deviceName;
+    rdma_param.numa_node = FLAGS_numaNode;
+    rdma_param.batch_size = FLAGS_batch_size;
+    rdma_param.sge_per_wr = 1;
+    smartns_roce_init(rdma_param, 1);
+    if (FLAGS_send_wq_pull) {
+        assert(smartns_set_send_wq_pull(rdma_param.contexts[0]) == 0);
+    }
+
+    pingpong_info *info = new pingpong_info[2 * FLAGS_threads]();
+
+    void **bufs = new void *[FLAGS_threads];
+    qp_handler **qp_handlers = new qp_handler * [FLAGS_threads]();
+    post_result *results = new post_result[FLAGS_threads]();
+
+    for (size_t i = 0;i < FLAGS_threads;i++) {
+        bufs[i] = get_huge_mem(FLAGS_numaNode, base_alloc_size);
+        memset(bufs[i], 0, base_alloc_size);
+    }
+
+    for (size_t i = 0;i < FLAGS_threads;i++) {
+        qp_handlers[i] = smartns_create_qp_rc(rdma_param, bufs[i], base_alloc_size, info + i, 0, FLAGS_send_wq);
+    }
+    exchange_data(net_param, reinterpret_cast<char *>(info), reinterpret_cast<char *>(info) + sizeof(pingpong_info) * FLAGS_threads, sizeof(pingpong_info) * FLAGS_threads);
+
+    for (size_t i = 0;i < FLAGS_threads;i++) {
+        smartns_connect_qp_rc(rdma_param, *qp_handlers[i], info + i + FLAGS_threads, info + i);
+        init_wr_base_write(*qp_handlers[i]);
+    }
+
+    std::vector<std::thread> threads(FLAGS_threads);
+    for (size_t i = 0;i < FLAGS_threads;i++) {
+        size_t now_index = i + FLAGS_coreOffset;
+        if (FLAGS_is_server) {
+            threads[i] = std::thread(sub_task_server, now_index, qp_handlers[i]);
+        } else {
+            threads[i] = std::thread(sub_task_client, now_index, qp_handlers[i], results + i);
+        }
+        bind_to_core(threads[i], FLAGS_numaNode, now_index);
+    }
+
+    for (size_t i = 0;i < FLAGS_threads;i++) {
+        threads[i].join();
+    }
+
+    if (!FLAGS_is_server) {
+        double mops = 0, post_ns = 0;
+        for (size_t i = 0;i < FLAGS_threads;i++) {
+            mops += results[i].posts / results[i].duration / 1e6;
+            post_ns += results[i].post_tsc / get_tsc_freq_per_ns() / (results[i].posts / FLAGS_batch_size);
+        }
+        printf("threads [%lu], total posts [%f] Mops, avg post [%f] ns\n", FLAGS_threads, mops, post_ns / FLAGS_threads);
+    }
+
+    delete[]results;
+    delete[]qp_handlers;
+    delete[]bufs;
+    delete[]info;
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGINT, ctrl_c_handler);
+    signal(SIGTERM, ctrl_c_handler);
+
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    assert(setenv("MLX5_TOTAL_UUARS", "129", 0) == 0);
+    assert(setenv("MLX5_NUM_LOW_LAT_UUARS", "128", 0) == 0);
+
+    benchmark();
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "smartns.h"
+#include "phmap.h"
+#include <stdio.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Per packet cost of keeping the set of active QPs, the phmap hash set
+// handle_send used to walk against the scheduler's ready list, for 1, 64, 1k
+// and 16k active QPs. Every round N/8 random QPs get 8 more packets and every
+// active QP sends one, QPs join on their first packet and leave when drained,
+// like loop_datapath_send_wq and handle_send.
+//  ./ready_list_bench
+
+static const size_t total_pkts = 1 << 24;
+
+struct bench_result {
+    double tsc_per_pkt;
+    size_t checksum;
+};
+
+template <typename ACTIVATE, typename ROUND>
+static bench_result run_once(std::vector<dpu_qp *> &qps, const std::vector<uint32_t> &arrivals, ACTIVATE &activate, ROUND &round) {
+    size_t n = qps.size();
+    size_t per_round = max_t(size_t, n / 8, 1);
+    size_t sent = 0, next_arrival = 0, checksum = 0;
+    size_t begin = get_tsc();
+    while (sent < total_pkts) {
+        for (size_t i = 0;i < per_round;i++) {
+            dpu_qp *qp = qps[arrivals[next_arrival]];
+            next_arrival = next_arrival + 1 == arrivals.size() ? 0 : next_arrival + 1;
+            if (qp->send_wq->head == qp->send_wq->tail) {
+                activate(qp);
+            }
+            qp->send_wq->head += 8;
+        }
+        sent += round(checksum);
+    }
+    size_t end = get_tsc();
+    // leave no QP active for the next run
+    while (round(checksum)) {
+    }
+    return { static_cast<double>(end - begin) / sent, checksum };
+}
+
+// best of a few runs
+template <typename ACTIVATE, typename ROUND>
+static bench_result run(std::vector<dpu_qp *> &qps, const std::vector<uint32_t> &arrivals, ACTIVATE &&activate, ROUND &&round) {
+    bench_result best = run_once(qps, arrivals, activate, round);
+    for (int i = 0;i < 2;i++) {
+        bench_result result = run_once(qps, arrivals, activate, round);
+        best.tsc_per_pkt = std::min(best.tsc_per_pkt, result.tsc_per_pkt);
+        best.checksum += result.checksum;
+    }
+    return best;
+}
+
+// one packet from a QP, touches its send wq like building a header would
+static inline bool send_one(dpu_qp *qp, size_t &checksum) {
+    checksum += qp->send_wq->psn++;
+    return ++qp->send_wq->tail == qp->send_wq->head;
+}
+
+int main() {
+    std::mt19937_64 rng(1);
+    datapath_handler *handler = new datapath_handler();
+    handler->ready_head = nullptr;
+    handler->ready_tail = nullptr;
+    printf("%8s %16s %16s\n", "qps", "hash set tsc/pkt", "ready list tsc/pkt");
+
+    for (size_t n : { 1, 64, 1024, 16384 }) {
+        // scatter QPs over the heap like QPs created over time
+        std::vector<dpu_qp *> qps;
+        std::vector<dpu_qp *> spacers;
+        for (size_t i = 0;i < n;i++) {
+            dpu_qp *qp = new dpu_qp();
+            qp->send_wq = new dpu_send_wq();
+            qps.push_back(qp);
+            spacers.push_back(new dpu_qp());
+        }
+        std::shuffle(qps.begin(), qps.end(), rng);
+        std::vector<uint32_t> arrivals(1 << 20);
+        for (uint32_t &a : arrivals) {
+            a = rng() % n;
+        }
+
+        phmap::flat_hash_set<dpu_qp *> active_qp_list;
+        bench_result hash = run(qps, arrivals,
+            [&](dpu_qp *qp) { active_qp_list.insert(qp); },
+            [&](size_t &checksum) {
+                size_t sent = 0;
+                for (auto it = active_qp_list.begin();it != active_qp_list.end();) {
+                    sent++;
+                    if (send_one(*it, checksum)) {
+                        it = active_qp_list.erase(it);
+                    } else {
+                        it++;
+                    }
+                }
+                return sent;
+            });
+
+        bench_result list = run(qps, arrivals,
+            [&](dpu_qp *qp) { handler->sched_activate(qp); },
+            [&](size_t &checksum) {
+                size_t sent = 0;
+                for (dpu_qp *qp = handler->ready_head;qp != nullptr;) {
+                    dpu_qp *next = qp->sched.next;
+                    sent++;
+                    if (send_one(qp, checksum)) {
+                        handler->sched_deactivate(qp);
+                    }
+                    qp = next;
+                }
+                return sent;
+            });
+
+        printf("%8zu %16.2f %16.2f\n", n, hash.tsc_per_pkt, list.tsc_per_pkt);
+        // keeps the work from being optimized out
+        if (hash.checksum == 0 || list.checksum == 0) {
+            printf("checksum %zu %zu\n", hash.checksum, list.checksum);
+        }
+
+        for (size_t i = 0;i < n;i++) {
+            delete qps[i]->send_wq;
+            delete qps[i];
+            delete spacers[i];
+        }
+    }
+    printf("tsc runs at %.3f per ns\n", get_tsc_freq_per_ns());
+    return 0;
+}
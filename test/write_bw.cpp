@@ -8,6 +8,12 @@
 //  ./write_bw -deviceName mlx5_0 -batch_size 1 -threads 1 -outstanding 64 -payload_size 1024 -serverIp 10.0.0.200 -iterations 10000
 //  ./write_bw -deviceName mlx5_0 -batch_size 1 -threads 1 -outstanding 80 -payload_size 1024 -is_server -iterations 10000
 
+DEFINE_uint64(wqe_batch, SMARTNS_WQE_DMA_MAX_BATCH, "WQEs coalesced into one DMA to the DPU at most, 1 disables batching");
+DEFINE_uint64(wqe_delay_ns, SMARTNS_WQE_DMA_DELAY_NS, "longest a posted WQE is held for batching");
+DEFINE_uint64(inline_size, 0, "payloads up to this size are sent inline, at most SMARTNS_MAX_INLINE_DATA");
+DEFINE_uint64(send_sge, 1, "SGEs each write gathers its payload from, at most SMARTNS_MAX_SEND_SGE");
+DEFINE_bool(send_wq_pull, false, "experimental, the DPU reads send WQEs from host memory instead of posts DMAing them");
+
 std::atomic<bool> stop_flag = false;
 size_t base_alloc_size = 16 * 1024 * 1024;
 
@@ -37,6 +43,14 @@ void sub_task_client(size_t thread_index, qp_handler *handler) {
         smartns_post_send_batch(*handler, 1, send, FLAGS_payload_size);
     }
 
+    // post to completion latency of the signaled WQEs posted from here on
+    size_t untimed = send.index() / SEND_CQ_BATCH;
+    std::vector<size_t> timers(tx_depth / SEND_CQ_BATCH + 1, 0);
+    size_t timer_head = 0;
+    size_t timer_tail = 0;
+    struct hdr_histogram *latency;
+    hdr_init(1, 100000000, 3, &latency);
+
     size_t ne_send;
 
     size_t batch_size = FLAGS_batch_size;
@@ -52,10 +66,21 @@ void sub_task_client(size_t thread_index, qp_handler *handler) {
             assert(wc_send[i].status == IBV_WC_SUCCESS);
             // printf("send comp index %ld\n", send_comp.index());
             send_comp.step(SEND_CQ_BATCH);
+            if (untimed) {
+                untimed--;
+            } else if (timer_tail != timer_head) {
+                hdr_record_value(latency, (get_tsc() - timers[timer_tail % timers.size()]) / get_tsc_freq_per_ns());
+                timer_tail++;
+            }
         }
 
         if (send.index() < ops && send.index() - send_comp.index() <= tx_depth - batch_size) {
             size_t now_send_num = std::min(ops - send.index(), batch_size);
+            size_t signaled = (send.index() + now_send_num) / SEND_CQ_BATCH - send.index() / SEND_CQ_BATCH;
+            size_t now = get_tsc();
+            for (size_t i = 0;i < signaled && timer_head - timer_tail < timers.size();i++) {
+                timers[timer_head++ % timers.size()] = now;
+            }
             smartns_post_send_batch(*handler, now_send_num, send, FLAGS_payload_size);
         }
 
@@ -68,7 +93,9 @@ void sub_task_client(size_t thread_index, qp_handler *handler) {
     double duration = (end_time.tv_sec - begin_time.tv_sec) + (end_time.tv_nsec - begin_time.tv_nsec) / 1e9;
     double speed = 8.0 * send.index() * FLAGS_payload_size / 1000 / 1000 / 1000 / duration;
 
-    printf("thread [%ld], duration [%f]s, throughput [%f] Gpbs\n", thread_index, duration, speed);
+    printf("thread [%ld], duration [%f]s, throughput [%f] Gpbs, latency p50 [%ld] p99 [%ld] ns\n", thread_index, duration, speed,
+        hdr_value_at_percentile(latency, 50.0), hdr_value_at_percentile(latency, 99.0));
+    hdr_close(latency);
 
     free(wc_send);
     sleep(1);
@@ -93,8 +120,13 @@ void benchmark() {
     rdma_param.device_name = FLAGS_deviceName;
     rdma_param.numa_node = FLAGS_numaNode;
     rdma_param.batch_size = FLAGS_batch_size;
-    rdma_param.sge_per_wr = 1;
+    rdma_param.sge_per_wr = FLAGS_send_sge;
+    rdma_param.max_inline_size = FLAGS_inline_size;
     smartns_roce_init(rdma_param, 1);
+    assert(smartns_set_wqe_dma_batch(rdma_param.contexts[0], FLAGS_wqe_batch, FLAGS_wqe_delay_ns) == 0);
+    if (FLAGS_send_wq_pull) {
+        assert(smartns_set_send_wq_pull(rdma_param.contexts[0]) == 0);
+    }
 
     pingpong_info *info = new pingpong_info[2 * FLAGS_threads]();
 
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.hpp"
+#include <vector>
+
+// Hashed timing wheel keyed by tsc. Entries are never cancelled, the owner
+// keeps the real deadline and decides on expiry whether the entry is stale,
+// should be re-armed later, or actually fired.
+template <typename T>
+class timer_wheel {
+private:
+    std::vector<std::vector<T>> slots;
+    std::vector<T> fired;
+    size_t num_slots;
+    size_t tick_tsc;
+    size_t cur_tick;
+
+public:
+    timer_wheel() {
+        num_slots = 0;
+        tick_tsc = 1;
+        cur_tick = 0;
+    }
+
+    void init(size_t num_slots, size_t tick_tsc, size_t now) {
+        assert(is_log2(num_slots));
+        this->num_slots = num_slots;
+        this->tick_tsc = max_(tick_tsc, 1);
+        this->cur_tick = now / this->tick_tsc;
+        slots.clear();
+        slots.resize(num_slots);
+    }
+
+    // deadline beyond the wheel span lands in the last slot, the owner will re-arm it on expiry
+    void schedule(T entry, size_t deadline) {
+        size_t tick = deadline / tick_tsc;
+        if (tick <= cur_tick) {
+            tick = cur_tick + 1;
+        } else if (tick - cur_tick >= num_slots) {
+            tick = cur_tick + num_slots - 1;
+        }
+        slots[tick & (num_slots - 1)].push_back(entry);
+    }
+
+    // call on_expire(entry) for every entry whose slot has passed
+    template <typename F>
+    size_t advance(size_t now, F &&on_expire) {
+        size_t now_tick = now / tick_tsc;
+        size_t expired = 0;
+        if (now_tick - cur_tick > num_slots) {
+            cur_tick = now_tick - num_slots;
+        }
+        while (cur_tick < now_tick) {
+            cur_tick++;
+            std::vector<T> &slot = slots[cur_tick & (num_slots - 1)];
+            if (likely(slot.empty())) {
+                continue;
+            }
+            fired.swap(slot);
+            for (T &entry : fired) {
+                on_expire(entry);
+            }
+            expired += fired.size();
+            fired.clear();
+        }
+        return expired;
+    }
+};